@@ -0,0 +1,648 @@
+// iousb_bench: round-trip latency and throughput of the IOUSB* transfer paths.
+//
+// Runs against the simulated device by default, or against a real device
+// with -p <pid>. Build together with the library sources, e.g.
+//   cc -DRA1NPOC_MODE -Iinclude-root bench/iousb_bench.c iousb*.c -lpthread
+
+#include <getopt.h>
+
+#include <io/iousb.h>
+#include <io/iousb_sim.h>
+#include <io/iousb_upload.h>
+#include <io/iousb_timer.h>
+#include <io/iousb_dfu.h>
+#include <io/iousb_pool.h>
+#include <common/log.h>
+#include <common/common.h>
+
+#define BENCH_DEFAULT_ITERS     (2000)
+#define BENCH_MAX_BULK_SZ       (0x800000)
+#define BENCH_DFU_IMAGE_SZ      (0x80000)
+#define BENCH_PARSE_BATCH       (64)
+#define BENCH_URB_SZ            (0x880)     // usbfs control urb for a full DFU block
+
+static const uint16_t control_sizes[] = { 0, EP0_MAX_PACKET_SZ, 0x100, 0x400, DFU_MAX_TRANSFER_SZ };
+static const uint32_t bulk_sizes[] = { 0x200, 0x1000, 0x10000, 0x100000, BENCH_MAX_BULK_SZ };
+static const char *serials[] =
+{
+    "CPID:8010 CPRV:11 CPFM:03 SCEP:01 BDID:0C ECID:001A2B3C4D5E6F70 IBFL:3C SRTG:[iBoot-2696.0.0.1.33]",
+    "CPID:8015 CPRV:11 CPFM:03 SCEP:01 BDID:06 ECID:000A1B2C3D4E5F60 IBFL:3C SRTG:[iBoot-3332.0.0.1.23] PWND:[checkm8]",
+    "SDOM:01 CPID:8010 CPRV:11 CPFM:03 SCEP:01 BDID:0C ECID:001A2B3C4D5E6F70 IBFL:3C SRNM:[F2LXXXXXXXXX] IMEI:[359999999999999]",
+};
+
+typedef struct
+{
+    uint64_t *samples;
+    unsigned int count;
+    uint64_t bytes;
+    uint64_t elapsed;
+    unsigned int errors;
+} bench_result_t;
+
+static uint64_t BenchNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int BenchCompare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t BenchPercentile(const bench_result_t *r, unsigned int pct)
+{
+    if(!r->count)
+    {
+        return 0;
+    }
+    unsigned int idx = (unsigned int)(((uint64_t)r->count * pct + 99) / 100);
+    if(idx)
+    {
+        idx--;
+    }
+    return r->samples[idx];
+}
+
+static void BenchReport(const char *name, uint32_t size, bench_result_t *r)
+{
+    double secs = r->elapsed / 1e9;
+    
+    qsort(r->samples, r->count, sizeof(uint64_t), BenchCompare);
+    printf("%-38s %8u %7u %10.2f %10.2f %12.0f %10.2f %6u\n",
+           name, size, r->count,
+           BenchPercentile(r, 50) / 1e3,
+           BenchPercentile(r, 99) / 1e3,
+           secs > 0 ? r->count / secs : 0,
+           secs > 0 ? r->bytes / secs / (1024 * 1024) : 0,
+           r->errors);
+}
+
+static void BenchControl(client_t *client, uint8_t bm_request_type, uint8_t b_request,
+                         uint16_t size, unsigned int iters, bench_result_t *r)
+{
+    for(unsigned int i = 0; i < iters; i++)
+    {
+        uint64_t t0 = BenchNow();
+        transfer_t result = IOUSBControlTransfer(client, bm_request_type, b_request, 0, 0, IOUSBBlank(client), size);
+        r->samples[r->count++] = BenchNow() - t0;
+        if(result.ret != kIOReturnSuccess)
+        {
+            r->errors++;
+        }
+        r->bytes += result.wLenDone;
+    }
+}
+
+static void BenchControlTO(client_t *client, uint8_t bm_request_type, uint8_t b_request,
+                           uint16_t size, unsigned int iters, bench_result_t *r)
+{
+    for(unsigned int i = 0; i < iters; i++)
+    {
+        uint64_t t0 = BenchNow();
+        transfer_t result = IOUSBControlTransferTO(client, bm_request_type, b_request, 0, 0, IOUSBBlank(client), size, 100);
+        r->samples[r->count++] = BenchNow() - t0;
+        if(result.ret != kIOReturnSuccess)
+        {
+            r->errors++;
+        }
+        r->bytes += result.wLenDone;
+    }
+}
+
+// one sample per request, the batch time split evenly over its requests
+static void BenchControlBatch(client_t *client, uint8_t bm_request_type, uint8_t b_request,
+                              uint16_t size, unsigned int iters, bench_result_t *r)
+{
+    control_batch_t batch[CONTROL_BATCH_MAX_DEPTH * 4];
+    transfer_t results[CONTROL_BATCH_MAX_DEPTH * 4];
+    const unsigned int n = sizeof(batch) / sizeof(batch[0]);
+    
+    for(unsigned int i = 0; i < n; i++)
+    {
+        batch[i].req = (control_request_t){ bm_request_type, b_request, 0, 0, size };
+        batch[i].data = IOUSBBlank(client);
+    }
+    for(unsigned int done = 0; done < iters; done += n)
+    {
+        unsigned int count = iters - done < n ? iters - done : n;
+        uint64_t t0 = BenchNow();
+        IOUSBControlTransferBatch(client, batch, results, count, 0, 100);
+        uint64_t per = (BenchNow() - t0) / count;
+        for(unsigned int i = 0; i < count; i++)
+        {
+            r->samples[r->count++] = per;
+            if(results[i].ret != kIOReturnSuccess)
+            {
+                r->errors++;
+            }
+            r->bytes += results[i].wLenDone;
+        }
+    }
+}
+
+#if defined(RA1NPOC_MODE)
+static void BenchAsyncControl(client_t *client, uint8_t bm_request_type, uint8_t b_request,
+                              uint16_t size, unsigned int iters, bench_result_t *r)
+{
+    for(unsigned int i = 0; i < iters; i++)
+    {
+        async_transfer_t transfer;
+        memset(&transfer, '\0', sizeof(async_transfer_t));
+        
+        uint64_t t0 = BenchNow();
+        transfer_t result = IOUSBAsyncControlTransfer(client, bm_request_type, b_request, 0, 0, IOUSBBlank(client), size, &transfer, 100);
+        if(result.ret == kIOReturnSuccess)
+        {
+            IOUSBAsyncWait(client);
+        }
+        r->samples[r->count++] = BenchNow() - t0;
+        if(result.ret != kIOReturnSuccess || transfer.ret != kIOReturnSuccess)
+        {
+            r->errors++;
+        }
+        r->bytes += transfer.wLenDone;
+    }
+}
+
+static void BenchAsyncCancel(client_t *client, uint16_t size, unsigned int iters,
+                             unsigned int ns_time, bench_result_t *r)
+{
+    for(unsigned int i = 0; i < iters; i++)
+    {
+        uint64_t t0 = BenchNow();
+        UInt32 done = IOUSBAsyncControlTransferWithCancel(client, 0x21, DFU_DNLOAD, 0, 0, IOUSBBlank(client), size, 0, ns_time);
+        r->samples[r->count++] = BenchNow() - t0;
+        if(done > size)
+        {
+            r->errors++;
+        }
+        else
+        {
+            r->bytes += done;
+        }
+    }
+}
+
+// samples are how far past ns_time the abort went out, not round trips
+static void BenchTimedAbort(client_t *client, uint16_t size, unsigned int iters, unsigned int ns_time,
+                            const abort_timer_t *timer, bench_result_t *r)
+{
+    for(unsigned int i = 0; i < iters; i++)
+    {
+        timed_abort_t result;
+        IOReturn ret = IOUSBAsyncControlTransferTimedAbort(client, 0x21, DFU_DNLOAD, 0, 0, IOUSBBlank(client), size, 0, ns_time, timer, &result);
+        r->samples[r->count++] = result.delta > result.target ? result.delta - result.target : 0;
+        if(ret != kIOReturnSuccess)
+        {
+            r->errors++;
+        }
+        else
+        {
+            r->bytes += result.wLenDone;
+        }
+    }
+}
+#endif
+
+static void BenchBulk(client_t *client, void *buf, uint32_t size, unsigned int iters, bench_result_t *r)
+{
+    for(unsigned int i = 0; i < iters; i++)
+    {
+        uint64_t t0 = BenchNow();
+        transfer_t result = IOUSBBulkUpload(client, buf, size);
+        r->samples[r->count++] = BenchNow() - t0;
+        if(result.ret != kIOReturnSuccess)
+        {
+            r->errors++;
+        }
+        else
+        {
+            r->bytes += size;
+        }
+    }
+}
+
+static void BenchBulkStream(client_t *client, void *buf, uint32_t size, unsigned int iters,
+                            const upload_opts_t *opts, bench_result_t *r)
+{
+    for(unsigned int i = 0; i < iters; i++)
+    {
+        uint64_t t0 = BenchNow();
+        transfer_t result = IOUSBBulkUploadStream(client, buf, size, opts);
+        r->samples[r->count++] = BenchNow() - t0;
+        if(result.ret != kIOReturnSuccess)
+        {
+            r->errors++;
+        }
+        r->bytes += result.wLenDone;
+    }
+}
+
+// sends a typical iBSS sized image without manifesting, so a real device stays in DFU
+static void BenchDFU(client_t *client, void *buf, unsigned int depth, unsigned int iters, bench_result_t *r)
+{
+    dfu_opts_t opts;
+    memset(&opts, '\0', sizeof(dfu_opts_t));
+    opts.flags = kDFUNoManifest;
+    opts.depth = depth;
+    
+    for(unsigned int i = 0; i < iters; i++)
+    {
+        dfu_result_t result;
+        uint64_t t0 = BenchNow();
+        IOUSBDFUDownload(client, buf, BENCH_DFU_IMAGE_SZ, &opts, &result);
+        r->samples[r->count++] = BenchNow() - t0;
+        if(result.ret != kIOReturnSuccess)
+        {
+            r->errors++;
+        }
+        r->bytes += result.bytes;
+    }
+}
+
+// the strstr/sscanf parser IOUSBGetInfo used before the single-pass tokenizer
+static void BenchLegacyGetInfo(client_t *client, const char *str)
+{
+    char *strptr = strstr(str, "CPID:");
+    if(strptr != NULL)
+    {
+        sscanf(strptr, "CPID:%x", (unsigned int *)&client->cpid);
+    }
+    strptr = strstr(str, "CPRV:");
+    if(strptr != NULL)
+    {
+        sscanf(strptr, "CPRV:%x", (unsigned int *)&client->cprv);
+    }
+    unsigned long long ecid = 0;
+    strptr = strstr(str, "ECID:");
+    if(strptr != NULL)
+    {
+        sscanf(strptr, "ECID:%llx", &ecid);
+    }
+    client->ecid = ecid;
+    if(strstr(str, "SRTG:"))
+    {
+        client->devmode = kDeviceDFUMode;
+    }
+    if(strstr(str, "YOLO:checkra1n"))
+    {
+        client->devmode |= kDeviceYoloDFUMode;
+    }
+    if(strstr(str, "PWND:"))
+    {
+        client->devmode |= kDevicePwnedDFUMode;
+    }
+    client->sn = true;
+}
+
+static void BenchGetInfo(void (*parse)(client_t *, const char *), const char *str, unsigned int iters, bench_result_t *r)
+{
+    client_t client;
+    memset(&client, '\0', sizeof(client_t));
+    
+    for(unsigned int i = 0; i < iters; i++)
+    {
+        uint64_t t0 = BenchNow();
+        for(unsigned int j = 0; j < BENCH_PARSE_BATCH; j++)
+        {
+            parse(&client, str);
+        }
+        r->samples[r->count++] = (BenchNow() - t0) / BENCH_PARSE_BATCH;
+        r->bytes += strlen(str);
+    }
+    if(!client.ecid)
+    {
+        r->errors++;
+    }
+}
+
+// what a usbfs control urb costs to get hold of, from the allocator or the pool
+static void BenchBuffer(bool pool, uint32_t size, unsigned int iters, bench_result_t *r)
+{
+    client_t client;
+    memset(&client, '\0', sizeof(client_t));
+    if(pool && IOUSBPoolCreate(&client, 0, 0, 0) != 0)
+    {
+        r->errors++;
+        return;
+    }
+    
+    for(unsigned int i = 0; i < iters; i++)
+    {
+        uint64_t t0 = BenchNow();
+        for(unsigned int j = 0; j < BENCH_PARSE_BATCH; j++)
+        {
+            void *buf = pool ? IOUSBBufferGet(&client, size) : calloc(1, size);
+            if(!buf)
+            {
+                r->errors++;
+                continue;
+            }
+            ((volatile unsigned char *)buf)[0] = 0;
+            pool ? IOUSBBufferPut(&client, buf) : free(buf);
+        }
+        r->samples[r->count++] = (BenchNow() - t0) / BENCH_PARSE_BATCH;
+    }
+    IOUSBPoolDestroy(&client);
+}
+
+static void usage(const char *argv0)
+{
+    printf("usage: %s [options]\n", argv0);
+    printf("  -p <pid>      benchmark a real device in this mode instead of the simulator\n");
+    printf("  -i <iters>    iterations per data point (default %u)\n", BENCH_DEFAULT_ITERS);
+    printf("  -l <usec>     simulated control latency (default 0)\n");
+    printf("  -w <bps>      simulated bulk bandwidth in bytes/sec (default unlimited)\n");
+    printf("  -c <nsec>     abort delay for IOUSBAsyncControlTransferWithCancel (default 10000)\n");
+    printf("  -r <bm>:<b>   control request to time (default 0x40:0)\n");
+    printf("  -a <cpu>      pin the timed-abort rows to this cpu\n");
+    printf("  -f <prio>     run the timed-abort rows SCHED_FIFO at this priority\n");
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int iters = BENCH_DEFAULT_ITERS;
+    unsigned int latency = 0;
+    unsigned int bandwidth = 0;
+    unsigned int ns_time = 10000;
+    unsigned int bm_request_type = 0x40;
+    unsigned int b_request = 0;
+    uint16_t pid = 0;
+    int cpu = -1;
+    int priority = 0;
+    int opt;
+    
+    while((opt = getopt(argc, argv, "p:i:l:w:c:r:a:f:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'p':
+                pid = (uint16_t)strtoul(optarg, NULL, 0);
+                break;
+            case 'i':
+                iters = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            case 'l':
+                latency = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            case 'w':
+                bandwidth = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                ns_time = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            case 'a':
+                cpu = (int)strtol(optarg, NULL, 0);
+                break;
+            case 'f':
+                priority = (int)strtol(optarg, NULL, 0);
+                break;
+            case 'r':
+                if(sscanf(optarg, "%i:%i", &bm_request_type, &b_request) != 2)
+                {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : -1;
+        }
+    }
+    if(!iters)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+    
+    uint64_t *samples = calloc(iters, sizeof(uint64_t));
+    void *bulk = calloc(1, BENCH_MAX_BULK_SZ);
+    if(!samples || !bulk)
+    {
+        ERR("Out of memory");
+        return -1;
+    }
+    
+    client_t ctrl, cancel, pongo;
+    memset(&ctrl, '\0', sizeof(client_t));
+    memset(&cancel, '\0', sizeof(client_t));
+    memset(&pongo, '\0', sizeof(client_t));
+    
+    iousb_sim_t *sims[3] = { NULL, NULL, NULL };
+    if(!pid)
+    {
+        iousb_sim_config_t config;
+        memset(&config, '\0', sizeof(iousb_sim_config_t));
+        config.control_latency = latency;
+        config.bulk_bandwidth = bandwidth;
+        config.bulk_latency = latency;
+        
+        config.pid = kDeviceDFUModeID;
+        sims[0] = IOUSBSimCreate(&config);
+        config.async_hang = true;
+        sims[1] = IOUSBSimCreate(&config);
+        config.async_hang = false;
+        config.pid = kDevicePongoModeID;
+        sims[2] = IOUSBSimCreate(&config);
+        
+        IOUSBSimAttach(&ctrl, sims[0]);
+        IOUSBSimAttach(&cancel, sims[1]);
+        IOUSBSimAttach(&pongo, sims[2]);
+        IOUSBConnect(&ctrl, kDeviceDFUModeID, 1, 0, 0);
+        IOUSBConnect(&cancel, kDeviceDFUModeID, 1, 0, 0);
+        IOUSBConnect(&pongo, kDevicePongoModeID, 1, 0, 0);
+    }
+    else
+    {
+        if(IOUSBConnect(&ctrl, pid, 5, 0, 0) != 0)
+        {
+            ERR("Device 0x%04x not found", pid);
+            return -1;
+        }
+    }
+    
+    printf("%-38s %8s %7s %10s %10s %12s %10s %6s\n",
+           "function", "size", "n", "p50(us)", "p99(us)", "xfer/s", "MB/s", "errors");
+    
+    for(size_t i = 0; i < sizeof(serials) / sizeof(serials[0]); i++)
+    {
+        bench_result_t r;
+        
+        memset(&r, '\0', sizeof(bench_result_t));
+        r.samples = samples;
+        uint64_t t0 = BenchNow();
+        BenchGetInfo(BenchLegacyGetInfo, serials[i], iters, &r);
+        r.elapsed = (BenchNow() - t0) / BENCH_PARSE_BATCH;
+        BenchReport("IOUSBGetInfo (strstr/sscanf)", (uint32_t)strlen(serials[i]), &r);
+        
+        memset(&r, '\0', sizeof(bench_result_t));
+        r.samples = samples;
+        t0 = BenchNow();
+        BenchGetInfo(IOUSBGetInfo, serials[i], iters, &r);
+        r.elapsed = (BenchNow() - t0) / BENCH_PARSE_BATCH;
+        BenchReport("IOUSBGetInfo", (uint32_t)strlen(serials[i]), &r);
+    }
+    
+    for(int pool = 0; pool < 2; pool++)
+    {
+        bench_result_t r;
+        
+        memset(&r, '\0', sizeof(bench_result_t));
+        r.samples = samples;
+        uint64_t t0 = BenchNow();
+        BenchBuffer(pool, BENCH_URB_SZ, iters, &r);
+        r.elapsed = (BenchNow() - t0) / BENCH_PARSE_BATCH;
+        BenchReport(pool ? "IOUSBBufferGet/Put" : "calloc/free", BENCH_URB_SZ, &r);
+    }
+    
+    for(size_t i = 0; i < sizeof(control_sizes) / sizeof(control_sizes[0]); i++)
+    {
+        uint16_t size = control_sizes[i];
+        bench_result_t r;
+        
+        memset(&r, '\0', sizeof(bench_result_t));
+        r.samples = samples;
+        uint64_t t0 = BenchNow();
+        BenchControl(&ctrl, bm_request_type, b_request, size, iters, &r);
+        r.elapsed = BenchNow() - t0;
+        BenchReport("IOUSBControlTransfer", size, &r);
+        
+        memset(&r, '\0', sizeof(bench_result_t));
+        r.samples = samples;
+        t0 = BenchNow();
+        BenchControlTO(&ctrl, bm_request_type, b_request, size, iters, &r);
+        r.elapsed = BenchNow() - t0;
+        BenchReport("IOUSBControlTransferTO", size, &r);
+        
+        memset(&r, '\0', sizeof(bench_result_t));
+        r.samples = samples;
+        t0 = BenchNow();
+        BenchControlBatch(&ctrl, bm_request_type, b_request, size, iters, &r);
+        r.elapsed = BenchNow() - t0;
+        BenchReport("IOUSBControlTransferBatch", size, &r);
+        
+#if defined(RA1NPOC_MODE)
+        memset(&r, '\0', sizeof(bench_result_t));
+        r.samples = samples;
+        t0 = BenchNow();
+        BenchAsyncControl(&ctrl, bm_request_type, b_request, size, iters, &r);
+        r.elapsed = BenchNow() - t0;
+        BenchReport("IOUSBAsyncControlTransfer+Wait", size, &r);
+        
+        if(!pid || pid == kDeviceDFUModeID)
+        {
+            client_t *client = pid ? &ctrl : &cancel;
+            memset(&r, '\0', sizeof(bench_result_t));
+            r.samples = samples;
+            t0 = BenchNow();
+            BenchAsyncCancel(client, size, iters, ns_time, &r);
+            r.elapsed = BenchNow() - t0;
+            BenchReport("IOUSBAsyncControlTransferWithCancel", size, &r);
+        }
+#endif
+    }
+    
+#if defined(RA1NPOC_MODE)
+    if(!pid || pid == kDeviceDFUModeID)
+    {
+        static const struct
+        {
+            const char *name;
+            int mode;
+        } timers[] =
+        {
+            { "TimedAbort overshoot (nanosleep)", kAbortTimerSleep },
+            { "TimedAbort overshoot (native)", kAbortTimerNative },
+            { "TimedAbort overshoot (spin)", kAbortTimerSpin },
+        };
+        client_t *client = pid ? &ctrl : &cancel;
+        for(size_t i = 0; i < sizeof(timers) / sizeof(timers[0]); i++)
+        {
+            abort_timer_t timer;
+            bench_result_t r;
+            
+            IOUSBTimerInit(&timer, timers[i].mode);
+            IOUSBTimerCalibrate(&timer);
+            timer.cpu = cpu;
+            timer.priority = priority;
+            
+            memset(&r, '\0', sizeof(bench_result_t));
+            r.samples = samples;
+            uint64_t t0 = BenchNow();
+            BenchTimedAbort(client, DFU_MAX_TRANSFER_SZ, iters, ns_time, &timer, &r);
+            r.elapsed = BenchNow() - t0;
+            BenchReport(timers[i].name, DFU_MAX_TRANSFER_SZ, &r);
+            IOUSBTimerDestroy(&timer);
+        }
+    }
+#endif
+    
+    if(!pid || pid == kDeviceDFUModeID)
+    {
+        static const struct
+        {
+            const char *name;
+            unsigned int depth;
+        } dfu[] =
+        {
+            { "IOUSBDFUDownload (depth 1)", 1 },
+            { "IOUSBDFUDownload", 0 },
+        };
+        unsigned int n = (iters + 99) / 100;
+        for(size_t i = 0; i < sizeof(dfu) / sizeof(dfu[0]); i++)
+        {
+            bench_result_t r;
+            
+            memset(&r, '\0', sizeof(bench_result_t));
+            r.samples = samples;
+            uint64_t t0 = BenchNow();
+            BenchDFU(&ctrl, bulk, dfu[i].depth, n, &r);
+            r.elapsed = BenchNow() - t0;
+            BenchReport(dfu[i].name, BENCH_DFU_IMAGE_SZ, &r);
+        }
+    }
+    
+    client_t *bulk_client = pid ? (pid == kDevicePongoModeID ? &ctrl : NULL) : &pongo;
+    for(size_t i = 0; bulk_client && i < sizeof(bulk_sizes) / sizeof(bulk_sizes[0]); i++)
+    {
+        uint32_t size = bulk_sizes[i];
+        unsigned int n = size >= 0x100000 ? (iters + 99) / 100 : iters;
+        bench_result_t r;
+        
+        memset(&r, '\0', sizeof(bench_result_t));
+        r.samples = samples;
+        uint64_t t0 = BenchNow();
+        BenchBulk(bulk_client, bulk, size, n, &r);
+        r.elapsed = BenchNow() - t0;
+        BenchReport("IOUSBBulkUpload", size, &r);
+        
+        upload_opts_t opts;
+        memset(&opts, '\0', sizeof(upload_opts_t));
+        opts.chunk_size = size >= 0x100000 ? BULK_DEFAULT_CHUNK_SZ : 0x4000;
+        memset(&r, '\0', sizeof(bench_result_t));
+        r.samples = samples;
+        t0 = BenchNow();
+        BenchBulkStream(bulk_client, bulk, size, n, &opts, &r);
+        r.elapsed = BenchNow() - t0;
+        BenchReport("IOUSBBulkUploadStream", size, &r);
+    }
+    
+    IOUSBClose(&ctrl);
+    IOUSBClose(&cancel);
+    IOUSBClose(&pongo);
+    IOUSBPoolDestroy(&ctrl);
+    IOUSBPoolDestroy(&cancel);
+    IOUSBPoolDestroy(&pongo);
+    for(int i = 0; i < 3; i++)
+    {
+        IOUSBSimDestroy(sims[i]);
+    }
+    free(samples);
+    free(bulk);
+    
+    return 0;
+}
@@ -0,0 +1,244 @@
+// iousb_bench_co: many devices through DFU -> pongoOS -> boot, once as
+// coroutines on a single thread (iousb_co.hpp) and once as the blocking C
+// calls with a thread per device.
+//
+// Runs against simulated devices with a control latency, a replug delay and
+// pongoOS commands that take a while, so what is measured is how well each
+// side overlaps the waiting. Build together with the library sources, e.g.
+//   cc -c -DRA1NPOC_MODE -Iinclude-root iousb*.c
+//   c++ -std=c++20 -O2 -DRA1NPOC_MODE -Iinclude-root bench/iousb_bench_co.cpp iousb*.o -lpthread -lz
+
+#include <getopt.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+#include <io/iousb_co.hpp>
+
+extern "C"
+{
+#include <io/iousb_sim.h>
+#include <common/log.h>
+#include <common/common.h>
+}
+
+#define BENCH_DEFAULT_DEVICES   (32)
+#define BENCH_IMAGE_SZ          (0x10000)
+#define BENCH_KPF_SZ            (0x40000)
+#define BENCH_RAMDISK_SZ        (0x200000)
+#define BENCH_TIMEOUT           (5000)      // msec for a device to come back
+#define BENCH_COMMAND_TIMEOUT   (2000)      // msec per pongoOS command
+
+typedef struct
+{
+    iousb_sim_t *sim;
+    const std::vector<unsigned char> *image;
+    const std::vector<unsigned char> *kpf;
+    const std::vector<unsigned char> *ramdisk;
+    int ret;
+    pthread_t thread;
+} bench_device_t;
+
+static uint64_t BenchNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static iousb_sim_t *BenchSim(unsigned int i)
+{
+    iousb_sim_config_t config;
+    memset(&config, '\0', sizeof(iousb_sim_config_t));
+    config.pid = kDeviceDFUModeID;
+    config.manifest_pid = kDevicePongoModeID;
+    config.cpid = 0x8015;
+    config.ecid = 0x1000 + i;
+    config.location = 0x01100000 | ((i % 15 + 1) << 16);
+    config.control_latency = 200;
+    config.bulk_bandwidth = 40000000;
+    config.replug_delay = 300000;
+    config.pongo_latency = 20000;
+    return IOUSBSimCreate(&config);
+}
+
+// the same flow as BenchFlow below, written against the blocking calls
+static void *BenchThread(void *arg)
+{
+    bench_device_t *d = (bench_device_t *)arg;
+    client_t client;
+    memset(&client, '\0', sizeof(client_t));
+    IOUSBSimAttach(&client, d->sim);
+
+    d->ret = -1;
+    if(IOUSBConnect(&client, kDeviceDFUModeID, 1, 0, 0) != 0)
+    {
+        return NULL;
+    }
+    if(IOUSBDFUDownload(&client, d->image->data(), (uint32_t)d->image->size(), NULL, NULL) != kIOReturnSuccess ||
+       IOUSBReattach(&client, kDevicePongoModeID, 1, BENCH_TIMEOUT) != 0)
+    {
+        IOUSBClose(&client);
+        return NULL;
+    }
+
+    pongo_shell_t *shell = IOUSBPongoShellCreate(&client, 0, NULL, NULL);
+    if(shell &&
+       IOUSBPongoUpload(shell, d->kpf->data(), (uint32_t)d->kpf->size(), NULL).ret == kIOReturnSuccess &&
+       IOUSBPongoCommand(shell, "modload", BENCH_COMMAND_TIMEOUT) == 0 &&
+       IOUSBPongoUpload(shell, d->ramdisk->data(), (uint32_t)d->ramdisk->size(), NULL).ret == kIOReturnSuccess &&
+       IOUSBPongoCommand(shell, "ramdisk", BENCH_COMMAND_TIMEOUT) == 0)
+    {
+        // the device leaves the bus once it boots, the answer does not matter
+        IOUSBPongoSend(shell, "bootx");
+        d->ret = 0;
+    }
+    IOUSBPongoShellDestroy(shell);
+    IOUSBClose(&client);
+    return NULL;
+}
+
+static iousb::co::task<int> BenchBoot(iousb::co::executor &ex, iousb::client &dev, bench_device_t *d)
+{
+    IOReturn ret = co_await ex.dfu_download(dev, *d->image);
+    if(ret != kIOReturnSuccess)
+    {
+        co_return -1;
+    }
+    int err = co_await ex.wait_device(dev, kDevicePongoModeID, BENCH_TIMEOUT, 1);
+    if(err)
+    {
+        co_return -1;
+    }
+
+    transfer_t result = co_await ex.pongo_upload(dev, *d->kpf);
+    err = result.ret == kIOReturnSuccess ? co_await ex.pongo_command(dev, "modload", BENCH_COMMAND_TIMEOUT) : -1;
+    if(err)
+    {
+        co_return -1;
+    }
+    result = co_await ex.pongo_upload(dev, *d->ramdisk);
+    err = result.ret == kIOReturnSuccess ? co_await ex.pongo_command(dev, "ramdisk", BENCH_COMMAND_TIMEOUT) : -1;
+    if(err)
+    {
+        co_return -1;
+    }
+
+    // the device leaves the bus once it boots, the answer does not matter
+    co_await ex.pongo_command(dev, "bootx");
+    co_return 0;
+}
+
+static iousb::co::task<int> BenchFlow(iousb::co::executor &ex, bench_device_t *d)
+{
+    iousb::client dev;
+    IOUSBSimAttach(dev.get(), d->sim);
+    if(dev.connect(kDeviceDFUModeID) != 0)
+    {
+        co_return -1;
+    }
+    int ret = co_await BenchBoot(ex, dev, d);
+    ex.release(dev);
+    co_return ret;
+}
+
+// what the device saw has to match, a flow cannot pass by skipping steps
+static int BenchVerify(std::vector<bench_device_t> &devices)
+{
+    int failed = 0;
+    for(bench_device_t &d : devices)
+    {
+        iousb_sim_stats_t stats;
+        IOUSBSimGetStats(d.sim, &stats);
+        if(stats.dfu_image_size != d.image->size() || stats.pongo_upload != d.ramdisk->size() || stats.pongo_commands != 3)
+        {
+            failed++;
+        }
+        IOUSBSimDestroy(d.sim);
+    }
+    return failed;
+}
+
+static void BenchReport(const char *name, unsigned int count, uint64_t elapsed, int failed, int mismatched)
+{
+    printf("%-24s %6u %10.1f %10.2f %6d %6d\n", name, count,
+           (double)elapsed / 1000000.0, (double)elapsed / 1000000.0 / count, failed, mismatched);
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-n devices]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int count = BENCH_DEFAULT_DEVICES;
+    int opt;
+
+    while((opt = getopt(argc, argv, "n:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n':
+                count = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : -1;
+        }
+    }
+    if(!count)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    std::vector<unsigned char> image(BENCH_IMAGE_SZ, 0x41);
+    std::vector<unsigned char> kpf(BENCH_KPF_SZ, 0x42);
+    std::vector<unsigned char> ramdisk(BENCH_RAMDISK_SZ, 0x43);
+    std::vector<bench_device_t> devices(count);
+
+    printf("%-24s %6s %10s %10s %6s %6s\n", "flow", "devs", "total ms", "ms/dev", "failed", "badsim");
+
+    // thread per device
+    for(unsigned int i = 0; i < count; i++)
+    {
+        devices[i] = bench_device_t{ BenchSim(i), &image, &kpf, &ramdisk, -1, {} };
+    }
+    uint64_t t0 = BenchNow();
+    for(bench_device_t &d : devices)
+    {
+        pthread_create(&d.thread, NULL, BenchThread, &d);
+    }
+    int failed = 0;
+    for(bench_device_t &d : devices)
+    {
+        pthread_join(d.thread, NULL);
+        failed += d.ret != 0;
+    }
+    uint64_t elapsed = BenchNow() - t0;
+    BenchReport("threads (blocking C)", count, elapsed, failed, BenchVerify(devices));
+
+    // one thread, one coroutine per device
+    for(unsigned int i = 0; i < count; i++)
+    {
+        devices[i] = bench_device_t{ BenchSim(i), &image, &kpf, &ramdisk, -1, {} };
+    }
+    t0 = BenchNow();
+    {
+        iousb::co::executor ex;
+        if(!ex)
+        {
+            ERR("Failed to create the completion queue");
+            return -1;
+        }
+        for(bench_device_t &d : devices)
+        {
+            ex.spawn(BenchFlow(ex, &d));
+        }
+        failed = ex.run();
+    }
+    elapsed = BenchNow() - t0;
+    BenchReport("coroutines (1 thread)", count, elapsed, failed, BenchVerify(devices));
+    return 0;
+}
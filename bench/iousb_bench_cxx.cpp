@@ -0,0 +1,170 @@
+// iousb_bench_cxx: the C++ layer (iousb.hpp) against the C calls it wraps,
+// request for request on the same client.
+//
+// Runs against the simulated device, so what is left is the per-call cost of
+// both paths. Build together with the library sources, e.g.
+//   cc -c -DRA1NPOC_MODE -Iinclude-root iousb*.c
+//   c++ -std=c++20 -O2 -DRA1NPOC_MODE -Iinclude-root bench/iousb_bench_cxx.cpp iousb*.o -lpthread -lz
+
+#include <algorithm>
+#include <array>
+#include <getopt.h>
+#include <vector>
+
+#include <io/iousb.hpp>
+
+extern "C"
+{
+#include <io/iousb_sim.h>
+#include <common/log.h>
+#include <common/common.h>
+}
+
+#define BENCH_DEFAULT_ITERS     (200000)
+#define BENCH_ROUNDS            (5)         // the paths take turns, the best round counts
+
+typedef struct
+{
+    std::vector<uint64_t> samples;
+    unsigned int errors;
+} bench_result_t;
+
+static uint64_t BenchNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// per request nsec of one round of iters calls to fn
+template<typename F>
+static uint64_t BenchRound(unsigned int iters, bench_result_t *r, F fn)
+{
+    uint64_t t0 = BenchNow();
+    for(unsigned int i = 0; i < iters; i++)
+    {
+        if(fn().ret != kIOReturnSuccess)
+        {
+            r->errors++;
+        }
+    }
+    return (BenchNow() - t0) / iters;
+}
+
+template<typename C, typename X>
+static void BenchPair(const char *name, unsigned int iters, C c_path, X cxx_path)
+{
+    bench_result_t c_result = {};
+    bench_result_t cxx_result = {};
+    
+    for(int round = 0; round < BENCH_ROUNDS; round++)
+    {
+        c_result.samples.push_back(BenchRound(iters, &c_result, c_path));
+        cxx_result.samples.push_back(BenchRound(iters, &cxx_result, cxx_path));
+    }
+    uint64_t c_best = *std::min_element(c_result.samples.begin(), c_result.samples.end());
+    uint64_t cxx_best = *std::min_element(cxx_result.samples.begin(), cxx_result.samples.end());
+    printf("%-24s %10llu %10llu %9.2f%% %6u %6u\n", name,
+           (unsigned long long)c_best, (unsigned long long)cxx_best,
+           c_best ? 100.0 * ((double)cxx_best - (double)c_best) / (double)c_best : 0.0,
+           c_result.errors, cxx_result.errors);
+}
+
+static transfer_t BenchTransfer(int failed)
+{
+    transfer_t result;
+    result.wLenDone = 0;
+    result.ret = failed ? kIOReturnError : kIOReturnSuccess;
+    return result;
+}
+
+// the clients close through sim when they go out of scope, so they live in here
+static int BenchRun(iousb_sim_t *sim, unsigned int iters)
+{
+    iousb::client dev;
+    IOUSBSimAttach(dev.get(), sim);
+    if(dev.connect(kDeviceDFUModeID) != 0)
+    {
+        ERR("Simulated device did not come up");
+        return -1;
+    }
+    client_t *client = dev.get();
+    
+    std::array<unsigned char, iousb::dfu::status_size> status = {};
+    std::array<unsigned char, DFU_MAX_TRANSFER_SZ> block = {};
+    
+    printf("%-24s %10s %10s %10s %6s %6s\n", "request (ns)", "C", "C++", "delta", "errC", "errC++");
+    BenchPair("DFU_GET_STATUS", iters,
+              [&] { return IOUSBControlTransfer(client, 0xa1, DFU_GET_STATUS, 0, 0, status.data(), iousb::dfu::status_size); },
+              [&] { return dev.dfu_status(status); });
+    BenchPair("DFU_GET_STATUS TO", iters,
+              [&] { return IOUSBControlTransferTO(client, 0xa1, DFU_GET_STATUS, 0, 0, status.data(), iousb::dfu::status_size, 100); },
+              [&] { return dev.control<iousb::dfu::get_status>(status, 100); });
+    BenchPair("DFU_CLR_STATUS", iters,
+              [&] { return IOUSBControlTransfer(client, 0x21, DFU_CLR_STATUS, 0, 0, NULL, 0); },
+              [&] { return dev.dfu_clear(); });
+    
+    // a DNLOAD followed by a CLR_STATUS keeps the simulated device from filling up
+    BenchPair("DFU_DNLOAD 0x800", iters / 4,
+              [&] {
+                  transfer_t result = IOUSBControlTransfer(client, 0x21, DFU_DNLOAD, 0, 0, block.data(), DFU_MAX_TRANSFER_SZ);
+                  IOUSBControlTransfer(client, 0x21, DFU_ABORT, 0, 0, NULL, 0);
+                  return result;
+              },
+              [&] {
+                  transfer_t result = dev.dfu_dnload(std::span<const unsigned char, DFU_MAX_TRANSFER_SZ>(block));
+                  dev.dfu_abort();
+                  return result;
+              });
+    
+    // the simulated device takes recovery commands in any mode, a reboot included
+    BenchPair("reboot commands", iters / 4,
+              [&] { IOUSBSendReboot(client); return BenchTransfer(0); },
+              [&] { return BenchTransfer(dev.send_reboot()); });
+    
+    iousb::client moved = std::move(dev);
+    printf("moved client still open: %s\n", moved.get() == client && client->devmode ? "yes" : "no");
+    
+    moved.close();
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-n iters]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int iters = BENCH_DEFAULT_ITERS;
+    int opt;
+    
+    while((opt = getopt(argc, argv, "n:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n':
+                iters = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : -1;
+        }
+    }
+    if(!iters)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+    
+    iousb_sim_config_t config;
+    memset(&config, '\0', sizeof(iousb_sim_config_t));
+    config.pid = kDeviceDFUModeID;
+    config.cpid = 0x8015;
+    config.ecid = 0x1122334455667788ULL;
+    iousb_sim_t *sim = IOUSBSimCreate(&config);
+    
+    int ret = BenchRun(sim, iters);
+    IOUSBSimDestroy(sim);
+    return ret;
+}
@@ -0,0 +1,102 @@
+// iousb_brokerd: holds the devices for tools attached with IOUSBBrokerAttach,
+// so they skip opening them and never seize one from each other.
+//
+// Runs until SIGINT or SIGTERM and prints what it served. Build together
+// with the library sources, e.g.
+//   cc -DRA1NPOC_MODE -Iinclude-root bench/iousb_brokerd.c iousb*.c -lpthread -lz
+
+#include <getopt.h>
+#include <signal.h>
+
+#include <io/iousb.h>
+#include <io/iousb_sim.h>
+#include <io/iousb_broker.h>
+#include <common/log.h>
+#include <common/common.h>
+
+static iousb_broker_t *broker;
+
+static void BrokerdSignal(int sig)
+{
+    (void)sig;
+    IOUSBBrokerStop(broker);
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-s path] [-S pid] [-l usec]\n"
+           "  -s  socket to listen on, default $XDG_RUNTIME_DIR/" BROKER_DEFAULT_NAME "\n"
+           "  -S  serve a simulated device in mode pid instead of the real ones\n"
+           "  -l  simulated discovery latency\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = NULL;
+    uint16_t sim_pid = 0;
+    unsigned int latency = 0;
+    iousb_sim_t *sim = NULL;
+    client_t tmpl;
+    int opt;
+    
+    while((opt = getopt(argc, argv, "s:S:l:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 's':
+                path = optarg;
+                break;
+            case 'S':
+                sim_pid = (uint16_t)strtoul(optarg, NULL, 0);
+                break;
+            case 'l':
+                latency = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : -1;
+        }
+    }
+    
+    memset(&tmpl, '\0', sizeof(client_t));
+    if(sim_pid)
+    {
+        iousb_sim_config_t config;
+        memset(&config, '\0', sizeof(iousb_sim_config_t));
+        config.pid = sim_pid;
+        config.cpid = 0x8015;
+        config.ecid = 0x1122334455667788ULL;
+        config.discovery_latency = latency;
+        sim = IOUSBSimCreate(&config);
+        IOUSBSimAttach(&tmpl, sim);
+    }
+    
+    broker = IOUSBBrokerCreate(path, sim ? &tmpl : NULL);
+    if(!broker)
+    {
+        IOUSBSimDestroy(sim);
+        return -1;
+    }
+    
+    struct sigaction sa;
+    memset(&sa, '\0', sizeof(sa));
+    sa.sa_handler = BrokerdSignal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    
+    printf("Listening on %s\n", path);
+    int ret = IOUSBBrokerRun(broker);
+    
+    broker_stats_t stats;
+    IOUSBBrokerGetStats(broker, &stats);
+    printf("%llu devices, %llu clients, %llu opens, %llu requests\n",
+           (unsigned long long)stats.devices, (unsigned long long)stats.clients,
+           (unsigned long long)stats.opens, (unsigned long long)stats.requests);
+    
+    IOUSBBrokerDestroy(broker);
+    if(sim)
+    {
+        IOUSBSimDestroy(sim);
+    }
+    return ret;
+}
@@ -0,0 +1,652 @@
+// iousb_gadget: the simulated device on a real bus through raw-gadget, and a
+// driver that runs the usbfs backend against it.
+//
+// The gadget enumerates with the Apple VID and the DFU or recovery PID. It
+// answers the standard requests itself: descriptors, configuration and
+// interface. Every other control request and everything written to its
+// bulk OUT pipe is passed on to an iousb_sim device. The simulator's
+// statistics then show what actually crossed the wire. The driver opens the
+// gadget with IOUSBConnectWait and checks the serial string it parsed. In DFU
+// mode it sends an image with IOUSBDFUDownload; in recovery mode it sends a
+// command and a bulk upload. Both modes also queue async control requests.
+// Linux only, needs raw_gadget and a UDC, e.g. dummy_hcd:
+//   modprobe dummy_hcd raw_gadget
+//   cc -DRA1NPOC_MODE -Iinclude-root bench/iousb_gadget.c iousb*.c -lpthread -lz
+//   ./a.out -m recovery
+
+#include <getopt.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/ioctl.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+
+#include <io/iousb.h>
+#include <io/iousb_sim.h>
+#include <io/iousb_dfu.h>
+#include <common/log.h>
+#include <common/common.h>
+
+#define GADGET_RAW_NODE         "/dev/raw-gadget"
+#define GADGET_DEFAULT_DRIVER   "dummy_udc"
+#define GADGET_DEFAULT_DEVICE   "dummy_udc.0"
+#define GADGET_DEFAULT_CPID     (0x8010)
+#define GADGET_DEFAULT_ECID     (0x001a2b3c4d5e6f70ULL)
+#define GADGET_DEFAULT_IMAGE_SZ (0x80000)
+#define GADGET_DEFAULT_ASYNC    (64)
+#define GADGET_CONNECT_TIMEOUT  (10000)     // msec for the host to enumerate the gadget
+#define GADGET_BULK_TIMEOUT     (5000)      // msec for the gadget to pass the upload on
+#define GADGET_EP0_BUF_SZ       (0x1000)    // usbfs caps control transfers at a page
+#define GADGET_BULK_BUF_SZ      (0x10000)
+#define GADGET_BULK_MAX_PACKET  (512)
+#define GADGET_BULK_ADDR        (0x04)      // iBoot's, when the UDC lets us choose
+#define GADGET_MAX_STRING       (126)
+
+// raw-gadget hands out events and takes data through trailing arrays
+typedef struct
+{
+    struct usb_raw_event inner;
+    unsigned char data[sizeof(struct usb_ctrlrequest)];
+} gadget_event_t;
+
+typedef struct
+{
+    struct usb_raw_ep_io inner;
+    unsigned char data[GADGET_EP0_BUF_SZ];
+} gadget_ep0_io_t;
+
+typedef struct
+{
+    struct usb_raw_ep_io inner;
+    unsigned char data[GADGET_BULK_BUF_SZ];
+} gadget_bulk_io_t;
+
+typedef struct
+{
+    int fd;
+    uint16_t pid;
+    bool has_bulk;                  // recovery mode, DFU has ep0 only
+    iousb_sim_t *sim;
+    client_t model;                 // the simulator every forwarded request goes to
+    char serial[256];
+    pthread_mutex_t lock;           // model is driven from ep0 and the bulk pipe
+    int bulk_ep;                    // raw-gadget handle, -1 until configured
+    uint8_t bulk_addr;
+    pthread_t bulk_thread;
+    uint64_t requests;
+    uint64_t forwarded;
+    uint64_t stalled;
+    uint64_t bulk_bytes;
+} gadget_t;
+
+RA1NPOC_STATIC_API static const char *GadgetProduct(uint16_t pid)
+{
+    return pid == kDeviceDFUModeID ? "Apple Mobile Device (DFU Mode)" : "Apple Mobile Device (Recovery Mode)";
+}
+
+// string descriptor of str in UTF-16LE, returns its length
+RA1NPOC_STATIC_API static int GadgetString(const char *str, unsigned char *buf)
+{
+    size_t len = strlen(str);
+    if(len > GADGET_MAX_STRING)
+    {
+        len = GADGET_MAX_STRING;
+    }
+    buf[0] = (unsigned char)(2 + len * 2);
+    buf[1] = USB_DT_STRING;
+    for(size_t i = 0; i < len; i++)
+    {
+        buf[2 + i * 2] = (unsigned char)str[i];
+        buf[3 + i * 2] = 0;
+    }
+    return buf[0];
+}
+
+RA1NPOC_STATIC_API static int GadgetDescriptor(gadget_t *g, uint16_t w_value, unsigned char *buf)
+{
+    uint8_t type = w_value >> 8;
+    uint8_t index = w_value & 0xff;
+    
+    switch(type)
+    {
+        case USB_DT_DEVICE:
+        {
+            struct usb_device_descriptor desc =
+            {
+                .bLength            = USB_DT_DEVICE_SIZE,
+                .bDescriptorType    = USB_DT_DEVICE,
+                .bcdUSB             = htole16(0x0200),
+                .bMaxPacketSize0    = EP0_MAX_PACKET_SZ,
+                .idVendor           = htole16(kAppleVendorID),
+                .idProduct          = htole16(g->pid),
+                .bcdDevice          = htole16(0x0000),
+                .iManufacturer      = 1,
+                .iProduct           = 2,
+                .iSerialNumber      = 3,
+                .bNumConfigurations = 1,
+            };
+            memcpy(buf, &desc, USB_DT_DEVICE_SIZE);
+            return USB_DT_DEVICE_SIZE;
+        }
+        case USB_DT_CONFIG:
+        {
+            struct usb_config_descriptor config =
+            {
+                .bLength             = USB_DT_CONFIG_SIZE,
+                .bDescriptorType     = USB_DT_CONFIG,
+                .bNumInterfaces      = 1,
+                .bConfigurationValue = 1,
+                .bmAttributes        = USB_CONFIG_ATT_ONE | USB_CONFIG_ATT_SELFPOWER,
+                .bMaxPower           = 0xfa,
+            };
+            // DFU is interface 0 of class application specific, recovery a
+            // vendor interface carrying the bulk OUT pipe
+            struct usb_interface_descriptor interface =
+            {
+                .bLength            = USB_DT_INTERFACE_SIZE,
+                .bDescriptorType    = USB_DT_INTERFACE,
+                .bNumEndpoints      = g->has_bulk ? 1 : 0,
+                .bInterfaceClass    = g->has_bulk ? USB_CLASS_VENDOR_SPEC : USB_CLASS_APP_SPEC,
+                .bInterfaceSubClass = 0x01,
+                .bInterfaceProtocol = g->has_bulk ? 0x01 : 0x00,
+            };
+            struct usb_endpoint_descriptor endpoint =
+            {
+                .bLength          = USB_DT_ENDPOINT_SIZE,
+                .bDescriptorType  = USB_DT_ENDPOINT,
+                .bEndpointAddress = g->bulk_addr,
+                .bmAttributes     = USB_ENDPOINT_XFER_BULK,
+                .wMaxPacketSize   = htole16(GADGET_BULK_MAX_PACKET),
+            };
+            size_t len = USB_DT_CONFIG_SIZE + USB_DT_INTERFACE_SIZE + (g->has_bulk ? USB_DT_ENDPOINT_SIZE : 0);
+            config.wTotalLength = htole16((uint16_t)len);
+            memcpy(buf, &config, USB_DT_CONFIG_SIZE);
+            memcpy(buf + USB_DT_CONFIG_SIZE, &interface, USB_DT_INTERFACE_SIZE);
+            if(g->has_bulk)
+            {
+                memcpy(buf + USB_DT_CONFIG_SIZE + USB_DT_INTERFACE_SIZE, &endpoint, USB_DT_ENDPOINT_SIZE);
+            }
+            return (int)len;
+        }
+        case USB_DT_STRING:
+            switch(index)
+            {
+                case 0:
+                    buf[0] = 4;
+                    buf[1] = USB_DT_STRING;
+                    buf[2] = 0x09;      // en-US
+                    buf[3] = 0x04;
+                    return 4;
+                case 1:
+                    return GadgetString("Apple Inc.", buf);
+                case 2:
+                    return GadgetString(GadgetProduct(g->pid), buf);
+                case 3:
+                    return GadgetString(g->serial, buf);
+                default:
+                    return -1;
+            }
+        default:
+            // no qualifier or BOS, the host falls back to full speed rules
+            return -1;
+    }
+}
+
+// picks the UDC endpoint the bulk OUT pipe goes on, called once the host connected
+RA1NPOC_STATIC_API static void GadgetPickEndpoint(gadget_t *g)
+{
+    struct usb_raw_eps_info info;
+    
+    memset(&info, '\0', sizeof(info));
+    int n = ioctl(g->fd, USB_RAW_IOCTL_EPS_INFO, &info);
+    for(int i = 0; i < n; i++)
+    {
+        if(info.eps[i].caps.type_bulk && info.eps[i].caps.dir_out)
+        {
+            g->bulk_addr = info.eps[i].addr == USB_RAW_EP_ADDR_ANY ? GADGET_BULK_ADDR : info.eps[i].addr;
+            return;
+        }
+    }
+    ERR("UDC has no bulk OUT endpoint");
+    g->has_bulk = false;
+}
+
+// hands every bulk OUT transfer to the simulator
+RA1NPOC_STATIC_API static void *GadgetBulkThread(void *arg)
+{
+    gadget_t *g = (gadget_t *)arg;
+    static gadget_bulk_io_t io;
+    
+    for(;;)
+    {
+        io.inner.ep = g->bulk_ep;
+        io.inner.flags = 0;
+        io.inner.length = sizeof(io.data);
+        int n = ioctl(g->fd, USB_RAW_IOCTL_EP_READ, &io);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            DEVLOG("USB_RAW_IOCTL_EP_READ: %s", strerror(errno));
+            break;
+        }
+        pthread_mutex_lock(&g->lock);
+        IOUSBBulkUpload(&g->model, io.data, (uint32_t)n);
+        g->bulk_bytes += n;
+        pthread_mutex_unlock(&g->lock);
+    }
+    return NULL;
+}
+
+RA1NPOC_STATIC_API static int GadgetConfigure(gadget_t *g)
+{
+    if(g->has_bulk && g->bulk_ep < 0)
+    {
+        struct usb_endpoint_descriptor endpoint =
+        {
+            .bLength          = USB_DT_ENDPOINT_SIZE,
+            .bDescriptorType  = USB_DT_ENDPOINT,
+            .bEndpointAddress = g->bulk_addr,
+            .bmAttributes     = USB_ENDPOINT_XFER_BULK,
+            .wMaxPacketSize   = htole16(GADGET_BULK_MAX_PACKET),
+        };
+        g->bulk_ep = ioctl(g->fd, USB_RAW_IOCTL_EP_ENABLE, &endpoint);
+        if(g->bulk_ep < 0)
+        {
+            ERR("USB_RAW_IOCTL_EP_ENABLE: %s", strerror(errno));
+            return -1;
+        }
+        pthread_create(&g->bulk_thread, NULL, GadgetBulkThread, g);
+    }
+    ioctl(g->fd, USB_RAW_IOCTL_VBUS_DRAW, 0xfa);
+    if(ioctl(g->fd, USB_RAW_IOCTL_CONFIGURE, 0) != 0)
+    {
+        ERR("USB_RAW_IOCTL_CONFIGURE: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Answers a standard request into io. Returns the IN data length, 0 to
+// acknowledge an OUT request, or -1 to stall.
+RA1NPOC_STATIC_API static int GadgetStandard(gadget_t *g, const struct usb_ctrlrequest *ctrl, gadget_ep0_io_t *io)
+{
+    switch(ctrl->bRequest)
+    {
+        case USB_REQ_GET_DESCRIPTOR:
+            return GadgetDescriptor(g, le16toh(ctrl->wValue), io->data);
+        case USB_REQ_SET_CONFIGURATION:
+            return GadgetConfigure(g);
+        case USB_REQ_GET_CONFIGURATION:
+            io->data[0] = 1;
+            return 1;
+        case USB_REQ_SET_INTERFACE:
+            return le16toh(ctrl->wValue) == 0 ? 0 : -1;
+        case USB_REQ_GET_INTERFACE:
+            io->data[0] = 0;
+            return 1;
+        case USB_REQ_GET_STATUS:
+            io->data[0] = (ctrl->bRequestType & USB_RECIP_MASK) == USB_RECIP_DEVICE ? 1 : 0;
+            io->data[1] = 0;
+            return 2;
+        case USB_REQ_CLEAR_FEATURE:
+        case USB_REQ_SET_FEATURE:
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+RA1NPOC_STATIC_API static void GadgetControl(gadget_t *g, const struct usb_ctrlrequest *ctrl)
+{
+    static gadget_ep0_io_t io;
+    uint16_t w_length = le16toh(ctrl->wLength);
+    bool in = ctrl->bRequestType & USB_DIR_IN;
+    int len = -1;
+    
+    g->requests++;
+    memset(&io.inner, '\0', sizeof(io.inner));
+    
+    if(w_length > sizeof(io.data))
+    {
+        ERR("Control request 0x%02x/0x%02x wants %u bytes", ctrl->bRequestType, ctrl->bRequest, w_length);
+    }
+    else if((ctrl->bRequestType & USB_TYPE_MASK) == USB_TYPE_STANDARD)
+    {
+        memset(io.data, '\0', w_length);
+        len = GadgetStandard(g, ctrl, &io);
+    }
+    else
+    {
+        // the data stage of an OUT request is acked before the simulator
+        // sees it, a DNLOAD it rejects shows up in the next GET_STATUS
+        if(!in && w_length)
+        {
+            io.inner.length = w_length;
+            if(ioctl(g->fd, USB_RAW_IOCTL_EP0_READ, &io) < 0)
+            {
+                ERR("USB_RAW_IOCTL_EP0_READ: %s", strerror(errno));
+                return;
+            }
+        }
+        pthread_mutex_lock(&g->lock);
+        transfer_t result = IOUSBControlTransfer(&g->model,
+                                                 ctrl->bRequestType,
+                                                 ctrl->bRequest,
+                                                 le16toh(ctrl->wValue),
+                                                 le16toh(ctrl->wIndex),
+                                                 io.data,
+                                                 w_length);
+        g->forwarded++;
+        pthread_mutex_unlock(&g->lock);
+        if(!in && w_length)
+        {
+            return;
+        }
+        len = result.ret == kIOReturnSuccess ? (int)result.wLenDone : -1;
+    }
+    
+    if(len < 0)
+    {
+        g->stalled++;
+        ioctl(g->fd, USB_RAW_IOCTL_EP0_STALL, 0);
+        return;
+    }
+    
+    io.inner.ep = 0;
+    io.inner.flags = 0;
+    if(in)
+    {
+        io.inner.length = len < w_length ? len : w_length;
+        if(ioctl(g->fd, USB_RAW_IOCTL_EP0_WRITE, &io) < 0)
+        {
+            ERR("USB_RAW_IOCTL_EP0_WRITE: %s", strerror(errno));
+        }
+    }
+    else
+    {
+        io.inner.length = 0;
+        if(ioctl(g->fd, USB_RAW_IOCTL_EP0_READ, &io) < 0)
+        {
+            ERR("USB_RAW_IOCTL_EP0_READ: %s", strerror(errno));
+        }
+    }
+}
+
+RA1NPOC_STATIC_API static void *GadgetThread(void *arg)
+{
+    gadget_t *g = (gadget_t *)arg;
+    gadget_event_t event;
+    
+    for(;;)
+    {
+        memset(&event, '\0', sizeof(event));
+        event.inner.length = sizeof(event.data);
+        if(ioctl(g->fd, USB_RAW_IOCTL_EVENT_FETCH, &event) < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            ERR("USB_RAW_IOCTL_EVENT_FETCH: %s", strerror(errno));
+            break;
+        }
+        switch(event.inner.type)
+        {
+            case USB_RAW_EVENT_CONNECT:
+                if(g->has_bulk)
+                {
+                    GadgetPickEndpoint(g);
+                }
+                break;
+            case USB_RAW_EVENT_CONTROL:
+                GadgetControl(g, (const struct usb_ctrlrequest *)event.data);
+                break;
+            default:
+                DEVLOG("raw-gadget event %u", event.inner.type);
+                break;
+        }
+    }
+    return NULL;
+}
+
+RA1NPOC_STATIC_API static int GadgetStart(gadget_t *g, const char *driver, const char *device)
+{
+    struct usb_raw_init init;
+    pthread_t thread;
+    
+    g->fd = open(GADGET_RAW_NODE, O_RDWR | O_CLOEXEC);
+    if(g->fd < 0)
+    {
+        ERR("open(%s): %s", GADGET_RAW_NODE, strerror(errno));
+        return -1;
+    }
+    
+    memset(&init, '\0', sizeof(init));
+    strncpy((char *)init.driver_name, driver, UDC_NAME_LENGTH_MAX - 1);
+    strncpy((char *)init.device_name, device, UDC_NAME_LENGTH_MAX - 1);
+    init.speed = USB_SPEED_HIGH;
+    if(ioctl(g->fd, USB_RAW_IOCTL_INIT, &init) != 0 || ioctl(g->fd, USB_RAW_IOCTL_RUN, 0) != 0)
+    {
+        ERR("Failed to bind to %s/%s: %s", driver, device, strerror(errno));
+        close(g->fd);
+        return -1;
+    }
+    
+    pthread_create(&thread, NULL, GadgetThread, g);
+    pthread_detach(thread);
+    return 0;
+}
+
+RA1NPOC_STATIC_API static int GadgetCheck(bool ok, const char *what)
+{
+    printf("%-40s %s\n", what, ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
+
+RA1NPOC_STATIC_API static int GadgetRunDFU(gadget_t *g, client_t *client, const unsigned char *image, uint32_t len)
+{
+    iousb_sim_stats_t stats;
+    dfu_result_t result;
+    int failed = 0;
+    
+    IOReturn ret = IOUSBDFUDownload(client, image, len, NULL, &result);
+    pthread_mutex_lock(&g->lock);
+    IOUSBSimGetStats(g->sim, &stats);
+    pthread_mutex_unlock(&g->lock);
+    failed += GadgetCheck(ret == kIOReturnSuccess, "IOUSBDFUDownload");
+    failed += GadgetCheck(stats.dfu_image_size == len, "image size seen by the device");
+    failed += GadgetCheck(result.state == DFU_STATE_MANIFEST_WAIT_RESET, "left in dfuMANIFEST-WAIT-RESET");
+    printf("%u blocks, %llu bytes/s, %llu us per block\n", result.blocks,
+           (unsigned long long)result.throughput, (unsigned long long)(result.latency_avg / 1000));
+    return failed;
+}
+
+RA1NPOC_STATIC_API static int GadgetRunRecovery(gadget_t *g, client_t *client, unsigned char *image, uint32_t len)
+{
+    static const char command[] = "setenv auto-boot false";
+    iousb_sim_stats_t stats;
+    int failed = 0;
+    
+    transfer_t result = IOUSBControlTransfer(client, 0x40, 0, 0, 0, (unsigned char *)command, sizeof(command));
+    failed += GadgetCheck(result.ret == kIOReturnSuccess && result.wLenDone == sizeof(command), "recovery command");
+    
+    result = IOUSBBulkUpload(client, image, len);
+    failed += GadgetCheck(result.ret == kIOReturnSuccess && result.wLenDone == len, "IOUSBBulkUpload");
+    
+    // the gadget passes the pipe on from its own thread
+    for(unsigned int waited = 0; waited < GADGET_BULK_TIMEOUT; waited++)
+    {
+        pthread_mutex_lock(&g->lock);
+        IOUSBSimGetStats(g->sim, &stats);
+        pthread_mutex_unlock(&g->lock);
+        if(stats.bulk_bytes >= len)
+        {
+            break;
+        }
+        usleep(1000);
+    }
+    failed += GadgetCheck(stats.bulk_bytes == len, "bulk bytes seen by the device");
+    return failed;
+}
+
+// async control requests queued back to back and reaped together
+RA1NPOC_STATIC_API static int GadgetRunAsync(client_t *client, unsigned int count)
+{
+    static async_transfer_t transfers[GADGET_DEFAULT_ASYNC];
+    static unsigned char status[GADGET_DEFAULT_ASYNC][6];
+    unsigned int done = 0;
+    
+    if(count > GADGET_DEFAULT_ASYNC)
+    {
+        count = GADGET_DEFAULT_ASYNC;
+    }
+    for(unsigned int i = 0; i < count; i++)
+    {
+        IOUSBAsyncControlTransfer(client, 0xa1, DFU_GET_STATUS, 0, 0, status[i], sizeof(status[i]), &transfers[i], IOUSB_DEFAULT_TIMEOUT);
+    }
+    for(unsigned int i = 0; i < count; i++)
+    {
+        if(IOUSBAsyncWait(client) != 0)
+        {
+            break;
+        }
+    }
+    for(unsigned int i = 0; i < count; i++)
+    {
+        done += transfers[i].ret == kIOReturnSuccess && transfers[i].wLenDone == sizeof(status[i]);
+    }
+    return GadgetCheck(done == count, "async control transfers");
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-m dfu|recovery] [-d driver] [-u device] [-c cpid] [-s image size] [-a async]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    const char *driver = GADGET_DEFAULT_DRIVER;
+    const char *device = GADGET_DEFAULT_DEVICE;
+    uint32_t image_size = GADGET_DEFAULT_IMAGE_SZ;
+    unsigned int async = GADGET_DEFAULT_ASYNC;
+    iousb_sim_config_t config;
+    usb_device_t sim_device;
+    client_t client;
+    gadget_t g;
+    int opt;
+    
+    memset(&config, '\0', sizeof(iousb_sim_config_t));
+    config.pid = kDeviceDFUModeID;
+    config.cpid = GADGET_DEFAULT_CPID;
+    config.cprv = 0x11;
+    config.ecid = GADGET_DEFAULT_ECID;
+    
+    while((opt = getopt(argc, argv, "m:d:u:c:s:a:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'm':
+                if(!strcmp(optarg, "dfu"))
+                {
+                    config.pid = kDeviceDFUModeID;
+                }
+                else if(!strcmp(optarg, "recovery"))
+                {
+                    config.pid = kDeviceRecovery2ModeID;
+                }
+                else
+                {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'd':
+                driver = optarg;
+                break;
+            case 'u':
+                device = optarg;
+                break;
+            case 'c':
+                config.cpid = (unsigned int)strtoul(optarg, NULL, 16);
+                break;
+            case 's':
+                image_size = (uint32_t)strtoul(optarg, NULL, 0);
+                break;
+            case 'a':
+                async = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : -1;
+        }
+    }
+    
+    memset(&g, '\0', sizeof(gadget_t));
+    g.pid = config.pid;
+    g.has_bulk = config.pid != kDeviceDFUModeID;
+    g.bulk_addr = GADGET_BULK_ADDR;
+    g.bulk_ep = -1;
+    pthread_mutex_init(&g.lock, NULL);
+    
+    // the serial string comes from the simulator so both ends agree on it
+    g.sim = IOUSBSimCreate(&config);
+    IOUSBSimAttach(&g.model, g.sim);
+    if(!g.sim || IOUSBEnumerate(&g.model, config.pid, &sim_device, 1) != 1 ||
+       IOUSBOpenDevice(&g.model, &sim_device) != 0)
+    {
+        ERR("Failed to open the simulated device");
+        return -1;
+    }
+    snprintf(g.serial, sizeof(g.serial), "%s", sim_device.serial);
+    
+    if(GadgetStart(&g, driver, device) != 0)
+    {
+        return -1;
+    }
+    
+    // the driver side is the plain usbfs backend, like on a flashing host
+    memset(&client, '\0', sizeof(client_t));
+    if(IOUSBConnectWait(&client, config.pid, config.ecid, 0, GADGET_CONNECT_TIMEOUT) != 0)
+    {
+        ERR("Gadget 0x%04x did not show up on %s", config.pid, IOUSBGetBackend(&client)->name);
+        return -1;
+    }
+    
+    int failed = 0;
+    failed += GadgetCheck(client.identity.cpid == config.cpid && client.identity.ecid == config.ecid, "identity from the serial string");
+    
+    unsigned char *image = malloc(image_size ? image_size : 1);
+    if(!image)
+    {
+        ERR("Out of memory");
+        return -1;
+    }
+    for(uint32_t i = 0; i < image_size; i++)
+    {
+        image[i] = (unsigned char)(i * 7);
+    }
+    
+    if(config.pid == kDeviceDFUModeID)
+    {
+        failed += GadgetRunAsync(&client, async);
+        failed += GadgetRunDFU(&g, &client, image, image_size);
+    }
+    else
+    {
+        failed += GadgetRunRecovery(&g, &client, image, image_size);
+        failed += GadgetRunAsync(&client, async);
+    }
+    
+    printf("%llu requests on ep0, %llu passed to the simulator, %llu stalled, %llu bytes on the bulk pipe\n",
+           (unsigned long long)g.requests, (unsigned long long)g.forwarded,
+           (unsigned long long)g.stalled, (unsigned long long)g.bulk_bytes);
+    
+    IOUSBClose(&client);
+    free(image);
+    return failed ? -1 : 0;
+}
@@ -0,0 +1,168 @@
+// iousb_pool_stress: several threads borrowing and returning buffers of one
+// client's pool at once, to run under -fsanitize=thread or =address.
+//
+// Every borrow is stamped with its thread and checked again before it goes
+// back, so a buffer handed out twice shows up as a mismatch even without a
+// sanitizer. Sizes cycle through small, exactly one buffer and oversized, so
+// the allocator fallback is exercised alongside the lock-free bitmap. Build
+// together with the library sources, e.g.
+//   cc -fsanitize=thread -DRA1NPOC_MODE -Iinclude-root bench/iousb_pool_stress.c iousb*.c -lpthread -lz
+
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <io/iousb.h>
+#include <io/iousb_pool.h>
+#include <common/log.h>
+#include <common/common.h>
+
+#define STRESS_DEFAULT_THREADS      (4)
+#define STRESS_DEFAULT_ITERATIONS   (200000)
+#define STRESS_MAX_THREADS          (64)
+#define STRESS_HELD                 (4)     // buffers a thread holds at once
+
+typedef struct
+{
+    client_t *client;
+    unsigned int id;
+    unsigned int iterations;
+    uint64_t gets;
+    uint64_t failed;                // NULL borrows
+    uint64_t mismatched;            // stamps overwritten while borrowed
+    pthread_t thread;
+} stress_thread_t;
+
+static size_t StressSize(const iousb_pool_stats_t *stats, unsigned int i)
+{
+    switch(i % 3)
+    {
+        case 0:
+            return 64;
+        case 1:
+            return stats->buffer_size;
+        default:
+            return stats->buffer_size + 1;
+    }
+}
+
+static void *StressThread(void *arg)
+{
+    stress_thread_t *t = (stress_thread_t *)arg;
+    iousb_pool_stats_t stats;
+    unsigned char *held[STRESS_HELD];
+    size_t sizes[STRESS_HELD];
+
+    IOUSBPoolGetStats(t->client, &stats);
+    for(unsigned int i = 0; i < t->iterations; i++)
+    {
+        unsigned int count = 0;
+        for(unsigned int j = 0; j < STRESS_HELD; j++)
+        {
+            sizes[count] = StressSize(&stats, i + j + t->id);
+            held[count] = IOUSBBufferGet(t->client, sizes[count]);
+            t->gets++;
+            if(!held[count])
+            {
+                t->failed++;
+                continue;
+            }
+            // the first and last byte are enough to catch a second owner
+            held[count][0] = (unsigned char)t->id;
+            held[count][sizes[count] - 1] = (unsigned char)t->id;
+            count++;
+        }
+
+        if(!(i & 0xff))
+        {
+            sched_yield();
+        }
+
+        for(unsigned int j = 0; j < count; j++)
+        {
+            if(held[j][0] != (unsigned char)t->id || held[j][sizes[j] - 1] != (unsigned char)t->id)
+            {
+                t->mismatched++;
+            }
+            IOUSBBufferPut(t->client, held[j]);
+        }
+    }
+    return NULL;
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-t threads] [-n iterations] [-b buffers]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int threads = STRESS_DEFAULT_THREADS;
+    unsigned int iterations = STRESS_DEFAULT_ITERATIONS;
+    unsigned int buffers = 0;
+    stress_thread_t t[STRESS_MAX_THREADS];
+    iousb_pool_stats_t stats;
+    client_t client;
+    int opt;
+
+    while((opt = getopt(argc, argv, "t:n:b:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 't':
+                threads = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                iterations = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                buffers = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : -1;
+        }
+    }
+    if(!threads || threads > STRESS_MAX_THREADS)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    // the pool needs no device, only the client it hangs off
+    memset(&client, '\0', sizeof(client_t));
+    if(IOUSBPoolCreate(&client, buffers, 0, 0) != 0)
+    {
+        ERR("Failed to create the buffer pool");
+        return -1;
+    }
+
+    for(unsigned int i = 0; i < threads; i++)
+    {
+        memset(&t[i], '\0', sizeof(stress_thread_t));
+        t[i].client = &client;
+        t[i].id = i + 1;
+        t[i].iterations = iterations;
+        pthread_create(&t[i].thread, NULL, StressThread, &t[i]);
+    }
+
+    uint64_t gets = 0;
+    uint64_t failed = 0;
+    uint64_t mismatched = 0;
+    for(unsigned int i = 0; i < threads; i++)
+    {
+        pthread_join(t[i].thread, NULL);
+        gets += t[i].gets;
+        failed += t[i].failed;
+        mismatched += t[i].mismatched;
+    }
+
+    IOUSBPoolGetStats(&client, &stats);
+    printf("%u threads, %llu borrows: %llu from the pool, %llu from the allocator\n", threads,
+           (unsigned long long)gets, (unsigned long long)stats.hits, (unsigned long long)stats.misses);
+    printf("failed %llu, mismatched %llu, still in use %u\n",
+           (unsigned long long)failed, (unsigned long long)mismatched, stats.in_use);
+    IOUSBPoolDestroy(&client);
+
+    return (failed || mismatched || stats.in_use || stats.hits + stats.misses != gets) ? -1 : 0;
+}
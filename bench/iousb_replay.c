@@ -0,0 +1,146 @@
+// iousb_replay: runs a trace written by IOUSBCaptureStart against the
+// simulated device and compares its timing with the recording.
+//
+// The simulated device takes its mode, CPID and ECID from the trace header.
+// Build together with the library sources, e.g.
+//   cc -DRA1NPOC_MODE -Iinclude-root bench/iousb_replay.c iousb*.c -lpthread -lz
+
+#include <getopt.h>
+
+#include <io/iousb.h>
+#include <io/iousb_sim.h>
+#include <io/iousb_capture.h>
+#include <common/log.h>
+#include <common/common.h>
+
+static const char *op_names[CAPTURE_MAX_OPS] =
+{
+    "control", "interface", "async control", "bulk", "bulk async", "complete", "abort",
+};
+
+typedef struct
+{
+    uint64_t count;
+    uint64_t recorded;              // nsec, summed over the requests
+    uint64_t replayed;
+    uint64_t mismatches;
+} replay_op_t;
+
+typedef struct
+{
+    bool verbose;
+    replay_op_t ops[CAPTURE_MAX_OPS];
+} replay_ctx_t;
+
+static void ReplayRecord(void *ctx, const capture_record_t *recorded, const capture_record_t *replayed)
+{
+    replay_ctx_t *replay = ctx;
+    replay_op_t *op = &replay->ops[recorded->op];
+    bool mismatch = recorded->ret != replayed->ret || recorded->wLenDone != replayed->wLenDone;
+    
+    op->count++;
+    op->recorded += recorded->end - recorded->start;
+    op->replayed += replayed->end - replayed->start;
+    op->mismatches += mismatch;
+    if(replay->verbose && mismatch)
+    {
+        printf("#%u %s %02x:%02x: recorded 0x%x/%u, replayed 0x%x/%u\n", recorded->seq, op_names[recorded->op],
+               recorded->bm_request_type, recorded->b_request, recorded->ret, recorded->wLenDone, replayed->ret, replayed->wLenDone);
+    }
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-m] [-v] [-l usec] [-w bytes/s] trace\n"
+           "  -m  max speed, ignore the recorded gaps between requests\n"
+           "  -v  print every request whose result differs\n"
+           "  -l  simulated control and bulk latency\n"
+           "  -w  simulated bulk bandwidth\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int flags = 0;
+    unsigned int latency = 0;
+    unsigned int bandwidth = 0;
+    replay_ctx_t ctx;
+    int opt;
+    
+    memset(&ctx, '\0', sizeof(replay_ctx_t));
+    while((opt = getopt(argc, argv, "mvl:w:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'm':
+                flags |= kReplayMaxSpeed;
+                break;
+            case 'v':
+                ctx.verbose = true;
+                break;
+            case 'l':
+                latency = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            case 'w':
+                bandwidth = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : -1;
+        }
+    }
+    if(optind != argc - 1)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+    
+    capture_header_t header;
+    capture_reader_t *reader = IOUSBCaptureOpen(argv[optind], &header);
+    if(!reader)
+    {
+        return -1;
+    }
+    IOUSBCaptureClose(reader);
+    
+    iousb_sim_config_t config;
+    memset(&config, '\0', sizeof(iousb_sim_config_t));
+    config.pid = header.pid ? header.pid : kDeviceDFUModeID;
+    config.cpid = header.cpid;
+    config.ecid = header.ecid;
+    config.control_latency = latency;
+    config.bulk_latency = latency;
+    config.bulk_bandwidth = bandwidth;
+    
+    client_t client;
+    memset(&client, '\0', sizeof(client_t));
+    iousb_sim_t *sim = IOUSBSimCreate(&config);
+    IOUSBSimAttach(&client, sim);
+    if(IOUSBConnect(&client, config.pid, 1, 0, 0) != 0)
+    {
+        ERR("Simulated device 0x%04x did not come up", config.pid);
+        IOUSBSimDestroy(sim);
+        return -1;
+    }
+    
+    capture_replay_t result;
+    int ret = IOUSBCaptureReplay(&client, argv[optind], flags, ReplayRecord, &ctx, &result);
+    
+    printf("%-14s %8s %14s %14s %10s\n", "op", "n", "recorded(us)", "replayed(us)", "mismatch");
+    for(int i = 0; i < CAPTURE_MAX_OPS; i++)
+    {
+        replay_op_t *op = &ctx.ops[i];
+        if(!op->count)
+        {
+            continue;
+        }
+        printf("%-14s %8llu %14.2f %14.2f %10llu\n", op_names[i], (unsigned long long)op->count,
+               op->recorded / 1e3 / op->count, op->replayed / 1e3 / op->count, (unsigned long long)op->mismatches);
+    }
+    printf("%llu records, %llu requests, %llu mismatches, recorded %.3f ms, replayed %.3f ms\n",
+           (unsigned long long)result.records, (unsigned long long)result.requests, (unsigned long long)result.mismatches,
+           result.recorded / 1e6, result.elapsed / 1e6);
+    
+    IOUSBClose(&client);
+    IOUSBSimDestroy(sim);
+    return ret;
+}
@@ -0,0 +1,86 @@
+// iousb_identity_fuzz: IOUSBParseIdentity under libFuzzer or AFL.
+//
+// Every input is parsed as an iSerial string and the result checked for
+// keys the parser does not know and text fields that lost their NUL. The
+// seed corpus in fuzz/corpus/identity holds real DFU, recovery and pongoOS
+// strings and the malformed shapes they are cut into over flaky links.
+// Build together with the library sources, e.g.
+//   clang -g -fsanitize=fuzzer,address -DRA1NPOC_MODE -Iinclude-root fuzz/iousb_identity_fuzz.c iousb*.c -lpthread -lz
+//   ./a.out -dict=fuzz/identity.dict fuzz/corpus/identity
+// or, for AFL and for replaying single inputs, with -DIOUSB_FUZZ_MAIN:
+//   afl-clang-fast -DIOUSB_FUZZ_MAIN -DRA1NPOC_MODE -Iinclude-root fuzz/iousb_identity_fuzz.c iousb*.c -lpthread -lz
+//   afl-fuzz -i fuzz/corpus/identity -o findings -x fuzz/identity.dict -- ./a.out @@
+
+#include <io/iousb.h>
+#include <common/log.h>
+#include <common/common.h>
+
+#define FUZZ_MAX_INPUT      (0x10000)
+#define FUZZ_KNOWN_KEYS     ((kIdentityYOLO << 1) - 1)
+
+#define FUZZ_CHECK_STRING(identity, field) \
+    if(strnlen((identity)->field, sizeof((identity)->field)) == sizeof((identity)->field)) \
+    { \
+        ERR("%s is not terminated", #field); \
+        abort(); \
+    }
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    device_identity_t identity;
+    
+    // the descriptor is NUL terminated by the time the parser sees it
+    char *str = malloc(size + 1);
+    if(!str)
+    {
+        return 0;
+    }
+    memcpy(str, data, size);
+    str[size] = '\0';
+    
+    IOUSBParseIdentity(str, &identity);
+    free(str);
+    
+    if(identity.keys & ~FUZZ_KNOWN_KEYS)
+    {
+        ERR("Unknown keys %x", identity.keys);
+        abort();
+    }
+    FUZZ_CHECK_STRING(&identity, srtg);
+    FUZZ_CHECK_STRING(&identity, srnm);
+    FUZZ_CHECK_STRING(&identity, imei);
+    FUZZ_CHECK_STRING(&identity, pwnd);
+    FUZZ_CHECK_STRING(&identity, yolo);
+    return 0;
+}
+
+#ifdef IOUSB_FUZZ_MAIN
+static int FuzzFile(FILE *fp)
+{
+    static uint8_t buf[FUZZ_MAX_INPUT];
+    size_t len = fread(buf, 1, sizeof(buf), fp);
+    return LLVMFuzzerTestOneInput(buf, len);
+}
+
+// runs every file named on the command line, stdin without any
+int main(int argc, char **argv)
+{
+    if(argc < 2)
+    {
+        return FuzzFile(stdin);
+    }
+    
+    for(int i = 1; i < argc; i++)
+    {
+        FILE *fp = fopen(argv[i], "rb");
+        if(!fp)
+        {
+            ERR("Failed to open %s", argv[i]);
+            return -1;
+        }
+        FuzzFile(fp);
+        fclose(fp);
+    }
+    return 0;
+}
+#endif
@@ -3,9 +3,37 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+
+#if defined(__APPLE__)
 #include <CoreFoundation/CoreFoundation.h>
 #include <IOKit/usb/IOUSBLib.h>
 #include <IOKit/IOCFPlugIn.h>
+#else
+// IOKit compatible return codes, so callers see the same values on every backend
+typedef int32_t IOReturn;
+typedef uint32_t UInt32;
+
+#define kIOReturnSuccess        (IOReturn)0
+#define kIOReturnError          (IOReturn)0xe00002bc
+#define kIOReturnNoMemory       (IOReturn)0xe00002bd
+#define kIOReturnNoResources    (IOReturn)0xe00002be
+#define kIOReturnNoDevice       (IOReturn)0xe00002c0
+#define kIOReturnNotPrivileged  (IOReturn)0xe00002c1
+#define kIOReturnBadArgument    (IOReturn)0xe00002c2
+#define kIOReturnExclusiveAccess (IOReturn)0xe00002c5
+#define kIOReturnUnsupported    (IOReturn)0xe00002c7
+#define kIOReturnNotOpen        (IOReturn)0xe00002cd
+#define kIOReturnBusy           (IOReturn)0xe00002d5
+#define kIOReturnTimeout        (IOReturn)0xe00002d6
+#define kIOReturnUnderrun       (IOReturn)0xe00002e7
+#define kIOReturnOverrun        (IOReturn)0xe00002e8
+#define kIOReturnAborted        (IOReturn)0xe00002eb
+#define kIOReturnNotResponding  (IOReturn)0xe00002ed
+#define kIOReturnNotFound       (IOReturn)0xe00002f0
+
+#define kAppleVendorID          (0x05ac)
+#endif
 
 #ifndef kUSBHostReturnPipeStalled
 #define kUSBHostReturnPipeStalled (IOReturn)0xe0005000
@@ -43,22 +71,130 @@ __API_DEPRECATED_WITH_REPLACEMENT("kIOMainPortDefault", macos(10.0, 12.0), ios(9
 #define DFU_DNLOAD              (1)
 #define DFU_GET_STATUS          (3)
 #define DFU_CLR_STATUS          (4)
+#define DFU_ABORT               (6)
 #define DFU_MAX_TRANSFER_SZ     (0x800)
 #define EP0_MAX_PACKET_SZ       (0x40)
 
+// process wide and shared by every client, kept for existing callers; new
+// code takes IOUSBBlank(client) from iousb_pool.h, which is private to it
 extern unsigned char blank[DFU_MAX_TRANSFER_SZ];
 
+// DFU 1.1 device states, as reported by DFU_GET_STATUS
+#define DFU_STATE_IDLE                  (2)
+#define DFU_STATE_DNLOAD_SYNC           (3)
+#define DFU_STATE_DNBUSY                (4)
+#define DFU_STATE_DNLOAD_IDLE           (5)
+#define DFU_STATE_MANIFEST_SYNC         (6)
+#define DFU_STATE_MANIFEST              (7)
+#define DFU_STATE_MANIFEST_WAIT_RESET   (8)
+#define DFU_STATE_ERROR                 (10)
+
+#define DFU_STATUS_OK                   (0x00)
+#define DFU_STATUS_ERR_STALLEDPKT       (0x0f)
+
+// backend timeout value selecting the non-TO request variant
+#define IOUSB_NO_TIMEOUT        (0xffffffffU)
+// msec for control transfers that have no reason to pick their own
+#define IOUSB_DEFAULT_TIMEOUT   (5000U)
+// timeout letting an attached policy choose, IOUSB_DEFAULT_TIMEOUT without
+// one; only IOUSBControlTransferTO and IOUSBControlTransferRequest take it
+#define IOUSB_POLICY_TIMEOUT    (0xfffffffeU)
+// wLenDone of an async transfer that has not completed yet
+#define IOUSB_TRANSFER_PENDING  (0xffffffffU)
+
 typedef struct client_p client_t;
+typedef struct iousb_backend_p iousb_backend_t;
+typedef struct iousb_telemetry_p iousb_telemetry_t;
+typedef struct iousb_pool_p iousb_pool_t;
+typedef struct iousb_capture_p iousb_capture_t;
+typedef struct iousb_policy_p iousb_policy_t;
+typedef struct iousb_sched_p iousb_sched_t;
+#if !defined(__APPLE__)
+typedef struct usbfs_device_p usbfs_device_t;
+#endif
+
+#define IOUSB_LAYOUT_CACHE_SZ   (4)
+
+// keys present in a device_identity_t
+#define kIdentityCPID           (1 << 0)
+#define kIdentityCPRV           (1 << 1)
+#define kIdentityCPFM           (1 << 2)
+#define kIdentitySCEP           (1 << 3)
+#define kIdentityBDID           (1 << 4)
+#define kIdentityECID           (1 << 5)
+#define kIdentityIBFL           (1 << 6)
+#define kIdentitySDOM           (1 << 7)
+#define kIdentitySRTG           (1 << 8)
+#define kIdentitySRNM           (1 << 9)
+#define kIdentityIMEI           (1 << 10)
+#define kIdentityPWND           (1 << 11)
+#define kIdentityYOLO           (1 << 12)
+
+// everything the iSerial string of a DFU, recovery or pongoOS device carries
+typedef struct
+{
+    uint32_t keys;              // kIdentity* for every key that was present
+    uint32_t cpid;
+    uint32_t cprv;
+    uint32_t cpfm;
+    uint32_t scep;
+    uint32_t bdid;
+    uint32_t ibfl;
+    uint32_t sdom;
+    uint64_t ecid;
+    char srtg[64];              // iBoot/pongoOS tag, brackets stripped
+    char srnm[32];              // recovery mode only
+    char imei[32];
+    char pwnd[32];              // exploit tag, e.g. "checkm8"
+    char yolo[32];
+} device_identity_t;
+
+// interface and endpoint layout a full open resolved, cached per mode so
+// re-opening the same kind of device skips descriptor discovery
+typedef struct
+{
+    uint16_t pid;               // 0 = unused slot
+    uint8_t config;
+    uint8_t interface;
+    uint8_t alt_setting;
+    uint8_t if_class;
+    uint8_t if_subclass;
+    uint8_t if_protocol;
+    uint8_t bulk_out;           // endpoint addresses
+    uint8_t bulk_in;
+    uint8_t bulk_pipe;          // IOKit pipe ref of bulk_out, 0 on usbfs
+} usb_layout_t;
 
 struct client_p
 {
+#if defined(__APPLE__)
     IOUSBDeviceInterface245 **dev;
     IOUSBInterfaceInterface245 **handle;
     CFRunLoopSourceRef async_event_source;
+    CFRunLoopSourceRef async_interface_source;
+#else
+    usbfs_device_t *dev;
+#endif
+    const iousb_backend_t *backend;
+    void *backend_data;
     unsigned int cpid;
     unsigned int cprv;
+    uint64_t ecid;
+    // identity of the device last opened, kept across close for reconnects
+    uint64_t id;
+    uint32_t location;
+    usb_layout_t layout;        // of the device currently open
+    usb_layout_t layouts[IOUSB_LAYOUT_CACHE_SZ];
     bool sn;
     uint64_t devmode;
+    device_identity_t identity;     // of the device currently open
+    iousb_telemetry_t *telemetry;   // opt-in, see iousb_telemetry.h
+    iousb_pool_t *pool;             // transfer buffers, see iousb_pool.h
+    iousb_capture_t *capture;       // opt-in, see iousb_capture.h
+    iousb_policy_t *policy;         // opt-in and shared, see iousb_policy.h
+    bool policy_timeout;            // the policy chose the timeout of the transfer in flight
+    iousb_sched_t *sched;           // opt-in and shared, see iousb_sched.h
+    int stage;                      // last AUTOBOOT_STAGE passed to IOUSBTelemetryStage
 };
 
 typedef struct
@@ -69,6 +205,93 @@ typedef struct
 
 typedef transfer_t async_transfer_t;
 
+// one enumerated device, stable enough to open the same one again
+typedef struct
+{
+    uint64_t id;                // IORegistry entry ID, usbfs (bus << 16 | devnum)
+    uint16_t pid;
+    uint32_t location;          // IOKit style locationID: bus << 24 | one nibble per port
+    uint64_t ecid;
+    char path[64];              // usbfs node, empty on IOKit
+    char serial[256];
+} usb_device_t;
+
+#define kUSBDeviceArrived       (1)
+#define kUSBDeviceRemoved       (2)
+
+typedef struct
+{
+    int type;
+    usb_device_t device;
+} hotplug_event_t;
+
+// Host order fields laid out like the setup packet, so on a little-endian
+// host the 8 bytes of a control_request_t are the packet on the wire.
+typedef struct
+{
+    uint8_t  bm_request_type;
+    uint8_t  b_request;
+    uint16_t w_value;
+    uint16_t w_index;
+    uint16_t w_length;
+} control_request_t;
+
+#define USB_SETUP_PACKET_SZ     (8)
+
+#define kControlBatchStopOnError    (1 << 0)    // abort the rest of the batch after a failure
+#define kControlBatchStallOK        (1 << 1)    // kUSBHostReturnPipeStalled is not a failure
+
+#define CONTROL_BATCH_MAX_DEPTH     (16)
+
+typedef struct
+{
+    control_request_t req;
+    unsigned char *data;
+} control_batch_t;
+
+// platform glue behind the IOUSB* API
+struct iousb_backend_p
+{
+    const char *name;
+    int        (*open)(client_t *client, uint16_t pid);
+    // fills devices with up to max matches for pid, returns the number found or -1
+    int        (*enumerate)(client_t *client, uint16_t pid, usb_device_t *devices, int max);
+    int        (*open_device)(client_t *client, const usb_device_t *device);
+    void       (*close)(client_t *client);
+    void       (*reset)(client_t *client, int reset);
+    // the reset flags after which the device comes back under a new id, a
+    // plain port reset keeps it on IOKit and usbfs alike
+    int        reenumerate;
+    IOReturn   (*abort_pipe_zero)(client_t *client);
+    transfer_t (*control_transfer)(client_t *client, const control_request_t *req, unsigned char *data, unsigned int timeout);
+    transfer_t (*async_control_transfer)(client_t *client, const control_request_t *req, unsigned char *data, async_transfer_t *transfer, unsigned int timeout);
+    // blocks until one async completion has been delivered, -1 if none is pending
+    int        (*async_wait)(client_t *client);
+    transfer_t (*interface_control_transfer)(client_t *client, const control_request_t *req, unsigned char *data);
+    transfer_t (*bulk_upload)(client_t *client, void *data, uint32_t len);
+    transfer_t (*bulk_upload_async)(client_t *client, void *data, uint32_t len, async_transfer_t *transfer);
+    // optional arrival/removal notifications, next returns 0 with an event, 1 on timeout, -1 on error
+    void      *(*monitor_open)(client_t *client);
+    int        (*monitor_next)(client_t *client, void *monitor, hotplug_event_t *event, unsigned int timeout);
+    void       (*monitor_close)(client_t *client, void *monitor);
+    // optional completion queue hooks: an fd that polls ready when a completion
+    // can be reaped (-1 if none), a non-blocking reap that also expires timed
+    // out requests, and the CLOCK_MONOTONIC nsec at which the reap next has work.
+    // async_poll returns the number of completions it delivered, 0 if none was
+    // ready, or -1 if it failed without delivering any
+    int        (*async_fd)(client_t *client);
+    int        (*async_poll)(client_t *client);
+    uint64_t   (*async_deadline)(client_t *client);
+    // optional: sends the first len bytes of a regular file without mapping it here
+    transfer_t (*bulk_upload_fd)(client_t *client, int fd, uint32_t len);
+};
+
+#if defined(__APPLE__)
+extern const iousb_backend_t iousb_darwin_backend;
+#elif defined(__linux__)
+extern const iousb_backend_t iousb_linux_backend;
+#endif
+
 typedef struct
 {
     uint32_t endpoint, pad_0;
@@ -114,10 +337,36 @@ enum AUTOBOOT_STAGE
     USB_TRANSFER_ERROR,
 };
 
+const iousb_backend_t *IOUSBGetBackend(client_t *client);
+void IOUSBGetInfo(client_t *client, const char *str);
+uint64_t IOUSBParseECID(const char *str);
+// One pass over a serial string, e.g. usb_device_t.serial, so a device can be
+// told apart before it is opened. Unknown keys are skipped.
+void IOUSBParseIdentity(const char *str, device_identity_t *identity);
+
 void IOUSBClose(client_t *client);
 int IOUSBConnect(client_t *client, uint16_t pid, int retry, int reset, unsigned long sec);
+// Like IOUSBConnect, but blocks on hotplug events instead of sleeping. Opens
+// the first pid device matching ecid (0 = any) within timeout (msec); after a
+// reset that re-enumerates, the device that was open is skipped until it
+// comes back under its new id.
+int IOUSBConnectWait(client_t *client, uint16_t pid, uint64_t ecid, int reset, unsigned int timeout);
+// Re-opens the device this client was last attached to, now enumerating as
+// pid, matched on its port location and ECID instead of the id that changes
+// with every re-enumeration. Never picks up another device on the same hub.
+int IOUSBReattach(client_t *client, uint16_t pid, int reset, unsigned int timeout);
+// The id to skip while waiting for the device open on client to come back
+// after reset, 0 when that reset leaves it in place under the same id.
+uint64_t IOUSBResetExclude(client_t *client, int reset);
+int IOUSBEnumerate(client_t *client, uint16_t pid, usb_device_t *devices, int max);
+int IOUSBOpenDevice(client_t *client, const usb_device_t *device);
 void IOUSBSendReboot(client_t *client);
 
+// the per-client layout cache, filled by the backends on a full open
+const usb_layout_t *IOUSBLayoutLookup(client_t *client, uint16_t pid);
+void IOUSBLayoutStore(client_t *client, const usb_layout_t *layout);
+void IOUSBLayoutFlush(client_t *client);
+
 IOReturn IOUSBAbortPipeZero(client_t *client);
 transfer_t IOUSBControlTransfer(client_t *client,
                                 uint8_t bm_request_type,
@@ -134,6 +383,9 @@ transfer_t IOUSBControlTransferTO(client_t *client,
                                   unsigned char *data,
                                   uint16_t w_length,
                                   unsigned int time);
+// Takes a setup packet that is already built, e.g. a constant, instead of the
+// loose fields; IOUSB_NO_TIMEOUT as timeout behaves like IOUSBControlTransfer.
+transfer_t IOUSBControlTransferRequest(client_t *client, const control_request_t *req, unsigned char *data, unsigned int timeout);
 transfer_t IOUSBAsyncControlTransfer(client_t *client,
                                      uint8_t bm_request_type,
                                      uint8_t b_request,
@@ -168,6 +420,30 @@ transfer_t IOUSBControlRequestTransfer(client_t *client,
                                        unsigned char *data,
                                        uint16_t w_length);
 
+// Queues up to CONTROL_BATCH_MAX_DEPTH requests on EP0 at a time instead of
+// a round trip each. results[i] gets the outcome of batch[i]; requests never
+// sent or discarded by kControlBatchStopOnError report kIOReturnAborted.
+// Returns the number of failed requests (at most 1 with StopOnError), or -1.
+// Completions are reaped like IOUSBAsyncWait does, so on Darwin the calling
+// thread must be the one whose run loop the client was opened on.
+int IOUSBControlTransferBatch(client_t *client,
+                              const control_batch_t *batch,
+                              transfer_t *results,
+                              size_t count,
+                              unsigned int flags,
+                              unsigned int timeout);
+
 transfer_t IOUSBBulkUpload(client_t *client, void *data, uint32_t len);
+transfer_t IOUSBBulkUploadAsync(client_t *client, void *data, uint32_t len, async_transfer_t *transfer);
+int IOUSBAsyncWait(client_t *client);
+// For when IOUSBAsyncWait failed with transfers still queued into the
+// caller's memory: aborts EP0 and reaps while pending(ctx) holds. If the
+// backend cannot reap them either, the device is closed, which discards them.
+// Either way nothing is written to them after it returns; 0 once they all
+// landed, -1 if the client had to be closed.
+int IOUSBAsyncDiscard(client_t *client, bool (*pending)(void *ctx), void *ctx);
+int IOUSBAsyncFd(client_t *client);
+int IOUSBAsyncPoll(client_t *client);
+uint64_t IOUSBAsyncDeadline(client_t *client);
 
 #endif
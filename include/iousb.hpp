@@ -0,0 +1,282 @@
+#ifndef IOUSB_HPP
+#define IOUSB_HPP
+
+// C++20 layer over the IOUSB* API, header only. A client owns its client_t
+// and closes the device when it goes out of scope; setup packets are
+// constants built at compile time and handed to the C side as they are, so
+// a transfer only passes a pointer to rodata and a span. On little-endian
+// hosts those constants are the 8 wire bytes, checked at compile time, and
+// the usbfs backend copies them into the URB unchanged.
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <span>
+#include <utility>
+
+extern "C"
+{
+#include <io/iousb.h>
+#include <io/iousb_dfu.h>
+#include <io/iousb_pool.h>
+#include <io/iousb_telemetry.h>
+#include <io/iousb_upload.h>
+}
+
+namespace iousb
+{
+    using bytes = std::span<unsigned char>;
+    using const_bytes = std::span<const unsigned char>;
+    
+    using setup_packet = std::array<unsigned char, USB_SETUP_PACKET_SZ>;
+    
+    static_assert(sizeof(control_request_t) == USB_SETUP_PACKET_SZ, "control_request_t is laid out like the setup packet");
+    
+    // A setup packet. The fields are in host order like every control_request_t.
+    consteval control_request_t request(uint8_t bm_request_type,
+                                        uint8_t b_request,
+                                        uint16_t w_value = 0,
+                                        uint16_t w_index = 0,
+                                        uint16_t w_length = 0)
+    {
+        return control_request_t{ bm_request_type, b_request, w_value, w_index, w_length };
+    }
+    
+    // the packet as it goes on the wire, little-endian on any host
+    consteval setup_packet wire(const control_request_t &req)
+    {
+        return setup_packet{ req.bm_request_type, req.b_request,
+                             (unsigned char)(req.w_value & 0xff), (unsigned char)(req.w_value >> 8),
+                             (unsigned char)(req.w_index & 0xff), (unsigned char)(req.w_index >> 8),
+                             (unsigned char)(req.w_length & 0xff), (unsigned char)(req.w_length >> 8) };
+    }
+    
+    consteval bool is_in(const control_request_t &req)
+    {
+        return (req.bm_request_type & 0x80) != 0;
+    }
+    
+    // A recovery mode command, the string literal with its terminator. The
+    // size is part of the type, so the packet carrying it is a constant too.
+    template<size_t N>
+    struct command
+    {
+        char text[N];
+        
+        consteval command(const char (&str)[N])
+        {
+            for(size_t i = 0; i < N; i++)
+            {
+                text[i] = str[i];
+            }
+        }
+        
+        static constexpr size_t size = N;
+    };
+    
+    namespace dfu
+    {
+        inline constexpr uint16_t status_size = 6;
+        
+        inline constexpr control_request_t get_status = request(0xa1, DFU_GET_STATUS, 0, 0, status_size);
+        inline constexpr control_request_t clr_status = request(0x21, DFU_CLR_STATUS);
+        inline constexpr control_request_t abort = request(0x21, DFU_ABORT);
+        // one block of Length bytes, 0 for the one that starts the manifest;
+        // wValue is the block number, which dfu_dnload fills in
+        template<uint16_t Length>
+        inline constexpr control_request_t dnload = request(0x21, DFU_DNLOAD, 0, 0, Length);
+    }
+    
+    namespace recovery
+    {
+        // the commands IOUSBSendReboot sends, byte for byte
+        inline constexpr command auto_boot = "setenv auto-boot true\x00";
+        inline constexpr command saveenv = "saveenv\x00";
+        inline constexpr command reboot = "reboot\x00";
+        
+        template<command Cmd>
+        inline constexpr control_request_t packet = request(0x40, 0, 0, 0, Cmd.size);
+    }
+    
+    // Owns a client_t, which stays at one address for its whole life, so a
+    // client can be moved while a completion queue or session points at it.
+    class client
+    {
+    public:
+        client() : c_(new client_t()) {}
+        
+        // e.g. IOUSBSimAttach, IOUSBBrokerAttach or IOUSBCaptureStart on get() works as well
+        client(const iousb_backend_t *backend, void *backend_data) : client()
+        {
+            c_->backend = backend;
+            c_->backend_data = backend_data;
+        }
+        
+        client(const client &) = delete;
+        client &operator=(const client &) = delete;
+        client(client &&) noexcept = default;
+        client &operator=(client &&) noexcept = default;
+        ~client() = default;
+        
+        client_t *get() const noexcept
+        {
+            return c_.get();
+        }
+        
+        explicit operator bool() const noexcept
+        {
+            return c_ != nullptr;
+        }
+        
+        int connect(uint16_t pid, int retry = 1, int reset = 0, unsigned long sec = 0) noexcept
+        {
+            return IOUSBConnect(get(), pid, retry, reset, sec);
+        }
+        
+        int connect_wait(uint16_t pid, uint64_t ecid, int reset, unsigned int timeout) noexcept
+        {
+            return IOUSBConnectWait(get(), pid, ecid, reset, timeout);
+        }
+        
+        int reattach(uint16_t pid, int reset, unsigned int timeout) noexcept
+        {
+            return IOUSBReattach(get(), pid, reset, timeout);
+        }
+        
+        int open(const usb_device_t &device) noexcept
+        {
+            return IOUSBOpenDevice(get(), &device);
+        }
+        
+        void close() noexcept
+        {
+            if(c_)
+            {
+                IOUSBClose(get());
+            }
+        }
+        
+        // Req is resolved at compile time, data has to hold its wLength bytes
+        template<control_request_t Req>
+        transfer_t control(bytes data = {}, unsigned int timeout = IOUSB_NO_TIMEOUT) noexcept
+        {
+            static constexpr control_request_t packet = Req;
+            static_assert(std::endian::native != std::endian::little || std::bit_cast<setup_packet>(Req) == wire(Req),
+                          "the constant is not the wire packet");
+            if(data.size() < Req.w_length)
+            {
+                return failed(kIOReturnBadArgument);
+            }
+            return IOUSBControlTransferRequest(get(), &packet, Req.w_length ? data.data() : nullptr, timeout);
+        }
+        
+        // the OUT requests take read-only data, the backends never write to it
+        template<control_request_t Req>
+            requires (!is_in(Req))
+        transfer_t send(const_bytes data = {}, unsigned int timeout = IOUSB_NO_TIMEOUT) noexcept
+        {
+            return control<Req>(bytes(const_cast<unsigned char *>(data.data()), data.size()), timeout);
+        }
+        
+        template<command Cmd>
+        transfer_t send(unsigned int timeout = IOUSB_NO_TIMEOUT) noexcept
+        {
+            static constexpr command text = Cmd;
+            return send<recovery::packet<Cmd>>(const_bytes(reinterpret_cast<const unsigned char *>(text.text), text.size), timeout);
+        }
+        
+        transfer_t dfu_status(std::span<unsigned char, dfu::status_size> status) noexcept
+        {
+            return control<dfu::get_status>(status);
+        }
+        
+        transfer_t dfu_clear() noexcept
+        {
+            return control<dfu::clr_status>();
+        }
+        
+        transfer_t dfu_abort() noexcept
+        {
+            return control<dfu::abort>();
+        }
+        
+        // number is wBlockNum, counted from 0 since the last dfuIDLE
+        template<size_t Length>
+        transfer_t dfu_dnload(std::span<const unsigned char, Length> block, uint16_t number = 0) noexcept
+        {
+            static_assert(Length <= DFU_MAX_TRANSFER_SZ, "a DFU block is at most DFU_MAX_TRANSFER_SZ bytes");
+            control_request_t packet = dfu::dnload<(uint16_t)Length>;
+            packet.w_value = number;
+            return IOUSBControlTransferRequest(get(), &packet, Length ? const_cast<unsigned char *>(block.data()) : nullptr, IOUSB_NO_TIMEOUT);
+        }
+        
+        // What IOUSBSendReboot does, from the constant packets and just as
+        // synchronous. Returns the number of failed requests.
+        int send_reboot() noexcept
+        {
+            return (send<recovery::auto_boot>().ret != kIOReturnSuccess) +
+                   (send<recovery::saveenv>().ret != kIOReturnSuccess) +
+                   (send<recovery::reboot>().ret != kIOReturnSuccess);
+        }
+        
+        IOReturn abort_pipe_zero() noexcept
+        {
+            return IOUSBAbortPipeZero(get());
+        }
+        
+        transfer_t bulk(const_bytes data) noexcept
+        {
+            if(data.size() > std::numeric_limits<uint32_t>::max())
+            {
+                return failed(kIOReturnBadArgument);
+            }
+            return IOUSBBulkUpload(get(), const_cast<unsigned char *>(data.data()), (uint32_t)data.size());
+        }
+        
+        transfer_t upload(const_bytes data, const upload_opts_t *opts = nullptr) noexcept
+        {
+            if(data.size() > std::numeric_limits<uint32_t>::max())
+            {
+                return failed(kIOReturnBadArgument);
+            }
+            return IOUSBBulkUploadStream(get(), data.data(), (uint32_t)data.size(), opts);
+        }
+        
+        IOReturn dfu_download(const_bytes image, const dfu_opts_t *opts = nullptr, dfu_result_t *result = nullptr) noexcept
+        {
+            if(image.size() > std::numeric_limits<uint32_t>::max())
+            {
+                return kIOReturnBadArgument;
+            }
+            return IOUSBDFUDownload(get(), image.data(), (uint32_t)image.size(), opts, result);
+        }
+    
+    private:
+        struct release
+        {
+            void operator()(client_t *client) const noexcept
+            {
+                IOUSBClose(client);
+                IOUSBTelemetryDisable(client);
+                IOUSBPoolDestroy(client);
+                delete client;
+            }
+        };
+        
+        static transfer_t failed(IOReturn ret) noexcept
+        {
+            transfer_t result;
+            result.wLenDone = 0;
+            result.ret = ret;
+            return result;
+        }
+        
+        std::unique_ptr<client_t, release> c_;
+    };
+}
+
+#endif
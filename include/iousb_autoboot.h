@@ -0,0 +1,70 @@
+#ifndef IOUSB_AUTOBOOT_H
+#define IOUSB_AUTOBOOT_H
+
+#include <io/iousb.h>
+#include <io/iousb_pongo.h>
+
+#define AUTOBOOT_MAX_STAGES         (USB_TRANSFER_ERROR + 1)
+#define AUTOBOOT_DEFAULT_RETRIES    (2)
+#define AUTOBOOT_DEFAULT_TIMEOUT    (10000) // msec per shell command
+
+#define kAutobootStage(stage)       (1u << (stage))
+
+typedef struct
+{
+    const void *kpf;                // NULL skips SEND_STAGE_KPF, SETUP_STAGE_KPF and the flag stages
+    uint32_t kpf_len;
+    const void *ramdisk;            // NULL skips both ramdisk stages
+    uint32_t ramdisk_len;
+    const void *overlay;            // NULL skips both overlay stages
+    uint32_t overlay_len;
+    uint32_t kpf_flags;
+    uint32_t checkra1n_flags;
+    const char *xargs;              // NULL skips SETUP_STAGE_XARGS
+    const char *rootdev;            // NULL skips SETUP_STAGE_ROOTDEV
+    uint32_t skip;                  // kAutobootStage() bits of further stages to leave out
+} autoboot_plan_t;
+
+typedef struct
+{
+    uint64_t start;                 // nsec from the start of the run, last attempt
+    uint64_t end;
+    unsigned int attempts;          // 0 when the stage was skipped
+    IOReturn ret;
+} autoboot_timing_t;
+
+// called whenever a stage attempt ends, including ones that will be retried
+typedef void (*autoboot_stage_cb_t)(void *ctx, int stage, const autoboot_timing_t *timing);
+
+typedef struct
+{
+    int retries;                    // extra attempts per stage, 0 = default, < 0 = none
+    unsigned int timeout;           // msec per shell command, 0 = default
+    upload_opts_t upload;           // chunking of the blob uploads, progress is ignored
+    autoboot_stage_cb_t stage;      // may be NULL
+    pongo_output_t output;          // shell output as it arrives, may be NULL
+    void *ctx;
+} autoboot_opts_t;
+
+typedef struct
+{
+    int stage;                      // BOOTUP_STAGE on success, USB_TRANSFER_ERROR otherwise
+    int failed;                     // the stage that gave up, NONE on success
+    IOReturn ret;
+    uint64_t elapsed;               // nsec for the whole run
+    autoboot_timing_t stages[AUTOBOOT_MAX_STAGES];
+} autoboot_result_t;
+
+// Runs the pongoOS boot sequence of plan on an open pongoOS client. Shell
+// commands run one at a time in AUTOBOOT_STAGE order, while the next blob is
+// announced and streamed over the bulk pipe as soon as the loader buffer is
+// free, i.e. once the previous blob has been consumed by its setup command.
+// A stage that fails with a transfer error is retried on its own, up to
+// opts->retries times; a command that times out is not. The client must be
+// used from this thread only until the call returns. opts and result may be
+// NULL. Returns 0 once the device has left the bus to boot, -1 otherwise.
+int IOUSBAutoboot(client_t *client, const autoboot_plan_t *plan, const autoboot_opts_t *opts, autoboot_result_t *result);
+
+const char *IOUSBAutobootStageName(int stage);
+
+#endif
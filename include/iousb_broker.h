@@ -0,0 +1,54 @@
+#ifndef IOUSB_BROKER_H
+#define IOUSB_BROKER_H
+
+#include <io/iousb.h>
+
+#define BROKER_DEFAULT_NAME     "iousb_broker.sock"
+#define BROKER_RING_SZ          (16)        // requests one client can have outstanding
+#define BROKER_SLOT_SZ          (0x40000)   // payload bytes per request, a default bulk chunk
+#define BROKER_MAX_DEVICES      (64)
+#define BROKER_MAX_ENUMERATE    (16)        // devices one enumerate through the broker reports
+#define BROKER_HELLO_TIMEOUT    (100)       // msec a new connection gets to say what it wants
+
+typedef struct iousb_broker_p iousb_broker_t;
+
+typedef struct
+{
+    uint64_t devices;               // devices the broker holds
+    uint64_t clients;               // connections served
+    uint64_t opens;                 // device opens the broker had to do
+    uint64_t requests;
+} broker_stats_t;
+
+extern const iousb_backend_t iousb_broker_backend;
+
+// The broker is a long running process that owns the devices, so tools that
+// come and go skip the open and never seize a device from each other. Every
+// device gets a worker thread of its own; a client talks to it through a
+// shared memory ring with eventfd doorbells both ways, and files for bulk
+// uploads are passed as fds instead of being copied. Linux only.
+//
+// tmpl picks the backend the broker drives, e.g. a client attached to a
+// simulated device; NULL for the native one. A scheduler attached to tmpl
+// admits the bulk uploads of every device the broker opens. A NULL path is BROKER_DEFAULT_NAME
+// in $XDG_RUNTIME_DIR, or without one in /tmp/iousb-<uid>, a 0700 directory
+// the broker creates. The socket is made 0600 and connections from other
+// users are turned away.
+iousb_broker_t *IOUSBBrokerCreate(const char *path, const client_t *tmpl);
+// Serves until IOUSBBrokerStop, which is async-signal-safe.
+int IOUSBBrokerRun(iousb_broker_t *broker);
+void IOUSBBrokerStop(iousb_broker_t *broker);
+// Closes every device, call it after IOUSBBrokerRun returned.
+void IOUSBBrokerDestroy(iousb_broker_t *broker);
+void IOUSBBrokerGetStats(iousb_broker_t *broker, broker_stats_t *stats);
+
+// Points client at the broker listening on path (NULL for the default). The
+// usual IOUSBConnect/IOUSBOpenDevice then attach to the broker's device, the
+// one with ecid if not 0, and IOUSBClose only detaches from it. A reset
+// reaches the device and ends every other client's session with it as well.
+// Async bulk transfers are limited to BROKER_SLOT_SZ, IOUSBBulkUploadStream
+// with the default chunk size stays within it.
+int IOUSBBrokerAttach(client_t *client, const char *path, uint64_t ecid);
+void IOUSBBrokerDetach(client_t *client);
+
+#endif
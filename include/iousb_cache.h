@@ -0,0 +1,70 @@
+#ifndef IOUSB_CACHE_H
+#define IOUSB_CACHE_H
+
+#include <io/iousb.h>
+#include <io/iousb_upload.h>
+
+#define PAYLOAD_CACHE_VERSION       (1)     // bump when a builder changes its output
+#define PAYLOAD_CACHE_MAX_ENTRIES   (64)    // images kept mapped per cache
+#define PAYLOAD_CACHE_NAME_SZ       (16)
+
+typedef struct iousb_payload_cache_p iousb_payload_cache_t;
+
+// the unpatched image a prepared one is built from
+typedef struct
+{
+    const void *data;
+    size_t len;
+    uint64_t hash;                  // IOUSBPayloadHash of data, 0 = hash it on lookup
+} payload_source_t;
+
+// Prepares the image of src for one chip into a malloc'd buffer the cache
+// takes over. Returns 0 on success.
+typedef int (*payload_build_t)(void *ctx, uint32_t cpid, uint32_t cprv, const void *src, size_t src_len, void **out, size_t *out_len);
+
+// Builds the checkra1n payload of one chip from src: the stage images into
+// malloc'd buffers the cache takes over, plus the callback/next overwrite
+// values. Returns 0 on success.
+typedef int (*checkra1n_build_t)(void *ctx, uint32_t cpid, uint32_t cprv, const checkra1n_payload_t *src, checkra1n_payload_t *out);
+
+// Opens the store in dir, creating the directory if needed. Entries are
+// files there that every process using the same dir maps read-only, so the
+// page cache holds one copy no matter how many tools boot devices. dir may
+// be NULL to keep built images in memory only.
+iousb_payload_cache_t *IOUSBPayloadCacheOpen(const char *dir);
+// unmaps every image handed out by this cache
+void IOUSBPayloadCacheClose(iousb_payload_cache_t *cache);
+
+uint64_t IOUSBPayloadHash(const void *data, size_t len);
+
+// Looks up the image name was built into for (cpid, cprv) from src: first
+// among the images this cache has mapped, then in the store, and only then
+// runs build and stores its output. Concurrent misses on the same store,
+// from any process, build once. map is owned by the cache and stays valid
+// until IOUSBPayloadCacheClose; do not pass it to IOUSBUnmapPayload.
+// Returns 1 on a hit, 0 after a build, -1 on error.
+int IOUSBPayloadCacheGet(iousb_payload_cache_t *cache,
+                         uint32_t cpid,
+                         uint32_t cprv,
+                         const char *name,
+                         const payload_source_t *src,
+                         payload_build_t build,
+                         void *ctx,
+                         payload_map_t *map);
+
+// IOUSBPayloadCacheGet for a whole checkra1n payload, keyed on (cpid, cprv)
+// and the stage1, pongoOS and stage2 images of src. The stage pointers of out
+// point into the cache, read-only, with the same lifetime as a map from
+// IOUSBPayloadCacheGet. Returns 1 on a hit, 0 after a build, -1 on error.
+int IOUSBPayloadCacheGetCheckra1n(iousb_payload_cache_t *cache,
+                                  uint32_t cpid,
+                                  uint32_t cprv,
+                                  const checkra1n_payload_t *src,
+                                  checkra1n_build_t build,
+                                  void *ctx,
+                                  checkra1n_payload_t *out);
+
+// removes every stored image, e.g. after a builder changed; mapped ones stay valid
+int IOUSBPayloadCachePurge(iousb_payload_cache_t *cache);
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef IOUSB_CAPTURE_H
+#define IOUSB_CAPTURE_H
+
+#include <io/iousb.h>
+
+#define CAPTURE_MAGIC               "IOUSBCAP"
+#define CAPTURE_VERSION             (1)
+#define CAPTURE_HEADER_SZ           (40)
+#define CAPTURE_RECORD_SZ           (56)
+#define CAPTURE_MAX_INFLIGHT        (64)
+
+// what a record is for
+#define kCaptureControl             (0)
+#define kCaptureInterfaceControl    (1)
+#define kCaptureAsyncControl        (2)     // submit, its completion follows as kCaptureComplete
+#define kCaptureBulk                (3)
+#define kCaptureBulkAsync           (4)     // submit, its completion follows as kCaptureComplete
+#define kCaptureComplete            (5)     // seq names the submit record
+#define kCaptureAbort               (6)
+#define CAPTURE_MAX_OPS             (7)
+
+// IOUSBCaptureStart flags, what gets stored besides the payload hash
+#define kCaptureControlData         (1 << 0)    // control payloads, both directions
+#define kCaptureBulkData            (1 << 1)    // bulk payloads, can be large
+
+// record flags
+#define kCaptureRecordPayload       (1 << 0)    // payload_len bytes follow the record
+#define kCaptureRecordLost          (1 << 1)    // in-flight table was full, no completion will follow
+
+// IOUSBCaptureReplay flags
+#define kReplayMaxSpeed             (1 << 0)    // ignore the recorded gaps between requests
+
+typedef struct
+{
+    uint32_t version;
+    uint32_t flags;                 // kCapture* the trace was started with
+    uint64_t wall;                  // CLOCK_REALTIME nsec at the start of the capture
+    uint64_t ecid;
+    uint32_t cpid;
+    uint16_t pid;
+} capture_header_t;
+
+typedef struct
+{
+    uint8_t op;
+    uint8_t flags;
+    uint8_t bm_request_type;
+    uint8_t b_request;
+    uint16_t w_value;
+    uint16_t w_index;
+    uint32_t length;                // wLength, or the bulk length
+    uint32_t seq;                   // position in the trace, the submit's for kCaptureComplete
+    IOReturn ret;
+    uint32_t wLenDone;              // IOUSB_TRANSFER_PENDING on a submit
+    uint32_t timeout;
+    uint32_t payload_len;
+    uint64_t start;                 // nsec since the capture started
+    uint64_t end;
+    uint64_t hash;                  // FNV-1a of the bytes sent, or received for IN requests
+} capture_record_t;
+
+typedef struct capture_reader_p capture_reader_t;
+
+// called for every replayed request with what was recorded and what happened now
+typedef void (*capture_replay_cb_t)(void *ctx, const capture_record_t *recorded, const capture_record_t *replayed);
+
+typedef struct
+{
+    uint64_t records;
+    uint64_t requests;              // records that put something on the bus
+    uint64_t mismatches;            // ret or wLenDone differ from the recording
+    uint64_t recorded;              // nsec from the first to the last recorded request
+    uint64_t elapsed;               // nsec the replay took
+} capture_replay_t;
+
+// Records every request the client makes, from any API that reaches the
+// backend, into the trace at path. Interposes on the client's backend, so
+// start it after the backend is chosen (e.g. after IOUSBSimAttach) and stop
+// it with no transfers in flight. Async completions are written as they are
+// reaped by IOUSBAsyncWait or IOUSBAsyncPoll, so a transfer has to stay valid
+// until one of those saw it complete or the device was closed; closing
+// records whatever was still in flight as aborted.
+int IOUSBCaptureStart(client_t *client, const char *path, unsigned int flags);
+void IOUSBCaptureStop(client_t *client);
+
+capture_reader_t *IOUSBCaptureOpen(const char *path, capture_header_t *header);
+// 1 with the next record, 0 at the end of the trace, -1 on a damaged trace.
+// Up to len bytes of its payload are copied to payload when it has one.
+int IOUSBCaptureNext(capture_reader_t *reader, capture_record_t *record, void *payload, size_t len);
+void IOUSBCaptureClose(capture_reader_t *reader);
+
+// Feeds a trace through client, usually a simulated device, in the recorded
+// order and, unless kReplayMaxSpeed is given, with the recorded gaps between
+// submits. Payloads that were not stored are sent as zeros. cb and result may
+// be NULL. Returns 0 when the trace was replayed to the end.
+int IOUSBCaptureReplay(client_t *client, const char *path, unsigned int flags,
+                       capture_replay_cb_t cb, void *ctx, capture_replay_t *result);
+
+#endif
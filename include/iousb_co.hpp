@@ -0,0 +1,911 @@
+#ifndef IOUSB_CO_HPP
+#define IOUSB_CO_HPP
+
+// C++20 coroutines over the completion queue, header only. An executor owns
+// one iousb_cq_t and runs any number of device flows on the thread that
+// calls run(); a flow suspends on every transfer, sleep or device wait, and
+// is resumed from the queue's completions, so devices overlap without a
+// thread or a blocking wait of their own. Like the queue itself, an executor
+// and the clients its flows use belong to one thread.
+//
+// GCC 12 never starts a task awaited inside an if condition; await it into a
+// local and test that.
+
+#include <algorithm>
+#include <array>
+#include <coroutine>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <optional>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <io/iousb.hpp>
+
+extern "C"
+{
+#include <io/iousb_cq.h>
+#include <io/iousb_hotplug.h>
+#include <io/iousb_pongo.h>
+#include <io/iousb_sched.h>
+#include <common/log.h>
+}
+
+namespace iousb::co
+{
+    template<typename T = void>
+    class task;
+    class executor;
+
+    namespace detail
+    {
+        inline uint64_t now() noexcept
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        }
+
+        inline transfer_t failed(IOReturn ret) noexcept
+        {
+            transfer_t result;
+            result.wLenDone = 0;
+            result.ret = ret;
+            return result;
+        }
+
+        struct promise_base
+        {
+            std::coroutine_handle<> continuation;
+
+            // a task starts once it is awaited or spawned
+            std::suspend_always initial_suspend() noexcept
+            {
+                return {};
+            }
+
+            struct final_awaiter
+            {
+                bool await_ready() const noexcept
+                {
+                    return false;
+                }
+
+                template<typename P>
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) const noexcept
+                {
+                    // straight back into whoever awaited it, no trip through the executor
+                    std::coroutine_handle<> next = h.promise().continuation;
+                    return next ? next : std::noop_coroutine();
+                }
+
+                void await_resume() const noexcept {}
+            };
+
+            final_awaiter final_suspend() noexcept
+            {
+                return {};
+            }
+
+            // flows report failures as values, an exception escaping one is a bug
+            void unhandled_exception() noexcept
+            {
+                std::terminate();
+            }
+        };
+
+        template<typename T>
+        struct promise : promise_base
+        {
+            std::optional<T> value;
+
+            task<T> get_return_object() noexcept;
+
+            void return_value(T v) noexcept(std::is_nothrow_move_constructible_v<T>)
+            {
+                value.emplace(std::move(v));
+            }
+        };
+
+        template<>
+        struct promise<void> : promise_base
+        {
+            task<void> get_return_object() noexcept;
+
+            void return_void() noexcept {}
+        };
+    }
+
+    // A lazily started coroutine returning T. Awaiting it runs it to its end
+    // and resumes the awaiting coroutine directly; it owns its frame, so a
+    // task that goes out of scope takes its unfinished children with it.
+    template<typename T>
+    class task
+    {
+    public:
+        using promise_type = detail::promise<T>;
+        using handle_type = std::coroutine_handle<promise_type>;
+
+        explicit task(handle_type h) noexcept : h_(h) {}
+        task(task &&other) noexcept : h_(std::exchange(other.h_, {})) {}
+
+        task &operator=(task &&other) noexcept
+        {
+            if(this != &other)
+            {
+                if(h_)
+                {
+                    h_.destroy();
+                }
+                h_ = std::exchange(other.h_, {});
+            }
+            return *this;
+        }
+
+        task(const task &) = delete;
+        task &operator=(const task &) = delete;
+
+        ~task()
+        {
+            if(h_)
+            {
+                h_.destroy();
+            }
+        }
+
+        bool done() const noexcept
+        {
+            return !h_ || h_.done();
+        }
+
+        handle_type handle() const noexcept
+        {
+            return h_;
+        }
+
+        struct awaiter
+        {
+            handle_type h;
+
+            bool await_ready() const noexcept
+            {
+                return !h || h.done();
+            }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) const noexcept
+            {
+                h.promise().continuation = caller;
+                return h;
+            }
+
+            T await_resume() const
+            {
+                if constexpr(!std::is_void_v<T>)
+                {
+                    return std::move(*h.promise().value);
+                }
+            }
+        };
+
+        awaiter operator co_await() const noexcept
+        {
+            return awaiter{ h_ };
+        }
+
+    private:
+        handle_type h_;
+    };
+
+    namespace detail
+    {
+        template<typename T>
+        inline task<T> promise<T>::get_return_object() noexcept
+        {
+            return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+        }
+
+        inline task<void> promise<void>::get_return_object() noexcept
+        {
+            return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+        }
+    }
+
+    // One submitted transfer. It has to stay put until it completed, so it
+    // lives in a coroutine frame; submit several and await them in order to
+    // keep a pipe busy. Destroying one that is still in flight, e.g. with
+    // the task that owns its frame, takes its client out of the queue: EP0 is
+    // aborted and everything else that client had queued is dropped too.
+    class in_flight
+    {
+    public:
+        in_flight() = default;
+        in_flight(const in_flight &) = delete;
+        in_flight &operator=(const in_flight &) = delete;
+
+        ~in_flight()
+        {
+            if(cq_ && !done_)
+            {
+                IOUSBCompletionQueueRemove(cq_, client_);
+            }
+        }
+
+        auto operator co_await() & noexcept
+        {
+            return awaiter<in_flight>{ *this };
+        }
+
+        bool done() const noexcept
+        {
+            return done_;
+        }
+
+        // valid once done()
+        transfer_t result() const noexcept
+        {
+            return result_;
+        }
+
+    protected:
+        friend class executor;
+
+        // awaits op where it is, an awaitable copied into the frame would miss its completion
+        template<typename Op>
+        struct awaiter
+        {
+            Op &op;
+
+            bool await_ready() const noexcept
+            {
+                return op.done_;
+            }
+
+            auto await_suspend(std::coroutine_handle<> h) noexcept
+            {
+                return op.suspend(h);
+            }
+
+            transfer_t await_resume() const noexcept
+            {
+                return op.result_;
+            }
+        };
+
+        void suspend(std::coroutine_handle<> h) noexcept
+        {
+            waiter_ = h;
+        }
+
+        void reset(iousb_cq_t *cq, client_t *client) noexcept
+        {
+            result_ = detail::failed(kIOReturnSuccess);
+            done_ = false;
+            waiter_ = {};
+            cq_ = cq;
+            client_ = client;
+        }
+
+        void fail(IOReturn ret) noexcept
+        {
+            result_ = detail::failed(ret);
+            done_ = true;
+        }
+
+        transfer_t result_ = detail::failed(kIOReturnSuccess);
+        bool done_ = false;
+        std::coroutine_handle<> waiter_;
+        iousb_cq_t *cq_ = nullptr;
+        client_t *client_ = nullptr;
+    };
+
+    class executor
+    {
+    public:
+        static constexpr int max_completions = 64;
+
+        explicit executor(unsigned int capacity = 0) : cq_(IOUSBCompletionQueueCreate(capacity)) {}
+
+        executor(const executor &) = delete;
+        executor &operator=(const executor &) = delete;
+
+        ~executor()
+        {
+            // an unfinished flow takes its transfers out of the queue as its frame goes
+            flows_.clear();
+            IOUSBCompletionQueueDestroy(cq_);
+        }
+
+        explicit operator bool() const noexcept
+        {
+            return cq_ != nullptr;
+        }
+
+        iousb_cq_t *queue() const noexcept
+        {
+            return cq_;
+        }
+
+        // starts flow on the next run(); the executor keeps it until it is destroyed
+        void spawn(task<int> flow)
+        {
+            ready_.push_back(flow.handle());
+            flows_.push_back(std::move(flow));
+        }
+
+        // Clients join the queue on their first transfer, up to CQ_MAX_CLIENTS.
+        // Release one before it is closed or goes out of scope.
+        void release(client &dev)
+        {
+            IOUSBCompletionQueueRemove(cq_, dev.get());
+        }
+
+        // Runs until every spawned flow has returned. Returns how many returned
+        // non-zero or could not finish because nothing was left to wake them.
+        int run();
+
+        // --- submits, for callers that keep several transfers going themselves ---
+
+        bool submit_control(in_flight &op, client &dev, const control_request_t &req, unsigned char *data, unsigned int timeout = IOUSB_NO_TIMEOUT)
+        {
+            op.reset(cq_, dev.get());
+            if(!IOUSBCompletionQueueSubmitControl(cq_, dev.get(), &req, data, timeout, &op))
+            {
+                op.fail(kIOReturnError);
+                return false;
+            }
+            return true;
+        }
+
+        bool submit_bulk(in_flight &op, client &dev, const_bytes data)
+        {
+            op.reset(cq_, dev.get());
+            if(data.size() > std::numeric_limits<uint32_t>::max())
+            {
+                op.fail(kIOReturnBadArgument);
+                return false;
+            }
+            if(!IOUSBCompletionQueueSubmitBulk(cq_, dev.get(), const_cast<unsigned char *>(data.data()), (uint32_t)data.size(), &op))
+            {
+                op.fail(kIOReturnError);
+                return false;
+            }
+            return true;
+        }
+
+        // --- awaitables ---
+
+        // a transfer that is submitted when it is awaited
+        class transfer_op : public in_flight
+        {
+        public:
+            // only as a temporary, it is submitted by the co_await
+            auto operator co_await() && noexcept
+            {
+                return awaiter<transfer_op>{ *this };
+            }
+
+        private:
+            friend class executor;
+            template<typename>
+            friend struct in_flight::awaiter;
+
+            transfer_op(executor &ex, client &dev, const control_request_t &req, unsigned char *data, uint32_t len, unsigned int timeout, bool bulk, bool bad) noexcept
+                : ex_(ex), dev_(dev), req_(req), data_(data), len_(len), timeout_(timeout), bulk_(bulk)
+            {
+                if(bad)
+                {
+                    fail(kIOReturnBadArgument);
+                }
+            }
+
+            bool suspend(std::coroutine_handle<> h) noexcept
+            {
+                bool ok = bulk_ ? ex_.submit_bulk(*this, dev_, const_bytes(data_, len_))
+                                : ex_.submit_control(*this, dev_, req_, data_, timeout_);
+                if(!ok)
+                {
+                    return false;
+                }
+                waiter_ = h;
+                return true;
+            }
+
+            executor &ex_;
+            client &dev_;
+            control_request_t req_;
+            unsigned char *data_;
+            uint32_t len_;
+            unsigned int timeout_;
+            bool bulk_;
+        };
+
+        class sleep_op
+        {
+        public:
+            bool await_ready() const noexcept
+            {
+                return detail::now() >= deadline_;
+            }
+
+            void await_suspend(std::coroutine_handle<> h)
+            {
+                ex_.timers_.push(timer{ deadline_, h });
+            }
+
+            void await_resume() const noexcept {}
+
+        private:
+            friend class executor;
+
+            sleep_op(executor &ex, uint64_t deadline) noexcept : ex_(ex), deadline_(deadline) {}
+
+            executor &ex_;
+            uint64_t deadline_;
+        };
+
+        // done by the time it is awaited, the aborted transfers complete on their own
+        struct abort_op
+        {
+            IOReturn ret;
+
+            bool await_ready() const noexcept
+            {
+                return true;
+            }
+
+            void await_suspend(std::coroutine_handle<>) const noexcept {}
+
+            IOReturn await_resume() const noexcept
+            {
+                return ret;
+            }
+        };
+
+        transfer_op control(client &dev, const control_request_t &req, bytes data = {}, unsigned int timeout = IOUSB_NO_TIMEOUT) noexcept
+        {
+            return transfer_op(*this, dev, req, req.w_length ? data.data() : nullptr, req.w_length, timeout, false, data.size() < req.w_length);
+        }
+
+        // Req is resolved at compile time, data has to hold its wLength bytes
+        template<control_request_t Req>
+        transfer_op control(client &dev, bytes data = {}, unsigned int timeout = IOUSB_NO_TIMEOUT) noexcept
+        {
+            return control(dev, Req, data, timeout);
+        }
+
+        template<control_request_t Req>
+            requires (!is_in(Req))
+        transfer_op send(client &dev, const_bytes data = {}, unsigned int timeout = IOUSB_NO_TIMEOUT) noexcept
+        {
+            return control(dev, Req, bytes(const_cast<unsigned char *>(data.data()), data.size()), timeout);
+        }
+
+        template<command Cmd>
+        transfer_op send(client &dev, unsigned int timeout = IOUSB_NO_TIMEOUT) noexcept
+        {
+            static constexpr command text = Cmd;
+            return send<recovery::packet<Cmd>>(dev, const_bytes(reinterpret_cast<const unsigned char *>(text.text), text.size), timeout);
+        }
+
+        transfer_op bulk(client &dev, const_bytes data) noexcept
+        {
+            return transfer_op(*this, dev, control_request_t{}, const_cast<unsigned char *>(data.data()), (uint32_t)data.size(), 0, true,
+                               data.size() > std::numeric_limits<uint32_t>::max());
+        }
+
+        abort_op abort(client &dev) noexcept
+        {
+            return abort_op{ IOUSBAbortPipeZero(dev.get()) };
+        }
+
+        sleep_op sleep_for(uint64_t nsec) noexcept
+        {
+            return sleep_op(*this, detail::now() + nsec);
+        }
+
+        // --- flows ---
+
+        // IOUSBBulkUploadStream as a coroutine: up to opts->depth chunks in flight
+        task<transfer_t> upload(client &dev, const_bytes data, const upload_opts_t *opts = nullptr);
+
+        // DFU_DNLOAD/DFU_GET_STATUS per block, then the manifest requests; the
+        // device is left in dfuMANIFEST-WAIT-RESET like after IOUSBDFUDownload
+        task<IOReturn> dfu_download(client &dev, const_bytes image, unsigned int timeout = IOUSB_NO_TIMEOUT);
+
+        // IOUSBConnectWait without blocking the thread: optionally resets the
+        // device, then polls for a pid device and opens it. A client that had
+        // a device open only takes that one back, matched on location and
+        // ECID; otherwise ecid picks the device (0 = any). 0 once open, -1 on
+        // timeout (msec).
+        task<int> wait_device(client &dev, uint16_t pid, unsigned int timeout, int reset = 0, uint64_t ecid = 0);
+
+        // runs one pongoOS shell command, like IOUSBPongoCommand: 0 when done,
+        // 1 on timeout (msec, 0 = none), -1 on error; output may be NULL
+        task<int> pongo_command(client &dev, std::string_view command, unsigned int timeout = 0, std::string *output = nullptr);
+        // announces the size, then upload()
+        task<transfer_t> pongo_upload(client &dev, const_bytes data, const upload_opts_t *opts = nullptr);
+
+    private:
+        struct timer
+        {
+            uint64_t deadline;
+            std::coroutine_handle<> h;
+
+            bool operator>(const timer &other) const noexcept
+            {
+                return deadline > other.deadline;
+            }
+        };
+
+        void dispatch(const cq_completion_t *completions, int count)
+        {
+            for(int i = 0; i < count; i++)
+            {
+                in_flight *op = static_cast<in_flight *>(completions[i].userdata);
+                op->result_ = completions[i].result;
+                op->done_ = true;
+                if(op->waiter_)
+                {
+                    ready_.push_back(std::exchange(op->waiter_, {}));
+                }
+            }
+        }
+
+        bool fire_timers()
+        {
+            bool fired = false;
+            uint64_t now = detail::now();
+            while(!timers_.empty() && timers_.top().deadline <= now)
+            {
+                ready_.push_back(timers_.top().h);
+                timers_.pop();
+                fired = true;
+            }
+            return fired;
+        }
+
+        iousb_cq_t *cq_;
+        std::vector<task<int>> flows_;
+        std::deque<std::coroutine_handle<>> ready_;
+        std::priority_queue<timer, std::vector<timer>, std::greater<timer>> timers_;
+    };
+
+    inline int executor::run()
+    {
+        cq_completion_t completions[max_completions];
+
+        if(!cq_)
+        {
+            return (int)flows_.size();
+        }
+
+        for(;;)
+        {
+            while(!ready_.empty())
+            {
+                std::coroutine_handle<> h = ready_.front();
+                ready_.pop_front();
+                h.resume();
+            }
+            if(std::all_of(flows_.begin(), flows_.end(), [](const task<int> &flow) { return flow.done(); }))
+            {
+                break;
+            }
+            if(fire_timers())
+            {
+                continue;
+            }
+
+            uint64_t now = detail::now();
+            uint64_t next = timers_.empty() ? 0 : timers_.top().deadline;
+            int count;
+            if(IOUSBCompletionQueueInflight(cq_))
+            {
+                // WaitAny counts in msec, spin on Poll when a timer is closer than that
+                if(next && next - now < 1000000ULL)
+                {
+                    count = IOUSBCompletionQueuePoll(cq_, completions, max_completions);
+                }
+                else
+                {
+                    unsigned int timeout = next ? (unsigned int)((next - now) / 1000000ULL) : 1000;
+                    count = IOUSBCompletionQueueWaitAny(cq_, completions, max_completions, timeout);
+                }
+                if(count < 0)
+                {
+                    ERR("Completion queue failed, %zu transfers lost", IOUSBCompletionQueueInflight(cq_));
+                    break;
+                }
+                dispatch(completions, count);
+            }
+            else if(next)
+            {
+                struct timespec ts;
+                ts.tv_sec = (next - now) / 1000000000ULL;
+                ts.tv_nsec = (next - now) % 1000000000ULL;
+                nanosleep(&ts, NULL);
+            }
+            else
+            {
+                ERR("Flows are suspended with nothing in flight to wake them");
+                break;
+            }
+        }
+
+        int failed = 0;
+        for(const task<int> &flow : flows_)
+        {
+            if(!flow.done() || *flow.handle().promise().value != 0)
+            {
+                failed++;
+            }
+        }
+        return failed;
+    }
+
+    inline task<transfer_t> executor::upload(client &dev, const_bytes data, const upload_opts_t *opts)
+    {
+        std::array<in_flight, BULK_MAX_DEPTH> slots;
+        std::array<uint32_t, BULK_MAX_DEPTH> lens;
+        transfer_t result = detail::failed(kIOReturnSuccess);
+
+        if(data.size() > std::numeric_limits<uint32_t>::max())
+        {
+            co_return detail::failed(kIOReturnBadArgument);
+        }
+        uint32_t len = (uint32_t)data.size();
+        uint32_t chunk = opts && opts->chunk_size ? opts->chunk_size : BULK_DEFAULT_CHUNK_SZ;
+        // keep every chunk but the last free of short packets
+        if(chunk < BULK_MAX_PACKET_SZ)
+        {
+            chunk = BULK_MAX_PACKET_SZ;
+        }
+        chunk -= chunk % BULK_MAX_PACKET_SZ;
+        unsigned int depth = opts && opts->depth ? std::min<unsigned int>(opts->depth, BULK_MAX_DEPTH) : BULK_DEFAULT_DEPTH;
+
+        unsigned int head = 0;
+        unsigned int inflight = 0;
+        uint32_t offset = 0;
+        bool failed = false;
+        for(;;)
+        {
+            while(!failed && offset < len && inflight < depth)
+            {
+                unsigned int idx = (head + inflight) % BULK_MAX_DEPTH;
+                lens[idx] = std::min(len - offset, chunk);
+                if(dev.get()->sched && IOUSBSchedBulkTryAcquire(dev.get(), lens[idx]) != 0)
+                {
+                    // the link is busy, the chunks in flight keep the pipe going meanwhile
+                    if(inflight)
+                    {
+                        break;
+                    }
+                    co_await sleep_for(IOUSBSchedBulkDeadline(dev.get()));
+                    continue;
+                }
+                if(!submit_bulk(slots[idx], dev, data.subspan(offset, lens[idx])))
+                {
+                    IOUSBSchedBulkRelease(dev.get(), lens[idx]);
+                    result.ret = slots[idx].result().ret;
+                    failed = true;
+                    break;
+                }
+                offset += lens[idx];
+                inflight++;
+            }
+            if(!inflight)
+            {
+                co_return result;
+            }
+
+            // bulk transfers on one pipe complete in order, retire from the head
+            transfer_t done = co_await slots[head];
+            IOUSBSchedBulkRelease(dev.get(), lens[head]);
+            if(!failed)
+            {
+                result.wLenDone += done.wLenDone;
+                if(done.ret != kIOReturnSuccess)
+                {
+                    result.ret = done.ret;
+                    failed = true;
+                }
+                else if(done.wLenDone != lens[head])
+                {
+                    result.ret = kIOReturnUnderrun;
+                    failed = true;
+                }
+                else if(opts && opts->progress)
+                {
+                    opts->progress(opts->ctx, result.wLenDone, len);
+                }
+            }
+            head = (head + 1) % BULK_MAX_DEPTH;
+            inflight--;
+        }
+    }
+
+    inline task<IOReturn> executor::dfu_download(client &dev, const_bytes image, unsigned int timeout)
+    {
+        std::array<unsigned char, dfu::status_size> status;
+        transfer_t result;
+        uint16_t block = 0;
+
+        for(size_t offset = 0; offset < image.size(); offset += DFU_MAX_TRANSFER_SZ, block++)
+        {
+            uint16_t len = (uint16_t)std::min<size_t>(image.size() - offset, DFU_MAX_TRANSFER_SZ);
+            const control_request_t dnload = { 0x21, DFU_DNLOAD, block, 0, len };
+            result = co_await control(dev, dnload, bytes(const_cast<unsigned char *>(image.data()) + offset, len), timeout);
+            if(result.ret != kIOReturnSuccess)
+            {
+                co_return result.ret;
+            }
+            result = co_await control<dfu::get_status>(dev, status, timeout);
+            if(result.ret != kIOReturnSuccess)
+            {
+                co_return result.ret;
+            }
+            if(status[0] != DFU_STATUS_OK)
+            {
+                co_return kIOReturnError;
+            }
+        }
+
+        const control_request_t manifest = { 0x21, DFU_DNLOAD, block, 0, 0 };
+        result = co_await control(dev, manifest, {}, timeout);
+        if(result.ret != kIOReturnSuccess)
+        {
+            co_return result.ret;
+        }
+        // walks dfuMANIFEST-SYNC to dfuMANIFEST-WAIT-RESET, the device may leave for the second one
+        result = co_await control<dfu::get_status>(dev, status, timeout);
+        if(result.ret != kIOReturnSuccess)
+        {
+            co_return result.ret;
+        }
+        result = co_await control<dfu::get_status>(dev, status, timeout);
+        if(result.ret == kIOReturnSuccess && status[0] != DFU_STATUS_OK)
+        {
+            co_return kIOReturnError;
+        }
+        co_return kIOReturnSuccess;
+    }
+
+    inline task<int> executor::wait_device(client &dev, uint16_t pid, unsigned int timeout, int reset, uint64_t ecid)
+    {
+        std::array<usb_device_t, HOTPLUG_MAX_DEVICES> devices;
+        client_t *c = dev.get();
+
+        // closing drops the ECID, take the identity first
+        uint32_t location = c->location;
+        uint64_t want = c->ecid ? c->ecid : ecid;
+        // after a re-enumerating reset the old device may linger on the bus for a moment, skip it
+        uint64_t exclude = IOUSBResetExclude(c, reset);
+
+        IOUSBCompletionQueueRemove(cq_, c);
+        if(reset)
+        {
+            IOUSBGetBackend(c)->reset(c, reset);
+        }
+        IOUSBClose(c);
+
+        uint64_t deadline = detail::now() + (uint64_t)timeout * 1000000ULL;
+        for(;;)
+        {
+            int count = IOUSBEnumerate(c, pid, devices.data(), (int)devices.size());
+            for(int i = 0; i < count; i++)
+            {
+                const usb_device_t &d = devices[i];
+                if((exclude && d.id == exclude) ||
+                   (location && d.location != location) ||
+                   (want && d.ecid && d.ecid != want) ||
+                   (want && !d.ecid && !location))
+                {
+                    continue;
+                }
+                if(!IOUSBOpenDevice(c, &d))
+                {
+                    co_return 0;
+                }
+                // udev may not have fixed up the node permissions yet
+                IOUSBClose(c);
+            }
+            if(detail::now() >= deadline)
+            {
+                co_return -1;
+            }
+            co_await sleep_for(HOTPLUG_POLL_INTERVAL * 1000000ULL);
+        }
+    }
+
+    inline task<int> executor::pongo_command(client &dev, std::string_view command, unsigned int timeout, std::string *output)
+    {
+        std::array<unsigned char, PONGO_MAX_COMMAND_SZ> line;
+        std::array<unsigned char, PONGO_STDOUT_CHUNK_SZ> chunk;
+        unsigned char prompt = 0;
+
+        if(command.size() + 1 > line.size())
+        {
+            co_return -1;
+        }
+        memcpy(line.data(), command.data(), command.size());
+        line[command.size()] = '\n';
+
+        const control_request_t send = { 0x21, PONGO_REQ_COMMAND, 0, 0, (uint16_t)(command.size() + 1) };
+        if((co_await control(dev, send, line)).ret != kIOReturnSuccess)
+        {
+            co_return -1;
+        }
+
+        const control_request_t ask = { 0xa1, PONGO_REQ_PROMPT, 0, 0, 1 };
+        const control_request_t drain = { 0xa1, PONGO_REQ_STDOUT, 0, 0, (uint16_t)chunk.size() };
+        uint64_t deadline = timeout ? detail::now() + (uint64_t)timeout * 1000000ULL : 0;
+        uint64_t wait = PONGO_POLL_MIN * 1000ULL;
+        for(;;)
+        {
+            // prompt first, so output written before it showed up is drained below
+            transfer_t result = co_await control(dev, ask, bytes(&prompt, 1));
+            if(result.ret != kIOReturnSuccess)
+            {
+                co_return -1;
+            }
+
+            bool more = false;
+            for(;;)
+            {
+                result = co_await control(dev, drain, chunk);
+                if(result.ret != kIOReturnSuccess)
+                {
+                    co_return -1;
+                }
+                if(!result.wLenDone)
+                {
+                    break;
+                }
+                if(output)
+                {
+                    output->append(reinterpret_cast<const char *>(chunk.data()), result.wLenDone);
+                }
+                more = true;
+            }
+
+            if(prompt)
+            {
+                co_return 0;
+            }
+            if(deadline && detail::now() >= deadline)
+            {
+                co_return 1;
+            }
+            wait = more ? PONGO_POLL_MIN * 1000ULL : std::min<uint64_t>(wait * 2, PONGO_POLL_MAX * 1000ULL);
+            co_await sleep_for(wait);
+        }
+    }
+
+    inline task<transfer_t> executor::pongo_upload(client &dev, const_bytes data, const upload_opts_t *opts)
+    {
+        if(data.size() > std::numeric_limits<uint32_t>::max())
+        {
+            co_return detail::failed(kIOReturnBadArgument);
+        }
+        uint32_t len = (uint32_t)data.size();
+        unsigned char size[4] = { (unsigned char)len, (unsigned char)(len >> 8), (unsigned char)(len >> 16), (unsigned char)(len >> 24) };
+
+        const control_request_t announce = { 0x21, PONGO_REQ_UPLOAD_SIZE, 0, 0, sizeof(size) };
+        transfer_t result = co_await control(dev, announce, size);
+        if(result.ret != kIOReturnSuccess)
+        {
+            co_return result;
+        }
+        co_return co_await upload(dev, data, opts);
+    }
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef IOUSB_CQ_H
+#define IOUSB_CQ_H
+
+#include <io/iousb.h>
+
+#define CQ_DEFAULT_CAPACITY     (256)
+#define CQ_MAX_CLIENTS          (64)
+
+typedef struct iousb_cq_p iousb_cq_t;
+typedef uint64_t cq_handle_t;           // 0 = submit failed
+
+typedef struct
+{
+    cq_handle_t handle;
+    client_t *client;
+    transfer_t result;
+    void *userdata;
+} cq_completion_t;
+
+// A completion queue reaps async transfers of many clients at once: epoll
+// over the usbfs fds plus a timerfd for timeouts and an eventfd for wakeups on
+// Linux, the thread's run loop on Darwin. A queue belongs to the thread that
+// waits on it, and on Darwin its clients must have been opened on that thread.
+// Do not mix it with IOUSBAsyncWait on the same client.
+iousb_cq_t *IOUSBCompletionQueueCreate(unsigned int capacity);
+void IOUSBCompletionQueueDestroy(iousb_cq_t *cq);
+
+// Clients are added on their first submit. Remove one before closing it: EP0
+// is aborted and whatever is still in flight gets up to a second to land.
+// Those completions are dropped, not reported.
+void IOUSBCompletionQueueRemove(iousb_cq_t *cq, client_t *client);
+
+cq_handle_t IOUSBCompletionQueueSubmitControl(iousb_cq_t *cq,
+                                              client_t *client,
+                                              const control_request_t *req,
+                                              unsigned char *data,
+                                              unsigned int timeout,
+                                              void *userdata);
+cq_handle_t IOUSBCompletionQueueSubmitBulk(iousb_cq_t *cq, client_t *client, void *data, uint32_t len, void *userdata);
+size_t IOUSBCompletionQueueInflight(iousb_cq_t *cq);
+
+// Reap up to max completions. Poll never blocks; WaitAny blocks until at
+// least one completion, timeout (msec) or IOUSBCompletionQueueWake.
+// Both return the number of completions or -1.
+int IOUSBCompletionQueuePoll(iousb_cq_t *cq, cq_completion_t *completions, int max);
+int IOUSBCompletionQueueWaitAny(iousb_cq_t *cq, cq_completion_t *completions, int max, unsigned int timeout);
+
+// the only call that is safe from other threads
+void IOUSBCompletionQueueWake(iousb_cq_t *cq);
+// The eventfd behind IOUSBCompletionQueueWake, -1 on Darwin. Writing to it,
+// from any thread or from another process it was passed to, wakes WaitAny the
+// same way.
+int IOUSBCompletionQueueFd(iousb_cq_t *cq);
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef IOUSB_DFU_H
+#define IOUSB_DFU_H
+
+#include <io/iousb.h>
+
+#define DFU_DEFAULT_DEPTH       (4)
+#define DFU_MAX_DEPTH           (CONTROL_BATCH_MAX_DEPTH / 2)
+#define DFU_SUFFIX_SZ           (16)
+
+#define kDFUAppendSuffix        (1 << 0)    // append the Apple DFU suffix and CRC32 to the image
+#define kDFUNoManifest          (1 << 1)    // leave the device in dfuDNLOAD_IDLE after the last block
+
+typedef struct
+{
+    uint64_t sent;                  // bytes acknowledged by the device so far
+    uint64_t total;                 // image size, suffix included
+    uint32_t block;                 // blocks acknowledged so far
+    uint32_t blocks;
+    uint64_t elapsed;               // nsec since the first DFU_DNLOAD went out
+    uint64_t latency;               // nsec from this block's DFU_DNLOAD to its status
+} dfu_progress_t;
+
+typedef void (*dfu_progress_cb_t)(void *ctx, const dfu_progress_t *progress);
+
+typedef struct
+{
+    unsigned int flags;
+    unsigned int depth;             // DNLOAD/GET_STATUS pairs kept in flight, 0 = default
+    unsigned int timeout;           // msec per request, 0 = none
+    dfu_progress_cb_t progress;     // called as blocks complete, may be NULL
+    void *ctx;
+} dfu_opts_t;
+
+typedef struct
+{
+    IOReturn ret;
+    uint8_t state;                  // last bState the device reported
+    uint8_t status;                 // last bStatus the device reported
+    uint64_t bytes;
+    uint32_t blocks;
+    uint64_t elapsed;               // nsec for the whole download, manifest included
+    uint64_t throughput;            // bytes per second over the block stream
+    uint64_t latency_avg;           // nsec per block, DFU_DNLOAD to status
+    uint64_t latency_max;
+} dfu_result_t;
+
+// Sends an image to a device in DFU mode. Blocks of DFU_MAX_TRANSFER_SZ go out
+// as DFU_DNLOAD/DFU_GET_STATUS pairs with opts->depth pairs queued on EP0, and
+// the manifest requests are sent as one batch. A block is sent before the
+// previous one reported dfuDNLOAD-IDLE and bwPollTimeout is never waited out,
+// which holds for iBoot since it reports a poll timeout of 0. On success the device is left
+// in dfuMANIFEST-WAIT-RESET (or dfuDNLOAD-IDLE with kDFUNoManifest); the caller
+// resets it, e.g. with IOUSBConnectWait. A failed download clears the error
+// state before returning. opts and result may be NULL.
+IOReturn IOUSBDFUDownload(client_t *client, const void *data, uint32_t len, const dfu_opts_t *opts, dfu_result_t *result);
+IOReturn IOUSBDFUDownloadFile(client_t *client, const char *path, const dfu_opts_t *opts, dfu_result_t *result);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef IOUSB_HOTPLUG_H
+#define IOUSB_HOTPLUG_H
+
+#include <io/iousb.h>
+
+#define HOTPLUG_MAX_DEVICES     (16)
+#define HOTPLUG_POLL_INTERVAL   (10)    // msec, backends without a monitor
+
+typedef struct hotplug_p hotplug_t;
+
+// Subscribes to device arrival/removal on the template's backend. tmpl may be
+// NULL for the native backend. Devices already on the bus are not reported.
+hotplug_t *IOUSBHotplugOpen(const client_t *tmpl);
+void IOUSBHotplugClose(hotplug_t *hp);
+
+// Returns 0 with an event, 1 on timeout (msec) or -1 on error. Without a
+// backend monitor this sleeps for a poll interval and returns 1, so callers
+// should re-enumerate on every return instead of trusting the events alone.
+int IOUSBHotplugNext(hotplug_t *hp, hotplug_event_t *event, unsigned int timeout);
+
+// Blocks until a pid device shows up that matches ecid (0 = any) and is not
+// exclude (0 = none), or timeout (msec) expires. Devices already on the bus
+// count. Returns 0 with device filled, 1 on timeout or -1 on error.
+int IOUSBHotplugWait(hotplug_t *hp, uint16_t pid, uint64_t ecid, uint64_t exclude, unsigned int timeout, usb_device_t *device);
+// Same, matching match->pid plus match->location and match->ecid when they are
+// non-zero. With a location, a device whose serial has no ECID still matches.
+int IOUSBHotplugWaitMatch(hotplug_t *hp, const usb_device_t *match, uint64_t exclude, unsigned int timeout, usb_device_t *device);
+int IOUSBWaitForDevice(const client_t *tmpl, uint16_t pid, uint64_t ecid, unsigned int timeout, usb_device_t *device);
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef IOUSB_POLICY_H
+#define IOUSB_POLICY_H
+
+#include <io/iousb.h>
+
+#define POLICY_MAX_KEYS             (128)   // devices and chips tracked per policy
+#define POLICY_SAMPLES              (64)    // latest round trips kept per key
+#define POLICY_MAX_DECISIONS        (256)
+
+#define POLICY_DEFAULT_PERCENTILE   (99)
+#define POLICY_DEFAULT_MARGIN       (300)   // percent of the percentile
+#define POLICY_DEFAULT_MIN_SAMPLES  (16)
+#define POLICY_DEFAULT_MIN_TIMEOUT  (5)     // msec
+#define POLICY_DEFAULT_MAX_TIMEOUT  (5000)  // msec
+#define POLICY_DEFAULT_BACKOFF_BASE (10)    // msec
+#define POLICY_DEFAULT_BACKOFF_MAX  (1000)  // msec
+
+// where a decision came from
+#define kPolicyFallback             (0)     // too few samples, the caller's value
+#define kPolicyDevice               (1)     // this device's round trips
+#define kPolicyChip                 (2)     // round trips of every device with its CPID
+#define kPolicyBackoff              (3)     // a reconnect delay
+
+typedef struct iousb_policy_p iousb_policy_t;
+
+typedef struct
+{
+    unsigned int percentile;        // of the round trips a timeout is based on, 0 = default
+    unsigned int margin;            // percent the percentile is scaled by, 0 = default
+    unsigned int min_samples;       // below this the caller's timeout is used, 0 = default
+    unsigned int min_timeout;       // msec, 0 = default
+    unsigned int max_timeout;       // msec, 0 = default
+    unsigned int backoff_base;      // msec before the first retry, 0 = default
+    unsigned int backoff_max;       // msec, 0 = default
+} policy_opts_t;
+
+typedef struct
+{
+    uint64_t time;                  // CLOCK_MONOTONIC nsec
+    uint64_t ecid;
+    unsigned int cpid;
+    int source;                     // kPolicy*
+    unsigned int samples;           // the decision was based on
+    uint64_t percentile;            // nsec, 0 for backoffs
+    unsigned int fallback;          // msec the caller asked for, the attempt for backoffs
+    unsigned int chosen;            // msec
+} policy_decision_t;
+
+typedef struct
+{
+    unsigned int samples;
+    uint64_t percentile;            // nsec
+    uint64_t timeouts;              // transfers that ran into a timeout the policy chose
+    unsigned int streak;            // of those in a row, each one doubles the next timeout
+} policy_stats_t;
+
+// A policy is shared by every client it is attached to, from any thread, so
+// one device's round trips inform the timeouts of others with its CPID.
+iousb_policy_t *IOUSBPolicyCreate(const policy_opts_t *opts);
+// detach it from every client first
+void IOUSBPolicyDestroy(iousb_policy_t *policy);
+
+// With a policy attached, IOUSBControlTransferTO and IOUSBControlTransferRequest
+// called with IOUSB_POLICY_TIMEOUT take their timeout from it once enough
+// round trips were seen; any other timeout is the caller's and kept as is.
+// IOUSBConnect retries after a jittered exponential backoff instead of a
+// second. NULL detaches.
+void IOUSBPolicyAttach(client_t *client, iousb_policy_t *policy);
+
+// called from IOUSBTelemetryRecord for every control round trip
+void IOUSBPolicyRecord(client_t *client, int op, uint64_t nsec, IOReturn ret);
+
+// msec to wait for a control transfer of client, fallback until the policy
+// knows better; notes on client whether it chose, only those timeouts count
+unsigned int IOUSBPolicyTimeout(client_t *client, unsigned int fallback);
+// msec to wait before reconnect attempt (counted from 0) of a device with cpid
+unsigned int IOUSBPolicyBackoff(iousb_policy_t *policy, unsigned int cpid, uint64_t ecid, unsigned int attempt);
+
+// by ECID, or by CPID with ecid 0
+int IOUSBPolicyGetStats(iousb_policy_t *policy, unsigned int cpid, uint64_t ecid, policy_stats_t *stats);
+// copies up to max of the latest decisions, oldest first, and returns how many
+size_t IOUSBPolicyDecisions(iousb_policy_t *policy, policy_decision_t *decisions, size_t max);
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef IOUSB_PONGO_H
+#define IOUSB_PONGO_H
+
+#include <io/iousb.h>
+#include <io/iousb_upload.h>
+
+// pongoOS shell requests, all addressed to the interface
+#define PONGO_REQ_UPLOAD_SIZE   (1)     // 0x21: 4-byte size of the next bulk upload
+#define PONGO_REQ_COMMAND       (3)     // 0x21: one command line
+#define PONGO_REQ_STDOUT        (1)     // 0xa1: drain up to wLength bytes of console output
+#define PONGO_REQ_PROMPT        (2)     // 0xa1: 1 byte, non-zero while the shell waits for input
+
+#define PONGO_STDOUT_CHUNK_SZ   (0x1000)
+#define PONGO_DEFAULT_RING_SZ   (0x10000)
+#define PONGO_MAX_COMMAND_SZ    (0x200)
+#define PONGO_POLL_MIN          (100)   // usec between polls while output keeps coming
+#define PONGO_POLL_MAX          (2000)  // usec between polls of a quiet command
+
+typedef struct pongo_shell_p pongo_shell_t;
+
+// called with console output as it is drained, before it lands in the ring
+typedef void (*pongo_output_t)(void *ctx, const char *data, size_t len);
+
+// A shell session on an open pongoOS client. Output is kept in a ring of
+// ring_size bytes (rounded up to a power of two, 0 = default); when nobody
+// reads it the oldest bytes are dropped. Not thread safe.
+pongo_shell_t *IOUSBPongoShellCreate(client_t *client, size_t ring_size, pongo_output_t output, void *ctx);
+void IOUSBPongoShellDestroy(pongo_shell_t *shell);
+
+// Sends one command line, the newline is added here.
+int IOUSBPongoSend(pongo_shell_t *shell, const char *command);
+// One poll: drains pending output and checks the prompt. Returns 1 once the
+// last command finished and all of its output is in the ring, 0 while it is
+// still running, -1 on a transfer error (the device may have left the bus).
+int IOUSBPongoPoll(pongo_shell_t *shell);
+// Polls until the last command finished: 0 when done, 1 on timeout (msec,
+// 0 = none), -1 on error.
+int IOUSBPongoWait(pongo_shell_t *shell, unsigned int timeout);
+// IOUSBPongoSend + IOUSBPongoWait
+int IOUSBPongoCommand(pongo_shell_t *shell, const char *command, unsigned int timeout);
+
+// Copies out and consumes up to len bytes of captured output.
+size_t IOUSBPongoRead(pongo_shell_t *shell, char *buf, size_t len);
+size_t IOUSBPongoPending(pongo_shell_t *shell);
+// output bytes lost to a full ring since the shell was created
+uint64_t IOUSBPongoDropped(pongo_shell_t *shell);
+
+// Announces len bytes and streams them over the bulk pipe, ready for a
+// loading command such as "modload" or "ramdisk". opts may be NULL.
+transfer_t IOUSBPongoUpload(pongo_shell_t *shell, const void *data, uint32_t len, const upload_opts_t *opts);
+// The same, but only announces the upload and starts stream, which the caller
+// then drives with IOUSBBulkUploadPump. Returns the announce result.
+IOReturn IOUSBPongoUploadBegin(pongo_shell_t *shell, upload_stream_t *stream, const void *data, uint32_t len, const upload_opts_t *opts);
+
+#endif
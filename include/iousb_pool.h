@@ -0,0 +1,48 @@
+#ifndef IOUSB_POOL_H
+#define IOUSB_POOL_H
+
+#include <io/iousb.h>
+
+#define IOUSB_POOL_DEFAULT_BUFFERS  (16)
+#define IOUSB_POOL_MAX_BUFFERS      (64)
+#define IOUSB_POOL_DEFAULT_BUFFER_SZ (0x2000)   // a DFU block plus backend headers
+#define IOUSB_POOL_DEFAULT_ARENA_SZ (0x100000)
+
+typedef struct
+{
+    unsigned int buffers;
+    size_t buffer_size;
+    size_t arena_size;
+    uint64_t hits;                  // borrows served from the pool
+    uint64_t misses;                // borrows that went to the allocator
+    unsigned int in_use;
+    size_t arena_used;
+} iousb_pool_stats_t;
+
+// Gives client its own set of page-aligned transfer buffers, an arena for
+// staging payload chunks and a blank buffer, all allocated and faulted in
+// here. Sizes are rounded up to whole pages, 0 selects the default. The pool
+// outlives IOUSBClose so reconnects keep it; create it before the client is
+// shared between threads.
+int IOUSBPoolCreate(client_t *client, unsigned int buffers, size_t buffer_size, size_t arena_size);
+// not safe against transfers still running on the client
+void IOUSBPoolDestroy(client_t *client);
+
+// Borrows a page-aligned buffer of at least size bytes. Lock-free when it
+// comes from the pool; without a free buffer of that size it falls back to
+// the allocator. Either way it goes back through IOUSBBufferPut.
+void *IOUSBBufferGet(client_t *client, size_t size);
+void IOUSBBufferPut(client_t *client, void *buf);
+
+// Page-aligned staging memory that lives until the next IOUSBArenaReset.
+// Returns NULL once the arena is used up.
+void *IOUSBArenaAlloc(client_t *client, size_t size);
+void IOUSBArenaReset(client_t *client);
+
+// DFU_MAX_TRANSFER_SZ bytes of scratch private to client, zeroed when the
+// pool was created. Creates a default pool if the client has none.
+unsigned char *IOUSBBlank(client_t *client);
+
+int IOUSBPoolGetStats(const client_t *client, iousb_pool_stats_t *stats);
+
+#endif
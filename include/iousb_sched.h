@@ -0,0 +1,74 @@
+#ifndef IOUSB_SCHED_H
+#define IOUSB_SCHED_H
+
+#include <io/iousb.h>
+
+#define SCHED_MAX_LINKS             (64)
+#define SCHED_MAX_DEPTH             (6)         // hub tiers a locationID can describe
+#define SCHED_DEFAULT_BUDGET        (40000000)  // bytes/sec per link, what high-speed sustains
+#define SCHED_DEFAULT_BURST         (20)        // msec of budget a quiet link may spend at once
+#define SCHED_DEFAULT_DRAIN         (50)        // msec a critical transfer waits for bulk to drain
+
+typedef struct iousb_sched_p iousb_sched_t;
+
+typedef struct
+{
+    uint64_t budget;                // bytes/sec per link, 0 = default
+    unsigned int burst;             // msec, 0 = default
+    unsigned int drain;             // msec, 0 = default
+} sched_opts_t;
+
+typedef struct
+{
+    uint32_t link;                  // locationID prefix, the bus alone for the root port
+    uint64_t budget;
+    uint64_t bytes;                 // admitted so far
+    uint32_t inflight;              // bytes admitted and not released yet
+    unsigned int critical;          // critical control transfers running below it
+    uint64_t waits;                 // bulk admissions that had to wait
+} sched_link_stats_t;
+
+// A scheduler is shared by every client it is attached to. Each client's
+// locationID names the links it sits behind: its bus and every hub on the
+// way to it. Bulk uploads spend a per-link byte budget, and a critical
+// control transfer holds back new bulk on every link it shares and waits
+// briefly for what is in flight to drain. Clients without a location, e.g.
+// simulated ones without one configured, are never held back.
+iousb_sched_t *IOUSBSchedCreate(const sched_opts_t *opts);
+// detach it from every client first
+void IOUSBSchedDestroy(iousb_sched_t *sched);
+
+// With a scheduler attached, IOUSBBulkUpload and the bulk stream admit every
+// chunk through it and IOUSBAsyncControlTransferTimedAbort runs as critical.
+// NULL detaches.
+void IOUSBSchedAttach(client_t *client, iousb_sched_t *sched);
+// overrides the budget of one link, e.g. a hub known to be full speed
+int IOUSBSchedSetBudget(iousb_sched_t *sched, uint32_t link, uint64_t budget);
+
+// the links above a device at location, root port first; returns how many
+int IOUSBSchedLinks(uint32_t location, uint32_t *links, int max);
+
+// TryAcquire returns 0 when len bytes were admitted, -1 when the links are
+// busy; Acquire blocks until they are. Admitted bytes go back through Release
+// once the transfer has completed. Event loops use TryAcquire and retry after
+// Deadline, the nsec until the links might admit again (0 = now); Wait blocks
+// for that without admitting anything.
+int IOUSBSchedBulkTryAcquire(client_t *client, uint32_t len);
+void IOUSBSchedBulkAcquire(client_t *client, uint32_t len);
+void IOUSBSchedBulkRelease(client_t *client, uint32_t len);
+uint64_t IOUSBSchedBulkDeadline(client_t *client);
+void IOUSBSchedBulkWait(client_t *client);
+
+// Critical holds back new bulk on every link the client sits behind, its bus
+// included, so bulk to every other device on that bus pauses until End. Keep
+// it to the few requests that need the quiet bus. Begin also waits up to the
+// drain time for bulk already in flight; TryBegin does not wait and returns 1
+// while some is, for the caller to poll Drained. Both pair with End.
+void IOUSBSchedCriticalBegin(client_t *client);
+int IOUSBSchedCriticalTryBegin(client_t *client);
+bool IOUSBSchedDrained(client_t *client);
+void IOUSBSchedCriticalEnd(client_t *client);
+
+size_t IOUSBSchedGetStats(iousb_sched_t *sched, sched_link_stats_t *stats, size_t max);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef IOUSB_SESSION_H
+#define IOUSB_SESSION_H
+
+#include <io/iousb.h>
+
+#define SESSION_MAX_DEVICES     (64)
+
+typedef struct session_p session_t;
+typedef struct session_manager_p session_manager_t;
+
+// one device and everything that belongs to it, never shared between sessions
+struct session_p
+{
+    client_t client;
+    usb_device_t device;
+    bool opened;
+    int result;
+    void *userdata;
+};
+
+typedef int (*session_job_t)(session_t *session, void *ctx);
+
+session_manager_t *IOUSBSessionManagerCreate(unsigned int workers);
+void IOUSBSessionManagerDestroy(session_manager_t *mgr);
+
+// Adds a session for every pid device the template's backend can see that is
+// not tracked yet (matched on ECID, then location). tmpl may be NULL for the
+// native backend. Returns the number of new sessions or -1.
+int IOUSBSessionManagerScan(session_manager_t *mgr, const client_t *tmpl, uint16_t pid);
+
+// Safe to call while a scan or a run is going on. Sessions are never removed:
+// the pointers stay valid until the manager is destroyed, and a session whose
+// device left the bus keeps its slot, its jobs find the device gone.
+size_t IOUSBSessionManagerCount(session_manager_t *mgr);
+session_t *IOUSBSessionManagerGet(session_manager_t *mgr, size_t index);
+session_t *IOUSBSessionManagerFind(session_manager_t *mgr, uint64_t ecid, uint32_t location);
+
+// Runs job once per session on the worker pool and waits for all of them.
+// A session always runs on the same worker, which also opens its client, so
+// per-thread event sources stay with the thread that uses them.
+// Returns the number of sessions whose job failed.
+int IOUSBSessionManagerRun(session_manager_t *mgr, session_job_t job, void *ctx);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef IOUSB_SIM_H
+#define IOUSB_SIM_H
+
+#include <io/iousb.h>
+
+typedef struct iousb_sim_p iousb_sim_t;
+
+typedef struct
+{
+    uint16_t pid;                   // mode the device enumerates in
+    uint16_t manifest_pid;          // mode after DFU manifest + reset, 0 = detach
+    unsigned int cpid;
+    unsigned int cprv;
+    uint64_t ecid;
+    uint32_t location;              // locationID reported by enumeration
+    bool pwned;                     // adds PWND:[checkm8] to the DFU serial
+    unsigned int control_latency;   // usec per control request
+    unsigned int bulk_latency;      // usec per bulk transfer
+    unsigned int bulk_bandwidth;    // bytes per second, 0 = unlimited
+    unsigned int stall_rate;        // per mille of control requests stalled
+    unsigned int seed;              // stall_rate is drawn from this, so runs repeat
+    bool async_hang;                // async control requests only finish when aborted
+    unsigned int replug_delay;      // usec off the bus after a reset or reboot
+    unsigned int discovery_latency; // usec an open without a cached layout spends on descriptors
+    unsigned int pongo_latency;     // usec a pongoOS shell command runs
+} iousb_sim_config_t;
+
+typedef struct
+{
+    uint64_t control;
+    uint64_t async;
+    uint64_t aborted;
+    uint64_t stalled;
+    uint64_t bulk;
+    uint64_t bulk_bytes;
+    uint64_t dfu_bytes;             // DFU_DNLOAD payload since the last manifest
+    uint64_t dfu_image_size;        // size of the last manifested image
+    uint64_t opens;
+    uint64_t discoveries;           // opens that had no cached layout to go on
+    uint64_t pongo_commands;
+    uint64_t pongo_upload;          // size announced for the last pongoOS bulk upload
+    uint8_t  dfu_state;
+    uint16_t pid;
+} iousb_sim_stats_t;
+
+extern const iousb_backend_t iousb_sim_backend;
+
+iousb_sim_t *IOUSBSimCreate(const iousb_sim_config_t *config);
+void IOUSBSimDestroy(iousb_sim_t *sim);
+void IOUSBSimAttach(client_t *client, iousb_sim_t *sim);
+
+void IOUSBSimSetPid(iousb_sim_t *sim, uint16_t pid);
+void IOUSBSimInjectFault(iousb_sim_t *sim, uint8_t b_request, IOReturn ret, unsigned int count);
+void IOUSBSimGetStats(iousb_sim_t *sim, iousb_sim_stats_t *stats);
+
+#endif
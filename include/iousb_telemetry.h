@@ -0,0 +1,79 @@
+#ifndef IOUSB_TELEMETRY_H
+#define IOUSB_TELEMETRY_H
+
+#include <io/iousb.h>
+
+// what a sample was recorded for
+#define kTelemetryControl           (0)
+#define kTelemetryControlTO         (1)
+#define kTelemetryAsyncControl      (2)     // submit only, completion lands in IOUSBAsyncWait
+#define kTelemetryInterfaceControl  (3)
+#define kTelemetryBatch             (4)     // per request, from batch start to retire
+#define kTelemetryBulk              (5)
+#define kTelemetryBulkAsync         (6)     // submit only
+#define TELEMETRY_MAX_OPS           (7)
+
+// buckets into which IOReturn codes are folded
+#define kTelemetryOK                (0)
+#define kTelemetryStalled           (1)
+#define kTelemetryTimeout           (2)
+#define kTelemetryAborted           (3)
+#define kTelemetryNoDevice          (4)
+#define kTelemetryNotResponding     (5)
+#define kTelemetryShort             (6)     // under/overrun
+#define kTelemetryOther             (7)
+#define TELEMETRY_MAX_ERRORS        (8)
+
+// bucket i counts samples below 2^(i + 10) nsec, the last one everything else
+#define TELEMETRY_BUCKETS           (24)
+#define TELEMETRY_MAX_STAGES        (USB_TRANSFER_ERROR + 1)
+
+typedef struct
+{
+    uint64_t count;
+    uint64_t bytes;
+    uint64_t sum;                   // nsec
+    uint64_t buckets[TELEMETRY_BUCKETS];
+    uint64_t errors[TELEMETRY_MAX_ERRORS];
+} telemetry_op_t;
+
+typedef struct
+{
+    uint64_t entries;
+    uint64_t time;                  // nsec spent in the stage, the current one up to the snapshot
+} telemetry_stage_t;
+
+typedef struct
+{
+    uint64_t ecid;
+    uint32_t location;
+    unsigned int cpid;
+    int stage;                      // current AUTOBOOT_STAGE
+    telemetry_op_t ops[TELEMETRY_MAX_OPS];
+    telemetry_stage_t stages[TELEMETRY_MAX_STAGES];
+} telemetry_snapshot_t;
+
+// Turns instrumentation on for client. Recording is lock-free, so a snapshot
+// can be taken from any thread while the client is busy. Clients without
+// telemetry pay one NULL check per transfer.
+int IOUSBTelemetryEnable(client_t *client);
+// not safe against transfers still running on the client
+void IOUSBTelemetryDisable(client_t *client);
+void IOUSBTelemetryReset(client_t *client);
+
+uint64_t IOUSBTelemetryStart(const client_t *client);
+void IOUSBTelemetryRecord(client_t *client, int op, uint64_t start, IOReturn ret, uint64_t bytes);
+
+// marks the client entering an AUTOBOOT_STAGE, time is charged to the previous one;
+// the stage is kept on the client and traced even without telemetry
+void IOUSBTelemetryStage(client_t *client, int stage);
+
+int IOUSBTelemetrySnapshot(const client_t *client, telemetry_snapshot_t *snapshot);
+
+// Both export count snapshots as one document, so several devices can be
+// scraped together. They behave like snprintf: the full length is returned
+// even when len is too small, and buf is always terminated if len > 0.
+size_t IOUSBTelemetryExportJSON(const telemetry_snapshot_t *snapshots, size_t count, char *buf, size_t len);
+size_t IOUSBTelemetryExportPrometheus(const telemetry_snapshot_t *snapshots, size_t count, char *buf, size_t len);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef IOUSB_TIMER_H
+#define IOUSB_TIMER_H
+
+#include <io/iousb.h>
+
+#define kAbortTimerSleep            (0) // relative nanosleep, the old WithCancel timing
+#define kAbortTimerNative           (1) // timerfd / mach_wait_until, spinning the last slack nsec
+#define kAbortTimerSpin             (2) // busy-wait on the clock for the whole delay
+
+#define ABORT_TIMER_DEFAULT_SLACK   (50000)
+#define ABORT_TIMER_CALIBRATE_ROUNDS (64)
+
+typedef struct
+{
+    int mode;
+    int cpu;                        // pin the submitting thread here, -1 = leave it
+    int priority;                   // SCHED_FIFO priority while timing, 0 = leave it
+    uint64_t slack;                 // nsec the native timer wakes early and spins
+    uint64_t clock_cost;            // nsec per clock read, spin targets are pulled in by it
+    int fd;                         // timerfd, Linux only
+} abort_timer_t;
+
+typedef struct
+{
+    IOReturn ret;                   // how the aborted transfer finished
+    UInt32 wLenDone;
+    bool submitted;
+    bool pinned;                    // cpu/priority were requested and actually applied
+    bool realtime;
+    uint64_t target;                // requested submit-to-abort delay, nsec
+    uint64_t delta;                 // measured from the submit returning to the abort being issued
+    uint64_t submit;                // nsec spent inside the submit call
+} timed_abort_t;
+
+uint64_t IOUSBTimerNow(void);
+
+int IOUSBTimerInit(abort_timer_t *timer, int mode);
+void IOUSBTimerDestroy(abort_timer_t *timer);
+
+// Measures the clock read cost and how late the native timer wakes up on this
+// host, and sets clock_cost and slack from them. Takes a few milliseconds.
+int IOUSBTimerCalibrate(abort_timer_t *timer);
+void IOUSBTimerWaitUntil(const abort_timer_t *timer, uint64_t deadline);
+
+// Submits an async control request, aborts EP0 ns_time after the submit
+// returned and waits for the abort to land. The submit, wait and abort run
+// pinned / SCHED_FIFO when the timer asks for it. Returns the submit or abort
+// error, or kIOReturnSuccess with the outcome in result.
+IOReturn IOUSBAsyncControlTransferTimedAbort(client_t *client,
+                                             uint8_t bm_request_type,
+                                             uint8_t b_request,
+                                             uint16_t w_value,
+                                             uint16_t w_index,
+                                             unsigned char *data,
+                                             uint16_t w_length,
+                                             unsigned int timeout,
+                                             unsigned int ns_time,
+                                             const abort_timer_t *timer,
+                                             timed_abort_t *result);
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef IOUSB_TRACE_H
+#define IOUSB_TRACE_H
+
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include <io/iousb.h>
+
+#define TRACE_DEFAULT_RING_SZ   (0x10000)   // events per thread
+
+// what an event is
+#define kTraceSpan              (0)         // begin and end of a call
+#define kTraceCounter           (1)
+#define kTraceInstant           (2)
+
+// what the value of a span is
+#define kTraceReturn            (0)         // the call's IOReturn or status
+#define kTraceBytes             (1)
+#define kTraceNsec              (2)
+#define kTraceCount             (3)
+#define kTraceNone              (4)         // nothing worth showing
+
+extern atomic_bool iousb_trace_enabled;
+
+// Tracing is process wide: every thread records into a ring of its own, so
+// recording takes no locks. With tracing off the hooks below cost one
+// predictable branch. Start and stop it while no transfers are running;
+// starting again drops what was recorded before.
+int IOUSBTraceStart(size_t ring_events);
+void IOUSBTraceStop(void);
+
+uint64_t IOUSBTraceClock(void);
+void IOUSBTraceEvent(client_t *client, int type, const char *name, uint64_t start, int64_t value);
+// a span that already ended, for code that cannot afford the hooks while it
+// runs, with a value of unit (kTrace*)
+void IOUSBTraceSpan(client_t *client, const char *name, uint64_t start, uint64_t end, int64_t value, int unit);
+
+// Hooks for the public entry points. name has to be a string literal or
+// otherwise outlive the trace. For spans, value is the call's result unless
+// IOUSBTraceEndUnit says otherwise.
+static inline uint64_t IOUSBTraceBegin(void)
+{
+    if(__builtin_expect(atomic_load_explicit(&iousb_trace_enabled, memory_order_relaxed), 0))
+    {
+        return IOUSBTraceClock();
+    }
+    return 0;
+}
+
+static inline void IOUSBTraceEnd(client_t *client, const char *name, uint64_t start, int64_t value)
+{
+    if(__builtin_expect(start != 0, 0))
+    {
+        IOUSBTraceEvent(client, kTraceSpan, name, start, value);
+    }
+}
+
+static inline void IOUSBTraceEndUnit(client_t *client, const char *name, uint64_t start, int64_t value, int unit)
+{
+    if(__builtin_expect(start != 0, 0))
+    {
+        IOUSBTraceSpan(client, name, start, IOUSBTraceClock(), value, unit);
+    }
+}
+
+static inline void IOUSBTraceCounter(client_t *client, const char *name, int64_t value)
+{
+    if(__builtin_expect(atomic_load_explicit(&iousb_trace_enabled, memory_order_relaxed), 0))
+    {
+        IOUSBTraceEvent(client, kTraceCounter, name, 0, value);
+    }
+}
+
+// events lost to full rings since the trace started
+uint64_t IOUSBTraceDropped(void);
+
+// Writes everything recorded as Chrome trace JSON, which chrome://tracing
+// and ui.perfetto.dev load. Every device (ECID and location) gets a process
+// of its own so several sessions line up on one timeline; calls made without
+// a device land in "host". Call it after IOUSBTraceStop, or while the traced
+// threads are idle. The ring of a thread that exited is freed once its
+// events were written here, or right away if it held none.
+int IOUSBTraceWriteJSON(FILE *fp);
+
+#endif
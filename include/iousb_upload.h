@@ -0,0 +1,79 @@
+#ifndef IOUSB_UPLOAD_H
+#define IOUSB_UPLOAD_H
+
+#include <io/iousb.h>
+
+#define BULK_DEFAULT_CHUNK_SZ   (0x40000)
+#define BULK_DEFAULT_DEPTH      (4)
+#define BULK_MAX_DEPTH          (32)
+#define BULK_MAX_PACKET_SZ      (0x200)
+
+typedef void (*upload_progress_t)(void *ctx, uint64_t done, uint64_t total);
+// Queues one chunk in place of IOUSBBulkUploadAsync, for streams whose
+// completions someone else reaps, e.g. a completion queue. That owner stores
+// each result in transfer and pumps the stream again.
+typedef transfer_t (*upload_submit_t)(void *ctx, client_t *client, void *data, uint32_t len, async_transfer_t *transfer);
+
+// read-only view of a payload file, shared with every other mapping of it
+typedef struct
+{
+    void *data;
+    size_t len;
+} payload_map_t;
+
+typedef struct
+{
+    uint32_t chunk_size;            // rounded down to a BULK_MAX_PACKET_SZ multiple, at least one, 0 = default
+    unsigned int depth;             // bulk transfers kept in flight, 0 = default
+    upload_progress_t progress;     // called as chunks complete, may be NULL
+    upload_submit_t submit;         // Begin/Pump only, NULL = IOUSBBulkUploadAsync
+    void *ctx;                      // passed to progress and submit
+} upload_opts_t;
+
+typedef struct
+{
+    async_transfer_t transfer;
+    uint32_t offset;
+    uint32_t len;
+} upload_slot_t;
+
+// an upload in progress, for callers that reap completions themselves
+typedef struct
+{
+    client_t *client;
+    const unsigned char *data;
+    uint32_t len;
+    uint32_t chunk;
+    unsigned int depth;
+    unsigned int head;
+    unsigned int inflight;
+    uint32_t offset;
+    bool failed;
+    upload_opts_t opts;
+    transfer_t result;
+    upload_slot_t slots[BULK_MAX_DEPTH];
+} upload_stream_t;
+
+// Streams data over the bulk pipe with up to opts->depth chunks in flight.
+// wLenDone is the number of bytes the device acknowledged in order; a short
+// chunk stops the upload and is reported as kIOReturnUnderrun.
+transfer_t IOUSBBulkUploadStream(client_t *client, const void *data, uint32_t len, const upload_opts_t *opts);
+
+// IOUSBBulkUploadStream in steps: Pump queues chunks up to the depth and
+// retires the ones that completed without blocking. It returns 1 once
+// stream->result is final, 0 while chunks are in flight; completions come in
+// through IOUSBAsyncWait or IOUSBAsyncPoll on the client. It returns 0 with
+// nothing in flight when the scheduler held the next chunk back; pump again
+// after IOUSBSchedBulkDeadline.
+void IOUSBBulkUploadBegin(upload_stream_t *stream, client_t *client, const void *data, uint32_t len, const upload_opts_t *opts);
+int IOUSBBulkUploadPump(upload_stream_t *stream);
+
+int IOUSBMapPayload(const char *path, payload_map_t *map);
+int IOUSBMapPayloadFd(int fd, payload_map_t *map);
+void IOUSBUnmapPayload(payload_map_t *map);
+
+// IOUSBBulkUploadStream straight out of the page cache
+transfer_t IOUSBBulkUploadFile(client_t *client, const char *path, const upload_opts_t *opts);
+transfer_t IOUSBBulkUploadFd(client_t *client, int fd, const upload_opts_t *opts);
+
+#endif
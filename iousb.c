@@ -1,96 +1,233 @@
+#include <pthread.h>
 
-#include <mach/mach.h>
 #include <io/iousb.h>
+#include <io/iousb_hotplug.h>
+#include <io/iousb_timer.h>
+#include <io/iousb_telemetry.h>
+#include <io/iousb_trace.h>
+#include <io/iousb_policy.h>
+#include <io/iousb_sched.h>
 #include <common/log.h>
 #include <common/common.h>
 
 unsigned char blank[DFU_MAX_TRANSFER_SZ];
 
-static const char *deviceClass = kIOUSBDeviceClassName;
-static char serialstr[256];
+#if defined(__APPLE__)
+#define IOUSB_NATIVE_BACKEND (&iousb_darwin_backend)
+#elif defined(__linux__)
+#define IOUSB_NATIVE_BACKEND (&iousb_linux_backend)
+#else
+#error "iousb: no native backend for this platform"
+#endif
 
-#if defined(RA1NPOC_MODE)
-RA1NPOC_STATIC_API static int nSleep(long nanoseconds)
+RA1NPOC_API const iousb_backend_t *IOUSBGetBackend(client_t *client)
 {
-    struct timespec req, rem;
-    req.tv_sec = 0;
-    req.tv_nsec = nanoseconds;
-    return nanosleep(&req, &rem);
+    if(!client->backend)
+    {
+        client->backend = IOUSB_NATIVE_BACKEND;
+    }
+    return client->backend;
 }
 
-RA1NPOC_STATIC_API static void IOUSBAsyncCallBack(void *refcon, IOReturn ret, void *arg0)
+RA1NPOC_STATIC_API static control_request_t IOUSBRequest(uint8_t bm_request_type,
+                                                         uint8_t b_request,
+                                                         uint16_t w_value,
+                                                         uint16_t w_index,
+                                                         uint16_t w_length)
 {
-    async_transfer_t* transfer = refcon;
-    
-    if(transfer != NULL)
+    control_request_t req =
+    {
+        .bm_request_type = bm_request_type,
+        .b_request       = b_request,
+        .w_value         = w_value,
+        .w_index         = w_index,
+        .w_length        = w_length,
+    };
+    return req;
+}
+
+#define IDENTITY_KEY(a, b, c, d) (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+// leading hex digits of a value, the rest is ignored like sscanf("%x") would
+RA1NPOC_STATIC_API static uint64_t IOUSBParseHex(const char *str, size_t len)
+{
+    uint64_t value = 0;
+    for(size_t i = 0; i < len; i++)
     {
-        transfer->ret = ret;
-        memcpy(&transfer->wLenDone, &arg0, sizeof(transfer->wLenDone));
-        CFRunLoopStop(CFRunLoopGetCurrent());
+        unsigned int c = (unsigned char)str[i];
+        unsigned int lower = c | 0x20;
+        if(c >= '0' && c <= '9')
+        {
+            value = (value << 4) | (c - '0');
+        }
+        else if(lower >= 'a' && lower <= 'f')
+        {
+            value = (value << 4) | (lower - 'a' + 10);
+        }
+        else
+        {
+            break;
+        }
     }
+    return value;
 }
-#endif
 
-RA1NPOC_STATIC_API static void CFDictionarySet16(CFMutableDictionaryRef dict, const void *key, SInt16 value)
+RA1NPOC_STATIC_API static void IOUSBCopyValue(char *dst, size_t size, const char *str, size_t len)
 {
-    CFNumberRef numberRef;
-    numberRef = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt16Type, &value);
-    if(numberRef)
+    if(len >= size)
     {
-        CFDictionarySetValue(dict, key, numberRef);
-        CFRelease(numberRef);
+        len = size - 1;
     }
+    memcpy(dst, str, len);
+    dst[len] = '\0';
 }
 
-RA1NPOC_STATIC_API static io_iterator_t IOUSBGetIteratorForPid(uint16_t pid)
+RA1NPOC_API void IOUSBParseIdentity(const char *str, device_identity_t *identity)
 {
-    IOReturn result;
-    io_iterator_t iterator;
-    CFMutableDictionaryRef dict;
-    
-#ifdef IPHONEOS_ARM
-    // Allows iOS to connect to iOS devices. // iOS 9.0 or high
-    deviceClass = "IOUSBHostDevice";
-#endif
+    const char *p = str;
     
-    dict = IOServiceMatching(deviceClass);
-    CFDictionarySet16(dict, CFSTR(kUSBVendorID),  kAppleVendorID);
-    CFDictionarySet16(dict, CFSTR(kUSBProductID), pid);
+    memset(identity, '\0', sizeof(device_identity_t));
     
-    result = IOServiceGetMatchingServices(kIOMasterPortDefault, dict, &iterator);
-    if(result != kIOReturnSuccess)
+    // "KEY:value KEY:[value, may hold blanks] ..."
+    while(*p)
     {
-        return IO_OBJECT_NULL;
+        const char *key = p;
+        while(*p && *p != ':' && *p != ' ')
+        {
+            p++;
+        }
+        if(*p != ':')
+        {
+            while(*p == ' ')
+            {
+                p++;
+            }
+            continue;
+        }
+        size_t keylen = p++ - key;
+        
+        const char *value = p;
+        size_t len;
+        if(*p == '[')
+        {
+            value = ++p;
+            while(*p && *p != ']')
+            {
+                p++;
+            }
+            len = p - value;
+            if(*p)
+            {
+                p++;
+            }
+        }
+        else
+        {
+            while(*p && *p != ' ')
+            {
+                p++;
+            }
+            len = p - value;
+        }
+        while(*p == ' ')
+        {
+            p++;
+        }
+        
+        if(keylen != 4)
+        {
+            continue;
+        }
+        switch(IDENTITY_KEY(key[0], key[1], key[2], key[3]))
+        {
+            case IDENTITY_KEY('C', 'P', 'I', 'D'):
+                identity->keys |= kIdentityCPID;
+                identity->cpid = (uint32_t)IOUSBParseHex(value, len);
+                break;
+            case IDENTITY_KEY('C', 'P', 'R', 'V'):
+                identity->keys |= kIdentityCPRV;
+                identity->cprv = (uint32_t)IOUSBParseHex(value, len);
+                break;
+            case IDENTITY_KEY('C', 'P', 'F', 'M'):
+                identity->keys |= kIdentityCPFM;
+                identity->cpfm = (uint32_t)IOUSBParseHex(value, len);
+                break;
+            case IDENTITY_KEY('S', 'C', 'E', 'P'):
+                identity->keys |= kIdentitySCEP;
+                identity->scep = (uint32_t)IOUSBParseHex(value, len);
+                break;
+            case IDENTITY_KEY('B', 'D', 'I', 'D'):
+                identity->keys |= kIdentityBDID;
+                identity->bdid = (uint32_t)IOUSBParseHex(value, len);
+                break;
+            case IDENTITY_KEY('E', 'C', 'I', 'D'):
+                identity->keys |= kIdentityECID;
+                identity->ecid = IOUSBParseHex(value, len);
+                break;
+            case IDENTITY_KEY('I', 'B', 'F', 'L'):
+                identity->keys |= kIdentityIBFL;
+                identity->ibfl = (uint32_t)IOUSBParseHex(value, len);
+                break;
+            case IDENTITY_KEY('S', 'D', 'O', 'M'):
+                identity->keys |= kIdentitySDOM;
+                identity->sdom = (uint32_t)IOUSBParseHex(value, len);
+                break;
+            case IDENTITY_KEY('S', 'R', 'T', 'G'):
+                identity->keys |= kIdentitySRTG;
+                IOUSBCopyValue(identity->srtg, sizeof(identity->srtg), value, len);
+                break;
+            case IDENTITY_KEY('S', 'R', 'N', 'M'):
+                identity->keys |= kIdentitySRNM;
+                IOUSBCopyValue(identity->srnm, sizeof(identity->srnm), value, len);
+                break;
+            case IDENTITY_KEY('I', 'M', 'E', 'I'):
+                identity->keys |= kIdentityIMEI;
+                IOUSBCopyValue(identity->imei, sizeof(identity->imei), value, len);
+                break;
+            case IDENTITY_KEY('P', 'W', 'N', 'D'):
+                identity->keys |= kIdentityPWND;
+                IOUSBCopyValue(identity->pwnd, sizeof(identity->pwnd), value, len);
+                break;
+            case IDENTITY_KEY('Y', 'O', 'L', 'O'):
+                identity->keys |= kIdentityYOLO;
+                IOUSBCopyValue(identity->yolo, sizeof(identity->yolo), value, len);
+                break;
+            default:
+                break;
+        }
     }
-    
-    return iterator;
 }
 
-RA1NPOC_STATIC_API static void IOUSBGetInfo(client_t *client, const char *str)
+RA1NPOC_API uint64_t IOUSBParseECID(const char *str)
 {
-    char* strptr = NULL;
-    strptr = strstr(str, "CPID:");
-    if (strptr != NULL)
+    device_identity_t identity;
+    IOUSBParseIdentity(str, &identity);
+    return identity.ecid;
+}
+
+RA1NPOC_API void IOUSBGetInfo(client_t *client, const char *str)
+{
+    device_identity_t *identity = &client->identity;
+    
+    IOUSBParseIdentity(str, identity);
+    if(identity->keys & kIdentityCPID)
     {
-        sscanf(strptr, "CPID:%x", (unsigned int *)&client->cpid);
+        client->cpid = identity->cpid;
     }
-    strptr = strstr(str, "CPRV:");
-    if (strptr != NULL)
+    if(identity->keys & kIdentityCPRV)
     {
-        sscanf(strptr, "CPRV:%x", (unsigned int *)&client->cprv);
+        client->cprv = identity->cprv;
     }
-    strptr = strstr(str, "SRTG:");
-    if(strptr != NULL)
+    client->ecid = identity->ecid;
+    if(identity->keys & kIdentitySRTG)
     {
         client->devmode = kDeviceDFUMode;
     }
-    strptr = strstr(str, "YOLO:checkra1n");
-    if(strptr != NULL)
+    if((identity->keys & kIdentityYOLO) && !strncmp(identity->yolo, "checkra1n", 9))
     {
         client->devmode |= kDeviceYoloDFUMode;
     }
-    strptr = strstr(str, "PWND:");
-    if(strptr != NULL)
+    if(identity->keys & kIdentityPWND)
     {
         client->devmode |= kDevicePwnedDFUMode;
     }
@@ -99,42 +236,19 @@ RA1NPOC_STATIC_API static void IOUSBGetInfo(client_t *client, const char *str)
 
 RA1NPOC_STATIC_API static void IOUSBReleaseClient(client_t *client)
 {
-    client->dev = NULL;
-    client->handle = NULL;
-    client->async_event_source = NULL;
     client->cpid = 0;
     client->cprv = 0;
+    client->ecid = 0;
     client->sn = false;
     client->devmode = kDeviceNotFoundMode;
-}
-
-RA1NPOC_STATIC_API static IOReturn IOUSBReEnumerate(client_t *client)
-{
-    if(!client || !client->dev)
-    {
-        return kIOReturnError;
-    }
-    return (*client->dev)->USBDeviceReEnumerate(client->dev, 0);
-}
-
-RA1NPOC_STATIC_API static IOReturn IOUSBResetDevice(client_t *client)
-{
-    if(!client || !client->dev)
-    {
-        return kIOReturnError;
-    }
-    return (*client->dev)->ResetDevice(client->dev);
+    memset(&client->identity, '\0', sizeof(device_identity_t));
 }
 
 RA1NPOC_STATIC_API static void IOUSBReset(client_t *client, int reset)
 {
-    if(reset & kDeviceUSBResetDevice)
-    {
-        IOUSBResetDevice(client);
-    }
-    if(reset & kDeviceUSBReEnumerate)
+    if(reset)
     {
-        IOUSBReEnumerate(client);
+        IOUSBGetBackend(client)->reset(client, reset);
     }
 }
 
@@ -142,31 +256,15 @@ RA1NPOC_API void IOUSBClose(client_t *client)
 {
     if(client)
     {
-        if (client->dev)
-        {
-            (*client->dev)->USBDeviceClose(client->dev);
-            (*client->dev)->Release(client->dev);
-            client->dev = NULL;
-        }
-        if (client->handle)
-        {
-            (*client->handle)->USBInterfaceClose(client->handle);
-            (*client->handle)->Release(client->handle);
-            client->handle = NULL;
-        }
-        if(client->async_event_source)
-        {
-            CFRunLoopRemoveSource(CFRunLoopGetCurrent(), client->async_event_source, kCFRunLoopDefaultMode);
-            CFRelease(client->async_event_source);
-        }
+        uint64_t trace = IOUSBTraceBegin();
+        IOUSBGetBackend(client)->close(client);
+        IOUSBTraceEndUnit(client, "IOUSBClose", trace, 0, kTraceNone);
         IOUSBReleaseClient(client);
     }
 }
 
 RA1NPOC_STATIC_API static int IOUSBOpen(client_t *client, uint16_t pid)
 {
-    io_iterator_t iterator;
-    
     if(!client)
     {
         ERR("No client");
@@ -175,177 +273,190 @@ RA1NPOC_STATIC_API static int IOUSBOpen(client_t *client, uint16_t pid)
     
     IOUSBClose(client);
     
-    iterator = IOUSBGetIteratorForPid(pid);
-    
-    if (iterator == IO_OBJECT_NULL)
+    uint64_t trace = IOUSBTraceBegin();
+    int ret = IOUSBGetBackend(client)->open(client, pid);
+    IOUSBTraceEnd(client, "IOUSBOpen", trace, ret);
+    return ret;
+}
+
+RA1NPOC_API int IOUSBConnect(client_t *client, uint16_t pid, int retry, int reset, unsigned long sec)
+{
+    if(!client)
     {
-        // not found
-        // DEVLOG("Failed IOServiceGetMatchingServices");
+        ERR("No client");
         return -1;
     }
     
-    io_service_t usbDev = MACH_PORT_NULL;
-    while((usbDev = IOIteratorNext(iterator)))
+    uint64_t trace = IOUSBTraceBegin();
+    // closing forgets the device, the backoff is still charged to it
+    unsigned int cpid = client->cpid;
+    uint64_t ecid = client->ecid;
+    if(client)
+    {
+        IOUSBReset(client, reset);
+        IOUSBClose(client);
+    }
+    
+    usleep(sec);
+    
+    for(int i=0; i<retry; i++)
     {
-        uint64_t regID;
-        kern_return_t ret = IORegistryEntryGetRegistryEntryID(usbDev, &regID);
-        if(ret != KERN_SUCCESS)
+        if(!IOUSBOpen(client, pid))
         {
-            ERR("IORegistryEntryGetRegistryEntryID: %s", mach_error_string(ret));
-            goto next;
+            IOUSBTraceEnd(client, "IOUSBConnect", trace, 0);
+            return 0;
         }
-        
-        SInt32 score = 0;
-        IOCFPlugInInterface **plugin = NULL;
-        ret = IOCreatePlugInInterfaceForService(usbDev, kIOUSBDeviceUserClientTypeID, kIOCFPlugInInterfaceID, &plugin, &score);
-        if(ret != KERN_SUCCESS)
+        IOUSBClose(client);
+        if(!client->policy)
         {
-            ERR("IOCreatePlugInInterfaceForService(usbDev): %s", mach_error_string(ret));
-            goto next;
+            sleep(1);
         }
-        
-        CFStringRef cfstr = IORegistryEntryCreateCFProperty(usbDev, CFSTR(kUSBSerialNumberString), kCFAllocatorDefault, kNilOptions);
-        if(cfstr == NULL)
+        else if(i + 1 < retry)
         {
-            ERR("Failed IORegistryEntryCreateCFProperty");
+            usleep(IOUSBPolicyBackoff(client->policy, cpid, ecid, i) * 1000);
         }
-        else
+    }
+    IOUSBTraceEnd(client, "IOUSBConnect", trace, -1);
+    return -1;
+}
+
+RA1NPOC_STATIC_API static int IOUSBConnectMatch(client_t *client, const usb_device_t *match, int reset, unsigned int timeout, const char *name)
+{
+    struct timespec ts;
+    usb_device_t device;
+    int ret = -1;
+    
+    // subscribe before the reset so the device coming back cannot slip past us
+    uint64_t trace = IOUSBTraceBegin();
+    hotplug_t *hp = IOUSBHotplugOpen(client);
+    if(!hp)
+    {
+        IOUSBTraceEnd(client, name, trace, -1);
+        return -1;
+    }
+    
+    uint64_t exclude = IOUSBResetExclude(client, reset);
+    IOUSBReset(client, reset);
+    IOUSBClose(client);
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t deadline = (uint64_t)ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000ULL + timeout;
+    for(;;)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        uint64_t now = (uint64_t)ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000ULL;
+        if(now >= deadline)
         {
-            memset(&serialstr, '\0', 256);
-            CFStringGetCString(cfstr, serialstr, sizeof(serialstr), kCFStringEncodingUTF8);
-            CFRelease(cfstr);
-            IOUSBGetInfo(client, serialstr);
-            memset(&serialstr, '\0', 256);
+            break;
         }
-        
-        HRESULT result = (*plugin)->QueryInterface(plugin, CFUUIDGetUUIDBytes(kIOUSBDeviceInterfaceID), (LPVOID*)&client->dev);
-        (*plugin)->Release(plugin);
-        if(result != 0)
+        uint64_t wait = IOUSBTraceBegin();
+        int found = IOUSBHotplugWaitMatch(hp, match, exclude, (unsigned int)(deadline - now), &device);
+        IOUSBTraceEnd(client, "IOUSBHotplugWaitMatch", wait, found);
+        if(found != 0)
         {
-            ERR("QueryInterface(dev): 0x%x", result);
-            goto next;
+            break;
         }
-        ret = (*client->dev)->USBDeviceOpenSeize(client->dev);
-        if(ret != KERN_SUCCESS)
+        if(!IOUSBOpenDevice(client, &device))
         {
-            ERR("USBDeviceOpenSeize: %s", mach_error_string(ret));
+            ret = 0;
+            break;
         }
-        else
-        {
-            ret = (*client->dev)->SetConfiguration(client->dev, 1);
-            if(ret != KERN_SUCCESS)
-            {
-                ERR("SetConfiguration: %s", mach_error_string(ret));
-            }
-            else
-            {
-                ret = (*client->dev)->CreateDeviceAsyncEventSource(client->dev, &client->async_event_source);
-                if (ret == kIOReturnSuccess)
-                {
-                    CFRunLoopAddSource(CFRunLoopGetCurrent(), client->async_event_source, kCFRunLoopDefaultMode);
-                }
-                
-                IOUSBFindInterfaceRequest request =
-                {
-                    .bInterfaceClass    = kIOUSBFindInterfaceDontCare,
-                    .bInterfaceSubClass = kIOUSBFindInterfaceDontCare,
-                    .bInterfaceProtocol = kIOUSBFindInterfaceDontCare,
-                    .bAlternateSetting  = kIOUSBFindInterfaceDontCare,
-                };
-                io_iterator_t iter = MACH_PORT_NULL;
-                ret = (*client->dev)->CreateInterfaceIterator(client->dev, &request, &iter);
-                if(ret != KERN_SUCCESS)
-                {
-                    ERR("CreateInterfaceIterator: %s", mach_error_string(ret));
-                }
-                else
-                {
-                    io_service_t usbIntf = MACH_PORT_NULL;
-                    while((usbIntf = IOIteratorNext(iter)))
-                    {
-                        ret = IOCreatePlugInInterfaceForService(usbIntf, kIOUSBInterfaceUserClientTypeID, kIOCFPlugInInterfaceID, &plugin, &score);
-                        IOObjectRelease(usbIntf);
-                        if(ret != KERN_SUCCESS)
-                        {
-                            ERR("IOCreatePlugInInterfaceForService(usbIntf): %s", mach_error_string(ret));
-                            continue;
-                        }
-                        result = (*plugin)->QueryInterface(plugin, CFUUIDGetUUIDBytes(kIOUSBInterfaceInterfaceID), (LPVOID*)&client->handle);
-                        (*plugin)->Release(plugin);
-                        if(result != 0)
-                        {
-                            ERR("QueryInterface(intf): 0x%x", result);
-                            continue;
-                        }
-                        
-                        ret = (*client->handle)->USBInterfaceOpen(client->handle);
-                        if(ret != KERN_SUCCESS)
-                        {
-                            ERR("USBInterfaceOpen: %s", mach_error_string(ret));
-                        }
-                        else
-                        {
-                            while((usbIntf = IOIteratorNext(iter))) IOObjectRelease(usbIntf);
-                            IOObjectRelease(iter);
-                            while((usbDev = IOIteratorNext(iterator))) IOObjectRelease(usbDev);
-                            IOObjectRelease(usbDev);
-                            return 0;
-                        }
-                        (*client->handle)->Release(client->handle);
-                        client->handle = NULL;
-                    }
-                    IOObjectRelease(iter);
-                }
-                if(client->async_event_source) {
-                    CFRunLoopRemoveSource(CFRunLoopGetCurrent(), client->async_event_source, kCFRunLoopDefaultMode);
-                    CFRelease(client->async_event_source);
-                }
-            }
-        }
-        
-    next:;
-        if(client->dev)
-        {
-            (*client->dev)->USBDeviceClose(client->dev);
-            (*client->dev)->Release(client->dev);
-            client->dev = NULL;
-        }
-        IOObjectRelease(usbDev);
+        // udev may not have fixed up the node permissions yet
+        IOUSBClose(client);
+        usleep(HOTPLUG_POLL_INTERVAL * 1000);
     }
     
-    return -1;
+    IOUSBHotplugClose(hp);
+    IOUSBTraceEnd(client, name, trace, ret);
+    return ret;
 }
 
-RA1NPOC_API int IOUSBConnect(client_t *client, uint16_t pid, int retry, int reset, unsigned long sec)
+RA1NPOC_API int IOUSBConnectWait(client_t *client, uint16_t pid, uint64_t ecid, int reset, unsigned int timeout)
 {
+    usb_device_t match;
+    
     if(!client)
     {
         ERR("No client");
         return -1;
     }
     
-    if(client)
+    memset(&match, '\0', sizeof(usb_device_t));
+    match.pid = pid;
+    match.ecid = ecid;
+    return IOUSBConnectMatch(client, &match, reset, timeout, "IOUSBConnectWait");
+}
+
+RA1NPOC_API int IOUSBReattach(client_t *client, uint16_t pid, int reset, unsigned int timeout)
+{
+    usb_device_t match;
+    
+    if(!client)
     {
-        IOUSBReset(client, reset);
-        IOUSBClose(client);
+        ERR("No client");
+        return -1;
+    }
+    if(!client->location && !client->ecid)
+    {
+        ERR("No device identity to reattach to");
+        return -1;
     }
     
-    usleep(sec);
-    
-    for(int i=0; i<retry; i++)
+    // closing drops the ECID, take the identity first
+    memset(&match, '\0', sizeof(usb_device_t));
+    match.pid = pid;
+    match.location = client->location;
+    match.ecid = client->ecid;
+    return IOUSBConnectMatch(client, &match, reset, timeout, "IOUSBReattach");
+}
+
+RA1NPOC_API uint64_t IOUSBResetExclude(client_t *client, int reset)
+{
+    if(!client)
     {
-        if(!IOUSBOpen(client, pid))
-            return 0;
-        IOUSBClose(client);
-        sleep(1);
+        return 0;
     }
-    return -1;
+    // a re-enumerated device may linger on the bus under its old id for a
+    // moment, skip that one; a reset in place keeps the id, so nothing is
+    return (reset & IOUSBGetBackend(client)->reenumerate) ? client->id : 0;
+}
+
+RA1NPOC_API int IOUSBEnumerate(client_t *client, uint16_t pid, usb_device_t *devices, int max)
+{
+    client_t native;
+    if(!client)
+    {
+        memset(&native, '\0', sizeof(client_t));
+        client = &native;
+    }
+    uint64_t trace = IOUSBTraceBegin();
+    int count = IOUSBGetBackend(client)->enumerate(client, pid, devices, max);
+    IOUSBTraceEndUnit(client == &native ? NULL : client, "IOUSBEnumerate", trace, count, kTraceCount);
+    return count;
+}
+
+RA1NPOC_API int IOUSBOpenDevice(client_t *client, const usb_device_t *device)
+{
+    if(!client || !device)
+    {
+        ERR("No client");
+        return -1;
+    }
+    
+    IOUSBClose(client);
+    
+    uint64_t trace = IOUSBTraceBegin();
+    int ret = IOUSBGetBackend(client)->open_device(client, device);
+    IOUSBTraceEnd(client, "IOUSBOpenDevice", trace, ret);
+    return ret;
 }
 
 RA1NPOC_API IOReturn IOUSBAbortPipeZero(client_t *client)
 {
-    if(!client->dev) return kIOReturnError;
-    return (*client->dev)->USBDeviceAbortPipeZero(client->dev);
+    uint64_t trace = IOUSBTraceBegin();
+    IOReturn ret = IOUSBGetBackend(client)->abort_pipe_zero(client);
+    IOUSBTraceEnd(client, "IOUSBAbortPipeZero", trace, ret);
+    return ret;
 }
 
 RA1NPOC_API transfer_t IOUSBControlTransfer(client_t *client,
@@ -356,25 +467,25 @@ RA1NPOC_API transfer_t IOUSBControlTransfer(client_t *client,
                                             unsigned char *data,
                                             uint16_t w_length)
 {
-    transfer_t result;
-    IOUSBDevRequest req;
-    
-    memset(&result, '\0', sizeof(transfer_t));
-    memset(&req, '\0', sizeof(req));
-    
-    req.bmRequestType     = bm_request_type;
-    req.bRequest          = b_request;
-    req.wValue            = OSSwapLittleToHostInt16(w_value);
-    req.wIndex            = OSSwapLittleToHostInt16(w_index);
-    req.wLength           = OSSwapLittleToHostInt16(w_length);
-    req.pData             = data;
-    
-    result.ret = (*client->dev)->DeviceRequest(client->dev, &req);
-    result.wLenDone = req.wLenDone;
-    
+    control_request_t req = IOUSBRequest(bm_request_type, b_request, w_value, w_index, w_length);
+    uint64_t trace = IOUSBTraceBegin();
+    uint64_t start = IOUSBTelemetryStart(client);
+    transfer_t result = IOUSBGetBackend(client)->control_transfer(client, &req, data, IOUSB_NO_TIMEOUT);
+    IOUSBTelemetryRecord(client, kTelemetryControl, start, result.ret, result.wLenDone);
+    IOUSBTraceEnd(client, "IOUSBControlTransfer", trace, result.ret);
     return result;
 }
 
+// IOUSB_POLICY_TIMEOUT never reaches a backend
+RA1NPOC_STATIC_API static unsigned int IOUSBControlTimeout(client_t *client, unsigned int timeout)
+{
+    if(timeout != IOUSB_POLICY_TIMEOUT)
+    {
+        return timeout;
+    }
+    return client->policy ? IOUSBPolicyTimeout(client, IOUSB_DEFAULT_TIMEOUT) : IOUSB_DEFAULT_TIMEOUT;
+}
+
 RA1NPOC_API transfer_t IOUSBControlTransferTO(client_t *client,
                                               uint8_t bm_request_type,
                                               uint8_t b_request,
@@ -384,24 +495,24 @@ RA1NPOC_API transfer_t IOUSBControlTransferTO(client_t *client,
                                               uint16_t w_length,
                                               unsigned int time)
 {
-    transfer_t result;
-    IOUSBDevRequestTO req;
-    
-    memset(&result, '\0', sizeof(transfer_t));
-    memset(&req, '\0', sizeof(req));
-    
-    req.bmRequestType     = bm_request_type;
-    req.bRequest          = b_request;
-    req.wValue            = OSSwapLittleToHostInt16(w_value);
-    req.wIndex            = OSSwapLittleToHostInt16(w_index);
-    req.wLength           = OSSwapLittleToHostInt16(w_length);
-    req.pData             = data;
-    req.noDataTimeout     = time;
-    req.completionTimeout = time;
-    
-    result.ret = (*client->dev)->DeviceRequestTO(client->dev, &req);
-    result.wLenDone = req.wLenDone;
-    
+    control_request_t req = IOUSBRequest(bm_request_type, b_request, w_value, w_index, w_length);
+    time = IOUSBControlTimeout(client, time);
+    uint64_t trace = IOUSBTraceBegin();
+    uint64_t start = IOUSBTelemetryStart(client);
+    transfer_t result = IOUSBGetBackend(client)->control_transfer(client, &req, data, time);
+    IOUSBTelemetryRecord(client, kTelemetryControlTO, start, result.ret, result.wLenDone);
+    IOUSBTraceEnd(client, "IOUSBControlTransferTO", trace, result.ret);
+    return result;
+}
+
+RA1NPOC_API transfer_t IOUSBControlTransferRequest(client_t *client, const control_request_t *req, unsigned char *data, unsigned int timeout)
+{
+    timeout = IOUSBControlTimeout(client, timeout);
+    uint64_t trace = IOUSBTraceBegin();
+    uint64_t start = IOUSBTelemetryStart(client);
+    transfer_t result = IOUSBGetBackend(client)->control_transfer(client, req, data, timeout);
+    IOUSBTelemetryRecord(client, timeout == IOUSB_NO_TIMEOUT ? kTelemetryControl : kTelemetryControlTO, start, result.ret, result.wLenDone);
+    IOUSBTraceEnd(client, "IOUSBControlTransferRequest", trace, result.ret);
     return result;
 }
 
@@ -416,24 +527,12 @@ RA1NPOC_API transfer_t IOUSBAsyncControlTransfer(client_t *client,
                                                  async_transfer_t* transfer,
                                                  unsigned int timeout)
 {
-    transfer_t result;
-    //IOUSBDevRequest req;
-    IOUSBDevRequestTO req;
-    
-    memset(&result, '\0', sizeof(transfer_t));
-    memset(&req, '\0', sizeof(req));
-    
-    req.bmRequestType     = bm_request_type;
-    req.bRequest          = b_request;
-    req.wValue            = OSSwapLittleToHostInt16(w_value);
-    req.wIndex            = OSSwapLittleToHostInt16(w_index);
-    req.wLength           = OSSwapLittleToHostInt16(w_length);
-    req.pData             = data;
-    req.completionTimeout = timeout;
-    
-    result.ret = (*client->dev)->DeviceRequestAsyncTO(client->dev, &req, IOUSBAsyncCallBack, transfer);
-    result.wLenDone = req.wLenDone;
-    
+    control_request_t req = IOUSBRequest(bm_request_type, b_request, w_value, w_index, w_length);
+    uint64_t trace = IOUSBTraceBegin();
+    uint64_t start = IOUSBTelemetryStart(client);
+    transfer_t result = IOUSBGetBackend(client)->async_control_transfer(client, &req, data, transfer, timeout);
+    IOUSBTelemetryRecord(client, kTelemetryAsyncControl, start, result.ret, 0);
+    IOUSBTraceEnd(client, "IOUSBAsyncControlTransfer", trace, result.ret);
     return result;
 }
 
@@ -446,25 +545,26 @@ RA1NPOC_API transfer_t IOUSBAsyncControlTransferNoTO(client_t *client,
                                                      uint16_t w_length,
                                                      async_transfer_t* transfer)
 {
-    transfer_t result;
-    IOUSBDevRequest req;
-    
-    memset(&result, '\0', sizeof(transfer_t));
-    memset(&req, '\0', sizeof(req));
-    
-    req.bmRequestType     = bm_request_type;
-    req.bRequest          = b_request;
-    req.wValue            = OSSwapLittleToHostInt16(w_value);
-    req.wIndex            = OSSwapLittleToHostInt16(w_index);
-    req.wLength           = OSSwapLittleToHostInt16(w_length);
-    req.pData             = data;
-    
-    result.ret = (*client->dev)->DeviceRequestAsync(client->dev, &req, IOUSBAsyncCallBack, transfer);
-    result.wLenDone = req.wLenDone;
-    
+    control_request_t req = IOUSBRequest(bm_request_type, b_request, w_value, w_index, w_length);
+    uint64_t trace = IOUSBTraceBegin();
+    uint64_t start = IOUSBTelemetryStart(client);
+    transfer_t result = IOUSBGetBackend(client)->async_control_transfer(client, &req, data, transfer, IOUSB_NO_TIMEOUT);
+    IOUSBTelemetryRecord(client, kTelemetryAsyncControl, start, result.ret, 0);
+    IOUSBTraceEnd(client, "IOUSBAsyncControlTransferNoTO", trace, result.ret);
     return result;
 }
 
+static pthread_once_t cancel_once = PTHREAD_ONCE_INIT;
+static abort_timer_t cancel_calibrated;
+
+// the native timer wakes early by a slack measured on this host, once per process
+RA1NPOC_STATIC_API static void IOUSBCancelCalibrate(void)
+{
+    IOUSBTimerInit(&cancel_calibrated, kAbortTimerNative);
+    IOUSBTimerCalibrate(&cancel_calibrated);
+    IOUSBTimerDestroy(&cancel_calibrated);
+}
+
 RA1NPOC_API UInt32 IOUSBAsyncControlTransferWithCancel(client_t *client,
                                                        uint8_t bm_request_type,
                                                        uint8_t b_request,
@@ -475,40 +575,108 @@ RA1NPOC_API UInt32 IOUSBAsyncControlTransferWithCancel(client_t *client,
                                                        unsigned int timeout,
                                                        unsigned int ns_time)
 {
-    transfer_t result;
+    abort_timer_t timer;
+    timed_abort_t result;
     IOReturn error;
-    async_transfer_t transfer;
-    
-    memset(&transfer, '\0', sizeof(async_transfer_t));
     
-    result = IOUSBAsyncControlTransfer(client, bm_request_type, b_request, w_value, w_index, data, w_length, &transfer, timeout);
-    if(result.ret != kIOReturnSuccess)
+    pthread_once(&cancel_once, IOUSBCancelCalibrate);
+    uint64_t trace = IOUSBTraceBegin();
+    IOUSBTimerInit(&timer, kAbortTimerNative);
+    timer.slack = cancel_calibrated.slack;
+    timer.clock_cost = cancel_calibrated.clock_cost;
+    error = IOUSBAsyncControlTransferTimedAbort(client, bm_request_type, b_request, w_value, w_index, data, w_length, timeout, ns_time, &timer, &result);
+    IOUSBTimerDestroy(&timer);
+    IOUSBTraceEnd(client, "IOUSBAsyncControlTransferWithCancel", trace, error);
+    if(error != kIOReturnSuccess)
     {
-        return result.ret;
+        return result.submitted ? (UInt32)-1 : (UInt32)error;
     }
-    nSleep(ns_time);
     
-    error = IOUSBAbortPipeZero(client);
-    if(error != kIOReturnSuccess)
+    return result.wLenDone;
+}
+#endif
+
+RA1NPOC_API int IOUSBAsyncWait(client_t *client)
+{
+    uint64_t trace = IOUSBTraceBegin();
+    int ret = IOUSBGetBackend(client)->async_wait(client);
+    IOUSBTraceEnd(client, "IOUSBAsyncWait", trace, ret);
+    return ret;
+}
+
+RA1NPOC_API int IOUSBAsyncDiscard(client_t *client, bool (*pending)(void *ctx), void *ctx)
+{
+    const iousb_backend_t *backend = IOUSBGetBackend(client);
+    
+    if(!pending(ctx))
     {
-        return -1;
+        return 0;
     }
-    
-    while(transfer.ret != kIOReturnAborted)
+    backend->abort_pipe_zero(client);
+    while(pending(ctx))
     {
-        CFRunLoopRun();
+        if(backend->async_wait(client) != 0)
+        {
+            // closing drains or discards everything the backend still holds
+            ERR("Transfers cannot be reaped, closing the device");
+            IOUSBClose(client);
+            return -1;
+        }
     }
-    
-    return transfer.wLenDone;
+    return 0;
+}
+
+RA1NPOC_API int IOUSBAsyncFd(client_t *client)
+{
+    const iousb_backend_t *backend = IOUSBGetBackend(client);
+    return backend->async_fd ? backend->async_fd(client) : -1;
+}
+
+RA1NPOC_API int IOUSBAsyncPoll(client_t *client)
+{
+    const iousb_backend_t *backend = IOUSBGetBackend(client);
+    return backend->async_poll ? backend->async_poll(client) : 0;
+}
+
+RA1NPOC_API uint64_t IOUSBAsyncDeadline(client_t *client)
+{
+    const iousb_backend_t *backend = IOUSBGetBackend(client);
+    return backend->async_deadline ? backend->async_deadline(client) : 0;
 }
-#endif
 
 RA1NPOC_API transfer_t IOUSBBulkUpload(client_t *client, void *data, uint32_t len)
 {
-    transfer_t result;
-    result.ret = (*client->handle)->WritePipe(client->handle, 2, data, len);
-    result.wLenDone = 0;
-    
+    if(client->sched)
+    {
+        IOUSBSchedBulkAcquire(client, len);
+    }
+    uint64_t trace = IOUSBTraceBegin();
+    uint64_t start = IOUSBTelemetryStart(client);
+    transfer_t result = IOUSBGetBackend(client)->bulk_upload(client, data, len);
+    if(client->sched)
+    {
+        IOUSBSchedBulkRelease(client, len);
+    }
+    IOUSBTelemetryRecord(client, kTelemetryBulk, start, result.ret, result.wLenDone);
+    IOUSBTraceEnd(client, "IOUSBBulkUpload", trace, result.ret);
+    return result;
+}
+
+RA1NPOC_API transfer_t IOUSBBulkUploadAsync(client_t *client, void *data, uint32_t len, async_transfer_t *transfer)
+{
+    const iousb_backend_t *backend = IOUSBGetBackend(client);
+    if(!backend->bulk_upload_async)
+    {
+        transfer_t result;
+        memset(&result, '\0', sizeof(transfer_t));
+        result.ret = kIOReturnUnsupported;
+        return result;
+    }
+    uint64_t trace = IOUSBTraceBegin();
+    uint64_t start = IOUSBTelemetryStart(client);
+    transfer_t result = backend->bulk_upload_async(client, data, len, transfer);
+    IOUSBTelemetryRecord(client, kTelemetryBulkAsync, start, result.ret, result.ret == kIOReturnSuccess ? len : 0);
+    IOUSBTraceEnd(client, "IOUSBBulkUploadAsync", trace, result.ret);
     return result;
 }
 
@@ -520,26 +688,167 @@ RA1NPOC_API transfer_t IOUSBControlRequestTransfer(client_t *client,
                                                    unsigned char *data,
                                                    uint16_t w_length)
 {
-    transfer_t result;
-    IOUSBDevRequest req;
+    control_request_t req = IOUSBRequest(bm_request_type, b_request, w_value, w_index, w_length);
+    uint64_t trace = IOUSBTraceBegin();
+    uint64_t start = IOUSBTelemetryStart(client);
+    transfer_t result = IOUSBGetBackend(client)->interface_control_transfer(client, &req, data);
+    IOUSBTelemetryRecord(client, kTelemetryInterfaceControl, start, result.ret, result.wLenDone);
+    IOUSBTraceEnd(client, "IOUSBControlRequestTransfer", trace, result.ret);
+    return result;
+}
+
+RA1NPOC_STATIC_API static bool IOUSBBatchFailed(const transfer_t *result, unsigned int flags)
+{
+    if(result->ret == kIOReturnSuccess)
+    {
+        return false;
+    }
+    return !(result->ret == kUSBHostReturnPipeStalled && (flags & kControlBatchStallOK));
+}
+
+typedef struct
+{
+    transfer_t *results;
+    size_t count;
+} batch_span_t;
+
+RA1NPOC_STATIC_API static bool IOUSBBatchPending(void *ctx)
+{
+    batch_span_t *span = ctx;
+    for(size_t i = 0; i < span->count; i++)
+    {
+        if(span->results[i].wLenDone == IOUSB_TRANSFER_PENDING)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+RA1NPOC_API int IOUSBControlTransferBatch(client_t *client,
+                                          const control_batch_t *batch,
+                                          transfer_t *results,
+                                          size_t count,
+                                          unsigned int flags,
+                                          unsigned int timeout)
+{
+    const iousb_backend_t *backend;
+    size_t head = 0;
+    size_t next = 0;
+    bool stop = false;
+    int failed = 0;
     
-    memset(&result, '\0', sizeof(transfer_t));
-    memset(&req, '\0', sizeof(req));
+    if(!client)
+    {
+        ERR("No client");
+        return -1;
+    }
+    backend = IOUSBGetBackend(client);
+    uint64_t trace = IOUSBTraceBegin();
+    uint64_t start = IOUSBTelemetryStart(client);
     
-    req.bmRequestType     = bm_request_type;
-    req.bRequest          = b_request;
-    req.wValue            = OSSwapLittleToHostInt16(w_value);
-    req.wIndex            = OSSwapLittleToHostInt16(w_index);
-    req.wLength           = OSSwapLittleToHostInt16(w_length);
-    req.pData             = data;
+    for(size_t i = 0; i < count; i++)
+    {
+        results[i].ret = kIOReturnAborted;
+        results[i].wLenDone = 0;
+    }
     
-    result.ret = (*client->handle)->ControlRequest(client->handle, 0, &req);
-    result.wLenDone = req.wLenDone;
+    while(head < count)
+    {
+        // EP0 completes in submission order, keep the queue topped up behind head
+        while(!stop && next < count && next - head < CONTROL_BATCH_MAX_DEPTH)
+        {
+            transfer_t *result = &results[next++];
+            result->ret = kIOReturnSuccess;
+            result->wLenDone = IOUSB_TRANSFER_PENDING;
+            
+            transfer_t submit = backend->async_control_transfer(client, &batch[next - 1].req, batch[next - 1].data, result, timeout);
+            if(submit.ret != kIOReturnSuccess)
+            {
+                // retired in order below like any other failure
+                *result = submit;
+                break;
+            }
+        }
+        if(head == next)
+        {
+            break;
+        }
+        
+        transfer_t *result = &results[head++];
+        while(result->wLenDone == IOUSB_TRANSFER_PENDING)
+        {
+            if(backend->async_wait(client) != 0)
+            {
+                // the rest is queued into results, it must not land after we return
+                batch_span_t span = { results + head - 1, next - head + 1 };
+                IOUSBAsyncDiscard(client, IOUSBBatchPending, &span);
+                for(size_t i = head - 1; i < next; i++)
+                {
+                    if(results[i].wLenDone == IOUSB_TRANSFER_PENDING)
+                    {
+                        results[i].ret = kIOReturnNotResponding;
+                        results[i].wLenDone = 0;
+                    }
+                }
+                stop = true;
+            }
+        }
+        IOUSBTelemetryRecord(client, kTelemetryBatch, start, result->ret, result->wLenDone);
+        
+        if(!stop && IOUSBBatchFailed(result, flags))
+        {
+            failed++;
+            if(flags & kControlBatchStopOnError)
+            {
+                // drop whatever is still queued behind the failure
+                stop = true;
+                if(head < next)
+                {
+                    backend->abort_pipe_zero(client);
+                }
+            }
+        }
+    }
     
-    return result;
+    IOUSBTraceEndUnit(client, "IOUSBControlTransferBatch", trace, failed, kTraceCount);
+    return failed;
+}
+
+RA1NPOC_API const usb_layout_t *IOUSBLayoutLookup(client_t *client, uint16_t pid)
+{
+    for(size_t i = 0; pid && i < IOUSB_LAYOUT_CACHE_SZ; i++)
+    {
+        if(client->layouts[i].pid == pid)
+        {
+            return &client->layouts[i];
+        }
+    }
+    return NULL;
 }
 
+RA1NPOC_API void IOUSBLayoutStore(client_t *client, const usb_layout_t *layout)
+{
+    size_t slot = IOUSB_LAYOUT_CACHE_SZ - 1;
+    for(size_t i = 0; i < IOUSB_LAYOUT_CACHE_SZ; i++)
+    {
+        if(client->layouts[i].pid == layout->pid || !client->layouts[i].pid)
+        {
+            slot = i;
+            break;
+        }
+    }
+    // most recent first, the oldest mode falls off the end
+    memmove(&client->layouts[1], &client->layouts[0], slot * sizeof(usb_layout_t));
+    client->layouts[0] = *layout;
+}
+
+RA1NPOC_API void IOUSBLayoutFlush(client_t *client)
+{
+    memset(client->layouts, '\0', sizeof(client->layouts));
+}
 
+// synchronous on purpose, it is called from threads without the client's run loop
 RA1NPOC_API void IOUSBSendReboot(client_t *client)
 {
     IOUSBControlTransfer(client, 0x40, 0, 0x0000, 0x0000, (unsigned char *)"setenv auto-boot true\x00", sizeof("setenv auto-boot true\x00"));
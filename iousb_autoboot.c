@@ -0,0 +1,497 @@
+#include <io/iousb.h>
+#include <io/iousb_autoboot.h>
+#include <io/iousb_pongo.h>
+#include <io/iousb_upload.h>
+#include <io/iousb_sched.h>
+#include <io/iousb_telemetry.h>
+#include <common/log.h>
+#include <common/common.h>
+
+#define kStagePending   (0)
+#define kStageRunning   (1)
+#define kStageDone      (2)
+
+typedef struct
+{
+    bool upload;                    // bulk transfer into the loader buffer rather than a command
+    uint32_t after;                 // stages that have to be done first
+    uint32_t with;                  // stages it is skipped along with
+} autoboot_step_t;
+
+// pongoOS has one loader buffer, so a blob may only go out once the blob
+// before it has been consumed; everything else only orders the commands.
+// The flag commands go to the KPF module, without it there is nothing to set.
+static const autoboot_step_t steps[AUTOBOOT_MAX_STAGES] =
+{
+    [SETUP_STAGE_FUSE]              = { false,  0 },
+    [SETUP_STAGE_SEP]               = { false,  kAutobootStage(SETUP_STAGE_FUSE) },
+    [SEND_STAGE_KPF]                = { true,   0 },
+    [SETUP_STAGE_KPF]               = { false,  kAutobootStage(SEND_STAGE_KPF) | kAutobootStage(SETUP_STAGE_SEP) },
+    [SEND_STAGE_RAMDISK]            = { true,   kAutobootStage(SETUP_STAGE_KPF) },
+    [SETUP_STAGE_RAMDISK]           = { false,  kAutobootStage(SEND_STAGE_RAMDISK) | kAutobootStage(SETUP_STAGE_SEP) },
+    [SEND_STAGE_OVERLAY]            = { true,   kAutobootStage(SETUP_STAGE_RAMDISK) },
+    [SETUP_STAGE_OVERLAY]           = { false,  kAutobootStage(SEND_STAGE_OVERLAY) | kAutobootStage(SETUP_STAGE_SEP) },
+    [SETUP_STAGE_KPF_FLAGS]         = { false,  kAutobootStage(SETUP_STAGE_KPF),   kAutobootStage(SETUP_STAGE_KPF) },
+    [SETUP_STAGE_CHECKRAIN_FLAGS]   = { false,  kAutobootStage(SETUP_STAGE_KPF),   kAutobootStage(SETUP_STAGE_KPF) },
+    [SETUP_STAGE_XARGS]             = { false,  kAutobootStage(SETUP_STAGE_SEP) },
+    [SETUP_STAGE_ROOTDEV]           = { false,  kAutobootStage(SETUP_STAGE_SEP) },
+    [BOOTUP_STAGE]                  = { false,  ((kAutobootStage(BOOTUP_STAGE) - 1) & ~kAutobootStage(NONE)) },
+};
+
+static const char *stage_names[AUTOBOOT_MAX_STAGES] =
+{
+    "NONE",
+    "SETUP_STAGE_FUSE",
+    "SETUP_STAGE_SEP",
+    "SEND_STAGE_KPF",
+    "SETUP_STAGE_KPF",
+    "SEND_STAGE_RAMDISK",
+    "SETUP_STAGE_RAMDISK",
+    "SEND_STAGE_OVERLAY",
+    "SETUP_STAGE_OVERLAY",
+    "SETUP_STAGE_KPF_FLAGS",
+    "SETUP_STAGE_CHECKRAIN_FLAGS",
+    "SETUP_STAGE_XARGS",
+    "SETUP_STAGE_ROOTDEV",
+    "BOOTUP_STAGE",
+    "USB_TRANSFER_ERROR",
+};
+
+typedef struct
+{
+    client_t *client;
+    const autoboot_plan_t *plan;
+    pongo_shell_t *shell;
+    autoboot_result_t *result;
+    autoboot_stage_cb_t callback;
+    void *ctx;
+    int retries;
+    unsigned int timeout;
+    upload_opts_t upload;
+    uint64_t start;
+    uint32_t done;
+    int state[AUTOBOOT_MAX_STAGES];
+    int command;                    // stage whose command is running, NONE if idle
+    int sending;                    // stage whose blob is streaming, NONE if idle
+    upload_stream_t stream;
+} autoboot_run_t;
+
+RA1NPOC_STATIC_API static uint64_t AutobootNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+RA1NPOC_STATIC_API static bool AutobootBlob(const autoboot_plan_t *plan, int stage, const void **data, uint32_t *len)
+{
+    switch(stage)
+    {
+        case SEND_STAGE_KPF:
+        case SETUP_STAGE_KPF:
+            *data = plan->kpf;
+            *len = plan->kpf_len;
+            break;
+        case SEND_STAGE_RAMDISK:
+        case SETUP_STAGE_RAMDISK:
+            *data = plan->ramdisk;
+            *len = plan->ramdisk_len;
+            break;
+        case SEND_STAGE_OVERLAY:
+        case SETUP_STAGE_OVERLAY:
+            *data = plan->overlay;
+            *len = plan->overlay_len;
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+RA1NPOC_STATIC_API static bool AutobootSkipped(const autoboot_plan_t *plan, int stage)
+{
+    const void *data;
+    uint32_t len;
+    
+    if(plan->skip & kAutobootStage(stage))
+    {
+        return true;
+    }
+    for(int with = SETUP_STAGE_FUSE; with < stage; with++)
+    {
+        if((steps[stage].with & kAutobootStage(with)) && AutobootSkipped(plan, with))
+        {
+            return true;
+        }
+    }
+    if(AutobootBlob(plan, stage, &data, &len))
+    {
+        return !data;
+    }
+    if(stage == SETUP_STAGE_XARGS)
+    {
+        return !plan->xargs;
+    }
+    if(stage == SETUP_STAGE_ROOTDEV)
+    {
+        return !plan->rootdev;
+    }
+    return false;
+}
+
+RA1NPOC_STATIC_API static int AutobootCommand(const autoboot_plan_t *plan, int stage, char *buf, size_t len)
+{
+    switch(stage)
+    {
+        case SETUP_STAGE_FUSE:
+            return snprintf(buf, len, "fuse lock");
+        case SETUP_STAGE_SEP:
+            return snprintf(buf, len, "sep auto");
+        case SETUP_STAGE_KPF:
+            return snprintf(buf, len, "modload");
+        case SETUP_STAGE_RAMDISK:
+            return snprintf(buf, len, "ramdisk");
+        case SETUP_STAGE_OVERLAY:
+            return snprintf(buf, len, "overlay");
+        case SETUP_STAGE_KPF_FLAGS:
+            return snprintf(buf, len, "kpf_flags 0x%x", plan->kpf_flags);
+        case SETUP_STAGE_CHECKRAIN_FLAGS:
+            return snprintf(buf, len, "checkra1n_flags 0x%x", plan->checkra1n_flags);
+        case SETUP_STAGE_XARGS:
+            return snprintf(buf, len, "xargs %s", plan->xargs);
+        case SETUP_STAGE_ROOTDEV:
+            return snprintf(buf, len, "rootdev %s", plan->rootdev);
+        case BOOTUP_STAGE:
+            return snprintf(buf, len, "bootx");
+        default:
+            return -1;
+    }
+}
+
+// first pending stage of the given kind whose dependencies are done
+RA1NPOC_STATIC_API static int AutobootNext(autoboot_run_t *run, bool upload)
+{
+    for(int stage = SETUP_STAGE_FUSE; stage <= BOOTUP_STAGE; stage++)
+    {
+        if(run->state[stage] == kStagePending && steps[stage].upload == upload &&
+           (run->done & steps[stage].after) == steps[stage].after)
+        {
+            return stage;
+        }
+    }
+    return NONE;
+}
+
+RA1NPOC_STATIC_API static void AutobootBegin(autoboot_run_t *run, int stage)
+{
+    autoboot_timing_t *timing = &run->result->stages[stage];
+    timing->start = AutobootNow() - run->start;
+    timing->end = 0;
+    timing->attempts++;
+    timing->ret = kIOReturnSuccess;
+    run->state[stage] = kStageRunning;
+}
+
+// Returns false once the stage has failed for good. A retried stage goes back
+// to pending and is picked up again by its lane.
+RA1NPOC_STATIC_API static bool AutobootEnd(autoboot_run_t *run, int stage, IOReturn ret, bool retry)
+{
+    autoboot_timing_t *timing = &run->result->stages[stage];
+    timing->end = AutobootNow() - run->start;
+    timing->ret = ret;
+    if(run->callback)
+    {
+        run->callback(run->ctx, stage, timing);
+    }
+    
+    if(ret == kIOReturnSuccess)
+    {
+        run->state[stage] = kStageDone;
+        run->done |= kAutobootStage(stage);
+        return true;
+    }
+    
+    IOUSBTelemetryStage(run->client, USB_TRANSFER_ERROR);
+    if(retry && timing->attempts <= (unsigned int)run->retries)
+    {
+        ERR("%s failed: 0x%x, retrying", stage_names[stage], ret);
+        run->state[stage] = kStagePending;
+        return true;
+    }
+    
+    ERR("%s failed: 0x%x", stage_names[stage], ret);
+    run->result->failed = stage;
+    run->result->ret = ret;
+    return false;
+}
+
+RA1NPOC_STATIC_API static bool AutobootStartCommand(autoboot_run_t *run, int stage)
+{
+    char line[PONGO_MAX_COMMAND_SZ];
+    
+    AutobootBegin(run, stage);
+    IOUSBTelemetryStage(run->client, stage);
+    if(AutobootCommand(run->plan, stage, line, sizeof(line)) >= (int)sizeof(line))
+    {
+        ERR("%s: command too long", stage_names[stage]);
+        return AutobootEnd(run, stage, kIOReturnBadArgument, false);
+    }
+    if(IOUSBPongoSend(run->shell, line) != 0)
+    {
+        return AutobootEnd(run, stage, kIOReturnError, true);
+    }
+    run->command = stage;
+    return true;
+}
+
+RA1NPOC_STATIC_API static bool AutobootStartUpload(autoboot_run_t *run, int stage)
+{
+    const void *data = NULL;
+    uint32_t len = 0;
+    
+    AutobootBegin(run, stage);
+    AutobootBlob(run->plan, stage, &data, &len);
+    IOReturn ret = IOUSBPongoUploadBegin(run->shell, &run->stream, data, len, &run->upload);
+    if(ret != kIOReturnSuccess)
+    {
+        return AutobootEnd(run, stage, ret, true);
+    }
+    run->sending = stage;
+    return true;
+}
+
+// lets chunks still on the bus complete before the buffers go away
+RA1NPOC_STATIC_API static void AutobootDrain(autoboot_run_t *run)
+{
+    if(run->sending == NONE)
+    {
+        return;
+    }
+    run->stream.failed = true;
+    while(!IOUSBBulkUploadPump(&run->stream))
+    {
+        if(IOUSBAsyncWait(run->client) != 0)
+        {
+            break;
+        }
+    }
+    run->sending = NONE;
+}
+
+RA1NPOC_API int IOUSBAutoboot(client_t *client, const autoboot_plan_t *plan, const autoboot_opts_t *opts, autoboot_result_t *result)
+{
+    autoboot_run_t *run = NULL;
+    autoboot_result_t local;
+    uint32_t all = 0;
+    uint64_t command_start = 0;
+    uint64_t next_poll = 0;
+    unsigned int interval = PONGO_POLL_MIN;
+    int ret = -1;
+    
+    if(!result)
+    {
+        result = &local;
+    }
+    memset(result, '\0', sizeof(autoboot_result_t));
+    result->stage = USB_TRANSFER_ERROR;
+    result->failed = NONE;
+    
+    if(!client || !plan)
+    {
+        result->ret = kIOReturnBadArgument;
+        return -1;
+    }
+    
+    run = calloc(1, sizeof(autoboot_run_t));
+    if(!run)
+    {
+        result->ret = kIOReturnNoMemory;
+        return -1;
+    }
+    run->client = client;
+    run->plan = plan;
+    run->result = result;
+    run->retries = AUTOBOOT_DEFAULT_RETRIES;
+    run->timeout = AUTOBOOT_DEFAULT_TIMEOUT;
+    run->command = NONE;
+    run->sending = NONE;
+    if(opts)
+    {
+        run->callback = opts->stage;
+        run->ctx = opts->ctx;
+        run->upload = opts->upload;
+        if(opts->retries)
+        {
+            run->retries = opts->retries < 0 ? 0 : opts->retries;
+        }
+        if(opts->timeout)
+        {
+            run->timeout = opts->timeout;
+        }
+    }
+    run->upload.progress = NULL;
+    run->upload.submit = NULL;
+    
+    run->shell = IOUSBPongoShellCreate(client, 0, opts ? opts->output : NULL, opts ? opts->ctx : NULL);
+    if(!run->shell)
+    {
+        result->ret = kIOReturnNoMemory;
+        free(run);
+        return -1;
+    }
+    
+    for(int stage = SETUP_STAGE_FUSE; stage <= BOOTUP_STAGE; stage++)
+    {
+        all |= kAutobootStage(stage);
+        if(stage != BOOTUP_STAGE && AutobootSkipped(plan, stage))
+        {
+            run->state[stage] = kStageDone;
+            run->done |= kAutobootStage(stage);
+        }
+    }
+    
+    run->start = AutobootNow();
+    while(run->done != all)
+    {
+        bool progress = false;
+        
+        // upload lane: keep the bulk pipe busy while the shell works
+        if(run->sending == NONE)
+        {
+            int stage = AutobootNext(run, true);
+            if(stage != NONE)
+            {
+                if(!AutobootStartUpload(run, stage))
+                {
+                    goto out;
+                }
+                progress = true;
+            }
+        }
+        if(run->sending != NONE)
+        {
+            unsigned int head = run->stream.head;
+            IOUSBAsyncPoll(client);
+            if(IOUSBBulkUploadPump(&run->stream))
+            {
+                int stage = run->sending;
+                run->sending = NONE;
+                if(!AutobootEnd(run, stage, run->stream.result.ret, true))
+                {
+                    goto out;
+                }
+                progress = true;
+            }
+            else if(run->stream.head != head)
+            {
+                progress = true;
+            }
+        }
+        
+        // command lane: one shell command at a time
+        if(run->command == NONE)
+        {
+            int stage = AutobootNext(run, false);
+            if(stage != NONE)
+            {
+                if(!AutobootStartCommand(run, stage))
+                {
+                    goto out;
+                }
+                command_start = AutobootNow();
+                next_poll = command_start;
+                interval = PONGO_POLL_MIN;
+                progress = true;
+            }
+        }
+        uint64_t now = AutobootNow();
+        if(run->command != NONE && now >= next_poll)
+        {
+            int stage = run->command;
+            size_t seen = IOUSBPongoPending(run->shell);
+            int poll = IOUSBPongoPoll(run->shell);
+            
+            if(poll < 0 && stage == BOOTUP_STAGE)
+            {
+                // the device dropped off the bus to boot
+                run->command = NONE;
+                AutobootEnd(run, stage, kIOReturnSuccess, false);
+                break;
+            }
+            if(poll != 0)
+            {
+                run->command = NONE;
+                IOReturn status = poll > 0 ? kIOReturnSuccess : kIOReturnError;
+                if(stage == BOOTUP_STAGE)
+                {
+                    ERR("pongoOS came back to the prompt instead of booting");
+                    status = kIOReturnError;
+                }
+                if(!AutobootEnd(run, stage, status, poll < 0))
+                {
+                    goto out;
+                }
+                progress = true;
+            }
+            else if(run->timeout && now - command_start >= run->timeout * 1000000ULL)
+            {
+                run->command = NONE;
+                AutobootEnd(run, stage, kIOReturnTimeout, false);
+                goto out;
+            }
+            else
+            {
+                // back off while the command is quiet, stay close while it talks
+                interval = IOUSBPongoPending(run->shell) != seen ? PONGO_POLL_MIN : interval * 2;
+                if(interval > PONGO_POLL_MAX)
+                {
+                    interval = PONGO_POLL_MAX;
+                }
+                next_poll = now + interval * 1000ULL;
+            }
+        }
+        
+        if(!progress)
+        {
+            uint64_t wait = PONGO_POLL_MAX * 1000ULL;
+            if(run->command != NONE)
+            {
+                now = AutobootNow();
+                wait = next_poll > now ? next_poll - now : 0;
+            }
+            if(run->sending != NONE && wait > PONGO_POLL_MIN * 1000ULL)
+            {
+                wait = PONGO_POLL_MIN * 1000ULL;
+            }
+            if(run->sending != NONE && !run->stream.inflight)
+            {
+                // held back by the scheduler, come back when it admits again
+                uint64_t admit = IOUSBSchedBulkDeadline(client);
+                wait = admit < wait ? admit : wait;
+            }
+            if(wait)
+            {
+                usleep((useconds_t)(wait / 1000));
+            }
+        }
+    }
+    
+    result->stage = BOOTUP_STAGE;
+    ret = 0;
+
+out:
+    AutobootDrain(run);
+    result->elapsed = AutobootNow() - run->start;
+    IOUSBPongoShellDestroy(run->shell);
+    free(run);
+    return ret;
+}
+
+RA1NPOC_API const char *IOUSBAutobootStageName(int stage)
+{
+    if(stage < 0 || stage >= AUTOBOOT_MAX_STAGES)
+    {
+        return "UNKNOWN";
+    }
+    return stage_names[stage];
+}
@@ -0,0 +1,1787 @@
+#if defined(__linux__)
+#define _GNU_SOURCE // accept4, memfd_create, POLLRDHUP
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+#include <io/iousb.h>
+#include <io/iousb_broker.h>
+#include <io/iousb_cq.h>
+#include <io/iousb_pool.h>
+#include <io/iousb_sched.h>
+#include <io/iousb_upload.h>
+#include <common/log.h>
+#include <common/common.h>
+
+#if defined(__linux__)
+
+#define BROKER_MAGIC            (0x494f5542)
+#define BROKER_VERSION          (1)
+#define BROKER_MAX_EVENTS       (32)
+#define BROKER_IDLE_TIMEOUT     (1000)          // msec a worker sleeps without a doorbell
+#define BROKER_POLL_INTERVAL    (1000000ULL)    // nsec, how often a completion queue reaps a broker client
+
+// what a connection is for
+#define kBrokerHelloOpen        (1)
+#define kBrokerHelloEnumerate   (2)
+
+// requests
+#define kBrokerControl          (0)
+#define kBrokerAsyncControl     (1)
+#define kBrokerInterfaceControl (2)
+#define kBrokerBulk             (3)
+#define kBrokerBulkAsync        (4)
+#define kBrokerBulkFd           (5)     // the file was sent over the socket before the request
+#define kBrokerAbort            (6)
+#define kBrokerReset            (7)
+#define BROKER_MAX_OPS          (8)
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t kind;
+    uint16_t pid;
+    uint64_t ecid;                  // 0 = any
+} broker_hello_t;
+
+// the device as the broker opened it, what a backend open fills in
+typedef struct
+{
+    int32_t ret;                    // 0 or -1, the device count for an enumerate
+    unsigned int cpid;
+    unsigned int cprv;
+    uint64_t ecid;
+    uint64_t id;
+    uint32_t location;
+    bool sn;
+    uint64_t devmode;
+    usb_layout_t layout;
+    device_identity_t identity;
+} broker_reply_t;
+
+typedef struct
+{
+    broker_reply_t reply;
+    usb_device_t devices[BROKER_MAX_ENUMERATE];
+} broker_enumerate_t;
+
+typedef struct
+{
+    uint8_t op;
+    uint8_t slot;                   // payload, and the tag of the completion
+    control_request_t req;
+    uint32_t len;                   // bulk length, the reset flags for kBrokerReset
+    uint32_t timeout;
+} broker_job_t;
+
+typedef struct
+{
+    uint8_t slot;
+    IOReturn ret;
+    uint32_t wLenDone;
+} broker_done_t;
+
+// Mapped by a client and the worker of its device. The client owns a slot
+// from its submit until it reaps the completion, so neither ring can overrun.
+typedef struct
+{
+    uint32_t magic;
+    _Alignas(64) _Atomic uint32_t sq_tail;     // written by the client
+    _Alignas(64) _Atomic uint32_t cq_tail;     // written by the worker
+    broker_job_t sq[BROKER_RING_SZ];
+    broker_done_t cq[BROKER_RING_SZ];
+    _Alignas(4096) unsigned char data[BROKER_RING_SZ][BROKER_SLOT_SZ];
+} broker_shm_t;
+
+typedef struct broker_conn_p broker_conn_t;
+typedef struct broker_device_p broker_device_t;
+
+typedef struct
+{
+    broker_conn_t *conn;
+    uint8_t slot;
+    bool busy;                      // in the completion queue
+} broker_tag_t;
+
+struct broker_conn_p
+{
+    broker_conn_t *next;
+    broker_device_t *device;
+    int sock;
+    int cq_efd;                     // completion doorbell
+    uint16_t pid;                   // mode the client asked for
+    broker_shm_t *shm;
+    uint32_t sq_head;
+    bool broken;                    // never attached or broke the protocol, waits for the hangup
+    bool closed;                    // the device was closed under it
+    bool aborted;
+    unsigned int inflight;
+    atomic_bool hangup;             // set by IOUSBBrokerRun once it let go of the connection
+    broker_tag_t tags[BROKER_RING_SZ];
+};
+
+struct broker_device_p
+{
+    iousb_broker_t *broker;
+    client_t client;
+    uint64_t ecid;                  // 0 until the first open if no client asked for one
+    uint16_t pid;
+    bool opened;
+    iousb_cq_t *cq;                 // its eventfd is every client's submit doorbell
+    pthread_t thread;
+    atomic_bool stop;
+    pthread_mutex_t lock;
+    broker_conn_t *pending;         // handed over by IOUSBBrokerRun
+    broker_conn_t *conns;           // the worker's
+    upload_stream_t *upload;        // BrokerUploadQueued's, its slots are the userdata of its chunks
+};
+
+struct iousb_broker_p
+{
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    const iousb_backend_t *backend;
+    void *backend_data;
+    iousb_sched_t *sched;           // attached to every device, shares their links
+    int sock;
+    int epfd;
+    int stop_efd;
+    bool bound;
+    pthread_mutex_t lock;           // the device table, and ecid and pid of its devices
+    broker_device_t *devices[BROKER_MAX_DEVICES];
+    unsigned int ndevices;
+    _Atomic uint64_t clients;
+    _Atomic uint64_t opens;
+    _Atomic uint64_t requests;
+};
+
+typedef struct
+{
+    async_transfer_t *transfer;     // NULL for a synchronous request
+    unsigned char *in;              // IN data is copied back here
+    uint32_t length;
+    bool busy;
+    bool done;
+    transfer_t result;
+} broker_slot_t;
+
+// backend_data of a client attached to a broker
+typedef struct
+{
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    uint64_t ecid;                  // device to ask for, the one last opened once there was one
+    int sock;
+    int sq_efd;
+    int cq_efd;
+    broker_shm_t *shm;
+    uint32_t cq_head;
+    bool lost;                      // the broker went away
+    unsigned int pending;           // async requests not delivered yet
+    broker_slot_t slots[BROKER_RING_SZ];
+} broker_link_t;
+
+RA1NPOC_STATIC_API static uint64_t BrokerNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+RA1NPOC_STATIC_API static int BrokerSend(int sock, const void *buf, size_t len, const int *fds, int nfds)
+{
+    union
+    {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    struct iovec iov;
+    struct msghdr msg;
+    
+    memset(&msg, '\0', sizeof(msg));
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if(nfds)
+    {
+        memset(&control, '\0', sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+}
+
+// the fds that did not come along are -1
+RA1NPOC_STATIC_API static ssize_t BrokerRecv(int sock, void *buf, size_t len, int *fds, int nfds)
+{
+    union
+    {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    struct iovec iov;
+    struct msghdr msg;
+    int received = 0;
+    
+    for(int i = 0; i < nfds; i++)
+    {
+        fds[i] = -1;
+    }
+    memset(&msg, '\0', sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    
+    ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); n >= 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        {
+            continue;
+        }
+        int *passed = (int *)CMSG_DATA(cmsg);
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for(size_t i = 0; i < count; i++)
+        {
+            if(received < nfds)
+            {
+                fds[received++] = passed[i];
+            }
+            else
+            {
+                close(passed[i]);
+            }
+        }
+    }
+    return n;
+}
+
+// ---- client side ----
+
+// $XDG_RUNTIME_DIR is private to the user already; without it the socket
+// goes into a directory of our own that nobody else may enter or plant it in
+RA1NPOC_STATIC_API static int BrokerDefaultPath(char *path, size_t size, bool create)
+{
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    char dir[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    struct stat st;
+    int len;
+    
+    if(runtime && runtime[0] == '/')
+    {
+        snprintf(dir, sizeof(dir), "%s", runtime);
+    }
+    else
+    {
+        snprintf(dir, sizeof(dir), "/tmp/iousb-%u", (unsigned int)geteuid());
+        if(create && mkdir(dir, 0700) != 0 && errno != EEXIST)
+        {
+            ERR("mkdir(%s): %s", dir, strerror(errno));
+            return -1;
+        }
+        // a client only finds out once it connects that there is no broker
+        if(lstat(dir, &st) == 0 ? (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 077)) : create)
+        {
+            ERR("%s is not a directory only we can use", dir);
+            return -1;
+        }
+    }
+    len = snprintf(path, size, "%s/%s", dir, BROKER_DEFAULT_NAME);
+    if(len < 0 || (size_t)len >= size)
+    {
+        ERR("Broker socket path too long: %s/%s", dir, BROKER_DEFAULT_NAME);
+        return -1;
+    }
+    return 0;
+}
+
+RA1NPOC_STATIC_API static int BrokerConnect(const char *path, bool quiet)
+{
+    struct sockaddr_un addr;
+    
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(sock < 0)
+    {
+        ERR("socket: %s", strerror(errno));
+        return -1;
+    }
+    memset(&addr, '\0', sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        if(!quiet)
+        {
+            ERR("connect(%s): %s", path, strerror(errno));
+        }
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+RA1NPOC_STATIC_API static broker_hello_t BrokerHello(uint32_t kind, uint16_t pid, uint64_t ecid)
+{
+    broker_hello_t hello;
+    
+    memset(&hello, '\0', sizeof(broker_hello_t));
+    hello.magic = BROKER_MAGIC;
+    hello.version = BROKER_VERSION;
+    hello.kind = kind;
+    hello.pid = pid;
+    hello.ecid = ecid;
+    return hello;
+}
+
+RA1NPOC_STATIC_API static void BrokerUnlink(broker_link_t *link)
+{
+    if(link->shm)
+    {
+        munmap(link->shm, sizeof(broker_shm_t));
+    }
+    if(link->sock >= 0) close(link->sock);
+    if(link->sq_efd >= 0) close(link->sq_efd);
+    if(link->cq_efd >= 0) close(link->cq_efd);
+    link->shm = NULL;
+    link->sock = link->sq_efd = link->cq_efd = -1;
+    link->lost = false;
+    link->pending = 0;
+    memset(link->slots, '\0', sizeof(link->slots));
+}
+
+// hands out the result of a request, returns 1 if it was an async one
+RA1NPOC_STATIC_API static int BrokerDeliver(broker_link_t *link, broker_slot_t *slot, IOReturn ret, uint32_t wLenDone)
+{
+    if(slot->transfer)
+    {
+        slot->transfer->ret = ret;
+        slot->transfer->wLenDone = wLenDone;
+        slot->busy = false;
+        link->pending--;
+        return 1;
+    }
+    slot->result.ret = ret;
+    slot->result.wLenDone = wLenDone;
+    slot->done = true;
+    return 0;
+}
+
+// nothing that is outstanding will come back
+RA1NPOC_STATIC_API static void BrokerLost(broker_link_t *link)
+{
+    ERR("Lost the connection to the broker");
+    link->lost = true;
+    for(int i = 0; i < BROKER_RING_SZ; i++)
+    {
+        if(link->slots[i].busy && !link->slots[i].done)
+        {
+            BrokerDeliver(link, &link->slots[i], kIOReturnNoDevice, 0);
+        }
+    }
+}
+
+// takes whatever the worker posted without blocking, returns the async requests delivered
+RA1NPOC_STATIC_API static int BrokerReap(broker_link_t *link)
+{
+    int delivered = 0;
+    
+    if(!link->shm)
+    {
+        return 0;
+    }
+    
+    uint32_t tail = atomic_load_explicit(&link->shm->cq_tail, memory_order_acquire);
+    while(link->cq_head != tail)
+    {
+        broker_done_t done = link->shm->cq[link->cq_head++ % BROKER_RING_SZ];
+        if(done.slot >= BROKER_RING_SZ || !link->slots[done.slot].busy || link->slots[done.slot].done)
+        {
+            continue;
+        }
+        
+        broker_slot_t *slot = &link->slots[done.slot];
+        if(slot->in && slot->length)
+        {
+            memcpy(slot->in, link->shm->data[done.slot], done.wLenDone < slot->length ? done.wLenDone : slot->length);
+        }
+        delivered += BrokerDeliver(link, slot, done.ret, done.wLenDone);
+    }
+    return delivered;
+}
+
+// blocks until the worker rings, -1 once the broker is gone
+RA1NPOC_STATIC_API static int BrokerWait(broker_link_t *link)
+{
+    struct pollfd fds[2];
+    uint64_t value;
+    
+    if(link->lost || !link->shm)
+    {
+        return -1;
+    }
+    
+    fds[0].fd = link->cq_efd;
+    fds[0].events = POLLIN;
+    fds[1].fd = link->sock;
+    fds[1].events = POLLRDHUP;
+    for(;;)
+    {
+        if(poll(fds, 2, -1) < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            ERR("poll: %s", strerror(errno));
+            return -1;
+        }
+        if(fds[0].revents & POLLIN)
+        {
+            if(read(link->cq_efd, &value, sizeof(value)) < 0)
+            {
+                ERR("eventfd read: %s", strerror(errno));
+            }
+            return 0;
+        }
+        if(fds[1].revents & (POLLRDHUP | POLLHUP | POLLERR))
+        {
+            BrokerLost(link);
+            return -1;
+        }
+    }
+}
+
+RA1NPOC_STATIC_API static broker_job_t BrokerJob(uint8_t op, const control_request_t *req, uint32_t len, unsigned int timeout)
+{
+    broker_job_t job;
+    
+    memset(&job, '\0', sizeof(broker_job_t));
+    job.op = op;
+    if(req)
+    {
+        job.req = *req;
+    }
+    job.len = len;
+    job.timeout = timeout;
+    return job;
+}
+
+// Queues job with out_len bytes of out as its payload, zeros if out is NULL.
+// Without a transfer it waits for the result and copies up to in_len bytes
+// of IN data to in; with one it returns once the request is queued.
+RA1NPOC_STATIC_API static transfer_t BrokerSubmit(broker_link_t *link,
+                                                  broker_job_t *job,
+                                                  const void *out,
+                                                  uint32_t out_len,
+                                                  unsigned char *in,
+                                                  uint32_t in_len,
+                                                  async_transfer_t *transfer)
+{
+    transfer_t result;
+    int index = -1;
+    
+    result.wLenDone = 0;
+    result.ret = kIOReturnNotOpen;
+    if(!link || !link->shm)
+    {
+        return result;
+    }
+    
+    // every slot is held by an async request, wait for one to land
+    for(;;)
+    {
+        for(int i = 0; i < BROKER_RING_SZ && index < 0; i++)
+        {
+            if(!link->slots[i].busy)
+            {
+                index = i;
+            }
+        }
+        if(index >= 0)
+        {
+            break;
+        }
+        if(!BrokerReap(link) && BrokerWait(link) != 0)
+        {
+            result.ret = kIOReturnNoDevice;
+            return result;
+        }
+    }
+    if(link->lost)
+    {
+        result.ret = kIOReturnNoDevice;
+        return result;
+    }
+    
+    broker_slot_t *slot = &link->slots[index];
+    slot->busy = true;
+    slot->done = false;
+    slot->transfer = transfer;
+    slot->in = in;
+    slot->length = in_len;
+    if(out_len)
+    {
+        if(out)
+        {
+            memcpy(link->shm->data[index], out, out_len);
+        }
+        else
+        {
+            memset(link->shm->data[index], '\0', out_len);
+        }
+    }
+    if(transfer)
+    {
+        transfer->ret = kIOReturnSuccess;
+        transfer->wLenDone = IOUSB_TRANSFER_PENDING;
+        link->pending++;
+    }
+    
+    job->slot = (uint8_t)index;
+    uint32_t tail = atomic_load_explicit(&link->shm->sq_tail, memory_order_relaxed);
+    link->shm->sq[tail % BROKER_RING_SZ] = *job;
+    atomic_store_explicit(&link->shm->sq_tail, tail + 1, memory_order_release);
+    uint64_t one = 1;
+    if(write(link->sq_efd, &one, sizeof(one)) < 0)
+    {
+        // the worker still finds it on its next round
+        ERR("eventfd write: %s", strerror(errno));
+    }
+    
+    if(transfer)
+    {
+        result.ret = kIOReturnSuccess;
+        return result;
+    }
+    
+    while(!slot->done)
+    {
+        BrokerReap(link);
+        if(!slot->done && BrokerWait(link) != 0)
+        {
+            break;
+        }
+    }
+    result = slot->result;
+    slot->busy = false;
+    return result;
+}
+
+RA1NPOC_STATIC_API static void BrokerClose(client_t *client)
+{
+    broker_link_t *link = client->backend_data;
+    if(link)
+    {
+        BrokerUnlink(link);
+    }
+}
+
+RA1NPOC_STATIC_API static int BrokerOpenECID(client_t *client, uint16_t pid, uint64_t ecid)
+{
+    broker_link_t *link = client->backend_data;
+    broker_reply_t reply;
+    int fds[3];
+    
+    if(!link)
+    {
+        return -1;
+    }
+    BrokerUnlink(link);
+    
+    int sock = BrokerConnect(link->path, false);
+    if(sock < 0)
+    {
+        return -1;
+    }
+    broker_hello_t hello = BrokerHello(kBrokerHelloOpen, pid, ecid);
+    if(BrokerSend(sock, &hello, sizeof(hello), NULL, 0) != 0 ||
+       BrokerRecv(sock, &reply, sizeof(reply), fds, 3) != sizeof(reply) ||
+       reply.ret != 0 || fds[0] < 0 || fds[1] < 0 || fds[2] < 0)
+    {
+        for(int i = 0; i < 3; i++)
+        {
+            if(fds[i] >= 0) close(fds[i]);
+        }
+        close(sock);
+        return -1;
+    }
+    
+    broker_shm_t *shm = mmap(NULL, sizeof(broker_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    if(shm == MAP_FAILED || shm->magic != BROKER_MAGIC)
+    {
+        ERR("Broker ring: %s", shm == MAP_FAILED ? strerror(errno) : "bad magic");
+        if(shm != MAP_FAILED) munmap(shm, sizeof(broker_shm_t));
+        close(fds[1]);
+        close(fds[2]);
+        close(sock);
+        return -1;
+    }
+    
+    link->sock = sock;
+    link->sq_efd = fds[1];
+    link->cq_efd = fds[2];
+    link->shm = shm;
+    link->cq_head = atomic_load_explicit(&shm->cq_tail, memory_order_acquire);
+    link->ecid = reply.ecid;
+    
+    client->cpid = reply.cpid;
+    client->cprv = reply.cprv;
+    client->ecid = reply.ecid;
+    client->id = reply.id;
+    client->location = reply.location;
+    client->sn = reply.sn;
+    client->devmode = reply.devmode;
+    client->layout = reply.layout;
+    client->identity = reply.identity;
+    return 0;
+}
+
+RA1NPOC_STATIC_API static int BrokerOpen(client_t *client, uint16_t pid)
+{
+    broker_link_t *link = client->backend_data;
+    return BrokerOpenECID(client, pid, link ? link->ecid : 0);
+}
+
+RA1NPOC_STATIC_API static int BrokerEnumerate(client_t *client, uint16_t pid, usb_device_t *devices, int max)
+{
+    broker_link_t *link = client->backend_data;
+    broker_enumerate_t msg;
+    
+    if(!link)
+    {
+        return -1;
+    }
+    int sock = BrokerConnect(link->path, false);
+    if(sock < 0)
+    {
+        return -1;
+    }
+    
+    broker_hello_t hello = BrokerHello(kBrokerHelloEnumerate, pid, 0);
+    ssize_t n = -1;
+    if(BrokerSend(sock, &hello, sizeof(hello), NULL, 0) == 0)
+    {
+        n = BrokerRecv(sock, &msg, sizeof(msg), NULL, 0);
+    }
+    close(sock);
+    
+    if(n < (ssize_t)sizeof(broker_reply_t) || msg.reply.ret < 0 || msg.reply.ret > BROKER_MAX_ENUMERATE ||
+       (size_t)n < offsetof(broker_enumerate_t, devices) + msg.reply.ret * sizeof(usb_device_t))
+    {
+        return -1;
+    }
+    int count = msg.reply.ret < max ? msg.reply.ret : max;
+    if(count > 0)
+    {
+        memcpy(devices, msg.devices, count * sizeof(usb_device_t));
+    }
+    return count;
+}
+
+RA1NPOC_STATIC_API static int BrokerOpenDevice(client_t *client, const usb_device_t *device)
+{
+    broker_link_t *link = client->backend_data;
+    return BrokerOpenECID(client, device->pid, device->ecid ? device->ecid : (link ? link->ecid : 0));
+}
+
+RA1NPOC_STATIC_API static void BrokerReset(client_t *client, int reset)
+{
+    broker_job_t job = BrokerJob(kBrokerReset, NULL, (uint32_t)reset, 0);
+    BrokerSubmit(client->backend_data, &job, NULL, 0, NULL, 0, NULL);
+}
+
+RA1NPOC_STATIC_API static IOReturn BrokerAbortPipeZero(client_t *client)
+{
+    broker_job_t job = BrokerJob(kBrokerAbort, NULL, 0, 0);
+    return BrokerSubmit(client->backend_data, &job, NULL, 0, NULL, 0, NULL).ret;
+}
+
+RA1NPOC_STATIC_API static transfer_t BrokerControl(client_t *client, uint8_t op, const control_request_t *req, unsigned char *data, async_transfer_t *transfer, unsigned int timeout)
+{
+    broker_job_t job = BrokerJob(op, req, req->w_length, timeout);
+    if(req->bm_request_type & 0x80)
+    {
+        return BrokerSubmit(client->backend_data, &job, NULL, 0, data, data ? req->w_length : 0, transfer);
+    }
+    return BrokerSubmit(client->backend_data, &job, data, req->w_length, NULL, 0, transfer);
+}
+
+RA1NPOC_STATIC_API static transfer_t BrokerControlTransfer(client_t *client, const control_request_t *req, unsigned char *data, unsigned int timeout)
+{
+    return BrokerControl(client, kBrokerControl, req, data, NULL, timeout);
+}
+
+RA1NPOC_STATIC_API static transfer_t BrokerAsyncControlTransfer(client_t *client, const control_request_t *req, unsigned char *data, async_transfer_t *transfer, unsigned int timeout)
+{
+    return BrokerControl(client, kBrokerAsyncControl, req, data, transfer, timeout);
+}
+
+RA1NPOC_STATIC_API static transfer_t BrokerInterfaceControlTransfer(client_t *client, const control_request_t *req, unsigned char *data)
+{
+    return BrokerControl(client, kBrokerInterfaceControl, req, data, NULL, 0);
+}
+
+RA1NPOC_STATIC_API static int BrokerAsyncWait(client_t *client)
+{
+    broker_link_t *link = client->backend_data;
+    if(!link || !link->pending)
+    {
+        return -1;
+    }
+    while(!BrokerReap(link))
+    {
+        if(BrokerWait(link) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+RA1NPOC_STATIC_API static int BrokerAsyncPoll(client_t *client)
+{
+    broker_link_t *link = client->backend_data;
+    if(!link || !link->shm)
+    {
+        return 0;
+    }
+    
+    int count = BrokerReap(link);
+    if(!count && link->pending)
+    {
+        struct pollfd pfd;
+        pfd.fd = link->sock;
+        pfd.events = POLLRDHUP;
+        if(poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR)))
+        {
+            BrokerLost(link);
+        }
+    }
+    return link->lost ? -1 : count;
+}
+
+RA1NPOC_STATIC_API static uint64_t BrokerAsyncDeadline(client_t *client)
+{
+    broker_link_t *link = client->backend_data;
+    // completions ring an eventfd that polls readable, not the writable usbfs fds a completion queue waits on
+    return (link && link->pending) ? BrokerNow() + BROKER_POLL_INTERVAL : 0;
+}
+
+RA1NPOC_STATIC_API static transfer_t BrokerBulkUpload(client_t *client, void *data, uint32_t len)
+{
+    transfer_t result;
+    uint32_t offset = 0;
+    
+    result.wLenDone = 0;
+    result.ret = kIOReturnSuccess;
+    
+    // larger uploads go as slot sized transfers, the split IOUSBBulkUploadStream makes
+    do
+    {
+        uint32_t chunk = (len - offset) < BROKER_SLOT_SZ ? (len - offset) : BROKER_SLOT_SZ;
+        broker_job_t job = BrokerJob(kBrokerBulk, NULL, chunk, 0);
+        transfer_t part = BrokerSubmit(client->backend_data, &job, data ? (unsigned char *)data + offset : NULL, chunk, NULL, 0, NULL);
+        result.ret = part.ret;
+        result.wLenDone += part.wLenDone;
+        offset += chunk;
+        if(part.ret != kIOReturnSuccess || part.wLenDone != chunk)
+        {
+            break;
+        }
+    } while(offset < len);
+    
+    return result;
+}
+
+RA1NPOC_STATIC_API static transfer_t BrokerBulkUploadAsync(client_t *client, void *data, uint32_t len, async_transfer_t *transfer)
+{
+    if(len > BROKER_SLOT_SZ)
+    {
+        transfer_t result;
+        ERR("Async bulk transfer of 0x%x bytes does not fit a broker slot", len);
+        result.wLenDone = 0;
+        result.ret = kIOReturnBadArgument;
+        return result;
+    }
+    broker_job_t job = BrokerJob(kBrokerBulkAsync, NULL, len, 0);
+    return BrokerSubmit(client->backend_data, &job, data, len, NULL, 0, transfer);
+}
+
+RA1NPOC_STATIC_API static transfer_t BrokerBulkUploadFd(client_t *client, int fd, uint32_t len)
+{
+    broker_link_t *link = client->backend_data;
+    transfer_t result;
+    uint8_t tag = kBrokerBulkFd;
+    
+    result.wLenDone = 0;
+    result.ret = kIOReturnNotOpen;
+    if(!link || !link->shm)
+    {
+        return result;
+    }
+    
+    // the file goes ahead of the request, the worker picks it up when it gets there
+    if(BrokerSend(link->sock, &tag, sizeof(tag), &fd, 1) != 0)
+    {
+        ERR("sendmsg: %s", strerror(errno));
+        result.ret = kIOReturnError;
+        return result;
+    }
+    broker_job_t job = BrokerJob(kBrokerBulkFd, NULL, len, 0);
+    return BrokerSubmit(link, &job, NULL, 0, NULL, 0, NULL);
+}
+
+const iousb_backend_t iousb_broker_backend =
+{
+    .name                       = "broker",
+    .open                       = BrokerOpen,
+    .enumerate                  = BrokerEnumerate,
+    .open_device                = BrokerOpenDevice,
+    .close                      = BrokerClose,
+    .reset                      = BrokerReset,
+#if defined(__APPLE__)
+    .reenumerate                = kDeviceUSBReEnumerate,    // the broker resets through IOKit
+#endif
+    .abort_pipe_zero            = BrokerAbortPipeZero,
+    .control_transfer           = BrokerControlTransfer,
+    .async_control_transfer     = BrokerAsyncControlTransfer,
+    .async_wait                 = BrokerAsyncWait,
+    .interface_control_transfer = BrokerInterfaceControlTransfer,
+    .bulk_upload                = BrokerBulkUpload,
+    .bulk_upload_async          = BrokerBulkUploadAsync,
+    .async_poll                 = BrokerAsyncPoll,
+    .async_deadline             = BrokerAsyncDeadline,
+    .bulk_upload_fd             = BrokerBulkUploadFd,
+};
+
+RA1NPOC_API int IOUSBBrokerAttach(client_t *client, const char *path, uint64_t ecid)
+{
+    char fallback[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    
+    if(!client)
+    {
+        return -1;
+    }
+    if(!path)
+    {
+        if(BrokerDefaultPath(fallback, sizeof(fallback), false) != 0)
+        {
+            return -1;
+        }
+        path = fallback;
+    }
+    
+    broker_link_t *link = calloc(1, sizeof(broker_link_t));
+    if(!link)
+    {
+        ERR("Out of memory");
+        return -1;
+    }
+    if(strlen(path) >= sizeof(link->path))
+    {
+        ERR("Broker socket path too long: %s", path);
+        free(link);
+        return -1;
+    }
+    snprintf(link->path, sizeof(link->path), "%s", path);
+    link->ecid = ecid;
+    link->sock = link->sq_efd = link->cq_efd = -1;
+    
+    client->backend = &iousb_broker_backend;
+    client->backend_data = link;
+    return 0;
+}
+
+RA1NPOC_API void IOUSBBrokerDetach(client_t *client)
+{
+    if(!client || client->backend != &iousb_broker_backend)
+    {
+        return;
+    }
+    IOUSBClose(client);
+    free(client->backend_data);
+    client->backend = NULL;
+    client->backend_data = NULL;
+}
+
+// ---- broker side ----
+
+RA1NPOC_STATIC_API static void BrokerPost(broker_conn_t *conn, uint8_t slot, transfer_t result)
+{
+    if(conn->broken || atomic_load(&conn->hangup))
+    {
+        return;
+    }
+    
+    broker_shm_t *shm = conn->shm;
+    uint32_t tail = atomic_load_explicit(&shm->cq_tail, memory_order_relaxed);
+    broker_done_t *done = &shm->cq[tail % BROKER_RING_SZ];
+    done->slot = slot;
+    done->ret = result.ret;
+    done->wLenDone = result.wLenDone;
+    atomic_store_explicit(&shm->cq_tail, tail + 1, memory_order_release);
+    
+    uint64_t one = 1;
+    if(write(conn->cq_efd, &one, sizeof(one)) < 0)
+    {
+        ERR("eventfd write: %s", strerror(errno));
+    }
+}
+
+RA1NPOC_STATIC_API static void BrokerRetire(broker_tag_t *tag, transfer_t result)
+{
+    tag->busy = false;
+    tag->conn->inflight--;
+    BrokerPost(tag->conn, tag->slot, result);
+}
+
+// the upload slot a completion belongs to, NULL for a client's request
+RA1NPOC_STATIC_API static async_transfer_t *BrokerUploadSlot(broker_device_t *dev, void *userdata)
+{
+    for(unsigned int i = 0; dev->upload && i < BULK_MAX_DEPTH; i++)
+    {
+        if(userdata == &dev->upload->slots[i].transfer)
+        {
+            return &dev->upload->slots[i].transfer;
+        }
+    }
+    return NULL;
+}
+
+// Ends every session with the device: what was still in flight is reported
+// aborted and the clients get kIOReturnNoDevice until they open it again.
+RA1NPOC_STATIC_API static void BrokerDeviceClose(broker_device_t *dev, int reset)
+{
+    cq_completion_t done[BROKER_RING_SZ];
+    transfer_t aborted;
+    int n;
+    
+    if(!dev->opened)
+    {
+        return;
+    }
+    
+    // what already landed is reported as it is
+    while((n = IOUSBCompletionQueuePoll(dev->cq, done, BROKER_RING_SZ)) > 0)
+    {
+        for(int i = 0; i < n; i++)
+        {
+            if(!BrokerUploadSlot(dev, done[i].userdata))
+            {
+                BrokerRetire(done[i].userdata, done[i].result);
+            }
+        }
+    }
+    IOUSBCompletionQueueRemove(dev->cq, &dev->client);
+    
+    aborted.wLenDone = 0;
+    aborted.ret = kIOReturnAborted;
+    for(broker_conn_t *conn = dev->conns; conn; conn = conn->next)
+    {
+        for(int i = 0; i < BROKER_RING_SZ; i++)
+        {
+            if(conn->tags[i].busy)
+            {
+                BrokerRetire(&conn->tags[i], aborted);
+            }
+        }
+        conn->closed = true;
+    }
+    
+    if(reset)
+    {
+        IOUSBGetBackend(&dev->client)->reset(&dev->client, reset);
+    }
+    IOUSBClose(&dev->client);
+    dev->opened = false;
+}
+
+RA1NPOC_STATIC_API static int BrokerDeviceOpen(broker_device_t *dev, uint16_t pid)
+{
+    usb_device_t devices[BROKER_MAX_ENUMERATE];
+    
+    if(dev->opened)
+    {
+        // the device stays in the mode it was opened in until someone resets it
+        return dev->pid == pid ? 0 : -1;
+    }
+    
+    int count = IOUSBEnumerate(&dev->client, pid, devices, BROKER_MAX_ENUMERATE);
+    for(int i = 0; i < count; i++)
+    {
+        if(dev->ecid && devices[i].ecid != dev->ecid)
+        {
+            continue;
+        }
+        if(IOUSBOpenDevice(&dev->client, &devices[i]) == 0)
+        {
+            pthread_mutex_lock(&dev->broker->lock);
+            dev->ecid = dev->client.ecid ? dev->client.ecid : devices[i].ecid;
+            dev->pid = pid;
+            pthread_mutex_unlock(&dev->broker->lock);
+            dev->opened = true;
+            atomic_fetch_add(&dev->broker->opens, 1);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+RA1NPOC_STATIC_API static void BrokerConnFree(broker_conn_t *conn)
+{
+    if(conn->shm)
+    {
+        munmap(conn->shm, sizeof(broker_shm_t));
+    }
+    if(conn->sock >= 0) close(conn->sock);
+    if(conn->cq_efd >= 0) close(conn->cq_efd);
+    free(conn);
+}
+
+// sets up the ring of a new client and sends it the device, or why not
+RA1NPOC_STATIC_API static void BrokerGreet(broker_device_t *dev, broker_conn_t *conn)
+{
+    broker_reply_t reply;
+    int fds[3];
+    int memfd = -1;
+    
+    memset(&reply, '\0', sizeof(broker_reply_t));
+    reply.ret = -1;
+    
+    if(BrokerDeviceOpen(dev, conn->pid) == 0)
+    {
+        memfd = memfd_create("iousb_broker", MFD_CLOEXEC);
+        conn->cq_efd = eventfd(0, EFD_CLOEXEC);
+        if(memfd >= 0 && conn->cq_efd >= 0 && ftruncate(memfd, sizeof(broker_shm_t)) == 0)
+        {
+            void *shm = mmap(NULL, sizeof(broker_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+            if(shm != MAP_FAILED)
+            {
+                conn->shm = shm;
+                conn->shm->magic = BROKER_MAGIC;
+                reply.ret = 0;
+            }
+        }
+        if(reply.ret)
+        {
+            ERR("Broker ring: %s", strerror(errno));
+        }
+    }
+    
+    if(!reply.ret)
+    {
+        client_t *client = &dev->client;
+        reply.cpid = client->cpid;
+        reply.cprv = client->cprv;
+        reply.ecid = client->ecid;
+        reply.id = client->id;
+        reply.location = client->location;
+        reply.sn = client->sn;
+        reply.devmode = client->devmode;
+        reply.layout = client->layout;
+        reply.identity = client->identity;
+        fds[0] = memfd;
+        fds[1] = IOUSBCompletionQueueFd(dev->cq);
+        fds[2] = conn->cq_efd;
+    }
+    if(BrokerSend(conn->sock, &reply, sizeof(reply), fds, reply.ret ? 0 : 3) != 0 || reply.ret)
+    {
+        conn->broken = true;
+    }
+    if(memfd >= 0)
+    {
+        close(memfd);
+    }
+}
+
+RA1NPOC_STATIC_API static transfer_t BrokerUploadSubmit(void *ctx, client_t *client, void *data, uint32_t len, async_transfer_t *transfer)
+{
+    broker_device_t *dev = (broker_device_t *)ctx;
+    transfer_t result;
+    
+    // the slot's transfer is the userdata, its result is copied there as it lands
+    result.wLenDone = 0;
+    result.ret = IOUSBCompletionQueueSubmitBulk(dev->cq, client, data, len, transfer) ? kIOReturnSuccess : kIOReturnError;
+    return result;
+}
+
+// IOUSBBulkUploadStream with the device's completion queue doing the reaping:
+// the stream submits its chunks through the queue and is pumped as they come
+// back, so chunking, depth and the scheduler are the stream's. Completions of
+// other requests that land meanwhile are posted as usual; the worker is busy
+// with this upload until it is done.
+RA1NPOC_STATIC_API static transfer_t BrokerUploadQueued(broker_device_t *dev, const unsigned char *data, uint32_t len)
+{
+    cq_completion_t done[BROKER_RING_SZ];
+    client_t *client = &dev->client;
+    upload_stream_t stream;
+    upload_opts_t opts;
+    
+    if(!IOUSBGetBackend(client)->bulk_upload_async)
+    {
+        return IOUSBBulkUpload(client, (void *)data, len);
+    }
+    
+    memset(&opts, '\0', sizeof(upload_opts_t));
+    opts.submit = BrokerUploadSubmit;
+    opts.ctx = dev;
+    IOUSBBulkUploadBegin(&stream, client, data, len, &opts);
+    dev->upload = &stream;
+    
+    while(!IOUSBBulkUploadPump(&stream))
+    {
+        if(!stream.inflight)
+        {
+            // held back by the scheduler, no completion is coming to wake us
+            IOUSBSchedBulkWait(client);
+            continue;
+        }
+        
+        int n = IOUSBCompletionQueueWaitAny(dev->cq, done, BROKER_RING_SZ, BROKER_IDLE_TIMEOUT);
+        if(n < 0)
+        {
+            // the chunks point into the caller's mapping, nothing may land there later
+            ERR("Completion queue failed with %u chunks in flight", stream.inflight);
+            BrokerDeviceClose(dev, 0);
+            for(unsigned int i = 0; i < stream.inflight; i++)
+            {
+                if(client->sched)
+                {
+                    IOUSBSchedBulkRelease(client, stream.slots[(stream.head + i) % BULK_MAX_DEPTH].len);
+                }
+            }
+            stream.result.ret = kIOReturnNotResponding;
+            break;
+        }
+        for(int i = 0; i < n; i++)
+        {
+            async_transfer_t *slot = BrokerUploadSlot(dev, done[i].userdata);
+            if(slot)
+            {
+                *slot = done[i].result;
+            }
+            else
+            {
+                BrokerRetire(done[i].userdata, done[i].result);
+            }
+        }
+    }
+    
+    dev->upload = NULL;
+    return stream.result;
+}
+
+RA1NPOC_STATIC_API static transfer_t BrokerUploadFd(broker_device_t *dev, broker_conn_t *conn, uint32_t len)
+{
+    transfer_t result;
+    payload_map_t map;
+    uint8_t tag;
+    int fd;
+    
+    result.wLenDone = 0;
+    result.ret = kIOReturnBadArgument;
+    
+    // sent ahead of the request, so it is already waiting
+    if(BrokerRecv(conn->sock, &tag, sizeof(tag), &fd, 1) != sizeof(tag) || fd < 0)
+    {
+        ERR("Bulk upload came without its file");
+        conn->broken = true;
+        return result;
+    }
+    if(IOUSBMapPayloadFd(fd, &map) == 0 && map.len >= len)
+    {
+        result = BrokerUploadQueued(dev, map.data, len);
+    }
+    IOUSBUnmapPayload(&map);
+    close(fd);
+    return result;
+}
+
+RA1NPOC_STATIC_API static void BrokerExecute(broker_device_t *dev, broker_conn_t *conn, const broker_job_t *job)
+{
+    client_t *client = &dev->client;
+    const iousb_backend_t *backend = IOUSBGetBackend(client);
+    transfer_t result;
+    
+    if(job->slot >= BROKER_RING_SZ || job->op >= BROKER_MAX_OPS || conn->tags[job->slot].busy ||
+       (job->op != kBrokerBulkFd && job->len > BROKER_SLOT_SZ))
+    {
+        ERR("Dropping a client that sent a bad request");
+        conn->broken = true;
+        return;
+    }
+    atomic_fetch_add(&dev->broker->requests, 1);
+    
+    broker_tag_t *tag = &conn->tags[job->slot];
+    unsigned char *data = conn->shm->data[job->slot];
+    unsigned char *setup = job->req.w_length ? data : NULL;
+    
+    result.wLenDone = 0;
+    result.ret = kIOReturnNoDevice;
+    if(!dev->opened || conn->closed)
+    {
+        BrokerPost(conn, job->slot, result);
+        return;
+    }
+    
+    switch(job->op)
+    {
+        case kBrokerControl:
+            result = backend->control_transfer(client, &job->req, setup, job->timeout);
+            break;
+        case kBrokerAsyncControl:
+            if(IOUSBCompletionQueueSubmitControl(dev->cq, client, &job->req, setup, job->timeout, tag))
+            {
+                tag->busy = true;
+                conn->inflight++;
+                return;
+            }
+            result.ret = kIOReturnError;
+            break;
+        case kBrokerInterfaceControl:
+            result = backend->interface_control_transfer(client, &job->req, setup);
+            break;
+        case kBrokerBulk:
+            result = backend->bulk_upload(client, data, job->len);
+            break;
+        case kBrokerBulkAsync:
+            if(!backend->bulk_upload_async)
+            {
+                result.ret = kIOReturnUnsupported;
+                break;
+            }
+            if(IOUSBCompletionQueueSubmitBulk(dev->cq, client, data, job->len, tag))
+            {
+                tag->busy = true;
+                conn->inflight++;
+                return;
+            }
+            result.ret = kIOReturnError;
+            break;
+        case kBrokerBulkFd:
+            result = BrokerUploadFd(dev, conn, job->len);
+            break;
+        case kBrokerAbort:
+            result.ret = backend->abort_pipe_zero(client);
+            break;
+        case kBrokerReset:
+            BrokerDeviceClose(dev, (int)job->len);
+            result.ret = kIOReturnSuccess;
+            break;
+    }
+    BrokerPost(conn, job->slot, result);
+}
+
+RA1NPOC_STATIC_API static void BrokerDrain(broker_device_t *dev, broker_conn_t *conn)
+{
+    if(conn->broken || atomic_load(&conn->hangup))
+    {
+        return;
+    }
+    
+    broker_shm_t *shm = conn->shm;
+    uint32_t tail = atomic_load_explicit(&shm->sq_tail, memory_order_acquire);
+    if(tail - conn->sq_head > BROKER_RING_SZ)
+    {
+        ERR("Dropping a client that overran its ring");
+        conn->broken = true;
+        return;
+    }
+    while(conn->sq_head != tail && !conn->broken)
+    {
+        // the client can still write to it, work on a copy
+        broker_job_t job = shm->sq[conn->sq_head++ % BROKER_RING_SZ];
+        BrokerExecute(dev, conn, &job);
+    }
+}
+
+// frees the clients that hung up once nothing of theirs is in flight
+RA1NPOC_STATIC_API static void BrokerSweep(broker_device_t *dev)
+{
+    for(broker_conn_t **p = &dev->conns; *p;)
+    {
+        broker_conn_t *conn = *p;
+        if(!atomic_load(&conn->hangup))
+        {
+            p = &conn->next;
+            continue;
+        }
+        if(conn->inflight)
+        {
+            // EP0 is all theirs, get the requests back instead of waiting for them
+            bool alone = true;
+            for(broker_conn_t *other = dev->conns; other; other = other->next)
+            {
+                alone = alone && (other == conn || atomic_load(&other->hangup));
+            }
+            if(alone && !conn->aborted && dev->opened)
+            {
+                IOUSBAbortPipeZero(&dev->client);
+                conn->aborted = true;
+            }
+            p = &conn->next;
+            continue;
+        }
+        *p = conn->next;
+        BrokerConnFree(conn);
+    }
+}
+
+RA1NPOC_STATIC_API static void *BrokerWorker(void *arg)
+{
+    broker_device_t *dev = arg;
+    cq_completion_t done[BROKER_RING_SZ];
+    
+    while(!atomic_load(&dev->stop))
+    {
+        pthread_mutex_lock(&dev->lock);
+        broker_conn_t *pending = dev->pending;
+        dev->pending = NULL;
+        pthread_mutex_unlock(&dev->lock);
+        while(pending)
+        {
+            broker_conn_t *conn = pending;
+            pending = conn->next;
+            conn->next = dev->conns;
+            dev->conns = conn;
+            BrokerGreet(dev, conn);
+        }
+        
+        BrokerSweep(dev);
+        for(broker_conn_t *conn = dev->conns; conn; conn = conn->next)
+        {
+            BrokerDrain(dev, conn);
+        }
+        
+        // returns early on a doorbell, IOUSBBrokerRun handing over a client or a hangup
+        int n = IOUSBCompletionQueueWaitAny(dev->cq, done, BROKER_RING_SZ, BROKER_IDLE_TIMEOUT);
+        for(int i = 0; i < n; i++)
+        {
+            BrokerRetire(done[i].userdata, done[i].result);
+        }
+    }
+    
+    BrokerDeviceClose(dev, 0);
+    return NULL;
+}
+
+RA1NPOC_STATIC_API static void BrokerDeviceDestroy(broker_device_t *dev)
+{
+    if(dev->cq)
+    {
+        atomic_store(&dev->stop, true);
+        IOUSBCompletionQueueWake(dev->cq);
+        pthread_join(dev->thread, NULL);
+        IOUSBCompletionQueueDestroy(dev->cq);
+    }
+    
+    broker_conn_t *lists[2] = { dev->conns, dev->pending };
+    for(int i = 0; i < 2; i++)
+    {
+        while(lists[i])
+        {
+            broker_conn_t *conn = lists[i];
+            lists[i] = conn->next;
+            BrokerConnFree(conn);
+        }
+    }
+    IOUSBPoolDestroy(&dev->client);
+    pthread_mutex_destroy(&dev->lock);
+    free(dev);
+}
+
+// takes broker->lock
+RA1NPOC_STATIC_API static broker_device_t *BrokerRoute(iousb_broker_t *broker, const broker_hello_t *hello)
+{
+    broker_device_t *dev = NULL;
+    
+    pthread_mutex_lock(&broker->lock);
+    for(unsigned int i = 0; i < broker->ndevices && !dev; i++)
+    {
+        broker_device_t *d = broker->devices[i];
+        if(hello->ecid ? d->ecid == hello->ecid : d->pid == hello->pid)
+        {
+            dev = d;
+        }
+    }
+    if(!dev && broker->ndevices < BROKER_MAX_DEVICES)
+    {
+        dev = calloc(1, sizeof(broker_device_t));
+        if(dev)
+        {
+            dev->broker = broker;
+            dev->client.backend = broker->backend;
+            dev->client.backend_data = broker->backend_data;
+            IOUSBSchedAttach(&dev->client, broker->sched);
+            dev->ecid = hello->ecid;
+            dev->pid = hello->pid;
+            pthread_mutex_init(&dev->lock, NULL);
+            dev->cq = IOUSBCompletionQueueCreate(0);
+            if(!dev->cq || pthread_create(&dev->thread, NULL, BrokerWorker, dev) != 0)
+            {
+                ERR("Failed to start a broker worker");
+                if(dev->cq)
+                {
+                    IOUSBCompletionQueueDestroy(dev->cq);
+                    dev->cq = NULL;
+                }
+                BrokerDeviceDestroy(dev);
+                dev = NULL;
+            }
+            else
+            {
+                broker->devices[broker->ndevices++] = dev;
+            }
+        }
+    }
+    pthread_mutex_unlock(&broker->lock);
+    return dev;
+}
+
+RA1NPOC_STATIC_API static void BrokerEnumerateReply(iousb_broker_t *broker, int sock, uint16_t pid)
+{
+    broker_enumerate_t msg;
+    client_t scan;
+    
+    memset(&msg, '\0', sizeof(broker_enumerate_t));
+    memset(&scan, '\0', sizeof(client_t));
+    scan.backend = broker->backend;
+    scan.backend_data = broker->backend_data;
+    
+    int count = IOUSBEnumerate(&scan, pid, msg.devices, BROKER_MAX_ENUMERATE);
+    msg.reply.ret = count;
+    BrokerSend(sock, &msg, offsetof(broker_enumerate_t, devices) + (count > 0 ? count : 0) * sizeof(usb_device_t), NULL, 0);
+}
+
+RA1NPOC_STATIC_API static void BrokerAccept(iousb_broker_t *broker)
+{
+    broker_hello_t hello;
+    struct timeval tv;
+    
+    int sock = accept4(broker->sock, NULL, NULL, SOCK_CLOEXEC);
+    if(sock < 0)
+    {
+        ERR("accept: %s", strerror(errno));
+        return;
+    }
+    
+    // the devices are ours, another user gets at them through their own broker
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if(getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 || cred.uid != geteuid())
+    {
+        ERR("Dropping a connection from another user");
+        close(sock);
+        return;
+    }
+    
+    // a client says what it wants right after connecting, the timeout also
+    // keeps a worker from hanging on a file that was promised but never sent
+    tv.tv_sec = 0;
+    tv.tv_usec = BROKER_HELLO_TIMEOUT * 1000;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    ssize_t n = recv(sock, &hello, sizeof(hello), 0);
+    if(n != sizeof(hello) || hello.magic != BROKER_MAGIC || hello.version != BROKER_VERSION)
+    {
+        // a broker starting up probes with a connection that never says anything
+        if(n != 0)
+        {
+            ERR("Dropping a client without a valid hello");
+        }
+        close(sock);
+        return;
+    }
+    if(hello.kind == kBrokerHelloEnumerate)
+    {
+        BrokerEnumerateReply(broker, sock, hello.pid);
+        close(sock);
+        return;
+    }
+    
+    broker_conn_t *conn = calloc(1, sizeof(broker_conn_t));
+    broker_device_t *dev = conn ? BrokerRoute(broker, &hello) : NULL;
+    if(!dev)
+    {
+        broker_reply_t reply;
+        memset(&reply, '\0', sizeof(broker_reply_t));
+        reply.ret = -1;
+        BrokerSend(sock, &reply, sizeof(reply), NULL, 0);
+        close(sock);
+        free(conn);
+        return;
+    }
+    conn->device = dev;
+    conn->sock = sock;
+    conn->cq_efd = -1;
+    conn->pid = hello.pid;
+    for(int i = 0; i < BROKER_RING_SZ; i++)
+    {
+        conn->tags[i].conn = conn;
+        conn->tags[i].slot = (uint8_t)i;
+    }
+    
+    // watched for the hangup only, the worker reads the files sent over it
+    struct epoll_event ev =
+    {
+        .events   = EPOLLRDHUP,
+        .data.ptr = conn,
+    };
+    if(epoll_ctl(broker->epfd, EPOLL_CTL_ADD, sock, &ev) != 0)
+    {
+        ERR("epoll_ctl: %s", strerror(errno));
+        close(sock);
+        free(conn);
+        return;
+    }
+    
+    pthread_mutex_lock(&dev->lock);
+    conn->next = dev->pending;
+    dev->pending = conn;
+    pthread_mutex_unlock(&dev->lock);
+    IOUSBCompletionQueueWake(dev->cq);
+    atomic_fetch_add(&broker->clients, 1);
+}
+
+RA1NPOC_API iousb_broker_t *IOUSBBrokerCreate(const char *path, const client_t *tmpl)
+{
+    char fallback[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    struct sockaddr_un addr;
+    
+    if(!path)
+    {
+        if(BrokerDefaultPath(fallback, sizeof(fallback), true) != 0)
+        {
+            return NULL;
+        }
+        path = fallback;
+    }
+    iousb_broker_t *broker = calloc(1, sizeof(iousb_broker_t));
+    if(!broker)
+    {
+        ERR("Out of memory");
+        return NULL;
+    }
+    broker->sock = broker->epfd = broker->stop_efd = -1;
+    pthread_mutex_init(&broker->lock, NULL);
+    if(strlen(path) >= sizeof(broker->path))
+    {
+        ERR("Broker socket path too long: %s", path);
+        IOUSBBrokerDestroy(broker);
+        return NULL;
+    }
+    snprintf(broker->path, sizeof(broker->path), "%s", path);
+    if(tmpl)
+    {
+        broker->backend = tmpl->backend;
+        broker->backend_data = tmpl->backend_data;
+        broker->sched = tmpl->sched;
+    }
+    
+    // a broker that died leaves its socket behind, a live one answers on it
+    int probe = BrokerConnect(path, true);
+    if(probe >= 0)
+    {
+        ERR("A broker is already listening on %s", path);
+        close(probe);
+        IOUSBBrokerDestroy(broker);
+        return NULL;
+    }
+    unlink(path);
+    
+    broker->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    broker->epfd = epoll_create1(EPOLL_CLOEXEC);
+    broker->stop_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(broker->sock < 0 || broker->epfd < 0 || broker->stop_efd < 0)
+    {
+        ERR("socket/epoll/eventfd: %s", strerror(errno));
+        IOUSBBrokerDestroy(broker);
+        return NULL;
+    }
+    
+    memset(&addr, '\0', sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if(bind(broker->sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        ERR("bind(%s): %s", path, strerror(errno));
+        IOUSBBrokerDestroy(broker);
+        return NULL;
+    }
+    broker->bound = true;
+    // connections from other users are refused in BrokerAccept as well
+    if(chmod(path, 0600) != 0 || listen(broker->sock, SOMAXCONN) != 0)
+    {
+        ERR("listen(%s): %s", path, strerror(errno));
+        IOUSBBrokerDestroy(broker);
+        return NULL;
+    }
+    
+    struct epoll_event ev =
+    {
+        .events   = EPOLLIN,
+        .data.ptr = &broker->sock,
+    };
+    epoll_ctl(broker->epfd, EPOLL_CTL_ADD, broker->sock, &ev);
+    ev.data.ptr = &broker->stop_efd;
+    epoll_ctl(broker->epfd, EPOLL_CTL_ADD, broker->stop_efd, &ev);
+    return broker;
+}
+
+RA1NPOC_API int IOUSBBrokerRun(iousb_broker_t *broker)
+{
+    struct epoll_event events[BROKER_MAX_EVENTS];
+    uint64_t value;
+    
+    if(!broker)
+    {
+        return -1;
+    }
+    
+    for(;;)
+    {
+        int n = epoll_wait(broker->epfd, events, BROKER_MAX_EVENTS, -1);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            ERR("epoll_wait: %s", strerror(errno));
+            return -1;
+        }
+        for(int i = 0; i < n; i++)
+        {
+            void *ptr = events[i].data.ptr;
+            if(ptr == &broker->stop_efd)
+            {
+                while(read(broker->stop_efd, &value, sizeof(value)) > 0);
+                return 0;
+            }
+            if(ptr == &broker->sock)
+            {
+                BrokerAccept(broker);
+                continue;
+            }
+            
+            // the worker frees the connection once it sees the hangup, so let go of it first
+            broker_conn_t *conn = ptr;
+            epoll_ctl(broker->epfd, EPOLL_CTL_DEL, conn->sock, NULL);
+            atomic_store(&conn->hangup, true);
+            IOUSBCompletionQueueWake(conn->device->cq);
+        }
+    }
+}
+
+RA1NPOC_API void IOUSBBrokerStop(iousb_broker_t *broker)
+{
+    uint64_t one = 1;
+    if(broker && write(broker->stop_efd, &one, sizeof(one)) < 0)
+    {
+        // nothing to report from a signal handler
+    }
+}
+
+RA1NPOC_API void IOUSBBrokerDestroy(iousb_broker_t *broker)
+{
+    if(!broker)
+    {
+        return;
+    }
+    for(unsigned int i = 0; i < broker->ndevices; i++)
+    {
+        BrokerDeviceDestroy(broker->devices[i]);
+    }
+    if(broker->sock >= 0) close(broker->sock);
+    if(broker->epfd >= 0) close(broker->epfd);
+    if(broker->stop_efd >= 0) close(broker->stop_efd);
+    if(broker->bound)
+    {
+        unlink(broker->path);
+    }
+    pthread_mutex_destroy(&broker->lock);
+    free(broker);
+}
+
+RA1NPOC_API void IOUSBBrokerGetStats(iousb_broker_t *broker, broker_stats_t *stats)
+{
+    memset(stats, '\0', sizeof(broker_stats_t));
+    if(!broker)
+    {
+        return;
+    }
+    pthread_mutex_lock(&broker->lock);
+    stats->devices = broker->ndevices;
+    pthread_mutex_unlock(&broker->lock);
+    stats->clients = atomic_load(&broker->clients);
+    stats->opens = atomic_load(&broker->opens);
+    stats->requests = atomic_load(&broker->requests);
+}
+
+#else
+
+RA1NPOC_API iousb_broker_t *IOUSBBrokerCreate(const char *path, const client_t *tmpl)
+{
+    (void)path;
+    (void)tmpl;
+    ERR("The broker needs Linux");
+    return NULL;
+}
+
+RA1NPOC_API int IOUSBBrokerRun(iousb_broker_t *broker)
+{
+    (void)broker;
+    return -1;
+}
+
+RA1NPOC_API void IOUSBBrokerStop(iousb_broker_t *broker)
+{
+    (void)broker;
+}
+
+RA1NPOC_API void IOUSBBrokerDestroy(iousb_broker_t *broker)
+{
+    (void)broker;
+}
+
+RA1NPOC_API void IOUSBBrokerGetStats(iousb_broker_t *broker, broker_stats_t *stats)
+{
+    (void)broker;
+    memset(stats, '\0', sizeof(broker_stats_t));
+}
+
+RA1NPOC_API int IOUSBBrokerAttach(client_t *client, const char *path, uint64_t ecid)
+{
+    (void)client;
+    (void)path;
+    (void)ecid;
+    ERR("The broker needs Linux");
+    return -1;
+}
+
+RA1NPOC_API void IOUSBBrokerDetach(client_t *client)
+{
+    (void)client;
+}
+
+#endif
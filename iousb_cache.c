@@ -0,0 +1,529 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include <io/iousb.h>
+#include <io/iousb_cache.h>
+#include <io/iousb_upload.h>
+#include <common/log.h>
+#include <common/common.h>
+
+#define PAYLOAD_CACHE_MAGIC     (0x43504f49)    // 'IOPC'
+#define PAYLOAD_FNV_OFFSET      (0xcbf29ce484222325ULL)
+#define PAYLOAD_FNV_PRIME       (0x100000001b3ULL)
+#define PAYLOAD_CHECKRA1N_NAME  "checkra1n"
+
+// in front of every stored image, the image follows right after it
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t cpid;
+    uint32_t cprv;
+    uint64_t source_hash;
+    uint64_t source_len;
+    uint64_t data_len;
+    char name[PAYLOAD_CACHE_NAME_SZ];
+    uint64_t reserved;
+} cache_header_t;
+
+_Static_assert(sizeof(cache_header_t) == 64, "cache_header_t is part of the store format");
+
+// a checkra1n payload as one image, the stages follow in order
+typedef struct
+{
+    uint64_t callback;
+    uint64_t next;
+    uint64_t stage1_len;
+    uint64_t pongoOS_len;
+    uint64_t stage2_len;
+} checkra1n_header_t;
+
+typedef struct
+{
+    const checkra1n_payload_t *src;
+    checkra1n_build_t build;
+    void *ctx;
+} checkra1n_build_ctx_t;
+
+typedef struct
+{
+    cache_header_t key;             // data_len is that of the image
+    payload_map_t file;             // the whole entry file, unless built in memory only
+    void *built;                    // set when the image could not be stored
+    const unsigned char *data;
+} cache_entry_t;
+
+struct iousb_payload_cache_p
+{
+    char *dir;
+    int dirfd;                      // flocked while a miss is built, -1 without a store
+    pthread_mutex_t lock;
+    unsigned int nentries;
+    cache_entry_t entries[PAYLOAD_CACHE_MAX_ENTRIES];
+};
+
+RA1NPOC_STATIC_API static uint64_t CacheHashUpdate(uint64_t hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for(size_t i = 0; p && i < len; i++)
+    {
+        hash = (hash ^ p[i]) * PAYLOAD_FNV_PRIME;
+    }
+    return hash;
+}
+
+RA1NPOC_API uint64_t IOUSBPayloadHash(const void *data, size_t len)
+{
+    return CacheHashUpdate(PAYLOAD_FNV_OFFSET, data, len);
+}
+
+RA1NPOC_STATIC_API static bool CacheKeyMatch(const cache_header_t *a, const cache_header_t *b)
+{
+    return a->cpid == b->cpid &&
+           a->cprv == b->cprv &&
+           a->source_hash == b->source_hash &&
+           a->source_len == b->source_len &&
+           !strncmp(a->name, b->name, PAYLOAD_CACHE_NAME_SZ);
+}
+
+// names end up in file names, keep them to [A-Za-z0-9_-]
+RA1NPOC_STATIC_API static bool CacheNameValid(const char *name)
+{
+    size_t len = name ? strlen(name) : 0;
+    if(!len || len >= PAYLOAD_CACHE_NAME_SZ)
+    {
+        return false;
+    }
+    for(size_t i = 0; i < len; i++)
+    {
+        char c = name[i];
+        if(!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-'))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+RA1NPOC_STATIC_API static void CachePath(const iousb_payload_cache_t *cache, const cache_header_t *key, char *path, size_t len)
+{
+    snprintf(path, len, "%s/%s-%04x-%02x-%016llx.bin", cache->dir, key->name, key->cpid, key->cprv, (unsigned long long)key->source_hash);
+}
+
+// Maps the stored entry at path if it holds key. A missing or stale file is
+// not an error, the caller builds it again.
+RA1NPOC_STATIC_API static int CacheLoad(const char *path, const cache_header_t *key, cache_entry_t *entry)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+    {
+        return -1;
+    }
+    int ret = IOUSBMapPayloadFd(fd, &entry->file);
+    close(fd);
+    if(ret != 0)
+    {
+        return -1;
+    }
+    
+    const cache_header_t *header = entry->file.data;
+    if(entry->file.len < sizeof(cache_header_t) ||
+       header->magic != PAYLOAD_CACHE_MAGIC ||
+       header->version != PAYLOAD_CACHE_VERSION ||
+       !CacheKeyMatch(header, key) ||
+       header->data_len != entry->file.len - sizeof(cache_header_t))
+    {
+        DEVLOG("Stale payload cache entry %s", path);
+        IOUSBUnmapPayload(&entry->file);
+        return -1;
+    }
+    
+    entry->key = *header;
+    entry->data = (const unsigned char *)entry->file.data + sizeof(cache_header_t);
+    return 0;
+}
+
+RA1NPOC_STATIC_API static int CacheWrite(int fd, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    while(len)
+    {
+        ssize_t n = write(fd, p, len);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Writes the entry next to path and renames it into place, so a reader
+// either sees the whole entry or none. Processes that still map an older
+// file keep their copy.
+RA1NPOC_STATIC_API static int CacheStore(const iousb_payload_cache_t *cache, const char *path, const cache_header_t *header, const void *data)
+{
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s/.%s.XXXXXX", cache->dir, header->name);
+    
+    int fd = mkstemp(tmp);
+    if(fd < 0)
+    {
+        ERR("mkstemp(%s): %s", tmp, strerror(errno));
+        return -1;
+    }
+    if(CacheWrite(fd, header, sizeof(cache_header_t)) != 0 ||
+       CacheWrite(fd, data, header->data_len) != 0 ||
+       fchmod(fd, 0644) != 0)
+    {
+        ERR("write(%s): %s", tmp, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+    
+    if(rename(tmp, path) != 0)
+    {
+        ERR("rename(%s): %s", path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+RA1NPOC_API iousb_payload_cache_t *IOUSBPayloadCacheOpen(const char *dir)
+{
+    iousb_payload_cache_t *cache = calloc(1, sizeof(iousb_payload_cache_t));
+    if(!cache)
+    {
+        ERR("Out of memory");
+        return NULL;
+    }
+    cache->dirfd = -1;
+    pthread_mutex_init(&cache->lock, NULL);
+    
+    if(!dir)
+    {
+        return cache;
+    }
+    
+    if(mkdir(dir, 0755) != 0 && errno != EEXIST)
+    {
+        ERR("mkdir(%s): %s", dir, strerror(errno));
+        IOUSBPayloadCacheClose(cache);
+        return NULL;
+    }
+    cache->dir = strdup(dir);
+    cache->dirfd = open(dir, O_RDONLY | O_CLOEXEC);
+    if(!cache->dir || cache->dirfd < 0)
+    {
+        ERR("open(%s): %s", dir, strerror(errno));
+        IOUSBPayloadCacheClose(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+RA1NPOC_API void IOUSBPayloadCacheClose(iousb_payload_cache_t *cache)
+{
+    if(!cache)
+    {
+        return;
+    }
+    for(unsigned int i = 0; i < cache->nentries; i++)
+    {
+        IOUSBUnmapPayload(&cache->entries[i].file);
+        free(cache->entries[i].built);
+    }
+    if(cache->dirfd >= 0)
+    {
+        close(cache->dirfd);
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->dir);
+    free(cache);
+}
+
+// Builds key into entry and stores it. Runs with the store flocked, so the
+// first miss of a key builds while every other process waits and then maps
+// what it stored.
+RA1NPOC_STATIC_API static int CacheBuild(iousb_payload_cache_t *cache,
+                                         cache_header_t *key,
+                                         const payload_source_t *src,
+                                         payload_build_t build,
+                                         void *ctx,
+                                         cache_entry_t *entry)
+{
+    char path[PATH_MAX];
+    void *out = NULL;
+    size_t out_len = 0;
+    
+    if(cache->dir)
+    {
+        CachePath(cache, key, path, sizeof(path));
+        if(CacheLoad(path, key, entry) == 0)
+        {
+            return 1;
+        }
+    }
+    
+    if(!build || build(ctx, key->cpid, key->cprv, src->data, src->len, &out, &out_len) != 0)
+    {
+        ERR("Failed to build %s for CPID:%04x CPRV:%02x", key->name, key->cpid, key->cprv);
+        free(out);
+        return -1;
+    }
+    
+    key->magic = PAYLOAD_CACHE_MAGIC;
+    key->version = PAYLOAD_CACHE_VERSION;
+    key->data_len = out_len;
+    
+    if(cache->dir && CacheStore(cache, path, key, out) == 0 && CacheLoad(path, key, entry) == 0)
+    {
+        free(out);
+        return 0;
+    }
+    
+    // without a store the image lives as long as the cache
+    entry->key = *key;
+    entry->built = out;
+    entry->data = out;
+    return 0;
+}
+
+RA1NPOC_API int IOUSBPayloadCacheGet(iousb_payload_cache_t *cache,
+                                     uint32_t cpid,
+                                     uint32_t cprv,
+                                     const char *name,
+                                     const payload_source_t *src,
+                                     payload_build_t build,
+                                     void *ctx,
+                                     payload_map_t *map)
+{
+    cache_header_t key;
+    int ret = -1;
+    
+    if(!cache || !src || !map || !CacheNameValid(name))
+    {
+        return -1;
+    }
+    memset(map, '\0', sizeof(payload_map_t));
+    
+    memset(&key, '\0', sizeof(cache_header_t));
+    key.cpid = cpid;
+    key.cprv = cprv;
+    key.source_len = src->len;
+    key.source_hash = src->hash ? src->hash : IOUSBPayloadHash(src->data, src->len);
+    strncpy(key.name, name, PAYLOAD_CACHE_NAME_SZ - 1);
+    
+    pthread_mutex_lock(&cache->lock);
+    
+    for(unsigned int i = 0; i < cache->nentries; i++)
+    {
+        if(CacheKeyMatch(&cache->entries[i].key, &key))
+        {
+            map->data = (void *)cache->entries[i].data;
+            map->len = cache->entries[i].key.data_len;
+            pthread_mutex_unlock(&cache->lock);
+            return 1;
+        }
+    }
+    
+    if(cache->nentries == PAYLOAD_CACHE_MAX_ENTRIES)
+    {
+        ERR("Payload cache is full");
+        pthread_mutex_unlock(&cache->lock);
+        return -1;
+    }
+    
+    cache_entry_t *entry = &cache->entries[cache->nentries];
+    memset(entry, '\0', sizeof(cache_entry_t));
+    
+    if(cache->dirfd >= 0 && flock(cache->dirfd, LOCK_EX) != 0)
+    {
+        ERR("flock(%s): %s", cache->dir, strerror(errno));
+        pthread_mutex_unlock(&cache->lock);
+        return -1;
+    }
+    ret = CacheBuild(cache, &key, src, build, ctx, entry);
+    if(cache->dirfd >= 0)
+    {
+        flock(cache->dirfd, LOCK_UN);
+    }
+    
+    if(ret >= 0)
+    {
+        cache->nentries++;
+        map->data = (void *)entry->data;
+        map->len = entry->key.data_len;
+    }
+    
+    pthread_mutex_unlock(&cache->lock);
+    return ret;
+}
+
+// Runs the checkra1n builder and lays its output out as one image: the
+// overwrite values and stage lengths, then the stages back to back.
+RA1NPOC_STATIC_API static int CacheBuildCheckra1n(void *ctx, uint32_t cpid, uint32_t cprv, const void *src, size_t src_len, void **out, size_t *out_len)
+{
+    checkra1n_build_ctx_t *build = (checkra1n_build_ctx_t *)ctx;
+    checkra1n_payload_t payload;
+    (void)src;
+    (void)src_len;
+    
+    memset(&payload, '\0', sizeof(checkra1n_payload_t));
+    if(build->build(build->ctx, cpid, cprv, build->src, &payload) != 0)
+    {
+        free(payload.stage1);
+        free(payload.pongoOS);
+        free(payload.stage2);
+        return -1;
+    }
+    
+    checkra1n_header_t header;
+    header.callback = payload.callback;
+    header.next = payload.next;
+    header.stage1_len = payload.stage1_len;
+    header.pongoOS_len = payload.pongoOS_len;
+    header.stage2_len = payload.stage2_len;
+    
+    size_t len = sizeof(checkra1n_header_t) + payload.stage1_len + payload.pongoOS_len + payload.stage2_len;
+    unsigned char *p = malloc(len);
+    if(p)
+    {
+        unsigned char *q = p;
+        memcpy(q, &header, sizeof(checkra1n_header_t));
+        q += sizeof(checkra1n_header_t);
+        memcpy(q, payload.stage1, payload.stage1_len);
+        q += payload.stage1_len;
+        memcpy(q, payload.pongoOS, payload.pongoOS_len);
+        q += payload.pongoOS_len;
+        memcpy(q, payload.stage2, payload.stage2_len);
+    }
+    else
+    {
+        ERR("Out of memory");
+    }
+    
+    free(payload.stage1);
+    free(payload.pongoOS);
+    free(payload.stage2);
+    
+    *out = p;
+    *out_len = len;
+    return p ? 0 : -1;
+}
+
+RA1NPOC_API int IOUSBPayloadCacheGetCheckra1n(iousb_payload_cache_t *cache,
+                                              uint32_t cpid,
+                                              uint32_t cprv,
+                                              const checkra1n_payload_t *src,
+                                              checkra1n_build_t build,
+                                              void *ctx,
+                                              checkra1n_payload_t *out)
+{
+    checkra1n_build_ctx_t build_ctx;
+    payload_source_t source;
+    payload_map_t map;
+    
+    if(!src || !build || !out)
+    {
+        return -1;
+    }
+    memset(out, '\0', sizeof(checkra1n_payload_t));
+    
+    // the lengths go into the hash too, so moving bytes between stages is a new key
+    uint64_t lens[3] = { src->stage1_len, src->pongoOS_len, src->stage2_len };
+    uint64_t hash = CacheHashUpdate(PAYLOAD_FNV_OFFSET, lens, sizeof(lens));
+    hash = CacheHashUpdate(hash, src->stage1, src->stage1_len);
+    hash = CacheHashUpdate(hash, src->pongoOS, src->pongoOS_len);
+    hash = CacheHashUpdate(hash, src->stage2, src->stage2_len);
+    
+    memset(&source, '\0', sizeof(payload_source_t));
+    source.len = src->stage1_len + src->pongoOS_len + src->stage2_len;
+    source.hash = hash ? hash : 1;
+    
+    build_ctx.src = src;
+    build_ctx.build = build;
+    build_ctx.ctx = ctx;
+    
+    int ret = IOUSBPayloadCacheGet(cache, cpid, cprv, PAYLOAD_CHECKRA1N_NAME, &source, CacheBuildCheckra1n, &build_ctx, &map);
+    if(ret < 0)
+    {
+        return -1;
+    }
+    
+    checkra1n_header_t header;
+    if(map.len < sizeof(checkra1n_header_t))
+    {
+        ERR("Cached checkra1n payload for CPID:%04x is truncated", cpid);
+        return -1;
+    }
+    memcpy(&header, map.data, sizeof(checkra1n_header_t));
+    
+    uint64_t left = map.len - sizeof(checkra1n_header_t);
+    if(header.stage1_len > left ||
+       header.pongoOS_len > left - header.stage1_len ||
+       header.stage2_len != left - header.stage1_len - header.pongoOS_len)
+    {
+        ERR("Cached checkra1n payload for CPID:%04x is truncated", cpid);
+        return -1;
+    }
+    
+    unsigned char *p = (unsigned char *)map.data + sizeof(checkra1n_header_t);
+    out->stage1 = header.stage1_len ? p : NULL;
+    out->stage1_len = header.stage1_len;
+    p += header.stage1_len;
+    out->pongoOS = header.pongoOS_len ? p : NULL;
+    out->pongoOS_len = header.pongoOS_len;
+    p += header.pongoOS_len;
+    out->stage2 = header.stage2_len ? p : NULL;
+    out->stage2_len = header.stage2_len;
+    out->callback = header.callback;
+    out->next = header.next;
+    return ret;
+}
+
+RA1NPOC_API int IOUSBPayloadCachePurge(iousb_payload_cache_t *cache)
+{
+    if(!cache || !cache->dir)
+    {
+        return cache ? 0 : -1;
+    }
+    
+    DIR *d = opendir(cache->dir);
+    if(!d)
+    {
+        ERR("opendir(%s): %s", cache->dir, strerror(errno));
+        return -1;
+    }
+    
+    pthread_mutex_lock(&cache->lock);
+    flock(cache->dirfd, LOCK_EX);
+    
+    struct dirent *ent;
+    while((ent = readdir(d)) != NULL)
+    {
+        size_t len = strlen(ent->d_name);
+        if(len > 4 && !strcmp(ent->d_name + len - 4, ".bin"))
+        {
+            unlinkat(cache->dirfd, ent->d_name, 0);
+        }
+    }
+    
+    flock(cache->dirfd, LOCK_UN);
+    pthread_mutex_unlock(&cache->lock);
+    closedir(d);
+    return 0;
+}
@@ -0,0 +1,842 @@
+#include <errno.h>
+#include <pthread.h>
+
+#include <io/iousb.h>
+#include <io/iousb_capture.h>
+#include <common/log.h>
+#include <common/common.h>
+
+#define CAPTURE_FILE_BUF_SZ     (0x100000)
+#define CAPTURE_FNV_OFFSET      (0xcbf29ce484222325ULL)
+#define CAPTURE_FNV_PRIME       (0x100000001b3ULL)
+
+typedef struct
+{
+    async_transfer_t *transfer;
+    unsigned char *data;
+    capture_record_t record;        // the submit
+} capture_inflight_t;
+
+struct iousb_capture_p
+{
+    iousb_backend_t shim;           // the inner backend with the recorded ops swapped out
+    const iousb_backend_t *inner;
+    FILE *fp;
+    unsigned int flags;
+    uint64_t start;
+    uint32_t seq;
+    bool failed;
+    pthread_mutex_t lock;
+    unsigned int ninflight;
+    capture_inflight_t inflight[CAPTURE_MAX_INFLIGHT];
+};
+
+struct capture_reader_p
+{
+    FILE *fp;
+};
+
+typedef struct
+{
+    uint32_t seq;
+    async_transfer_t transfer;
+    unsigned char *data;
+    capture_record_t record;
+} replay_slot_t;
+
+RA1NPOC_STATIC_API static uint64_t CaptureNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+RA1NPOC_STATIC_API static uint64_t CaptureHash(const unsigned char *data, size_t len)
+{
+    uint64_t hash = CAPTURE_FNV_OFFSET;
+    for(size_t i = 0; data && i < len; i++)
+    {
+        hash = (hash ^ data[i]) * CAPTURE_FNV_PRIME;
+    }
+    return hash;
+}
+
+RA1NPOC_STATIC_API static void CapturePut(unsigned char **p, uint64_t value, int bytes)
+{
+    for(int i = 0; i < bytes; i++)
+    {
+        *(*p)++ = (value >> (i * 8)) & 0xff;
+    }
+}
+
+RA1NPOC_STATIC_API static uint64_t CaptureGet(const unsigned char **p, int bytes)
+{
+    uint64_t value = 0;
+    for(int i = 0; i < bytes; i++)
+    {
+        value |= (uint64_t)*(*p)++ << (i * 8);
+    }
+    return value;
+}
+
+RA1NPOC_STATIC_API static void CaptureEncode(const capture_record_t *record, unsigned char *buf)
+{
+    unsigned char *p = buf;
+    CapturePut(&p, record->op, 1);
+    CapturePut(&p, record->flags, 1);
+    CapturePut(&p, record->bm_request_type, 1);
+    CapturePut(&p, record->b_request, 1);
+    CapturePut(&p, record->w_value, 2);
+    CapturePut(&p, record->w_index, 2);
+    CapturePut(&p, record->length, 4);
+    CapturePut(&p, record->seq, 4);
+    CapturePut(&p, (uint32_t)record->ret, 4);
+    CapturePut(&p, record->wLenDone, 4);
+    CapturePut(&p, record->timeout, 4);
+    CapturePut(&p, record->payload_len, 4);
+    CapturePut(&p, record->start, 8);
+    CapturePut(&p, record->end, 8);
+    CapturePut(&p, record->hash, 8);
+}
+
+RA1NPOC_STATIC_API static void CaptureDecode(const unsigned char *buf, capture_record_t *record)
+{
+    const unsigned char *p = buf;
+    record->op = CaptureGet(&p, 1);
+    record->flags = CaptureGet(&p, 1);
+    record->bm_request_type = CaptureGet(&p, 1);
+    record->b_request = CaptureGet(&p, 1);
+    record->w_value = CaptureGet(&p, 2);
+    record->w_index = CaptureGet(&p, 2);
+    record->length = CaptureGet(&p, 4);
+    record->seq = CaptureGet(&p, 4);
+    record->ret = (IOReturn)CaptureGet(&p, 4);
+    record->wLenDone = CaptureGet(&p, 4);
+    record->timeout = CaptureGet(&p, 4);
+    record->payload_len = CaptureGet(&p, 4);
+    record->start = CaptureGet(&p, 8);
+    record->end = CaptureGet(&p, 8);
+    record->hash = CaptureGet(&p, 8);
+}
+
+RA1NPOC_STATIC_API static capture_record_t CaptureRequest(uint8_t op, const control_request_t *req, uint32_t length, unsigned int timeout)
+{
+    capture_record_t record;
+    
+    memset(&record, '\0', sizeof(capture_record_t));
+    record.op = op;
+    if(req)
+    {
+        record.bm_request_type = req->bm_request_type;
+        record.b_request = req->b_request;
+        record.w_value = req->w_value;
+        record.w_index = req->w_index;
+    }
+    record.length = length;
+    record.timeout = timeout;
+    return record;
+}
+
+// bytes of data a finished request carries: what went out, or what came back
+RA1NPOC_STATIC_API static uint32_t CapturePayloadLen(const capture_record_t *record)
+{
+    if(record->op == kCaptureAbort)
+    {
+        return 0;
+    }
+    if(record->bm_request_type & 0x80)
+    {
+        if(record->wLenDone == IOUSB_TRANSFER_PENDING)
+        {
+            return 0;
+        }
+        return record->wLenDone < record->length ? record->wLenDone : record->length;
+    }
+    return record->length;
+}
+
+RA1NPOC_STATIC_API static bool CaptureStores(const iousb_capture_t *capture, const capture_record_t *record)
+{
+    bool bulk = record->op == kCaptureBulk || record->op == kCaptureBulkAsync;
+    if(record->op == kCaptureComplete && !(record->bm_request_type & 0x80))
+    {
+        // OUT payloads were stored with the submit
+        return false;
+    }
+    return (capture->flags & (bulk ? kCaptureBulkData : kCaptureControlData)) != 0;
+}
+
+// Appends record and its payload, and on a successful async submit starts
+// tracking transfer. Takes the capture lock.
+RA1NPOC_STATIC_API static void CaptureWrite(iousb_capture_t *capture, capture_record_t *record, const unsigned char *data, async_transfer_t *transfer)
+{
+    unsigned char buf[CAPTURE_RECORD_SZ];
+    uint32_t len = data ? CapturePayloadLen(record) : 0;
+    
+    record->hash = CaptureHash(data, len);
+    if(len && CaptureStores(capture, record))
+    {
+        record->flags |= kCaptureRecordPayload;
+        record->payload_len = len;
+    }
+    
+    pthread_mutex_lock(&capture->lock);
+    if(record->op != kCaptureComplete)
+    {
+        record->seq = capture->seq++;
+    }
+    if(transfer)
+    {
+        if(capture->ninflight < CAPTURE_MAX_INFLIGHT)
+        {
+            capture_inflight_t *entry = &capture->inflight[capture->ninflight++];
+            entry->transfer = transfer;
+            entry->data = (unsigned char *)data;
+            entry->record = *record;
+        }
+        else
+        {
+            record->flags |= kCaptureRecordLost;
+        }
+    }
+    
+    CaptureEncode(record, buf);
+    if(!capture->failed &&
+       (fwrite(buf, sizeof(buf), 1, capture->fp) != 1 ||
+        (record->payload_len && fwrite(data, record->payload_len, 1, capture->fp) != 1)))
+    {
+        ERR("Failed to write the capture: %s", strerror(errno));
+        capture->failed = true;
+    }
+    pthread_mutex_unlock(&capture->lock);
+}
+
+// Writes a kCaptureComplete for every tracked transfer the backend finished,
+// or with closing for all of them, the unfinished ones as aborted. The
+// transfers are the caller's: they are only looked at from inside a backend
+// call the caller made, where whatever it still has queued must be alive.
+RA1NPOC_STATIC_API static void CaptureReap(iousb_capture_t *capture, bool closing)
+{
+    capture_inflight_t done[CAPTURE_MAX_INFLIGHT];
+    unsigned int count = 0;
+    uint64_t now = CaptureNow() - capture->start;
+    
+    pthread_mutex_lock(&capture->lock);
+    for(unsigned int i = 0; i < capture->ninflight;)
+    {
+        capture_inflight_t *entry = &capture->inflight[i];
+        bool pending = entry->transfer->wLenDone == IOUSB_TRANSFER_PENDING;
+        if(pending && !closing)
+        {
+            i++;
+            continue;
+        }
+        done[count] = *entry;
+        done[count].record.ret = pending ? kIOReturnAborted : entry->transfer->ret;
+        done[count].record.wLenDone = pending ? 0 : entry->transfer->wLenDone;
+        if(pending)
+        {
+            done[count].data = NULL;
+        }
+        count++;
+        *entry = capture->inflight[--capture->ninflight];
+    }
+    pthread_mutex_unlock(&capture->lock);
+    
+    for(unsigned int i = 0; i < count; i++)
+    {
+        capture_record_t *record = &done[i].record;
+        record->op = kCaptureComplete;
+        record->flags = 0;
+        record->payload_len = 0;
+        record->end = now;
+        CaptureWrite(capture, record, (record->bm_request_type & 0x80) ? done[i].data : NULL, NULL);
+    }
+}
+
+RA1NPOC_STATIC_API static IOReturn CaptureAbortPipeZero(client_t *client)
+{
+    iousb_capture_t *capture = client->capture;
+    capture_record_t record = CaptureRequest(kCaptureAbort, NULL, 0, 0);
+    
+    record.start = CaptureNow() - capture->start;
+    record.ret = capture->inner->abort_pipe_zero(client);
+    record.end = CaptureNow() - capture->start;
+    CaptureWrite(capture, &record, NULL, NULL);
+    return record.ret;
+}
+
+RA1NPOC_STATIC_API static transfer_t CaptureControlTransfer(client_t *client, const control_request_t *req, unsigned char *data, unsigned int timeout)
+{
+    iousb_capture_t *capture = client->capture;
+    capture_record_t record = CaptureRequest(kCaptureControl, req, req->w_length, timeout);
+    
+    record.start = CaptureNow() - capture->start;
+    transfer_t result = capture->inner->control_transfer(client, req, data, timeout);
+    record.end = CaptureNow() - capture->start;
+    record.ret = result.ret;
+    record.wLenDone = result.wLenDone;
+    CaptureWrite(capture, &record, data, NULL);
+    return result;
+}
+
+RA1NPOC_STATIC_API static transfer_t CaptureAsyncControlTransfer(client_t *client, const control_request_t *req, unsigned char *data, async_transfer_t *transfer, unsigned int timeout)
+{
+    iousb_capture_t *capture = client->capture;
+    capture_record_t record = CaptureRequest(kCaptureAsyncControl, req, req->w_length, timeout);
+    
+    record.start = CaptureNow() - capture->start;
+    transfer_t result = capture->inner->async_control_transfer(client, req, data, transfer, timeout);
+    record.end = CaptureNow() - capture->start;
+    record.ret = result.ret;
+    record.wLenDone = IOUSB_TRANSFER_PENDING;
+    CaptureWrite(capture, &record, data, result.ret == kIOReturnSuccess ? transfer : NULL);
+    return result;
+}
+
+RA1NPOC_STATIC_API static int CaptureAsyncWait(client_t *client)
+{
+    iousb_capture_t *capture = client->capture;
+    int ret = capture->inner->async_wait(client);
+    CaptureReap(capture, false);
+    return ret;
+}
+
+RA1NPOC_STATIC_API static int CaptureAsyncPoll(client_t *client)
+{
+    iousb_capture_t *capture = client->capture;
+    int ret = capture->inner->async_poll(client);
+    // whatever the count, anything that landed must stop being tracked here
+    CaptureReap(capture, false);
+    return ret;
+}
+
+// nothing lands after the device is closed, so nothing stays tracked past it
+RA1NPOC_STATIC_API static void CaptureClose(client_t *client)
+{
+    iousb_capture_t *capture = client->capture;
+    capture->inner->close(client);
+    CaptureReap(capture, true);
+}
+
+RA1NPOC_STATIC_API static transfer_t CaptureInterfaceControlTransfer(client_t *client, const control_request_t *req, unsigned char *data)
+{
+    iousb_capture_t *capture = client->capture;
+    capture_record_t record = CaptureRequest(kCaptureInterfaceControl, req, req->w_length, 0);
+    
+    record.start = CaptureNow() - capture->start;
+    transfer_t result = capture->inner->interface_control_transfer(client, req, data);
+    record.end = CaptureNow() - capture->start;
+    record.ret = result.ret;
+    record.wLenDone = result.wLenDone;
+    CaptureWrite(capture, &record, data, NULL);
+    return result;
+}
+
+RA1NPOC_STATIC_API static transfer_t CaptureBulkUpload(client_t *client, void *data, uint32_t len)
+{
+    iousb_capture_t *capture = client->capture;
+    capture_record_t record = CaptureRequest(kCaptureBulk, NULL, len, 0);
+    
+    record.start = CaptureNow() - capture->start;
+    transfer_t result = capture->inner->bulk_upload(client, data, len);
+    record.end = CaptureNow() - capture->start;
+    record.ret = result.ret;
+    record.wLenDone = result.wLenDone;
+    CaptureWrite(capture, &record, data, NULL);
+    return result;
+}
+
+RA1NPOC_STATIC_API static transfer_t CaptureBulkUploadAsync(client_t *client, void *data, uint32_t len, async_transfer_t *transfer)
+{
+    iousb_capture_t *capture = client->capture;
+    capture_record_t record = CaptureRequest(kCaptureBulkAsync, NULL, len, 0);
+    
+    record.start = CaptureNow() - capture->start;
+    transfer_t result = capture->inner->bulk_upload_async(client, data, len, transfer);
+    record.end = CaptureNow() - capture->start;
+    record.ret = result.ret;
+    record.wLenDone = IOUSB_TRANSFER_PENDING;
+    CaptureWrite(capture, &record, data, result.ret == kIOReturnSuccess ? transfer : NULL);
+    return result;
+}
+
+RA1NPOC_API int IOUSBCaptureStart(client_t *client, const char *path, unsigned int flags)
+{
+    unsigned char header[CAPTURE_HEADER_SZ];
+    struct timespec ts;
+    
+    if(!client || !path)
+    {
+        return -1;
+    }
+    if(client->capture)
+    {
+        ERR("Client is already being captured");
+        return -1;
+    }
+    
+    iousb_capture_t *capture = calloc(1, sizeof(iousb_capture_t));
+    if(!capture)
+    {
+        ERR("Out of memory");
+        return -1;
+    }
+    capture->fp = fopen(path, "wb");
+    if(!capture->fp)
+    {
+        ERR("open(%s): %s", path, strerror(errno));
+        free(capture);
+        return -1;
+    }
+    setvbuf(capture->fp, NULL, _IOFBF, CAPTURE_FILE_BUF_SZ);
+    pthread_mutex_init(&capture->lock, NULL);
+    capture->flags = flags;
+    capture->inner = IOUSBGetBackend(client);
+    
+    // ops the inner backend leaves out stay out, so callers see the same capabilities
+    capture->shim = *capture->inner;
+    capture->shim.close = CaptureClose;
+    capture->shim.abort_pipe_zero = CaptureAbortPipeZero;
+    capture->shim.control_transfer = CaptureControlTransfer;
+    capture->shim.async_control_transfer = CaptureAsyncControlTransfer;
+    capture->shim.async_wait = CaptureAsyncWait;
+    capture->shim.interface_control_transfer = CaptureInterfaceControlTransfer;
+    capture->shim.bulk_upload = CaptureBulkUpload;
+    if(capture->inner->bulk_upload_async)
+    {
+        capture->shim.bulk_upload_async = CaptureBulkUploadAsync;
+    }
+    if(capture->inner->async_poll)
+    {
+        capture->shim.async_poll = CaptureAsyncPoll;
+    }
+    // files handed to the backend would bypass the recorded bulk path
+    capture->shim.bulk_upload_fd = NULL;
+    
+    clock_gettime(CLOCK_REALTIME, &ts);
+    unsigned char *p = header;
+    memcpy(p, CAPTURE_MAGIC, 8);
+    p += 8;
+    CapturePut(&p, CAPTURE_VERSION, 4);
+    CapturePut(&p, flags, 4);
+    CapturePut(&p, (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec, 8);
+    CapturePut(&p, client->ecid, 8);
+    CapturePut(&p, client->cpid, 4);
+    CapturePut(&p, client->layout.pid, 2);
+    CapturePut(&p, 0, 2);
+    if(fwrite(header, sizeof(header), 1, capture->fp) != 1)
+    {
+        ERR("Failed to write the capture header: %s", strerror(errno));
+        fclose(capture->fp);
+        pthread_mutex_destroy(&capture->lock);
+        free(capture);
+        return -1;
+    }
+    
+    capture->start = CaptureNow();
+    client->capture = capture;
+    client->backend = &capture->shim;
+    return 0;
+}
+
+RA1NPOC_API void IOUSBCaptureStop(client_t *client)
+{
+    iousb_capture_t *capture = client ? client->capture : NULL;
+    if(!capture)
+    {
+        return;
+    }
+    
+    client->backend = capture->inner;
+    client->capture = NULL;
+    if(capture->ninflight)
+    {
+        ERR("Capture stopped with %u transfers in flight", capture->ninflight);
+    }
+    if(fclose(capture->fp) != 0 && !capture->failed)
+    {
+        ERR("Failed to write the capture: %s", strerror(errno));
+    }
+    pthread_mutex_destroy(&capture->lock);
+    free(capture);
+}
+
+RA1NPOC_API capture_reader_t *IOUSBCaptureOpen(const char *path, capture_header_t *header)
+{
+    unsigned char buf[CAPTURE_HEADER_SZ];
+    
+    FILE *fp = fopen(path, "rb");
+    if(!fp)
+    {
+        ERR("open(%s): %s", path, strerror(errno));
+        return NULL;
+    }
+    if(fread(buf, sizeof(buf), 1, fp) != 1 || memcmp(buf, CAPTURE_MAGIC, 8) != 0)
+    {
+        ERR("%s is not a capture", path);
+        fclose(fp);
+        return NULL;
+    }
+    
+    const unsigned char *p = buf + 8;
+    capture_header_t h;
+    h.version = CaptureGet(&p, 4);
+    h.flags = CaptureGet(&p, 4);
+    h.wall = CaptureGet(&p, 8);
+    h.ecid = CaptureGet(&p, 8);
+    h.cpid = CaptureGet(&p, 4);
+    h.pid = CaptureGet(&p, 2);
+    if(h.version != CAPTURE_VERSION)
+    {
+        ERR("%s: unsupported capture version %u", path, h.version);
+        fclose(fp);
+        return NULL;
+    }
+    
+    capture_reader_t *reader = calloc(1, sizeof(capture_reader_t));
+    if(!reader)
+    {
+        fclose(fp);
+        return NULL;
+    }
+    reader->fp = fp;
+    if(header)
+    {
+        *header = h;
+    }
+    return reader;
+}
+
+// the fixed part of the next record, the payload is left for the caller
+RA1NPOC_STATIC_API static int CaptureReadRecord(capture_reader_t *reader, capture_record_t *record)
+{
+    unsigned char buf[CAPTURE_RECORD_SZ];
+    
+    size_t n = fread(buf, 1, sizeof(buf), reader->fp);
+    if(n == 0 && feof(reader->fp))
+    {
+        return 0;
+    }
+    if(n != sizeof(buf))
+    {
+        return -1;
+    }
+    CaptureDecode(buf, record);
+    return record->op < CAPTURE_MAX_OPS ? 1 : -1;
+}
+
+RA1NPOC_API int IOUSBCaptureNext(capture_reader_t *reader, capture_record_t *record, void *payload, size_t len)
+{
+    int ret = CaptureReadRecord(reader, record);
+    if(ret != 1)
+    {
+        return ret;
+    }
+    
+    if(record->payload_len)
+    {
+        size_t copy = payload ? (record->payload_len < len ? record->payload_len : len) : 0;
+        if(copy && fread(payload, copy, 1, reader->fp) != 1)
+        {
+            return -1;
+        }
+        if(record->payload_len > copy && fseeko(reader->fp, record->payload_len - copy, SEEK_CUR) != 0)
+        {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+RA1NPOC_API void IOUSBCaptureClose(capture_reader_t *reader)
+{
+    if(reader)
+    {
+        fclose(reader->fp);
+        free(reader);
+    }
+}
+
+// buffer for a replayed request: the stored payload, or zeros
+RA1NPOC_STATIC_API static unsigned char *ReplayData(const capture_record_t *record, const unsigned char *payload)
+{
+    unsigned char *data = calloc(1, record->length ? record->length : 1);
+    if(data && (record->flags & kCaptureRecordPayload) && !(record->bm_request_type & 0x80))
+    {
+        memcpy(data, payload, record->payload_len < record->length ? record->payload_len : record->length);
+    }
+    return data;
+}
+
+RA1NPOC_STATIC_API static void ReplayReport(capture_replay_t *result, capture_replay_cb_t cb, void *ctx,
+                                            const capture_record_t *recorded, const capture_record_t *replayed)
+{
+    if(replayed->ret != recorded->ret || replayed->wLenDone != recorded->wLenDone)
+    {
+        result->mismatches++;
+    }
+    if(cb)
+    {
+        cb(ctx, recorded, replayed);
+    }
+}
+
+typedef struct
+{
+    replay_slot_t **slots;
+    unsigned int nslots;
+} replay_span_t;
+
+RA1NPOC_STATIC_API static bool ReplayPending(void *ctx)
+{
+    const replay_span_t *span = ctx;
+    for(unsigned int i = 0; i < span->nslots; i++)
+    {
+        if(span->slots[i]->transfer.wLenDone == IOUSB_TRANSFER_PENDING)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The slots are ours to free only once the backend let go of them. A failed
+// wait aborts and drains every submit still out, or closes the device.
+RA1NPOC_STATIC_API static int ReplayDiscard(client_t *client, replay_slot_t **slots, unsigned int nslots)
+{
+    replay_span_t span = { slots, nslots };
+    return IOUSBAsyncDiscard(client, ReplayPending, &span);
+}
+
+RA1NPOC_API int IOUSBCaptureReplay(client_t *client, const char *path, unsigned int flags,
+                                   capture_replay_cb_t cb, void *ctx, capture_replay_t *result)
+{
+    capture_replay_t local;
+    replay_slot_t *slots[CAPTURE_MAX_INFLIGHT];
+    unsigned int nslots = 0;
+    unsigned char *payload = NULL;
+    size_t payload_size = 0;
+    capture_record_t record;
+    uint64_t first = 0;
+    uint64_t last = 0;
+    int ret = 0;
+    int next;
+    
+    if(!result)
+    {
+        result = &local;
+    }
+    memset(result, '\0', sizeof(capture_replay_t));
+    if(!client)
+    {
+        return -1;
+    }
+    
+    capture_reader_t *reader = IOUSBCaptureOpen(path, NULL);
+    if(!reader)
+    {
+        return -1;
+    }
+    const iousb_backend_t *backend = IOUSBGetBackend(client);
+    uint64_t t0 = CaptureNow();
+    
+    while((next = CaptureReadRecord(reader, &record)) == 1)
+    {
+        if(record.payload_len)
+        {
+            if(record.payload_len > payload_size)
+            {
+                unsigned char *grown = realloc(payload, record.payload_len);
+                if(!grown)
+                {
+                    ret = -1;
+                    break;
+                }
+                payload = grown;
+                payload_size = record.payload_len;
+            }
+            if(fread(payload, record.payload_len, 1, reader->fp) != 1)
+            {
+                ret = -1;
+                break;
+            }
+        }
+        
+        result->records++;
+        if(record.op != kCaptureComplete)
+        {
+            if(!result->requests)
+            {
+                first = record.start;
+            }
+            result->requests++;
+            if(!(flags & kReplayMaxSpeed))
+            {
+                uint64_t target = t0 + (record.start - first);
+                uint64_t now = CaptureNow();
+                if(target > now)
+                {
+                    usleep((useconds_t)((target - now) / 1000));
+                }
+            }
+        }
+        last = record.end > last ? record.end : last;
+        
+        capture_record_t replayed = record;
+        control_request_t req =
+        {
+            .bm_request_type = record.bm_request_type,
+            .b_request = record.b_request,
+            .w_value = record.w_value,
+            .w_index = record.w_index,
+            .w_length = (uint16_t)record.length,
+        };
+        replayed.start = CaptureNow() - t0;
+        
+        if(record.op == kCaptureAsyncControl || record.op == kCaptureBulkAsync)
+        {
+            replay_slot_t *slot = calloc(1, sizeof(replay_slot_t));
+            if(!slot || nslots == CAPTURE_MAX_INFLIGHT || !(slot->data = ReplayData(&record, payload)))
+            {
+                free(slot);
+                ret = -1;
+                break;
+            }
+            slot->seq = record.seq;
+            slot->record = record;
+            slot->transfer.ret = kIOReturnSuccess;
+            slot->transfer.wLenDone = IOUSB_TRANSFER_PENDING;
+            transfer_t submit;
+            if(record.op == kCaptureAsyncControl)
+            {
+                submit = backend->async_control_transfer(client, &req, slot->data, &slot->transfer, record.timeout);
+            }
+            else if(backend->bulk_upload_async)
+            {
+                submit = backend->bulk_upload_async(client, slot->data, record.length, &slot->transfer);
+            }
+            else
+            {
+                submit.ret = kIOReturnUnsupported;
+                submit.wLenDone = 0;
+            }
+            replayed.ret = submit.ret;
+            replayed.end = CaptureNow() - t0;
+            if(submit.ret == kIOReturnSuccess)
+            {
+                slots[nslots++] = slot;
+            }
+            else
+            {
+                free(slot->data);
+                free(slot);
+            }
+            ReplayReport(result, cb, ctx, &record, &replayed);
+            continue;
+        }
+        
+        if(record.op == kCaptureComplete)
+        {
+            unsigned int i = 0;
+            while(i < nslots && slots[i]->seq != record.seq)
+            {
+                i++;
+            }
+            if(i == nslots)
+            {
+                // its submit failed on replay, nothing to wait for
+                continue;
+            }
+            replay_slot_t *slot = slots[i];
+            while(slot->transfer.wLenDone == IOUSB_TRANSFER_PENDING)
+            {
+                if(backend->async_wait(client) != 0)
+                {
+                    if(ReplayDiscard(client, slots, nslots) != 0)
+                    {
+                        ret = -1;
+                    }
+                    if(slot->transfer.wLenDone == IOUSB_TRANSFER_PENDING)
+                    {
+                        slot->transfer.ret = kIOReturnNotResponding;
+                        slot->transfer.wLenDone = 0;
+                    }
+                }
+            }
+            replayed.start = slot->record.start;
+            replayed.end = CaptureNow() - t0;
+            replayed.ret = slot->transfer.ret;
+            replayed.wLenDone = slot->transfer.wLenDone;
+            replayed.hash = CaptureHash((record.bm_request_type & 0x80) ? slot->data : NULL, CapturePayloadLen(&replayed));
+            slots[i] = slots[--nslots];
+            free(slot->data);
+            free(slot);
+            ReplayReport(result, cb, ctx, &record, &replayed);
+            if(ret != 0)
+            {
+                // the device was closed under the replay
+                break;
+            }
+            continue;
+        }
+        
+        transfer_t done;
+        memset(&done, '\0', sizeof(transfer_t));
+        unsigned char *data = ReplayData(&record, payload);
+        if(!data)
+        {
+            ret = -1;
+            break;
+        }
+        switch(record.op)
+        {
+            case kCaptureControl:
+                done = backend->control_transfer(client, &req, data, record.timeout);
+                break;
+            case kCaptureInterfaceControl:
+                done = backend->interface_control_transfer(client, &req, data);
+                break;
+            case kCaptureBulk:
+                done = backend->bulk_upload(client, data, record.length);
+                break;
+            case kCaptureAbort:
+                done.ret = backend->abort_pipe_zero(client);
+                break;
+        }
+        replayed.end = CaptureNow() - t0;
+        replayed.ret = done.ret;
+        replayed.wLenDone = done.wLenDone;
+        replayed.hash = CaptureHash(data, CapturePayloadLen(&replayed));
+        free(data);
+        ReplayReport(result, cb, ctx, &record, &replayed);
+    }
+    if(next < 0)
+    {
+        ERR("%s: damaged record %llu", path, (unsigned long long)result->records);
+        ret = -1;
+    }
+    
+    // submits whose completion was never recorded
+    replay_span_t span = { slots, nslots };
+    while(ReplayPending(&span))
+    {
+        if(backend->async_wait(client) != 0)
+        {
+            IOUSBAsyncDiscard(client, ReplayPending, &span);
+            break;
+        }
+    }
+    while(nslots)
+    {
+        replay_slot_t *slot = slots[--nslots];
+        free(slot->data);
+        free(slot);
+    }
+    
+    result->recorded = last > first ? last - first : 0;
+    result->elapsed = CaptureNow() - t0;
+    free(payload);
+    IOUSBCaptureClose(reader);
+    return ret;
+}
@@ -0,0 +1,507 @@
+#include <errno.h>
+#include <stdatomic.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif
+
+#include <io/iousb.h>
+#include <io/iousb_cq.h>
+#include <io/iousb_telemetry.h>
+#include <common/log.h>
+#include <common/common.h>
+
+#define CQ_MAX_EVENTS           (CQ_MAX_CLIENTS + 2)
+#define CQ_EVENT_WAKE           (UINT64_MAX)
+#define CQ_EVENT_TIMER          (UINT64_MAX - 1)
+#define CQ_REMOVE_TIMEOUT       (1000000000ULL)
+
+typedef struct
+{
+    client_t *client;
+    async_transfer_t transfer;
+    void *userdata;
+    uint32_t gen;
+    bool busy;
+} cq_entry_t;
+
+typedef struct
+{
+    client_t *client;
+    int fd;                             // registered with epoll, -1 if none
+    bool dead;                          // reap failed, the device is gone
+} cq_client_t;
+
+struct iousb_cq_p
+{
+    cq_entry_t *entries;
+    unsigned int capacity;
+    unsigned int *free;
+    unsigned int nfree;
+    unsigned int *inflight;
+    unsigned int ninflight;
+    cq_client_t clients[CQ_MAX_CLIENTS];
+    unsigned int nclients;
+    atomic_bool woken;
+#if defined(__linux__)
+    int epfd;
+    int evfd;
+    int tfd;
+#elif defined(__APPLE__)
+    CFRunLoopRef runloop;
+#endif
+};
+
+RA1NPOC_STATIC_API static uint64_t CQNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+RA1NPOC_API iousb_cq_t *IOUSBCompletionQueueCreate(unsigned int capacity)
+{
+    iousb_cq_t *cq = calloc(1, sizeof(iousb_cq_t));
+    if(!cq)
+    {
+        return NULL;
+    }
+    
+    cq->capacity = capacity ? capacity : CQ_DEFAULT_CAPACITY;
+    cq->entries = calloc(cq->capacity, sizeof(cq_entry_t));
+    cq->free = calloc(cq->capacity, sizeof(unsigned int));
+    cq->inflight = calloc(cq->capacity, sizeof(unsigned int));
+#if defined(__linux__)
+    cq->epfd = epoll_create1(EPOLL_CLOEXEC);
+    cq->evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    cq->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if(cq->epfd >= 0 && cq->evfd >= 0 && cq->tfd >= 0)
+    {
+        struct epoll_event ev =
+        {
+            .events   = EPOLLIN,
+            .data.u64 = CQ_EVENT_WAKE,
+        };
+        epoll_ctl(cq->epfd, EPOLL_CTL_ADD, cq->evfd, &ev);
+        ev.data.u64 = CQ_EVENT_TIMER;
+        epoll_ctl(cq->epfd, EPOLL_CTL_ADD, cq->tfd, &ev);
+    }
+    else
+    {
+        ERR("epoll/eventfd/timerfd: %s", strerror(errno));
+        IOUSBCompletionQueueDestroy(cq);
+        return NULL;
+    }
+#elif defined(__APPLE__)
+    cq->runloop = CFRunLoopGetCurrent();
+    CFRetain(cq->runloop);
+#endif
+    if(!cq->entries || !cq->free || !cq->inflight)
+    {
+        ERR("Out of memory");
+        IOUSBCompletionQueueDestroy(cq);
+        return NULL;
+    }
+    
+    for(unsigned int i = 0; i < cq->capacity; i++)
+    {
+        cq->free[i] = cq->capacity - 1 - i;
+    }
+    cq->nfree = cq->capacity;
+    return cq;
+}
+
+RA1NPOC_API void IOUSBCompletionQueueDestroy(iousb_cq_t *cq)
+{
+    if(!cq)
+    {
+        return;
+    }
+    while(cq->nclients)
+    {
+        IOUSBCompletionQueueRemove(cq, cq->clients[0].client);
+    }
+#if defined(__linux__)
+    if(cq->epfd >= 0) close(cq->epfd);
+    if(cq->evfd >= 0) close(cq->evfd);
+    if(cq->tfd >= 0) close(cq->tfd);
+#elif defined(__APPLE__)
+    if(cq->runloop) CFRelease(cq->runloop);
+#endif
+    free(cq->entries);
+    free(cq->free);
+    free(cq->inflight);
+    free(cq);
+}
+
+RA1NPOC_STATIC_API static cq_client_t *CQClient(iousb_cq_t *cq, client_t *client)
+{
+    for(unsigned int i = 0; i < cq->nclients; i++)
+    {
+        if(cq->clients[i].client == client)
+        {
+            return &cq->clients[i];
+        }
+    }
+    if(cq->nclients == CQ_MAX_CLIENTS)
+    {
+        ERR("Completion queue is full of clients");
+        return NULL;
+    }
+    
+    cq_client_t *c = &cq->clients[cq->nclients];
+    c->client = client;
+    c->dead = false;
+    c->fd = IOUSBAsyncFd(client);
+#if defined(__linux__)
+    if(c->fd >= 0)
+    {
+        // level triggered, a reap always drains everything that is ready
+        struct epoll_event ev =
+        {
+            .events   = EPOLLOUT,
+            .data.u64 = (uintptr_t)client,
+        };
+        if(epoll_ctl(cq->epfd, EPOLL_CTL_ADD, c->fd, &ev) != 0)
+        {
+            ERR("epoll_ctl: %s", strerror(errno));
+            return NULL;
+        }
+    }
+#endif
+    cq->nclients++;
+    return c;
+}
+
+RA1NPOC_STATIC_API static void CQBlock(iousb_cq_t *cq, uint64_t until);
+
+RA1NPOC_STATIC_API static bool CQPending(iousb_cq_t *cq, client_t *client)
+{
+    for(unsigned int i = 0; i < cq->ninflight; i++)
+    {
+        cq_entry_t *e = &cq->entries[cq->inflight[i]];
+        if(e->client == client && e->transfer.wLenDone == IOUSB_TRANSFER_PENDING)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+RA1NPOC_STATIC_API static void CQRetire(iousb_cq_t *cq, unsigned int slot)
+{
+    cq->entries[slot].busy = false;
+    cq->free[cq->nfree++] = slot;
+}
+
+RA1NPOC_API void IOUSBCompletionQueueRemove(iousb_cq_t *cq, client_t *client)
+{
+    if(!cq || !client)
+    {
+        return;
+    }
+    for(unsigned int i = 0; i < cq->nclients; i++)
+    {
+        cq_client_t *c = &cq->clients[i];
+        if(c->client != client)
+        {
+            continue;
+        }
+        
+        // the backend writes into our entries, let what is in flight land first
+        if(!c->dead)
+        {
+            uint64_t deadline = CQNow() + CQ_REMOVE_TIMEOUT;
+            IOUSBAbortPipeZero(client);
+            while(CQPending(cq, client) && CQNow() < deadline)
+            {
+                if(IOUSBAsyncPoll(client) < 0)
+                {
+                    break;
+                }
+                if(CQPending(cq, client))
+                {
+                    CQBlock(cq, deadline);
+                }
+            }
+        }
+        for(unsigned int j = 0; j < cq->ninflight;)
+        {
+            unsigned int slot = cq->inflight[j];
+            cq_entry_t *e = &cq->entries[slot];
+            if(e->client != client)
+            {
+                j++;
+                continue;
+            }
+            // a transfer that never landed keeps its slot, it may still be written to
+            if(c->dead || e->transfer.wLenDone != IOUSB_TRANSFER_PENDING)
+            {
+                CQRetire(cq, slot);
+            }
+            cq->inflight[j] = cq->inflight[--cq->ninflight];
+        }
+#if defined(__linux__)
+        if(c->fd >= 0)
+        {
+            epoll_ctl(cq->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        }
+#endif
+        cq->clients[i] = cq->clients[--cq->nclients];
+        return;
+    }
+}
+
+RA1NPOC_STATIC_API static cq_entry_t *CQAlloc(iousb_cq_t *cq, client_t *client, void *userdata, unsigned int *slot)
+{
+    if(!cq->nfree)
+    {
+        ERR("Completion queue is full");
+        return NULL;
+    }
+    if(!CQClient(cq, client))
+    {
+        return NULL;
+    }
+    *slot = cq->free[--cq->nfree];
+    cq_entry_t *e = &cq->entries[*slot];
+    e->client = client;
+    e->userdata = userdata;
+    e->gen++;
+    e->busy = true;
+    e->transfer.ret = kIOReturnSuccess;
+    e->transfer.wLenDone = IOUSB_TRANSFER_PENDING;
+    return e;
+}
+
+RA1NPOC_STATIC_API static cq_handle_t CQSubmitted(iousb_cq_t *cq, unsigned int slot, IOReturn ret)
+{
+    if(ret != kIOReturnSuccess)
+    {
+        CQRetire(cq, slot);
+        return 0;
+    }
+    cq->inflight[cq->ninflight++] = slot;
+    return ((uint64_t)cq->entries[slot].gen << 32) | (slot + 1);
+}
+
+RA1NPOC_API cq_handle_t IOUSBCompletionQueueSubmitControl(iousb_cq_t *cq,
+                                                          client_t *client,
+                                                          const control_request_t *req,
+                                                          unsigned char *data,
+                                                          unsigned int timeout,
+                                                          void *userdata)
+{
+    unsigned int slot;
+    if(!cq || !client || !req)
+    {
+        return 0;
+    }
+    cq_entry_t *e = CQAlloc(cq, client, userdata, &slot);
+    if(!e)
+    {
+        return 0;
+    }
+    
+    uint64_t start = IOUSBTelemetryStart(client);
+    transfer_t result = IOUSBGetBackend(client)->async_control_transfer(client, req, data, &e->transfer, timeout);
+    IOUSBTelemetryRecord(client, kTelemetryAsyncControl, start, result.ret, 0);
+    return CQSubmitted(cq, slot, result.ret);
+}
+
+RA1NPOC_API cq_handle_t IOUSBCompletionQueueSubmitBulk(iousb_cq_t *cq, client_t *client, void *data, uint32_t len, void *userdata)
+{
+    unsigned int slot;
+    if(!cq || !client)
+    {
+        return 0;
+    }
+    cq_entry_t *e = CQAlloc(cq, client, userdata, &slot);
+    if(!e)
+    {
+        return 0;
+    }
+    
+    transfer_t result = IOUSBBulkUploadAsync(client, data, len, &e->transfer);
+    return CQSubmitted(cq, slot, result.ret);
+}
+
+RA1NPOC_API size_t IOUSBCompletionQueueInflight(iousb_cq_t *cq)
+{
+    return cq ? cq->ninflight : 0;
+}
+
+RA1NPOC_STATIC_API static int CQCollect(iousb_cq_t *cq, cq_completion_t *completions, int max)
+{
+    int count = 0;
+    
+    for(unsigned int i = 0; i < cq->ninflight && count < max;)
+    {
+        unsigned int slot = cq->inflight[i];
+        cq_entry_t *e = &cq->entries[slot];
+        if(e->transfer.wLenDone == IOUSB_TRANSFER_PENDING)
+        {
+            i++;
+            continue;
+        }
+        cq_completion_t *c = &completions[count++];
+        c->handle = ((uint64_t)e->gen << 32) | (slot + 1);
+        c->client = e->client;
+        c->result = e->transfer;
+        c->userdata = e->userdata;
+        CQRetire(cq, slot);
+        cq->inflight[i] = cq->inflight[--cq->ninflight];
+    }
+    return count;
+}
+
+RA1NPOC_STATIC_API static void CQFail(iousb_cq_t *cq, client_t *client, IOReturn ret)
+{
+    for(unsigned int i = 0; i < cq->ninflight; i++)
+    {
+        cq_entry_t *e = &cq->entries[cq->inflight[i]];
+        if(e->client == client && e->transfer.wLenDone == IOUSB_TRANSFER_PENDING)
+        {
+            e->transfer.ret = ret;
+            e->transfer.wLenDone = 0;
+        }
+    }
+}
+
+RA1NPOC_STATIC_API static void CQReapAll(iousb_cq_t *cq)
+{
+    for(unsigned int i = 0; i < cq->nclients; i++)
+    {
+        cq_client_t *c = &cq->clients[i];
+        if(!c->dead && IOUSBAsyncPoll(c->client) < 0)
+        {
+            // the device went away under us, nothing it had in flight will land
+            c->dead = true;
+#if defined(__linux__)
+            if(c->fd >= 0)
+            {
+                epoll_ctl(cq->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+            }
+#endif
+        }
+        if(c->dead)
+        {
+            CQFail(cq, c->client, kIOReturnNoDevice);
+        }
+    }
+}
+
+RA1NPOC_API int IOUSBCompletionQueuePoll(iousb_cq_t *cq, cq_completion_t *completions, int max)
+{
+    if(!cq || !completions || max <= 0)
+    {
+        return -1;
+    }
+    CQReapAll(cq);
+    return CQCollect(cq, completions, max);
+}
+
+// blocks until something may be ready, the earliest backend deadline or until
+RA1NPOC_STATIC_API static void CQBlock(iousb_cq_t *cq, uint64_t until)
+{
+    for(unsigned int i = 0; i < cq->nclients; i++)
+    {
+        uint64_t deadline = IOUSBAsyncDeadline(cq->clients[i].client);
+        if(deadline && deadline < until)
+        {
+            until = deadline;
+        }
+    }
+    
+#if defined(__linux__)
+    struct epoll_event events[CQ_MAX_EVENTS];
+    struct itimerspec its;
+    uint64_t value;
+    
+    memset(&its, '\0', sizeof(its));
+    its.it_value.tv_sec = until / 1000000000ULL;
+    its.it_value.tv_nsec = until % 1000000000ULL;
+    if(!its.it_value.tv_sec && !its.it_value.tv_nsec)
+    {
+        its.it_value.tv_nsec = 1;
+    }
+    timerfd_settime(cq->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+    
+    int n = epoll_wait(cq->epfd, events, CQ_MAX_EVENTS, -1);
+    for(int i = 0; i < n; i++)
+    {
+        if(events[i].data.u64 == CQ_EVENT_WAKE)
+        {
+            // whoever wrote it may not have gone through IOUSBCompletionQueueWake
+            while(read(cq->evfd, &value, sizeof(value)) > 0);
+            atomic_store(&cq->woken, true);
+        }
+        else if(events[i].data.u64 == CQ_EVENT_TIMER)
+        {
+            while(read(cq->tfd, &value, sizeof(value)) > 0);
+        }
+    }
+#elif defined(__APPLE__)
+    uint64_t now = CQNow();
+    CFRunLoopRunInMode(kCFRunLoopDefaultMode, until > now ? (until - now) / 1e9 : 0, true);
+#else
+    uint64_t now = CQNow();
+    if(until > now)
+    {
+        usleep((until - now) / 1000);
+    }
+#endif
+}
+
+RA1NPOC_API int IOUSBCompletionQueueWaitAny(iousb_cq_t *cq, cq_completion_t *completions, int max, unsigned int timeout)
+{
+    if(!cq || !completions || max <= 0)
+    {
+        return -1;
+    }
+    
+    uint64_t deadline = CQNow() + (uint64_t)timeout * 1000000ULL;
+    for(;;)
+    {
+        int count = IOUSBCompletionQueuePoll(cq, completions, max);
+        if(count)
+        {
+            return count;
+        }
+        if(atomic_exchange(&cq->woken, false) || CQNow() >= deadline)
+        {
+            return 0;
+        }
+        CQBlock(cq, deadline);
+    }
+}
+
+RA1NPOC_API void IOUSBCompletionQueueWake(iousb_cq_t *cq)
+{
+    if(!cq)
+    {
+        return;
+    }
+    atomic_store(&cq->woken, true);
+#if defined(__linux__)
+    uint64_t one = 1;
+    if(write(cq->evfd, &one, sizeof(one)) < 0)
+    {
+        ERR("eventfd write: %s", strerror(errno));
+    }
+#elif defined(__APPLE__)
+    CFRunLoopWakeUp(cq->runloop);
+#endif
+}
+
+RA1NPOC_API int IOUSBCompletionQueueFd(iousb_cq_t *cq)
+{
+#if defined(__linux__)
+    return cq ? cq->evfd : -1;
+#else
+    (void)cq;
+    return -1;
+#endif
+}
@@ -0,0 +1,756 @@
+#if defined(__APPLE__)
+
+#include <mach/mach.h>
+#include <io/iousb.h>
+#include <common/log.h>
+#include <common/common.h>
+
+static const char *deviceClass = kIOUSBDeviceClassName;
+// completions the run loop of this thread delivered, for IOKitAsyncPoll
+static __thread unsigned int delivered;
+
+RA1NPOC_STATIC_API static void IOUSBAsyncCallBack(void *refcon, IOReturn ret, void *arg0)
+{
+    async_transfer_t* transfer = refcon;
+    
+    if(transfer != NULL)
+    {
+        transfer->ret = ret;
+        memcpy(&transfer->wLenDone, &arg0, sizeof(transfer->wLenDone));
+        delivered++;
+        CFRunLoopStop(CFRunLoopGetCurrent());
+    }
+}
+
+RA1NPOC_STATIC_API static void CFDictionarySet16(CFMutableDictionaryRef dict, const void *key, SInt16 value)
+{
+    CFNumberRef numberRef;
+    numberRef = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt16Type, &value);
+    if(numberRef)
+    {
+        CFDictionarySetValue(dict, key, numberRef);
+        CFRelease(numberRef);
+    }
+}
+
+RA1NPOC_STATIC_API static io_iterator_t IOUSBGetIteratorForPid(uint16_t pid)
+{
+    IOReturn result;
+    io_iterator_t iterator;
+    CFMutableDictionaryRef dict;
+    
+#ifdef IPHONEOS_ARM
+    // Allows iOS to connect to iOS devices. // iOS 9.0 or high
+    deviceClass = "IOUSBHostDevice";
+#endif
+    
+    dict = IOServiceMatching(deviceClass);
+    CFDictionarySet16(dict, CFSTR(kUSBVendorID),  kAppleVendorID);
+    CFDictionarySet16(dict, CFSTR(kUSBProductID), pid);
+    
+    result = IOServiceGetMatchingServices(kIOMasterPortDefault, dict, &iterator);
+    if(result != kIOReturnSuccess)
+    {
+        return IO_OBJECT_NULL;
+    }
+    
+    return iterator;
+}
+
+RA1NPOC_STATIC_API static IOReturn IOKitReEnumerate(client_t *client)
+{
+    if(!client || !client->dev)
+    {
+        return kIOReturnError;
+    }
+    return (*client->dev)->USBDeviceReEnumerate(client->dev, 0);
+}
+
+RA1NPOC_STATIC_API static IOReturn IOKitResetDevice(client_t *client)
+{
+    if(!client || !client->dev)
+    {
+        return kIOReturnError;
+    }
+    return (*client->dev)->ResetDevice(client->dev);
+}
+
+RA1NPOC_STATIC_API static void IOKitReset(client_t *client, int reset)
+{
+    if(reset & kDeviceUSBResetDevice)
+    {
+        IOKitResetDevice(client);
+    }
+    if(reset & kDeviceUSBReEnumerate)
+    {
+        IOKitReEnumerate(client);
+    }
+}
+
+RA1NPOC_STATIC_API static void IOKitClose(client_t *client)
+{
+    if (client->dev)
+    {
+        (*client->dev)->USBDeviceClose(client->dev);
+        (*client->dev)->Release(client->dev);
+        client->dev = NULL;
+    }
+    if (client->handle)
+    {
+        (*client->handle)->USBInterfaceClose(client->handle);
+        (*client->handle)->Release(client->handle);
+        client->handle = NULL;
+    }
+    if(client->async_event_source)
+    {
+        CFRunLoopRemoveSource(CFRunLoopGetCurrent(), client->async_event_source, kCFRunLoopDefaultMode);
+        CFRelease(client->async_event_source);
+        client->async_event_source = NULL;
+    }
+    if(client->async_interface_source)
+    {
+        CFRunLoopRemoveSource(CFRunLoopGetCurrent(), client->async_interface_source, kCFRunLoopDefaultMode);
+        CFRelease(client->async_interface_source);
+        client->async_interface_source = NULL;
+    }
+}
+
+RA1NPOC_STATIC_API static bool IOKitGetSerial(io_service_t usbDev, char *serialstr, size_t len)
+{
+    CFStringRef cfstr = IORegistryEntryCreateCFProperty(usbDev, CFSTR(kUSBSerialNumberString), kCFAllocatorDefault, kNilOptions);
+    if(cfstr == NULL)
+    {
+        return false;
+    }
+    memset(serialstr, '\0', len);
+    CFStringGetCString(cfstr, serialstr, len, kCFStringEncodingUTF8);
+    CFRelease(cfstr);
+    return true;
+}
+
+RA1NPOC_STATIC_API static uint32_t IOKitGetLocation(io_service_t usbDev)
+{
+    uint32_t location = 0;
+    CFNumberRef number = IORegistryEntryCreateCFProperty(usbDev, CFSTR(kUSBDevicePropertyLocationID), kCFAllocatorDefault, kNilOptions);
+    if(number)
+    {
+        CFNumberGetValue(number, kCFNumberSInt32Type, &location);
+        CFRelease(number);
+    }
+    return location;
+}
+
+// records the interface we ended up with and where its bulk pipes are
+RA1NPOC_STATIC_API static void IOKitResolveLayout(client_t *client, uint16_t pid)
+{
+    usb_layout_t *layout = &client->layout;
+    UInt8 count = 0;
+    
+    memset(layout, '\0', sizeof(usb_layout_t));
+    layout->pid = pid;
+    layout->config = 1;
+    (*client->handle)->GetInterfaceNumber(client->handle, &layout->interface);
+    (*client->handle)->GetAlternateSetting(client->handle, &layout->alt_setting);
+    (*client->handle)->GetInterfaceClass(client->handle, &layout->if_class);
+    (*client->handle)->GetInterfaceSubClass(client->handle, &layout->if_subclass);
+    (*client->handle)->GetInterfaceProtocol(client->handle, &layout->if_protocol);
+    (*client->handle)->GetNumEndpoints(client->handle, &count);
+    
+    for(UInt8 pipe = 1; pipe <= count; pipe++)
+    {
+        UInt8 direction, number, type, interval;
+        UInt16 mps;
+        if((*client->handle)->GetPipeProperties(client->handle, pipe, &direction, &number, &type, &mps, &interval) != kIOReturnSuccess ||
+           type != kUSBBulk)
+        {
+            continue;
+        }
+        if(direction == kUSBIn)
+        {
+            layout->bulk_in = 0x80 | number;
+        }
+        else if(!layout->bulk_pipe)
+        {
+            layout->bulk_out = number;
+            layout->bulk_pipe = pipe;
+        }
+    }
+    IOUSBLayoutStore(client, layout);
+}
+
+// opens the first device on the iterator we can seize, consumes the iterator.
+// With a cached layout the configuration is left alone if it is already set
+// and only the known interface is looked up.
+RA1NPOC_STATIC_API static int IOKitOpenIterator(client_t *client, io_iterator_t iterator, uint16_t pid, const usb_layout_t *layout)
+{
+    char serialstr[256];
+    io_service_t usbDev = MACH_PORT_NULL;
+    while((usbDev = IOIteratorNext(iterator)))
+    {
+        uint64_t regID;
+        kern_return_t ret = IORegistryEntryGetRegistryEntryID(usbDev, &regID);
+        if(ret != KERN_SUCCESS)
+        {
+            ERR("IORegistryEntryGetRegistryEntryID: %s", mach_error_string(ret));
+            goto next;
+        }
+        
+        SInt32 score = 0;
+        IOCFPlugInInterface **plugin = NULL;
+        ret = IOCreatePlugInInterfaceForService(usbDev, kIOUSBDeviceUserClientTypeID, kIOCFPlugInInterfaceID, &plugin, &score);
+        if(ret != KERN_SUCCESS)
+        {
+            ERR("IOCreatePlugInInterfaceForService(usbDev): %s", mach_error_string(ret));
+            goto next;
+        }
+        
+        if(!IOKitGetSerial(usbDev, serialstr, sizeof(serialstr)))
+        {
+            ERR("Failed IORegistryEntryCreateCFProperty");
+        }
+        else
+        {
+            IOUSBGetInfo(client, serialstr);
+        }
+        
+        HRESULT result = (*plugin)->QueryInterface(plugin, CFUUIDGetUUIDBytes(kIOUSBDeviceInterfaceID), (LPVOID*)&client->dev);
+        (*plugin)->Release(plugin);
+        if(result != 0)
+        {
+            ERR("QueryInterface(dev): 0x%x", result);
+            goto next;
+        }
+        ret = (*client->dev)->USBDeviceOpenSeize(client->dev);
+        if(ret != KERN_SUCCESS)
+        {
+            ERR("USBDeviceOpenSeize: %s", mach_error_string(ret));
+        }
+        else
+        {
+            UInt8 config = 0;
+            if(layout && (*client->dev)->GetConfiguration(client->dev, &config) == KERN_SUCCESS && config == layout->config)
+            {
+                ret = KERN_SUCCESS;
+            }
+            else
+            {
+                ret = (*client->dev)->SetConfiguration(client->dev, 1);
+            }
+            if(ret != KERN_SUCCESS)
+            {
+                ERR("SetConfiguration: %s", mach_error_string(ret));
+            }
+            else
+            {
+                ret = (*client->dev)->CreateDeviceAsyncEventSource(client->dev, &client->async_event_source);
+                if (ret == kIOReturnSuccess)
+                {
+                    CFRunLoopAddSource(CFRunLoopGetCurrent(), client->async_event_source, kCFRunLoopDefaultMode);
+                }
+                
+                IOUSBFindInterfaceRequest request =
+                {
+                    .bInterfaceClass    = kIOUSBFindInterfaceDontCare,
+                    .bInterfaceSubClass = kIOUSBFindInterfaceDontCare,
+                    .bInterfaceProtocol = kIOUSBFindInterfaceDontCare,
+                    .bAlternateSetting  = kIOUSBFindInterfaceDontCare,
+                };
+                if(layout)
+                {
+                    request.bInterfaceClass    = layout->if_class;
+                    request.bInterfaceSubClass = layout->if_subclass;
+                    request.bInterfaceProtocol = layout->if_protocol;
+                    request.bAlternateSetting  = layout->alt_setting;
+                }
+                io_iterator_t iter = MACH_PORT_NULL;
+                ret = (*client->dev)->CreateInterfaceIterator(client->dev, &request, &iter);
+                if(ret != KERN_SUCCESS)
+                {
+                    ERR("CreateInterfaceIterator: %s", mach_error_string(ret));
+                }
+                else
+                {
+                    io_service_t usbIntf = MACH_PORT_NULL;
+                    while((usbIntf = IOIteratorNext(iter)))
+                    {
+                        ret = IOCreatePlugInInterfaceForService(usbIntf, kIOUSBInterfaceUserClientTypeID, kIOCFPlugInInterfaceID, &plugin, &score);
+                        IOObjectRelease(usbIntf);
+                        if(ret != KERN_SUCCESS)
+                        {
+                            ERR("IOCreatePlugInInterfaceForService(usbIntf): %s", mach_error_string(ret));
+                            continue;
+                        }
+                        result = (*plugin)->QueryInterface(plugin, CFUUIDGetUUIDBytes(kIOUSBInterfaceInterfaceID), (LPVOID*)&client->handle);
+                        (*plugin)->Release(plugin);
+                        if(result != 0)
+                        {
+                            ERR("QueryInterface(intf): 0x%x", result);
+                            continue;
+                        }
+                        
+                        ret = (*client->handle)->USBInterfaceOpen(client->handle);
+                        if(ret != KERN_SUCCESS)
+                        {
+                            ERR("USBInterfaceOpen: %s", mach_error_string(ret));
+                        }
+                        else
+                        {
+                            ret = (*client->handle)->CreateInterfaceAsyncEventSource(client->handle, &client->async_interface_source);
+                            if (ret == kIOReturnSuccess)
+                            {
+                                CFRunLoopAddSource(CFRunLoopGetCurrent(), client->async_interface_source, kCFRunLoopDefaultMode);
+                            }
+                            client->id = regID;
+                            client->location = IOKitGetLocation(usbDev);
+                            if(layout)
+                            {
+                                client->layout = *layout;
+                            }
+                            else
+                            {
+                                IOKitResolveLayout(client, pid);
+                            }
+                            while((usbIntf = IOIteratorNext(iter))) IOObjectRelease(usbIntf);
+                            IOObjectRelease(iter);
+                            IOObjectRelease(usbDev);
+                            while((usbDev = IOIteratorNext(iterator))) IOObjectRelease(usbDev);
+                            IOObjectRelease(iterator);
+                            return 0;
+                        }
+                        (*client->handle)->Release(client->handle);
+                        client->handle = NULL;
+                    }
+                    IOObjectRelease(iter);
+                }
+                if(client->async_event_source) {
+                    CFRunLoopRemoveSource(CFRunLoopGetCurrent(), client->async_event_source, kCFRunLoopDefaultMode);
+                    CFRelease(client->async_event_source);
+                    client->async_event_source = NULL;
+                }
+            }
+        }
+        
+    next:;
+        if(client->dev)
+        {
+            (*client->dev)->USBDeviceClose(client->dev);
+            (*client->dev)->Release(client->dev);
+            client->dev = NULL;
+        }
+        IOObjectRelease(usbDev);
+    }
+    IOObjectRelease(iterator);
+    
+    return -1;
+}
+
+RA1NPOC_STATIC_API static int IOKitOpen(client_t *client, uint16_t pid)
+{
+    io_iterator_t iterator;
+    
+    iterator = IOUSBGetIteratorForPid(pid);
+    
+    if (iterator == IO_OBJECT_NULL)
+    {
+        // not found
+        // DEVLOG("Failed IOServiceGetMatchingServices");
+        return -1;
+    }
+    
+    return IOKitOpenIterator(client, iterator, pid, NULL);
+}
+
+RA1NPOC_STATIC_API static int IOKitEnumerate(client_t *client, uint16_t pid, usb_device_t *devices, int max)
+{
+    io_iterator_t iterator;
+    io_service_t usbDev;
+    int count = 0;
+    (void)client;
+    
+    iterator = IOUSBGetIteratorForPid(pid);
+    if (iterator == IO_OBJECT_NULL)
+    {
+        return -1;
+    }
+    
+    while((usbDev = IOIteratorNext(iterator)))
+    {
+        if(count < max)
+        {
+            usb_device_t *device = &devices[count];
+            memset(device, '\0', sizeof(usb_device_t));
+            if(IORegistryEntryGetRegistryEntryID(usbDev, &device->id) == KERN_SUCCESS)
+            {
+                device->pid = pid;
+                device->location = IOKitGetLocation(usbDev);
+                if(IOKitGetSerial(usbDev, device->serial, sizeof(device->serial)))
+                {
+                    device->ecid = IOUSBParseECID(device->serial);
+                }
+                count++;
+            }
+        }
+        IOObjectRelease(usbDev);
+    }
+    IOObjectRelease(iterator);
+    
+    return count;
+}
+
+RA1NPOC_STATIC_API static int IOKitOpenDevice(client_t *client, const usb_device_t *device)
+{
+    const usb_layout_t *layout = IOUSBLayoutLookup(client, device->pid);
+    
+    for(;;)
+    {
+        io_iterator_t iterator = IO_OBJECT_NULL;
+        CFMutableDictionaryRef dict = IORegistryEntryIDMatching(device->id);
+        if(!dict || IOServiceGetMatchingServices(kIOMasterPortDefault, dict, &iterator) != kIOReturnSuccess)
+        {
+            return -1;
+        }
+        if(!IOKitOpenIterator(client, iterator, device->pid, layout))
+        {
+            return 0;
+        }
+        if(!layout)
+        {
+            return -1;
+        }
+        // stale layout, go through full discovery once
+        layout = NULL;
+    }
+}
+
+RA1NPOC_STATIC_API static IOReturn IOKitAbortPipeZero(client_t *client)
+{
+    if(!client->dev) return kIOReturnError;
+    return (*client->dev)->USBDeviceAbortPipeZero(client->dev);
+}
+
+RA1NPOC_STATIC_API static transfer_t IOKitControlTransfer(client_t *client,
+                                                          const control_request_t *request,
+                                                          unsigned char *data,
+                                                          unsigned int timeout)
+{
+    transfer_t result;
+    
+    memset(&result, '\0', sizeof(transfer_t));
+    
+    if(timeout == IOUSB_NO_TIMEOUT)
+    {
+        IOUSBDevRequest req;
+        memset(&req, '\0', sizeof(req));
+        
+        req.bmRequestType     = request->bm_request_type;
+        req.bRequest          = request->b_request;
+        req.wValue            = OSSwapLittleToHostInt16(request->w_value);
+        req.wIndex            = OSSwapLittleToHostInt16(request->w_index);
+        req.wLength           = OSSwapLittleToHostInt16(request->w_length);
+        req.pData             = data;
+        
+        result.ret = (*client->dev)->DeviceRequest(client->dev, &req);
+        result.wLenDone = req.wLenDone;
+    }
+    else
+    {
+        IOUSBDevRequestTO req;
+        memset(&req, '\0', sizeof(req));
+        
+        req.bmRequestType     = request->bm_request_type;
+        req.bRequest          = request->b_request;
+        req.wValue            = OSSwapLittleToHostInt16(request->w_value);
+        req.wIndex            = OSSwapLittleToHostInt16(request->w_index);
+        req.wLength           = OSSwapLittleToHostInt16(request->w_length);
+        req.pData             = data;
+        req.noDataTimeout     = timeout;
+        req.completionTimeout = timeout;
+        
+        result.ret = (*client->dev)->DeviceRequestTO(client->dev, &req);
+        result.wLenDone = req.wLenDone;
+    }
+    
+    return result;
+}
+
+RA1NPOC_STATIC_API static transfer_t IOKitAsyncControlTransfer(client_t *client,
+                                                               const control_request_t *request,
+                                                               unsigned char *data,
+                                                               async_transfer_t *transfer,
+                                                               unsigned int timeout)
+{
+    transfer_t result;
+    
+    memset(&result, '\0', sizeof(transfer_t));
+    
+    if(timeout == IOUSB_NO_TIMEOUT)
+    {
+        IOUSBDevRequest req;
+        memset(&req, '\0', sizeof(req));
+        
+        req.bmRequestType     = request->bm_request_type;
+        req.bRequest          = request->b_request;
+        req.wValue            = OSSwapLittleToHostInt16(request->w_value);
+        req.wIndex            = OSSwapLittleToHostInt16(request->w_index);
+        req.wLength           = OSSwapLittleToHostInt16(request->w_length);
+        req.pData             = data;
+        
+        result.ret = (*client->dev)->DeviceRequestAsync(client->dev, &req, IOUSBAsyncCallBack, transfer);
+        result.wLenDone = req.wLenDone;
+    }
+    else
+    {
+        IOUSBDevRequestTO req;
+        memset(&req, '\0', sizeof(req));
+        
+        req.bmRequestType     = request->bm_request_type;
+        req.bRequest          = request->b_request;
+        req.wValue            = OSSwapLittleToHostInt16(request->w_value);
+        req.wIndex            = OSSwapLittleToHostInt16(request->w_index);
+        req.wLength           = OSSwapLittleToHostInt16(request->w_length);
+        req.pData             = data;
+        req.completionTimeout = timeout;
+        
+        result.ret = (*client->dev)->DeviceRequestAsyncTO(client->dev, &req, IOUSBAsyncCallBack, transfer);
+        result.wLenDone = req.wLenDone;
+    }
+    
+    return result;
+}
+
+RA1NPOC_STATIC_API static int IOKitAsyncWait(client_t *client)
+{
+    if(!client->async_event_source && !client->async_interface_source) return -1;
+    CFRunLoopRun();
+    return 0;
+}
+
+RA1NPOC_STATIC_API static transfer_t IOKitInterfaceControlTransfer(client_t *client,
+                                                                   const control_request_t *request,
+                                                                   unsigned char *data)
+{
+    transfer_t result;
+    IOUSBDevRequest req;
+    
+    memset(&result, '\0', sizeof(transfer_t));
+    memset(&req, '\0', sizeof(req));
+    
+    req.bmRequestType     = request->bm_request_type;
+    req.bRequest          = request->b_request;
+    req.wValue            = OSSwapLittleToHostInt16(request->w_value);
+    req.wIndex            = OSSwapLittleToHostInt16(request->w_index);
+    req.wLength           = OSSwapLittleToHostInt16(request->w_length);
+    req.pData             = data;
+    
+    result.ret = (*client->handle)->ControlRequest(client->handle, 0, &req);
+    result.wLenDone = req.wLenDone;
+    
+    return result;
+}
+
+RA1NPOC_STATIC_API static transfer_t IOKitBulkUpload(client_t *client, void *data, uint32_t len)
+{
+    transfer_t result;
+    result.ret = (*client->handle)->WritePipe(client->handle, client->layout.bulk_pipe ? client->layout.bulk_pipe : 2, data, len);
+    // WritePipe only returns once all of it went out
+    result.wLenDone = result.ret == kIOReturnSuccess ? len : 0;
+    
+    return result;
+}
+
+RA1NPOC_STATIC_API static transfer_t IOKitBulkUploadAsync(client_t *client, void *data, uint32_t len, async_transfer_t *transfer)
+{
+    transfer_t result;
+    
+    memset(&result, '\0', sizeof(transfer_t));
+    
+    if(!client->async_interface_source)
+    {
+        result.ret = kIOReturnNotOpen;
+        return result;
+    }
+    result.ret = (*client->handle)->WritePipeAsync(client->handle, client->layout.bulk_pipe ? client->layout.bulk_pipe : 2, data, len, IOUSBAsyncCallBack, transfer);
+    
+    return result;
+}
+
+// completions are delivered by run loop callbacks on this thread, give them
+// one pass and count what landed
+RA1NPOC_STATIC_API static int IOKitAsyncPoll(client_t *client)
+{
+    (void)client;
+    delivered = 0;
+    CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0, false);
+    return (int)delivered;
+}
+
+#define IOKIT_MAX_EVENTS    (32)
+
+typedef struct
+{
+    IONotificationPortRef port;
+    io_iterator_t arrived;
+    io_iterator_t removed;
+    hotplug_event_t events[IOKIT_MAX_EVENTS];
+    unsigned int head;
+    unsigned int count;
+} iokit_monitor_t;
+
+RA1NPOC_STATIC_API static void IOKitMonitorDrain(iokit_monitor_t *monitor, io_iterator_t iterator, int type)
+{
+    io_service_t usbDev;
+    while((usbDev = IOIteratorNext(iterator)))
+    {
+        // the queue is only a wakeup hint, drop the oldest rather than block the callback
+        if(monitor->count == IOKIT_MAX_EVENTS)
+        {
+            monitor->head = (monitor->head + 1) % IOKIT_MAX_EVENTS;
+            monitor->count--;
+        }
+        hotplug_event_t *event = &monitor->events[(monitor->head + monitor->count) % IOKIT_MAX_EVENTS];
+        memset(event, '\0', sizeof(hotplug_event_t));
+        event->type = type;
+        IORegistryEntryGetRegistryEntryID(usbDev, &event->device.id);
+        event->device.location = IOKitGetLocation(usbDev);
+        
+        CFNumberRef number = IORegistryEntryCreateCFProperty(usbDev, CFSTR(kUSBProductID), kCFAllocatorDefault, kNilOptions);
+        if(number)
+        {
+            CFNumberGetValue(number, kCFNumberSInt16Type, &event->device.pid);
+            CFRelease(number);
+        }
+        if(IOKitGetSerial(usbDev, event->device.serial, sizeof(event->device.serial)))
+        {
+            event->device.ecid = IOUSBParseECID(event->device.serial);
+        }
+        monitor->count++;
+        IOObjectRelease(usbDev);
+    }
+}
+
+RA1NPOC_STATIC_API static void IOKitDeviceArrived(void *refcon, io_iterator_t iterator)
+{
+    IOKitMonitorDrain(refcon, iterator, kUSBDeviceArrived);
+}
+
+RA1NPOC_STATIC_API static void IOKitDeviceRemoved(void *refcon, io_iterator_t iterator)
+{
+    IOKitMonitorDrain(refcon, iterator, kUSBDeviceRemoved);
+}
+
+RA1NPOC_STATIC_API static void IOKitMonitorClose(client_t *client, void *handle)
+{
+    iokit_monitor_t *monitor = handle;
+    (void)client;
+    
+    if(!monitor)
+    {
+        return;
+    }
+    if(monitor->arrived)
+    {
+        IOObjectRelease(monitor->arrived);
+    }
+    if(monitor->removed)
+    {
+        IOObjectRelease(monitor->removed);
+    }
+    if(monitor->port)
+    {
+        CFRunLoopRemoveSource(CFRunLoopGetCurrent(), IONotificationPortGetRunLoopSource(monitor->port), kCFRunLoopDefaultMode);
+        IONotificationPortDestroy(monitor->port);
+    }
+    free(monitor);
+}
+
+RA1NPOC_STATIC_API static void *IOKitMonitorOpen(client_t *client)
+{
+    iokit_monitor_t *monitor = calloc(1, sizeof(iokit_monitor_t));
+    if(!monitor)
+    {
+        return NULL;
+    }
+    
+    monitor->port = IONotificationPortCreate(kIOMasterPortDefault);
+    if(!monitor->port)
+    {
+        ERR("IONotificationPortCreate failed");
+        free(monitor);
+        return NULL;
+    }
+    CFRunLoopAddSource(CFRunLoopGetCurrent(), IONotificationPortGetRunLoopSource(monitor->port), kCFRunLoopDefaultMode);
+    
+    CFMutableDictionaryRef dict = IOServiceMatching(deviceClass);
+    CFDictionarySet16(dict, CFSTR(kUSBVendorID), kAppleVendorID);
+    CFRetain(dict); // each notification consumes one reference
+    
+    kern_return_t ret = IOServiceAddMatchingNotification(monitor->port, kIOFirstMatchNotification, dict, IOKitDeviceArrived, monitor, &monitor->arrived);
+    if(ret != KERN_SUCCESS)
+    {
+        ERR("IOServiceAddMatchingNotification(arrived): %s", mach_error_string(ret));
+        CFRelease(dict);
+        IOKitMonitorClose(client, monitor);
+        return NULL;
+    }
+    ret = IOServiceAddMatchingNotification(monitor->port, kIOTerminatedNotification, dict, IOKitDeviceRemoved, monitor, &monitor->removed);
+    if(ret != KERN_SUCCESS)
+    {
+        ERR("IOServiceAddMatchingNotification(removed): %s", mach_error_string(ret));
+        IOKitMonitorClose(client, monitor);
+        return NULL;
+    }
+    
+    // arm both iterators, devices already on the bus are not events
+    IOKitMonitorDrain(monitor, monitor->arrived, kUSBDeviceArrived);
+    IOKitMonitorDrain(monitor, monitor->removed, kUSBDeviceRemoved);
+    monitor->head = 0;
+    monitor->count = 0;
+    
+    return monitor;
+}
+
+RA1NPOC_STATIC_API static int IOKitMonitorNext(client_t *client, void *handle, hotplug_event_t *event, unsigned int timeout)
+{
+    iokit_monitor_t *monitor = handle;
+    CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent() + timeout / 1000.0;
+    (void)client;
+    
+    while(!monitor->count)
+    {
+        CFTimeInterval left = deadline - CFAbsoluteTimeGetCurrent();
+        if(left <= 0)
+        {
+            return 1;
+        }
+        CFRunLoopRunInMode(kCFRunLoopDefaultMode, left, true);
+    }
+    
+    *event = monitor->events[monitor->head];
+    monitor->head = (monitor->head + 1) % IOKIT_MAX_EVENTS;
+    monitor->count--;
+    return 0;
+}
+
+const iousb_backend_t iousb_darwin_backend =
+{
+    .name                       = "iokit",
+    .open                       = IOKitOpen,
+    .enumerate                  = IOKitEnumerate,
+    .open_device                = IOKitOpenDevice,
+    .close                      = IOKitClose,
+    .reset                      = IOKitReset,
+    .reenumerate                = kDeviceUSBReEnumerate,
+    .abort_pipe_zero            = IOKitAbortPipeZero,
+    .control_transfer           = IOKitControlTransfer,
+    .async_control_transfer     = IOKitAsyncControlTransfer,
+    .async_wait                 = IOKitAsyncWait,
+    .interface_control_transfer = IOKitInterfaceControlTransfer,
+    .bulk_upload                = IOKitBulkUpload,
+    .bulk_upload_async          = IOKitBulkUploadAsync,
+    .monitor_open               = IOKitMonitorOpen,
+    .monitor_next               = IOKitMonitorNext,
+    .monitor_close              = IOKitMonitorClose,
+    .async_poll                 = IOKitAsyncPoll,
+};
+
+#endif
@@ -0,0 +1,447 @@
+#include <errno.h>
+#include <fcntl.h>
+
+#include <io/iousb.h>
+#include <io/iousb_dfu.h>
+#include <io/iousb_timer.h>
+#include <io/iousb_trace.h>
+#include <io/iousb_upload.h>
+#include <common/log.h>
+#include <common/common.h>
+
+#define DFU_STATUS_SZ           (6)
+
+typedef struct
+{
+    transfer_t dnload;
+    transfer_t status;
+    unsigned char reply[DFU_STATUS_SZ];
+    uint32_t len;
+    uint64_t submit;
+    unsigned char buf[DFU_MAX_TRANSFER_SZ]; // only used by blocks that reach into the suffix
+} dfu_slot_t;
+
+// CRC-32 (reflected 0xedb88320) four bits at a time
+static const uint32_t dfu_crc_nibble[16] =
+{
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+};
+
+static const unsigned char dfu_suffix_tag[DFU_SUFFIX_SZ - 4] =
+{
+    0xff, 0xff, 0xff, 0xff, 0xac, 0x05, 0x00, 0x01, 'U', 'F', 'D', DFU_SUFFIX_SZ,
+};
+
+RA1NPOC_STATIC_API static uint32_t IOUSBDFUCrc32(uint32_t crc, const unsigned char *data, size_t len)
+{
+    for(size_t i = 0; i < len; i++)
+    {
+        crc ^= data[i];
+        crc = (crc >> 4) ^ dfu_crc_nibble[crc & 0xf];
+        crc = (crc >> 4) ^ dfu_crc_nibble[crc & 0xf];
+    }
+    return crc;
+}
+
+// the DFU 1.1 suffix as Apple's loaders expect it, dwCRC without the final inversion
+RA1NPOC_STATIC_API static void IOUSBDFUSuffix(const void *data, uint32_t len, unsigned char *suffix)
+{
+    memcpy(suffix, dfu_suffix_tag, sizeof(dfu_suffix_tag));
+    uint32_t crc = IOUSBDFUCrc32(0xffffffff, data, len);
+    crc = IOUSBDFUCrc32(crc, suffix, sizeof(dfu_suffix_tag));
+    suffix[12] = crc & 0xff;
+    suffix[13] = (crc >> 8) & 0xff;
+    suffix[14] = (crc >> 16) & 0xff;
+    suffix[15] = (crc >> 24) & 0xff;
+}
+
+// w_value carries wBlockNum for DFU_DNLOAD, 0 for everything else
+RA1NPOC_STATIC_API static control_request_t IOUSBDFURequest(uint8_t bm_request_type, uint8_t b_request, uint16_t w_value, uint16_t w_length)
+{
+    control_request_t req;
+    req.bm_request_type = bm_request_type;
+    req.b_request = b_request;
+    req.w_value = w_value;
+    req.w_index = 0;
+    req.w_length = w_length;
+    return req;
+}
+
+// gets the device out of dfuERROR or a half finished download, one extra round trip only when needed
+RA1NPOC_STATIC_API static IOReturn IOUSBDFUPrepare(client_t *client, unsigned int timeout, dfu_result_t *result)
+{
+    const iousb_backend_t *backend = IOUSBGetBackend(client);
+    unsigned char reply[DFU_STATUS_SZ];
+    control_request_t req = IOUSBDFURequest(0xa1, DFU_GET_STATUS, 0, DFU_STATUS_SZ);
+    
+    transfer_t status = backend->control_transfer(client, &req, reply, timeout);
+    if(status.ret != kIOReturnSuccess || status.wLenDone < DFU_STATUS_SZ)
+    {
+        ERR("DFU_GET_STATUS failed: 0x%x", status.ret);
+        return status.ret != kIOReturnSuccess ? status.ret : kIOReturnUnderrun;
+    }
+    result->status = reply[0];
+    result->state = reply[4];
+    
+    if(reply[4] == DFU_STATE_IDLE)
+    {
+        return kIOReturnSuccess;
+    }
+    
+    req = IOUSBDFURequest(0x21, reply[4] == DFU_STATE_ERROR ? DFU_CLR_STATUS : DFU_ABORT, 0, 0);
+    status = backend->control_transfer(client, &req, NULL, timeout);
+    if(status.ret != kIOReturnSuccess)
+    {
+        ERR("Could not return to dfuIDLE from state %u: 0x%x", reply[4], status.ret);
+        return status.ret;
+    }
+    result->status = DFU_STATUS_OK;
+    result->state = DFU_STATE_IDLE;
+    return kIOReturnSuccess;
+}
+
+// zero length DFU_DNLOAD plus the two status polls that walk dfuMANIFEST-SYNC to
+// dfuMANIFEST-WAIT-RESET, in one round trip
+RA1NPOC_STATIC_API static IOReturn IOUSBDFUManifest(client_t *client, unsigned int timeout, dfu_result_t *result)
+{
+    unsigned char reply[2][DFU_STATUS_SZ];
+    const control_batch_t batch[] =
+    {
+        // the block number after the last one the device took
+        { IOUSBDFURequest(0x21, DFU_DNLOAD, (uint16_t)result->blocks, 0), NULL },
+        { IOUSBDFURequest(0xa1, DFU_GET_STATUS, 0, DFU_STATUS_SZ), reply[0] },
+        { IOUSBDFURequest(0xa1, DFU_GET_STATUS, 0, DFU_STATUS_SZ), reply[1] },
+    };
+    transfer_t results[sizeof(batch) / sizeof(batch[0])];
+    
+    if(IOUSBControlTransferBatch(client, batch, results, sizeof(batch) / sizeof(batch[0]), kControlBatchStopOnError, timeout) < 0)
+    {
+        return kIOReturnError;
+    }
+    if(results[0].ret != kIOReturnSuccess)
+    {
+        ERR("Manifest DFU_DNLOAD failed: 0x%x", results[0].ret);
+        return results[0].ret;
+    }
+    
+    // the device may already be leaving the bus for the last poll
+    bool polled = false;
+    for(size_t i = 1; i < sizeof(batch) / sizeof(batch[0]); i++)
+    {
+        if(results[i].ret == kIOReturnSuccess && results[i].wLenDone >= DFU_STATUS_SZ)
+        {
+            result->status = reply[i - 1][0];
+            result->state = reply[i - 1][4];
+            polled = true;
+        }
+    }
+    if(!polled)
+    {
+        ERR("No status after manifest: 0x%x", results[1].ret);
+        return results[1].ret != kIOReturnSuccess ? results[1].ret : kIOReturnUnderrun;
+    }
+    if(result->status != DFU_STATUS_OK ||
+       (result->state != DFU_STATE_MANIFEST && result->state != DFU_STATE_MANIFEST_WAIT_RESET))
+    {
+        ERR("Manifest failed: status %u state %u", result->status, result->state);
+        return kIOReturnError;
+    }
+    return kIOReturnSuccess;
+}
+
+typedef struct
+{
+    const dfu_slot_t *slots;
+    uint32_t head;
+    uint32_t next;
+} dfu_span_t;
+
+RA1NPOC_STATIC_API static bool IOUSBDFUPending(void *ctx)
+{
+    const dfu_span_t *span = ctx;
+    for(uint32_t i = span->head; i < span->next; i++)
+    {
+        const dfu_slot_t *slot = &span->slots[i % DFU_MAX_DEPTH];
+        if(slot->dnload.wLenDone == IOUSB_TRANSFER_PENDING || slot->status.wLenDone == IOUSB_TRANSFER_PENDING)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+RA1NPOC_STATIC_API static IOReturn IOUSBDFUStream(client_t *client,
+                                                  const unsigned char *data,
+                                                  uint32_t len,
+                                                  const unsigned char *suffix,
+                                                  const dfu_opts_t *opts,
+                                                  dfu_result_t *result)
+{
+    const iousb_backend_t *backend = IOUSBGetBackend(client);
+    dfu_slot_t slots[DFU_MAX_DEPTH];
+    unsigned int timeout = IOUSB_NO_TIMEOUT;
+    unsigned int depth = DFU_DEFAULT_DEPTH;
+    uint64_t total = (uint64_t)len + (suffix ? DFU_SUFFIX_SZ : 0);
+    uint32_t blocks = (uint32_t)((total + DFU_MAX_TRANSFER_SZ - 1) / DFU_MAX_TRANSFER_SZ);
+    uint32_t head = 0;
+    uint32_t next = 0;
+    uint64_t latency = 0;
+    IOReturn ret = kIOReturnSuccess;
+    bool stop = false;
+    
+    if(opts && opts->timeout)
+    {
+        timeout = opts->timeout;
+    }
+    if(opts && opts->depth)
+    {
+        depth = opts->depth < DFU_MAX_DEPTH ? opts->depth : DFU_MAX_DEPTH;
+    }
+    
+    uint64_t start = IOUSBTimerNow();
+    uint64_t retired = start;
+    
+    // The next block goes out before the status of the last one came back,
+    // and bwPollTimeout is not waited out: iBoot answers DFU_GET_STATUS with
+    // bwPollTimeout 0 and takes a DFU_DNLOAD queued behind it, which is what
+    // the pipelining depends on.
+    while(head < next || (ret == kIOReturnSuccess && !stop && next < blocks))
+    {
+        while(ret == kIOReturnSuccess && !stop && next < blocks && next - head < depth)
+        {
+            dfu_slot_t *slot = &slots[next % DFU_MAX_DEPTH];
+            uint64_t offset = (uint64_t)next * DFU_MAX_TRANSFER_SZ;
+            unsigned char *block = (unsigned char *)data + offset;
+            
+            slot->len = (uint32_t)((total - offset) < DFU_MAX_TRANSFER_SZ ? (total - offset) : DFU_MAX_TRANSFER_SZ);
+            if(offset + slot->len > len)
+            {
+                uint32_t head_len = offset < len ? (uint32_t)(len - offset) : 0;
+                if(head_len)
+                {
+                    memcpy(slot->buf, block, head_len);
+                }
+                memcpy(slot->buf + head_len, suffix + (offset + head_len - len), slot->len - head_len);
+                block = slot->buf;
+            }
+            
+            control_request_t dnload = IOUSBDFURequest(0x21, DFU_DNLOAD, (uint16_t)next, (uint16_t)slot->len);
+            control_request_t status = IOUSBDFURequest(0xa1, DFU_GET_STATUS, 0, DFU_STATUS_SZ);
+            slot->dnload.ret = kIOReturnSuccess;
+            slot->dnload.wLenDone = IOUSB_TRANSFER_PENDING;
+            slot->status.ret = kIOReturnSuccess;
+            slot->status.wLenDone = IOUSB_TRANSFER_PENDING;
+            slot->submit = IOUSBTimerNow();
+            
+            transfer_t submit = backend->async_control_transfer(client, &dnload, block, &slot->dnload, timeout);
+            if(submit.ret != kIOReturnSuccess)
+            {
+                ERR("DFU_DNLOAD submit failed for block %u: 0x%x", next, submit.ret);
+                ret = submit.ret;
+                break;
+            }
+            next++;
+            
+            // the status poll rides right behind its block, no round trip in between
+            submit = backend->async_control_transfer(client, &status, slot->reply, &slot->status, timeout);
+            if(submit.ret != kIOReturnSuccess)
+            {
+                // retired in order below like any other failure, nothing more goes out behind it
+                slot->status = submit;
+                stop = true;
+                break;
+            }
+        }
+        if(head == next)
+        {
+            break;
+        }
+        
+        dfu_slot_t *slot = &slots[head % DFU_MAX_DEPTH];
+        while(slot->dnload.wLenDone == IOUSB_TRANSFER_PENDING || slot->status.wLenDone == IOUSB_TRANSFER_PENDING)
+        {
+            if(backend->async_wait(client) != 0)
+            {
+                // the slots are on our stack, nothing may land in them once we return
+                ERR("DFU download failed with %u blocks in flight", next - head);
+                dfu_span_t span = { slots, head, next };
+                IOUSBAsyncDiscard(client, IOUSBDFUPending, &span);
+                return ret != kIOReturnSuccess ? ret : kIOReturnNotResponding;
+            }
+        }
+        
+        // service time: from the block reaching the front of the queue to its status
+        uint64_t now = IOUSBTimerNow();
+        uint64_t block_latency = now - (slot->submit > retired ? slot->submit : retired);
+        retired = now;
+        
+        if(slot->status.ret == kIOReturnSuccess && slot->status.wLenDone >= DFU_STATUS_SZ)
+        {
+            result->status = slot->reply[0];
+            result->state = slot->reply[4];
+        }
+        
+        if(ret == kIOReturnSuccess)
+        {
+            if(slot->dnload.ret != kIOReturnSuccess)
+            {
+                ERR("DFU_DNLOAD failed for block %u: 0x%x", head, slot->dnload.ret);
+                ret = slot->dnload.ret;
+            }
+            else if(slot->dnload.wLenDone != slot->len)
+            {
+                ERR("Short DFU_DNLOAD for block %u: %u of %u bytes", head, slot->dnload.wLenDone, slot->len);
+                ret = kIOReturnUnderrun;
+            }
+            else if(slot->status.ret != kIOReturnSuccess)
+            {
+                ERR("DFU_GET_STATUS failed for block %u: 0x%x", head, slot->status.ret);
+                ret = slot->status.ret;
+            }
+            else if(slot->status.wLenDone < DFU_STATUS_SZ)
+            {
+                ERR("Short DFU_GET_STATUS for block %u: %u bytes", head, slot->status.wLenDone);
+                ret = kIOReturnUnderrun;
+            }
+            else if(slot->reply[0] != DFU_STATUS_OK || slot->reply[4] != DFU_STATE_DNLOAD_IDLE)
+            {
+                ERR("Block %u rejected: status %u state %u", head, slot->reply[0], slot->reply[4]);
+                ret = kIOReturnError;
+            }
+            
+            if(ret != kIOReturnSuccess)
+            {
+                // drop whatever is still queued behind the failure
+                if(head + 1 < next)
+                {
+                    backend->abort_pipe_zero(client);
+                }
+            }
+            else
+            {
+                result->bytes += slot->len;
+                result->blocks++;
+                IOUSBTraceCounter(client, "dfu_bytes", result->bytes);
+                latency += block_latency;
+                if(block_latency > result->latency_max)
+                {
+                    result->latency_max = block_latency;
+                }
+                
+                if(opts && opts->progress)
+                {
+                    dfu_progress_t progress;
+                    progress.sent = result->bytes;
+                    progress.total = total;
+                    progress.block = result->blocks;
+                    progress.blocks = blocks;
+                    progress.elapsed = now - start;
+                    progress.latency = block_latency;
+                    opts->progress(opts->ctx, &progress);
+                }
+            }
+        }
+        head++;
+    }
+    
+    uint64_t elapsed = IOUSBTimerNow() - start;
+    if(result->blocks)
+    {
+        result->latency_avg = latency / result->blocks;
+    }
+    if(elapsed)
+    {
+        result->throughput = result->bytes * 1000000000ULL / elapsed;
+    }
+    
+    return ret;
+}
+
+RA1NPOC_API IOReturn IOUSBDFUDownload(client_t *client, const void *data, uint32_t len, const dfu_opts_t *opts, dfu_result_t *result)
+{
+    dfu_result_t local;
+    unsigned char suffix[DFU_SUFFIX_SZ];
+    unsigned int flags = opts ? opts->flags : 0;
+    unsigned int timeout = (opts && opts->timeout) ? opts->timeout : IOUSB_NO_TIMEOUT;
+    
+    if(!result)
+    {
+        result = &local;
+    }
+    memset(result, '\0', sizeof(dfu_result_t));
+    
+    if(!client || (!data && len))
+    {
+        result->ret = kIOReturnBadArgument;
+        return result->ret;
+    }
+    
+    uint64_t start = IOUSBTimerNow();
+    uint64_t trace = IOUSBTraceBegin();
+    
+    if(flags & kDFUAppendSuffix)
+    {
+        IOUSBDFUSuffix(data, len, suffix);
+    }
+    
+    result->ret = IOUSBDFUPrepare(client, timeout, result);
+    if(result->ret == kIOReturnSuccess)
+    {
+        result->ret = IOUSBDFUStream(client, data, len, (flags & kDFUAppendSuffix) ? suffix : NULL, opts, result);
+    }
+    if(result->ret == kIOReturnSuccess && !(flags & kDFUNoManifest))
+    {
+        result->ret = IOUSBDFUManifest(client, timeout, result);
+    }
+    
+    if(result->ret != kIOReturnSuccess)
+    {
+        // a stalled block leaves dfuERROR behind, ready the device for the next attempt
+        control_request_t req = IOUSBDFURequest(0x21, DFU_CLR_STATUS, 0, 0);
+        IOUSBGetBackend(client)->control_transfer(client, &req, NULL, timeout);
+    }
+    
+    result->elapsed = IOUSBTimerNow() - start;
+    IOUSBTraceEnd(client, "IOUSBDFUDownload", trace, result->ret);
+    return result->ret;
+}
+
+RA1NPOC_API IOReturn IOUSBDFUDownloadFile(client_t *client, const char *path, const dfu_opts_t *opts, dfu_result_t *result)
+{
+    payload_map_t map;
+    IOReturn ret;
+    
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+    {
+        ERR("open(%s): %s", path, strerror(errno));
+        ret = kIOReturnNotFound;
+    }
+    else if(IOUSBMapPayloadFd(fd, &map) != 0)
+    {
+        ret = kIOReturnBadArgument;
+    }
+    else if(map.len > UINT32_MAX)
+    {
+        ERR("Image too large: %zu bytes", map.len);
+        IOUSBUnmapPayload(&map);
+        ret = kIOReturnBadArgument;
+    }
+    else
+    {
+        ret = IOUSBDFUDownload(client, map.data, (uint32_t)map.len, opts, result);
+        IOUSBUnmapPayload(&map);
+    }
+    if(fd >= 0)
+    {
+        close(fd);
+    }
+    
+    if(ret != kIOReturnSuccess && result && ret != result->ret)
+    {
+        memset(result, '\0', sizeof(dfu_result_t));
+        result->ret = ret;
+    }
+    return ret;
+}
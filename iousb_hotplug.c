@@ -0,0 +1,149 @@
+#include <io/iousb.h>
+#include <io/iousb_hotplug.h>
+#include <common/log.h>
+#include <common/common.h>
+
+struct hotplug_p
+{
+    client_t client;
+    void *monitor;
+};
+
+RA1NPOC_STATIC_API static uint64_t HotplugNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000ULL;
+}
+
+RA1NPOC_API hotplug_t *IOUSBHotplugOpen(const client_t *tmpl)
+{
+    hotplug_t *hp = calloc(1, sizeof(hotplug_t));
+    if(!hp)
+    {
+        return NULL;
+    }
+    if(tmpl)
+    {
+        hp->client.backend = tmpl->backend;
+        hp->client.backend_data = tmpl->backend_data;
+    }
+    
+    const iousb_backend_t *backend = IOUSBGetBackend(&hp->client);
+    if(backend->monitor_open)
+    {
+        hp->monitor = backend->monitor_open(&hp->client);
+        if(!hp->monitor)
+        {
+            // still usable, IOUSBHotplugNext degrades to polling
+            ERR("%s: no hotplug monitor, polling", backend->name);
+        }
+    }
+    return hp;
+}
+
+RA1NPOC_API void IOUSBHotplugClose(hotplug_t *hp)
+{
+    if(hp)
+    {
+        if(hp->monitor)
+        {
+            IOUSBGetBackend(&hp->client)->monitor_close(&hp->client, hp->monitor);
+        }
+        free(hp);
+    }
+}
+
+RA1NPOC_API int IOUSBHotplugNext(hotplug_t *hp, hotplug_event_t *event, unsigned int timeout)
+{
+    if(!hp || !event)
+    {
+        return -1;
+    }
+    if(!hp->monitor)
+    {
+        if(timeout > HOTPLUG_POLL_INTERVAL)
+        {
+            timeout = HOTPLUG_POLL_INTERVAL;
+        }
+        usleep(timeout * 1000);
+        return 1;
+    }
+    return IOUSBGetBackend(&hp->client)->monitor_next(&hp->client, hp->monitor, event, timeout);
+}
+
+RA1NPOC_STATIC_API static bool HotplugMatch(const usb_device_t *match, const usb_device_t *device)
+{
+    if(match->location && device->location != match->location)
+    {
+        return false;
+    }
+    if(match->ecid && device->ecid != match->ecid)
+    {
+        // pongoOS and some recovery builds leave ECID out of the serial
+        return match->location && !device->ecid;
+    }
+    return true;
+}
+
+RA1NPOC_API int IOUSBHotplugWaitMatch(hotplug_t *hp, const usb_device_t *match, uint64_t exclude, unsigned int timeout, usb_device_t *device)
+{
+    usb_device_t devices[HOTPLUG_MAX_DEVICES];
+    hotplug_event_t event;
+    uint64_t deadline = HotplugNow() + timeout;
+    
+    if(!hp || !match || !device)
+    {
+        return -1;
+    }
+    
+    for(;;)
+    {
+        // the monitor only says something changed, enumeration says what is there
+        int count = IOUSBEnumerate(&hp->client, match->pid, devices, HOTPLUG_MAX_DEVICES);
+        for(int i = 0; i < count; i++)
+        {
+            if(!HotplugMatch(match, &devices[i]))
+            {
+                continue;
+            }
+            if(exclude && devices[i].id == exclude)
+            {
+                continue;
+            }
+            *device = devices[i];
+            return 0;
+        }
+        
+        uint64_t now = HotplugNow();
+        if(now >= deadline)
+        {
+            return 1;
+        }
+        if(IOUSBHotplugNext(hp, &event, (unsigned int)(deadline - now)) < 0)
+        {
+            return -1;
+        }
+    }
+}
+
+RA1NPOC_API int IOUSBHotplugWait(hotplug_t *hp, uint16_t pid, uint64_t ecid, uint64_t exclude, unsigned int timeout, usb_device_t *device)
+{
+    usb_device_t match;
+    memset(&match, '\0', sizeof(usb_device_t));
+    match.pid = pid;
+    match.ecid = ecid;
+    return IOUSBHotplugWaitMatch(hp, &match, exclude, timeout, device);
+}
+
+RA1NPOC_API int IOUSBWaitForDevice(const client_t *tmpl, uint16_t pid, uint64_t ecid, unsigned int timeout, usb_device_t *device)
+{
+    hotplug_t *hp = IOUSBHotplugOpen(tmpl);
+    if(!hp)
+    {
+        return -1;
+    }
+    int ret = IOUSBHotplugWait(hp, pid, ecid, 0, timeout, device);
+    IOUSBHotplugClose(hp);
+    return ret;
+}
@@ -0,0 +1,1187 @@
+#if defined(__linux__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/usbdevice_fs.h>
+
+#include <io/iousb.h>
+#include <io/iousb_pool.h>
+#include <common/log.h>
+#include <common/common.h>
+
+#define USBFS_ROOT              "/dev/bus/usb"
+#define USBFS_SYSFS_ROOT        "/sys/bus/usb/devices"
+#define USBFS_DEFAULT_TIMEOUT   (5000)
+#define USBFS_BULK_CHUNK_SZ     (0x100000)
+#define USBFS_DESC_BUF_SZ       (0x1000)
+#define USBFS_UEVENT_BUF_SZ     (0x2000)
+#define USBFS_UDEV_CONTROL      "/run/udev/control"
+#define UEVENT_GROUP_KERNEL     (1)
+#define UEVENT_GROUP_UDEV       (2)
+
+typedef struct usbfs_urb_p usbfs_urb_t;
+
+_Static_assert(sizeof(control_request_t) == USB_SETUP_PACKET_SZ, "control_request_t is copied as the setup packet");
+
+struct usbfs_urb_p
+{
+    struct usbdevfs_urb urb;
+    async_transfer_t *transfer;
+    unsigned char *data;
+    uint64_t deadline;
+    bool expired;
+    usbfs_urb_t *next;
+    unsigned char buf[];
+};
+
+struct usbfs_device_p
+{
+    client_t *client;               // urbs are borrowed from its buffer pool
+    int fd;
+    unsigned int interface;
+    uint8_t bulk_out;
+    uint8_t bulk_in;
+    usbfs_urb_t *urbs;
+};
+
+RA1NPOC_STATIC_API static uint64_t USBFSNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+RA1NPOC_STATIC_API static IOReturn USBFSError(int err)
+{
+    switch(err)
+    {
+        case 0:
+            return kIOReturnSuccess;
+        case EPIPE:
+            return kUSBHostReturnPipeStalled;
+        case ENOENT:
+        case ECONNRESET:
+            return kIOReturnAborted;
+        case ETIMEDOUT:
+            return kIOReturnTimeout;
+        case ENODEV:
+        case ESHUTDOWN:
+            return kIOReturnNoDevice;
+        case EOVERFLOW:
+            return kIOReturnOverrun;
+        case EREMOTEIO:
+            return kIOReturnUnderrun;
+        case EPROTO:
+        case EILSEQ:
+            return kIOReturnNotResponding;
+        case ENOMEM:
+            return kIOReturnNoMemory;
+        case EBUSY:
+            return kIOReturnExclusiveAccess;
+        case EACCES:
+        case EPERM:
+            return kIOReturnNotPrivileged;
+        default:
+            return kIOReturnError;
+    }
+}
+
+RA1NPOC_STATIC_API static int USBFSControl(int fd, const control_request_t *request, unsigned char *data, unsigned int timeout)
+{
+    struct usbdevfs_ctrltransfer ctrl =
+    {
+        .bRequestType = request->bm_request_type,
+        .bRequest     = request->b_request,
+        .wValue       = request->w_value,
+        .wIndex       = request->w_index,
+        .wLength      = request->w_length,
+        .timeout      = timeout,
+        .data         = data,
+    };
+    return ioctl(fd, USBDEVFS_CONTROL, &ctrl);
+}
+
+RA1NPOC_STATIC_API static void USBFSGetSerial(client_t *client, int fd, uint8_t index)
+{
+    unsigned char desc[255];
+    char serialstr[128];
+    control_request_t req =
+    {
+        .bm_request_type = 0x80,
+        .b_request       = 0x06, // GET_DESCRIPTOR
+        .w_value         = (0x03 << 8) | index,
+        .w_index         = 0x0409,
+        .w_length        = sizeof(desc),
+    };
+    
+    if(!index)
+    {
+        return;
+    }
+    
+    memset(desc, '\0', sizeof(desc));
+    int len = USBFSControl(fd, &req, desc, USBFS_DEFAULT_TIMEOUT);
+    if(len < 2 || desc[1] != 0x03)
+    {
+        ERR("Failed to read serial string: %s", strerror(errno));
+        return;
+    }
+    if(len > desc[0])
+    {
+        len = desc[0];
+    }
+    
+    // UTF-16LE, the iBoot serial is plain ASCII
+    size_t n = 0;
+    for(int i = 2; i + 1 < len && n < sizeof(serialstr) - 1; i += 2)
+    {
+        serialstr[n++] = desc[i + 1] ? '?' : (char)desc[i];
+    }
+    serialstr[n] = '\0';
+    
+    IOUSBGetInfo(client, serialstr);
+}
+
+// walks the first configuration, picks the first interface and its bulk pipes
+RA1NPOC_STATIC_API static void USBFSParseConfig(usbfs_device_t *dev, const unsigned char *buf, size_t len)
+{
+    bool found = false;
+    
+    dev->interface = 0;
+    dev->bulk_out = 0x02;
+    dev->bulk_in = 0x81;
+    
+    for(size_t off = 0; off + 2 <= len && buf[off] >= 2; off += buf[off])
+    {
+        const unsigned char *desc = buf + off;
+        if(off + desc[0] > len)
+        {
+            break;
+        }
+        if(desc[1] == 0x04 && desc[0] >= 9) // INTERFACE
+        {
+            if(found)
+            {
+                break;
+            }
+            if(desc[3] == 0)
+            {
+                dev->interface = desc[2];
+                found = true;
+            }
+        }
+        else if(desc[1] == 0x05 && desc[0] >= 7 && found) // ENDPOINT
+        {
+            if((desc[3] & 0x03) == 0x02)
+            {
+                if(desc[2] & 0x80)
+                {
+                    dev->bulk_in = desc[2];
+                }
+                else
+                {
+                    dev->bulk_out = desc[2];
+                }
+            }
+        }
+    }
+}
+
+RA1NPOC_STATIC_API static int USBFSClaim(usbfs_device_t *dev)
+{
+    struct usbdevfs_ioctl cmd =
+    {
+        .ifno       = dev->interface,
+        .ioctl_code = USBDEVFS_DISCONNECT,
+        .data       = NULL,
+    };
+    // no kernel driver bound is the common case
+    ioctl(dev->fd, USBDEVFS_IOCTL, &cmd);
+    
+    unsigned int config = 1;
+    if(ioctl(dev->fd, USBDEVFS_SETCONFIGURATION, &config) != 0 && errno != EBUSY)
+    {
+        ERR("USBDEVFS_SETCONFIGURATION: %s", strerror(errno));
+        return -1;
+    }
+    
+    unsigned int interface = dev->interface;
+    if(ioctl(dev->fd, USBDEVFS_CLAIMINTERFACE, &interface) != 0)
+    {
+        ERR("USBDEVFS_CLAIMINTERFACE: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+RA1NPOC_STATIC_API static uint32_t USBFSLookupLocation(unsigned long busnum, unsigned long devnum);
+
+RA1NPOC_STATIC_API static int USBFSOpenNode(client_t *client, const char *path, uint16_t pid)
+{
+    unsigned char *buf = NULL;
+    ssize_t len;
+    int fd;
+    
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if(fd < 0)
+    {
+        return -1;
+    }
+    
+    buf = malloc(USBFS_DESC_BUF_SZ);
+    if(!buf)
+    {
+        close(fd);
+        return -1;
+    }
+    
+    // usbfs hands out the device descriptor followed by the raw config descriptors
+    len = read(fd, buf, USBFS_DESC_BUF_SZ);
+    if(len < 18 || buf[1] != 0x01 ||
+       (buf[8] | (buf[9] << 8)) != kAppleVendorID ||
+       (buf[10] | (buf[11] << 8)) != pid)
+    {
+        goto fail;
+    }
+    
+    usbfs_device_t *dev = calloc(1, sizeof(usbfs_device_t));
+    if(!dev)
+    {
+        goto fail;
+    }
+    dev->client = client;
+    dev->fd = fd;
+    USBFSParseConfig(dev, buf + 18, len - 18);
+    
+    USBFSGetSerial(client, fd, buf[16]);
+    
+    if(USBFSClaim(dev) != 0)
+    {
+        free(dev);
+        goto fail;
+    }
+    
+    free(buf);
+    client->dev = dev;
+    
+    memset(&client->layout, '\0', sizeof(usb_layout_t));
+    client->layout.pid = pid;
+    client->layout.config = 1;
+    client->layout.interface = dev->interface;
+    client->layout.bulk_out = dev->bulk_out;
+    client->layout.bulk_in = dev->bulk_in;
+    IOUSBLayoutStore(client, &client->layout);
+    
+    unsigned long busnum = 0, devnum = 0;
+    if(sscanf(path, USBFS_ROOT "/%lu/%lu", &busnum, &devnum) == 2)
+    {
+        client->id = (busnum << 16) | devnum;
+        client->location = USBFSLookupLocation(busnum, devnum);
+    }
+    return 0;
+
+fail:
+    free(buf);
+    close(fd);
+    return -1;
+}
+
+RA1NPOC_STATIC_API static int USBFSOpen(client_t *client, uint16_t pid)
+{
+    DIR *bus_dir;
+    struct dirent *bus;
+    
+    bus_dir = opendir(USBFS_ROOT);
+    if(!bus_dir)
+    {
+        ERR("opendir(%s): %s", USBFS_ROOT, strerror(errno));
+        return -1;
+    }
+    
+    while((bus = readdir(bus_dir)))
+    {
+        if(bus->d_name[0] == '.')
+        {
+            continue;
+        }
+        
+        char bus_path[512];
+        snprintf(bus_path, sizeof(bus_path), "%s/%s", USBFS_ROOT, bus->d_name);
+        DIR *dev_dir = opendir(bus_path);
+        if(!dev_dir)
+        {
+            continue;
+        }
+        
+        struct dirent *node;
+        while((node = readdir(dev_dir)))
+        {
+            if(node->d_name[0] == '.')
+            {
+                continue;
+            }
+            
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/%s", bus_path, node->d_name);
+            if(!USBFSOpenNode(client, path, pid))
+            {
+                closedir(dev_dir);
+                closedir(bus_dir);
+                return 0;
+            }
+        }
+        closedir(dev_dir);
+    }
+    closedir(bus_dir);
+    
+    return -1;
+}
+
+RA1NPOC_STATIC_API static bool USBFSReadAttr(const char *dir, const char *attr, char *buf, size_t len)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s/%s", USBFS_SYSFS_ROOT, dir, attr);
+    
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+    {
+        return false;
+    }
+    ssize_t n = read(fd, buf, len - 1);
+    close(fd);
+    if(n <= 0)
+    {
+        return false;
+    }
+    while(n > 0 && (buf[n - 1] == '\n' || buf[n - 1] == '\r'))
+    {
+        n--;
+    }
+    buf[n] = '\0';
+    return true;
+}
+
+// sysfs names a device "<bus>-<port>.<port>...", fold that into a locationID
+RA1NPOC_STATIC_API static uint32_t USBFSLocation(const char *name)
+{
+    char *end = NULL;
+    unsigned long bus = strtoul(name, &end, 10);
+    uint32_t location = (uint32_t)(bus & 0xff) << 24;
+    int shift = 20;
+    
+    if(!end || *end != '-')
+    {
+        return 0;
+    }
+    do
+    {
+        unsigned long port = strtoul(end + 1, &end, 10);
+        if(shift >= 0)
+        {
+            location |= (uint32_t)(port & 0xf) << shift;
+            shift -= 4;
+        }
+    } while(end && *end == '.');
+    
+    return location;
+}
+
+RA1NPOC_STATIC_API static bool USBFSGetDevice(const char *name, uint16_t pid, usb_device_t *device)
+{
+    char attr[256];
+    unsigned long busnum, devnum, product;
+    
+    // interfaces carry a ':', root hubs are "usbN"
+    if(name[0] == '.' || strchr(name, ':') || !strncmp(name, "usb", 3))
+    {
+        return false;
+    }
+    if(!USBFSReadAttr(name, "idVendor", attr, sizeof(attr)) || strtoul(attr, NULL, 16) != kAppleVendorID)
+    {
+        return false;
+    }
+    if(!USBFSReadAttr(name, "idProduct", attr, sizeof(attr)))
+    {
+        return false;
+    }
+    product = strtoul(attr, NULL, 16);
+    if(pid && product != pid)
+    {
+        return false;
+    }
+    if(!USBFSReadAttr(name, "busnum", attr, sizeof(attr)))
+    {
+        return false;
+    }
+    busnum = strtoul(attr, NULL, 10);
+    if(!USBFSReadAttr(name, "devnum", attr, sizeof(attr)))
+    {
+        return false;
+    }
+    devnum = strtoul(attr, NULL, 10);
+    
+    memset(device, '\0', sizeof(usb_device_t));
+    device->id = (busnum << 16) | devnum;
+    device->pid = (uint16_t)product;
+    device->location = USBFSLocation(name);
+    snprintf(device->path, sizeof(device->path), "%s/%03lu/%03lu", USBFS_ROOT, busnum, devnum);
+    if(USBFSReadAttr(name, "serial", device->serial, sizeof(device->serial)))
+    {
+        device->ecid = IOUSBParseECID(device->serial);
+    }
+    return true;
+}
+
+RA1NPOC_STATIC_API static uint32_t USBFSLookupLocation(unsigned long busnum, unsigned long devnum)
+{
+    DIR *dir;
+    struct dirent *ent;
+    usb_device_t device;
+    uint32_t location = 0;
+    
+    dir = opendir(USBFS_SYSFS_ROOT);
+    if(!dir)
+    {
+        return 0;
+    }
+    while((ent = readdir(dir)))
+    {
+        if(USBFSGetDevice(ent->d_name, 0, &device) && device.id == ((busnum << 16) | devnum))
+        {
+            location = device.location;
+            break;
+        }
+    }
+    closedir(dir);
+    
+    return location;
+}
+
+RA1NPOC_STATIC_API static int USBFSEnumerate(client_t *client, uint16_t pid, usb_device_t *devices, int max)
+{
+    DIR *dir;
+    struct dirent *ent;
+    int count = 0;
+    (void)client;
+    
+    dir = opendir(USBFS_SYSFS_ROOT);
+    if(!dir)
+    {
+        ERR("opendir(%s): %s", USBFS_SYSFS_ROOT, strerror(errno));
+        return -1;
+    }
+    
+    while((ent = readdir(dir)) && count < max)
+    {
+        if(USBFSGetDevice(ent->d_name, pid, &devices[count]))
+        {
+            count++;
+        }
+    }
+    closedir(dir);
+    
+    return count;
+}
+
+// re-open with the layout an earlier full open cached for this mode: no config
+// descriptor walk, no SETCONFIGURATION or serial string round trip and no sysfs
+// scan for the location, enumeration already handed us all of that
+RA1NPOC_STATIC_API static int USBFSOpenCached(client_t *client, const usb_device_t *device, const usb_layout_t *layout)
+{
+    unsigned char desc[18];
+    
+    int fd = open(device->path, O_RDWR | O_CLOEXEC);
+    if(fd < 0)
+    {
+        return -1;
+    }
+    if(read(fd, desc, sizeof(desc)) != sizeof(desc) || desc[1] != 0x01 ||
+       (desc[8] | (desc[9] << 8)) != kAppleVendorID ||
+       (desc[10] | (desc[11] << 8)) != device->pid)
+    {
+        close(fd);
+        return -1;
+    }
+    
+    usbfs_device_t *dev = calloc(1, sizeof(usbfs_device_t));
+    if(!dev)
+    {
+        close(fd);
+        return -1;
+    }
+    dev->client = client;
+    dev->fd = fd;
+    dev->interface = layout->interface;
+    dev->bulk_out = layout->bulk_out;
+    dev->bulk_in = layout->bulk_in;
+    
+    // the kernel configures the device on enumeration, so the claim normally
+    // goes straight through; a bound driver or no config takes the slow path
+    unsigned int interface = dev->interface;
+    if(ioctl(fd, USBDEVFS_CLAIMINTERFACE, &interface) != 0 && USBFSClaim(dev) != 0)
+    {
+        free(dev);
+        close(fd);
+        return -1;
+    }
+    
+    if(device->serial[0])
+    {
+        IOUSBGetInfo(client, device->serial);
+    }
+    else
+    {
+        USBFSGetSerial(client, fd, desc[16]);
+    }
+    client->dev = dev;
+    client->id = device->id;
+    client->location = device->location;
+    client->layout = *layout;
+    return 0;
+}
+
+RA1NPOC_STATIC_API static int USBFSOpenDevice(client_t *client, const usb_device_t *device)
+{
+    if(!device->path[0])
+    {
+        return -1;
+    }
+    
+    const usb_layout_t *layout = IOUSBLayoutLookup(client, device->pid);
+    if(layout && !USBFSOpenCached(client, device, layout))
+    {
+        return 0;
+    }
+    return USBFSOpenNode(client, device->path, device->pid);
+}
+
+// kernel uevents come as "action@devpath\0KEY=VALUE\0...", udev ones behind a
+// "libudev" header that points at the same KEY=VALUE list
+RA1NPOC_STATIC_API static int USBFSParseUevent(const char *buf, size_t len, hotplug_event_t *event)
+{
+    const char *action = NULL, *devpath = NULL, *subsystem = NULL, *devtype = NULL, *product = NULL;
+    const char *busnum = NULL, *devnum = NULL;
+    size_t off = 0;
+    
+    if(len >= 24 && !memcmp(buf, "libudev", 8))
+    {
+        uint32_t props_off;
+        memcpy(&props_off, buf + 16, sizeof(props_off));
+        if(props_off >= len)
+        {
+            return -1;
+        }
+        off = props_off;
+    }
+    else
+    {
+        off = strnlen(buf, len) + 1;
+    }
+    
+    while(off < len)
+    {
+        const char *kv = buf + off;
+        size_t n = strnlen(kv, len - off);
+        if(!strncmp(kv, "ACTION=", 7)) action = kv + 7;
+        else if(!strncmp(kv, "DEVPATH=", 8)) devpath = kv + 8;
+        else if(!strncmp(kv, "SUBSYSTEM=", 10)) subsystem = kv + 10;
+        else if(!strncmp(kv, "DEVTYPE=", 8)) devtype = kv + 8;
+        else if(!strncmp(kv, "PRODUCT=", 8)) product = kv + 8;
+        else if(!strncmp(kv, "BUSNUM=", 7)) busnum = kv + 7;
+        else if(!strncmp(kv, "DEVNUM=", 7)) devnum = kv + 7;
+        off += n + 1;
+    }
+    
+    if(!action || !devpath || !subsystem || !devtype || !product || !busnum || !devnum ||
+       strcmp(subsystem, "usb") || strcmp(devtype, "usb_device"))
+    {
+        return -1;
+    }
+    
+    unsigned int vid = 0, pid = 0;
+    if(sscanf(product, "%x/%x", &vid, &pid) != 2 || vid != kAppleVendorID)
+    {
+        return -1;
+    }
+    
+    if(!strcmp(action, "add"))
+    {
+        event->type = kUSBDeviceArrived;
+    }
+    else if(!strcmp(action, "remove"))
+    {
+        event->type = kUSBDeviceRemoved;
+    }
+    else
+    {
+        return -1;
+    }
+    
+    const char *name = strrchr(devpath, '/');
+    name = name ? name + 1 : devpath;
+    unsigned long bus = strtoul(busnum, NULL, 10);
+    unsigned long dev = strtoul(devnum, NULL, 10);
+    
+    memset(&event->device, '\0', sizeof(usb_device_t));
+    event->device.id = (bus << 16) | dev;
+    event->device.pid = (uint16_t)pid;
+    event->device.location = USBFSLocation(name);
+    snprintf(event->device.path, sizeof(event->device.path), "%s/%03lu/%03lu", USBFS_ROOT, bus, dev);
+    if(event->type == kUSBDeviceArrived &&
+       USBFSReadAttr(name, "serial", event->device.serial, sizeof(event->device.serial)))
+    {
+        event->device.ecid = IOUSBParseECID(event->device.serial);
+    }
+    return 0;
+}
+
+RA1NPOC_STATIC_API static void *USBFSMonitorOpen(client_t *client)
+{
+    (void)client;
+    
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if(fd < 0)
+    {
+        ERR("socket(NETLINK_KOBJECT_UEVENT): %s", strerror(errno));
+        return NULL;
+    }
+    
+    // with udev running, wait for its events so the node has its final permissions
+    struct sockaddr_nl addr =
+    {
+        .nl_family = AF_NETLINK,
+        .nl_groups = access(USBFS_UDEV_CONTROL, F_OK) == 0 ? UEVENT_GROUP_UDEV : UEVENT_GROUP_KERNEL,
+    };
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        ERR("bind(NETLINK_KOBJECT_UEVENT): %s", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    
+    int *monitor = malloc(sizeof(int));
+    if(!monitor)
+    {
+        close(fd);
+        return NULL;
+    }
+    *monitor = fd;
+    return monitor;
+}
+
+RA1NPOC_STATIC_API static int USBFSMonitorNext(client_t *client, void *monitor, hotplug_event_t *event, unsigned int timeout)
+{
+    int fd = *(int *)monitor;
+    uint64_t deadline = USBFSNow() + timeout;
+    char buf[USBFS_UEVENT_BUF_SZ];
+    (void)client;
+    
+    for(;;)
+    {
+        ssize_t len = recv(fd, buf, sizeof(buf) - 1, 0);
+        if(len > 0)
+        {
+            buf[len] = '\0';
+            if(USBFSParseUevent(buf, len, event) == 0)
+            {
+                return 0;
+            }
+            continue;
+        }
+        if(len < 0 && errno != EAGAIN && errno != EINTR)
+        {
+            if(errno == ENOBUFS)
+            {
+                // the socket overflowed, callers re-enumerate on any wakeup anyway
+                continue;
+            }
+            return -1;
+        }
+        
+        uint64_t now = USBFSNow();
+        if(now >= deadline)
+        {
+            return 1;
+        }
+        struct pollfd pfd =
+        {
+            .fd     = fd,
+            .events = POLLIN,
+        };
+        if(poll(&pfd, 1, (int)(deadline - now)) < 0 && errno != EINTR)
+        {
+            return -1;
+        }
+    }
+}
+
+RA1NPOC_STATIC_API static void USBFSMonitorClose(client_t *client, void *monitor)
+{
+    (void)client;
+    if(monitor)
+    {
+        close(*(int *)monitor);
+        free(monitor);
+    }
+}
+
+// urbs with room for len bytes of setup packet and data, no allocator call
+// once the client has a buffer pool
+RA1NPOC_STATIC_API static usbfs_urb_t *USBFSAllocUrb(usbfs_device_t *dev, size_t len)
+{
+    usbfs_urb_t *u = IOUSBBufferGet(dev->client, sizeof(usbfs_urb_t) + len);
+    if(u)
+    {
+        memset(u, '\0', sizeof(usbfs_urb_t));
+    }
+    return u;
+}
+
+RA1NPOC_STATIC_API static void USBFSFreeUrb(usbfs_device_t *dev, usbfs_urb_t *u)
+{
+    IOUSBBufferPut(dev->client, u);
+}
+
+RA1NPOC_STATIC_API static void USBFSComplete(usbfs_device_t *dev, struct usbdevfs_urb *urb)
+{
+    usbfs_urb_t *u = (usbfs_urb_t *)urb;
+    
+    for(usbfs_urb_t **pp = &dev->urbs; *pp; pp = &(*pp)->next)
+    {
+        if(*pp == u)
+        {
+            *pp = u->next;
+            break;
+        }
+    }
+    
+    if(u->transfer)
+    {
+        IOReturn ret = USBFSError(-urb->status);
+        if(u->expired && ret == kIOReturnAborted)
+        {
+            ret = kIOReturnTimeout;
+        }
+        if(u->urb.type == USBDEVFS_URB_TYPE_CONTROL && (u->buf[0] & 0x80) && u->data && urb->actual_length > 0)
+        {
+            memcpy(u->data, u->buf + USB_SETUP_PACKET_SZ, urb->actual_length);
+        }
+        u->transfer->ret = ret;
+        u->transfer->wLenDone = urb->actual_length;
+    }
+    USBFSFreeUrb(dev, u);
+}
+
+RA1NPOC_STATIC_API static void USBFSDrain(usbfs_device_t *dev)
+{
+    for(usbfs_urb_t *u = dev->urbs; u; u = u->next)
+    {
+        ioctl(dev->fd, USBDEVFS_DISCARDURB, &u->urb);
+    }
+    while(dev->urbs)
+    {
+        struct usbdevfs_urb *urb = NULL;
+        if(ioctl(dev->fd, USBDEVFS_REAPURB, &urb) != 0)
+        {
+            // device is gone, nothing left to reap
+            while(dev->urbs)
+            {
+                usbfs_urb_t *u = dev->urbs;
+                dev->urbs = u->next;
+                USBFSFreeUrb(dev, u);
+            }
+            break;
+        }
+        USBFSComplete(dev, urb);
+    }
+}
+
+RA1NPOC_STATIC_API static void USBFSClose(client_t *client)
+{
+    usbfs_device_t *dev = client->dev;
+    if(dev)
+    {
+        USBFSDrain(dev);
+        unsigned int interface = dev->interface;
+        ioctl(dev->fd, USBDEVFS_RELEASEINTERFACE, &interface);
+        close(dev->fd);
+        free(dev);
+        client->dev = NULL;
+    }
+}
+
+RA1NPOC_STATIC_API static void USBFSReset(client_t *client, int reset)
+{
+    // usbfs has a single port reset, the device keeps its busnum/devnum through it
+    if(client->dev && (reset & (kDeviceUSBResetDevice | kDeviceUSBReEnumerate)))
+    {
+        if(ioctl(client->dev->fd, USBDEVFS_RESET, NULL) != 0)
+        {
+            DEVLOG("USBDEVFS_RESET: %s", strerror(errno));
+        }
+    }
+}
+
+RA1NPOC_STATIC_API static IOReturn USBFSAbortPipeZero(client_t *client)
+{
+    usbfs_device_t *dev = client->dev;
+    if(!dev) return kIOReturnError;
+    
+    for(usbfs_urb_t *u = dev->urbs; u; u = u->next)
+    {
+        if(u->urb.type == USBDEVFS_URB_TYPE_CONTROL)
+        {
+            ioctl(dev->fd, USBDEVFS_DISCARDURB, &u->urb);
+        }
+    }
+    return kIOReturnSuccess;
+}
+
+RA1NPOC_STATIC_API static transfer_t USBFSControlTransfer(client_t *client,
+                                                          const control_request_t *request,
+                                                          unsigned char *data,
+                                                          unsigned int timeout)
+{
+    transfer_t result;
+    
+    memset(&result, '\0', sizeof(transfer_t));
+    
+    if(!client->dev)
+    {
+        result.ret = kIOReturnNoDevice;
+        return result;
+    }
+    
+    if(timeout == IOUSB_NO_TIMEOUT)
+    {
+        timeout = USBFS_DEFAULT_TIMEOUT;
+    }
+    
+    int len = USBFSControl(client->dev->fd, request, data, timeout);
+    if(len < 0)
+    {
+        result.ret = USBFSError(errno);
+    }
+    else
+    {
+        result.wLenDone = len;
+    }
+    
+    return result;
+}
+
+RA1NPOC_STATIC_API static transfer_t USBFSAsyncControlTransfer(client_t *client,
+                                                               const control_request_t *request,
+                                                               unsigned char *data,
+                                                               async_transfer_t *transfer,
+                                                               unsigned int timeout)
+{
+    transfer_t result;
+    usbfs_device_t *dev = client->dev;
+    
+    memset(&result, '\0', sizeof(transfer_t));
+    
+    if(!dev)
+    {
+        result.ret = kIOReturnNoDevice;
+        return result;
+    }
+    
+    usbfs_urb_t *u = USBFSAllocUrb(dev, USB_SETUP_PACKET_SZ + request->w_length);
+    if(!u)
+    {
+        result.ret = kIOReturnNoMemory;
+        return result;
+    }
+    
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // already the wire packet, e.g. one iousb.hpp built at compile time
+    memcpy(u->buf, request, USB_SETUP_PACKET_SZ);
+#else
+    u->buf[0] = request->bm_request_type;
+    u->buf[1] = request->b_request;
+    u->buf[2] = request->w_value & 0xff;
+    u->buf[3] = request->w_value >> 8;
+    u->buf[4] = request->w_index & 0xff;
+    u->buf[5] = request->w_index >> 8;
+    u->buf[6] = request->w_length & 0xff;
+    u->buf[7] = request->w_length >> 8;
+#endif
+    if(!(request->bm_request_type & 0x80) && request->w_length)
+    {
+        if(data)
+        {
+            memcpy(u->buf + USB_SETUP_PACKET_SZ, data, request->w_length);
+        }
+        else
+        {
+            memset(u->buf + USB_SETUP_PACKET_SZ, '\0', request->w_length);
+        }
+    }
+    
+    u->transfer = transfer;
+    u->data = data;
+    u->deadline = (timeout && timeout != IOUSB_NO_TIMEOUT) ? USBFSNow() + timeout : 0;
+    u->urb.type = USBDEVFS_URB_TYPE_CONTROL;
+    u->urb.endpoint = 0;
+    u->urb.buffer = u->buf;
+    u->urb.buffer_length = USB_SETUP_PACKET_SZ + request->w_length;
+    u->urb.usercontext = transfer;
+    
+    if(ioctl(dev->fd, USBDEVFS_SUBMITURB, &u->urb) != 0)
+    {
+        result.ret = USBFSError(errno);
+        USBFSFreeUrb(dev, u);
+        return result;
+    }
+    
+    u->next = dev->urbs;
+    dev->urbs = u;
+    
+    return result;
+}
+
+RA1NPOC_STATIC_API static int USBFSNextTimeout(usbfs_device_t *dev)
+{
+    uint64_t now = USBFSNow();
+    int timeout = -1;
+    
+    for(usbfs_urb_t *u = dev->urbs; u; u = u->next)
+    {
+        if(!u->deadline || u->expired)
+        {
+            continue;
+        }
+        int left = u->deadline > now ? (int)(u->deadline - now) : 0;
+        if(timeout < 0 || left < timeout)
+        {
+            timeout = left;
+        }
+    }
+    return timeout;
+}
+
+RA1NPOC_STATIC_API static void USBFSExpire(usbfs_device_t *dev)
+{
+    uint64_t now = USBFSNow();
+    
+    for(usbfs_urb_t *u = dev->urbs; u; u = u->next)
+    {
+        if(u->deadline && !u->expired && u->deadline <= now)
+        {
+            u->expired = true;
+            ioctl(dev->fd, USBDEVFS_DISCARDURB, &u->urb);
+        }
+    }
+}
+
+RA1NPOC_STATIC_API static int USBFSAsyncWait(client_t *client)
+{
+    usbfs_device_t *dev = client->dev;
+    if(!dev || !dev->urbs) return -1;
+    
+    for(;;)
+    {
+        struct usbdevfs_urb *urb = NULL;
+        if(ioctl(dev->fd, USBDEVFS_REAPURBNDELAY, &urb) == 0)
+        {
+            USBFSComplete(dev, urb);
+            return 0;
+        }
+        if(errno != EAGAIN)
+        {
+            return -1;
+        }
+        
+        struct pollfd pfd =
+        {
+            .fd     = dev->fd,
+            .events = POLLOUT,
+        };
+        int n = poll(&pfd, 1, USBFSNextTimeout(dev));
+        if(n < 0 && errno != EINTR)
+        {
+            return -1;
+        }
+        if(n == 0)
+        {
+            USBFSExpire(dev);
+        }
+    }
+}
+
+RA1NPOC_STATIC_API static int USBFSAsyncFd(client_t *client)
+{
+    usbfs_device_t *dev = client->dev;
+    return dev ? dev->fd : -1;
+}
+
+RA1NPOC_STATIC_API static int USBFSAsyncPoll(client_t *client)
+{
+    usbfs_device_t *dev = client->dev;
+    int count = 0;
+    
+    if(!dev)
+    {
+        return -1;
+    }
+    
+    USBFSExpire(dev);
+    while(dev->urbs)
+    {
+        struct usbdevfs_urb *urb = NULL;
+        if(ioctl(dev->fd, USBDEVFS_REAPURBNDELAY, &urb) != 0)
+        {
+            if(errno == EAGAIN)
+            {
+                break;
+            }
+            return count ? count : -1;
+        }
+        USBFSComplete(dev, urb);
+        count++;
+    }
+    return count;
+}
+
+RA1NPOC_STATIC_API static uint64_t USBFSAsyncDeadline(client_t *client)
+{
+    usbfs_device_t *dev = client->dev;
+    uint64_t deadline = 0;
+    
+    for(usbfs_urb_t *u = dev ? dev->urbs : NULL; u; u = u->next)
+    {
+        if(u->deadline && !u->expired && (!deadline || u->deadline < deadline))
+        {
+            deadline = u->deadline;
+        }
+    }
+    return deadline * 1000000ULL;
+}
+
+RA1NPOC_STATIC_API static transfer_t USBFSInterfaceControlTransfer(client_t *client,
+                                                                   const control_request_t *request,
+                                                                   unsigned char *data)
+{
+    return USBFSControlTransfer(client, request, data, IOUSB_NO_TIMEOUT);
+}
+
+RA1NPOC_STATIC_API static transfer_t USBFSBulkUpload(client_t *client, void *data, uint32_t len)
+{
+    transfer_t result;
+    usbfs_device_t *dev = client->dev;
+    
+    memset(&result, '\0', sizeof(transfer_t));
+    
+    if(!dev)
+    {
+        result.ret = kIOReturnNoDevice;
+        return result;
+    }
+    
+    // usbfs caps a single transfer by usbfs_memory_mb, so go out in chunks
+    uint32_t done = 0;
+    do
+    {
+        uint32_t sz = len - done;
+        if(sz > USBFS_BULK_CHUNK_SZ)
+        {
+            sz = USBFS_BULK_CHUNK_SZ;
+        }
+        struct usbdevfs_bulktransfer bulk =
+        {
+            .ep      = dev->bulk_out,
+            .len     = sz,
+            .timeout = 0,
+            .data    = (unsigned char *)data + done,
+        };
+        int n = ioctl(dev->fd, USBDEVFS_BULK, &bulk);
+        if(n < 0)
+        {
+            result.ret = USBFSError(errno);
+            break;
+        }
+        done += n;
+        if((uint32_t)n != sz)
+        {
+            result.ret = kIOReturnUnderrun;
+            break;
+        }
+    } while(done < len);
+    
+    result.wLenDone = done;
+    
+    return result;
+}
+
+RA1NPOC_STATIC_API static transfer_t USBFSBulkUploadAsync(client_t *client, void *data, uint32_t len, async_transfer_t *transfer)
+{
+    transfer_t result;
+    usbfs_device_t *dev = client->dev;
+    
+    memset(&result, '\0', sizeof(transfer_t));
+    
+    if(!dev)
+    {
+        result.ret = kIOReturnNoDevice;
+        return result;
+    }
+    
+    // bulk urbs point straight at the caller's buffer, it has to outlive the transfer
+    usbfs_urb_t *u = USBFSAllocUrb(dev, 0);
+    if(!u)
+    {
+        result.ret = kIOReturnNoMemory;
+        return result;
+    }
+    
+    u->transfer = transfer;
+    u->urb.type = USBDEVFS_URB_TYPE_BULK;
+    u->urb.endpoint = dev->bulk_out;
+    u->urb.buffer = data;
+    u->urb.buffer_length = len;
+    u->urb.usercontext = transfer;
+    
+    if(ioctl(dev->fd, USBDEVFS_SUBMITURB, &u->urb) != 0)
+    {
+        result.ret = USBFSError(errno);
+        USBFSFreeUrb(dev, u);
+        return result;
+    }
+    
+    u->next = dev->urbs;
+    dev->urbs = u;
+    
+    return result;
+}
+
+const iousb_backend_t iousb_linux_backend =
+{
+    .name                       = "usbfs",
+    .open                       = USBFSOpen,
+    .enumerate                  = USBFSEnumerate,
+    .open_device                = USBFSOpenDevice,
+    .close                      = USBFSClose,
+    .reset                      = USBFSReset,
+    .reenumerate                = 0,
+    .abort_pipe_zero            = USBFSAbortPipeZero,
+    .control_transfer           = USBFSControlTransfer,
+    .async_control_transfer     = USBFSAsyncControlTransfer,
+    .async_wait                 = USBFSAsyncWait,
+    .interface_control_transfer = USBFSInterfaceControlTransfer,
+    .bulk_upload                = USBFSBulkUpload,
+    .bulk_upload_async          = USBFSBulkUploadAsync,
+    .monitor_open               = USBFSMonitorOpen,
+    .monitor_next               = USBFSMonitorNext,
+    .monitor_close              = USBFSMonitorClose,
+    .async_fd                   = USBFSAsyncFd,
+    .async_poll                 = USBFSAsyncPoll,
+    .async_deadline             = USBFSAsyncDeadline,
+};
+
+#endif
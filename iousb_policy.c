@@ -0,0 +1,398 @@
+#include <pthread.h>
+
+#include <io/iousb.h>
+#include <io/iousb_policy.h>
+#include <io/iousb_telemetry.h>
+#include <io/iousb_trace.h>
+#include <common/log.h>
+#include <common/common.h>
+
+#define POLICY_REFRESH          (8)     // new samples before the percentile is recomputed
+#define POLICY_MAX_STREAK       (4)
+
+// round trips of one device, or with ecid 0 of every device with that CPID
+typedef struct
+{
+    bool used;
+    unsigned int cpid;
+    uint64_t ecid;
+    uint32_t samples[POLICY_SAMPLES];   // usec, a ring
+    unsigned int count;
+    unsigned int next;
+    unsigned int fresh;                 // samples since percentile was computed
+    uint64_t percentile;                // nsec
+    uint64_t timeouts;
+    unsigned int streak;
+} policy_key_t;
+
+struct iousb_policy_p
+{
+    policy_opts_t opts;
+    pthread_mutex_t lock;
+    uint64_t seed;
+    policy_key_t keys[POLICY_MAX_KEYS];
+    policy_decision_t decisions[POLICY_MAX_DECISIONS];
+    size_t ndecisions;                  // ever made, the ring holds the latest
+};
+
+RA1NPOC_STATIC_API static uint64_t PolicyNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+RA1NPOC_STATIC_API static uint64_t PolicyRandom(iousb_policy_t *policy)
+{
+    // xorshift64, jitter only has to keep hosts on one hub from retrying in step
+    uint64_t x = policy->seed;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    policy->seed = x;
+    return x;
+}
+
+RA1NPOC_STATIC_API static bool PolicyIsTimeout(IOReturn ret)
+{
+#if defined(__APPLE__)
+    if(ret == kIOUSBTransactionTimeout)
+    {
+        return true;
+    }
+#endif
+    return ret == kIOReturnTimeout;
+}
+
+// A round trip the device answered, stalls included. Transfers that were
+// cut short say nothing about its latency.
+RA1NPOC_STATIC_API static bool PolicyIsSample(IOReturn ret)
+{
+    return !PolicyIsTimeout(ret) &&
+           ret != kIOReturnAborted &&
+           ret != kIOReturnNoDevice &&
+           ret != kIOReturnNotResponding;
+}
+
+RA1NPOC_STATIC_API static policy_key_t *PolicyKey(iousb_policy_t *policy, unsigned int cpid, uint64_t ecid, bool create)
+{
+    policy_key_t *free_key = NULL;
+    for(int i = 0; i < POLICY_MAX_KEYS; i++)
+    {
+        policy_key_t *key = &policy->keys[i];
+        if(!key->used)
+        {
+            if(!free_key)
+            {
+                free_key = key;
+            }
+            continue;
+        }
+        if(key->cpid == cpid && key->ecid == ecid)
+        {
+            return key;
+        }
+    }
+    if(!create || !free_key)
+    {
+        return NULL;
+    }
+    memset(free_key, '\0', sizeof(policy_key_t));
+    free_key->used = true;
+    free_key->cpid = cpid;
+    free_key->ecid = ecid;
+    return free_key;
+}
+
+RA1NPOC_STATIC_API static void PolicyAddSample(policy_key_t *key, uint64_t nsec, IOReturn ret, bool chosen)
+{
+    if(PolicyIsTimeout(ret))
+    {
+        // a caller's own short timeout says nothing about the policy's
+        if(!chosen)
+        {
+            return;
+        }
+        key->timeouts++;
+        if(key->streak < POLICY_MAX_STREAK)
+        {
+            key->streak++;
+        }
+        return;
+    }
+    if(!PolicyIsSample(ret))
+    {
+        return;
+    }
+    
+    uint64_t usec = (nsec + 999) / 1000;
+    key->samples[key->next] = usec > UINT32_MAX ? UINT32_MAX : (uint32_t)usec;
+    key->next = (key->next + 1) % POLICY_SAMPLES;
+    if(key->count < POLICY_SAMPLES)
+    {
+        key->count++;
+    }
+    key->fresh++;
+    key->streak = 0;
+}
+
+RA1NPOC_STATIC_API static uint64_t PolicyPercentile(policy_key_t *key, unsigned int percentile)
+{
+    uint32_t sorted[POLICY_SAMPLES];
+    
+    if(!key->count)
+    {
+        return 0;
+    }
+    if(key->percentile && key->fresh < POLICY_REFRESH)
+    {
+        return key->percentile;
+    }
+    
+    // a few dozen samples, insertion sort is as fast as anything here
+    memcpy(sorted, key->samples, key->count * sizeof(uint32_t));
+    for(unsigned int i = 1; i < key->count; i++)
+    {
+        uint32_t v = sorted[i];
+        unsigned int j = i;
+        for(; j > 0 && sorted[j - 1] > v; j--)
+        {
+            sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = v;
+    }
+    
+    unsigned int idx = (key->count * percentile + 99) / 100;
+    idx = idx ? idx - 1 : 0;
+    key->percentile = (uint64_t)sorted[idx < key->count ? idx : key->count - 1] * 1000;
+    key->fresh = 0;
+    return key->percentile;
+}
+
+RA1NPOC_STATIC_API static void PolicyLog(iousb_policy_t *policy, const policy_decision_t *decision)
+{
+    policy->decisions[policy->ndecisions % POLICY_MAX_DECISIONS] = *decision;
+    policy->ndecisions++;
+}
+
+RA1NPOC_API iousb_policy_t *IOUSBPolicyCreate(const policy_opts_t *opts)
+{
+    iousb_policy_t *policy = calloc(1, sizeof(iousb_policy_t));
+    if(!policy)
+    {
+        ERR("Out of memory");
+        return NULL;
+    }
+    if(opts)
+    {
+        policy->opts = *opts;
+    }
+    
+    policy_opts_t *o = &policy->opts;
+    if(!o->percentile || o->percentile > 100)
+    {
+        o->percentile = POLICY_DEFAULT_PERCENTILE;
+    }
+    o->margin = o->margin ? o->margin : POLICY_DEFAULT_MARGIN;
+    o->min_samples = o->min_samples ? o->min_samples : POLICY_DEFAULT_MIN_SAMPLES;
+    if(o->min_samples > POLICY_SAMPLES)
+    {
+        o->min_samples = POLICY_SAMPLES;
+    }
+    o->min_timeout = o->min_timeout ? o->min_timeout : POLICY_DEFAULT_MIN_TIMEOUT;
+    o->max_timeout = o->max_timeout ? o->max_timeout : POLICY_DEFAULT_MAX_TIMEOUT;
+    if(o->max_timeout < o->min_timeout)
+    {
+        o->max_timeout = o->min_timeout;
+    }
+    o->backoff_base = o->backoff_base ? o->backoff_base : POLICY_DEFAULT_BACKOFF_BASE;
+    o->backoff_max = o->backoff_max ? o->backoff_max : POLICY_DEFAULT_BACKOFF_MAX;
+    
+    policy->seed = PolicyNow() | 1;
+    pthread_mutex_init(&policy->lock, NULL);
+    return policy;
+}
+
+RA1NPOC_API void IOUSBPolicyDestroy(iousb_policy_t *policy)
+{
+    if(policy)
+    {
+        pthread_mutex_destroy(&policy->lock);
+        free(policy);
+    }
+}
+
+RA1NPOC_API void IOUSBPolicyAttach(client_t *client, iousb_policy_t *policy)
+{
+    if(client)
+    {
+        client->policy = policy;
+    }
+}
+
+RA1NPOC_API void IOUSBPolicyRecord(client_t *client, int op, uint64_t nsec, IOReturn ret)
+{
+    iousb_policy_t *policy = client ? client->policy : NULL;
+    // batches time from the batch start and async submits not at all
+    if(!policy || (op != kTelemetryControl && op != kTelemetryControlTO && op != kTelemetryInterfaceControl))
+    {
+        return;
+    }
+    bool chosen = client->policy_timeout;
+    client->policy_timeout = false;
+    
+    pthread_mutex_lock(&policy->lock);
+    policy_key_t *chip = PolicyKey(policy, client->cpid, 0, true);
+    if(chip)
+    {
+        PolicyAddSample(chip, nsec, ret, chosen);
+    }
+    if(client->ecid)
+    {
+        policy_key_t *device = PolicyKey(policy, client->cpid, client->ecid, true);
+        if(device)
+        {
+            PolicyAddSample(device, nsec, ret, chosen);
+        }
+    }
+    pthread_mutex_unlock(&policy->lock);
+}
+
+RA1NPOC_API unsigned int IOUSBPolicyTimeout(client_t *client, unsigned int fallback)
+{
+    iousb_policy_t *policy = client ? client->policy : NULL;
+    policy_decision_t decision;
+    
+    if(!policy)
+    {
+        return fallback;
+    }
+    
+    memset(&decision, '\0', sizeof(policy_decision_t));
+    decision.time = PolicyNow();
+    decision.ecid = client->ecid;
+    decision.cpid = client->cpid;
+    decision.fallback = fallback;
+    decision.chosen = fallback;
+    decision.source = kPolicyFallback;
+    
+    pthread_mutex_lock(&policy->lock);
+    
+    // the device itself once it has history, its chip until then
+    policy_key_t *key = client->ecid ? PolicyKey(policy, client->cpid, client->ecid, false) : NULL;
+    decision.source = kPolicyDevice;
+    if(!key || key->count < policy->opts.min_samples)
+    {
+        key = PolicyKey(policy, client->cpid, 0, false);
+        decision.source = kPolicyChip;
+    }
+    if(!key || key->count < policy->opts.min_samples)
+    {
+        decision.source = kPolicyFallback;
+        if(key)
+        {
+            decision.samples = key->count;
+        }
+    }
+    else
+    {
+        decision.samples = key->count;
+        decision.percentile = PolicyPercentile(key, policy->opts.percentile);
+        
+        uint64_t msec = (decision.percentile * policy->opts.margin / 100 + 999999) / 1000000;
+        // each timeout in a row says the percentile is behind the device, double up
+        msec <<= key->streak;
+        if(msec < policy->opts.min_timeout)
+        {
+            msec = policy->opts.min_timeout;
+        }
+        if(msec > policy->opts.max_timeout)
+        {
+            msec = policy->opts.max_timeout;
+        }
+        decision.chosen = (unsigned int)msec;
+    }
+    
+    PolicyLog(policy, &decision);
+    pthread_mutex_unlock(&policy->lock);
+    
+    client->policy_timeout = decision.source != kPolicyFallback;
+    IOUSBTraceCounter(client, "timeout", decision.chosen);
+    return decision.chosen;
+}
+
+RA1NPOC_API unsigned int IOUSBPolicyBackoff(iousb_policy_t *policy, unsigned int cpid, uint64_t ecid, unsigned int attempt)
+{
+    policy_decision_t decision;
+    
+    if(!policy)
+    {
+        return 0;
+    }
+    
+    uint64_t delay = policy->opts.backoff_base;
+    for(unsigned int i = 0; i < attempt && delay < policy->opts.backoff_max; i++)
+    {
+        delay <<= 1;
+    }
+    if(delay > policy->opts.backoff_max)
+    {
+        delay = policy->opts.backoff_max;
+    }
+    
+    memset(&decision, '\0', sizeof(policy_decision_t));
+    decision.time = PolicyNow();
+    decision.ecid = ecid;
+    decision.cpid = cpid;
+    decision.source = kPolicyBackoff;
+    decision.fallback = attempt;
+    
+    pthread_mutex_lock(&policy->lock);
+    // equal jitter, between half the delay and all of it
+    decision.chosen = (unsigned int)(delay / 2 + PolicyRandom(policy) % (delay - delay / 2 + 1));
+    PolicyLog(policy, &decision);
+    pthread_mutex_unlock(&policy->lock);
+    
+    return decision.chosen;
+}
+
+RA1NPOC_API int IOUSBPolicyGetStats(iousb_policy_t *policy, unsigned int cpid, uint64_t ecid, policy_stats_t *stats)
+{
+    if(!policy || !stats)
+    {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&policy->lock);
+    policy_key_t *key = PolicyKey(policy, cpid, ecid, false);
+    if(!key)
+    {
+        pthread_mutex_unlock(&policy->lock);
+        return -1;
+    }
+    stats->samples = key->count;
+    stats->percentile = PolicyPercentile(key, policy->opts.percentile);
+    stats->timeouts = key->timeouts;
+    stats->streak = key->streak;
+    pthread_mutex_unlock(&policy->lock);
+    return 0;
+}
+
+RA1NPOC_API size_t IOUSBPolicyDecisions(iousb_policy_t *policy, policy_decision_t *decisions, size_t max)
+{
+    if(!policy || !decisions)
+    {
+        return 0;
+    }
+    
+    pthread_mutex_lock(&policy->lock);
+    size_t avail = policy->ndecisions < POLICY_MAX_DECISIONS ? policy->ndecisions : POLICY_MAX_DECISIONS;
+    size_t count = avail < max ? avail : max;
+    size_t first = policy->ndecisions - count;
+    for(size_t i = 0; i < count; i++)
+    {
+        decisions[i] = policy->decisions[(first + i) % POLICY_MAX_DECISIONS];
+    }
+    pthread_mutex_unlock(&policy->lock);
+    return count;
+}
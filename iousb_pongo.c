@@ -0,0 +1,286 @@
+#include <io/iousb.h>
+#include <io/iousb_pongo.h>
+#include <io/iousb_upload.h>
+#include <common/log.h>
+#include <common/common.h>
+
+struct pongo_shell_p
+{
+    client_t *client;
+    char *ring;
+    size_t mask;
+    uint64_t head;                  // bytes ever written
+    uint64_t tail;                  // bytes ever consumed
+    uint64_t dropped;
+    bool running;                   // a command went out and the prompt has not come back
+    pongo_output_t output;
+    void *ctx;
+    char chunk[PONGO_STDOUT_CHUNK_SZ];
+};
+
+RA1NPOC_STATIC_API static uint64_t PongoNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000ULL;
+}
+
+RA1NPOC_STATIC_API static void PongoRingWrite(pongo_shell_t *shell, const char *data, size_t len)
+{
+    size_t size = shell->mask + 1;
+    
+    if(len > size)
+    {
+        // only the newest ring's worth can survive anyway
+        shell->dropped += shell->head - shell->tail + len - size;
+        shell->head += len - size;
+        shell->tail = shell->head;
+        data += len - size;
+        len = size;
+    }
+    if(shell->head + len - shell->tail > size)
+    {
+        uint64_t lost = shell->head + len - shell->tail - size;
+        shell->dropped += lost;
+        shell->tail += lost;
+    }
+    
+    size_t off = shell->head & shell->mask;
+    size_t first = size - off < len ? size - off : len;
+    memcpy(shell->ring + off, data, first);
+    memcpy(shell->ring, data + first, len - first);
+    shell->head += len;
+}
+
+RA1NPOC_API pongo_shell_t *IOUSBPongoShellCreate(client_t *client, size_t ring_size, pongo_output_t output, void *ctx)
+{
+    size_t size = 1;
+    
+    if(!client)
+    {
+        ERR("No client");
+        return NULL;
+    }
+    if(!ring_size)
+    {
+        ring_size = PONGO_DEFAULT_RING_SZ;
+    }
+    while(size < ring_size)
+    {
+        size <<= 1;
+    }
+    
+    pongo_shell_t *shell = calloc(1, sizeof(pongo_shell_t));
+    if(!shell)
+    {
+        return NULL;
+    }
+    shell->ring = malloc(size);
+    if(!shell->ring)
+    {
+        free(shell);
+        return NULL;
+    }
+    shell->client = client;
+    shell->mask = size - 1;
+    shell->output = output;
+    shell->ctx = ctx;
+    return shell;
+}
+
+RA1NPOC_API void IOUSBPongoShellDestroy(pongo_shell_t *shell)
+{
+    if(shell)
+    {
+        free(shell->ring);
+        free(shell);
+    }
+}
+
+RA1NPOC_API int IOUSBPongoSend(pongo_shell_t *shell, const char *command)
+{
+    char line[PONGO_MAX_COMMAND_SZ];
+    
+    if(!shell || !command)
+    {
+        return -1;
+    }
+    size_t len = strlen(command);
+    if(len + 1 > sizeof(line))
+    {
+        ERR("pongo command too long: %zu bytes", len);
+        return -1;
+    }
+    memcpy(line, command, len);
+    line[len++] = '\n';
+    
+    transfer_t result = IOUSBControlRequestTransfer(shell->client, 0x21, PONGO_REQ_COMMAND, 0, 0, (unsigned char *)line, (uint16_t)len);
+    if(result.ret != kIOReturnSuccess)
+    {
+        ERR("Failed to send pongo command \"%s\": 0x%x", command, result.ret);
+        return -1;
+    }
+    // the prompt flag drops as soon as the shell takes the line
+    shell->running = true;
+    return 0;
+}
+
+RA1NPOC_API int IOUSBPongoPoll(pongo_shell_t *shell)
+{
+    unsigned char prompt = 0;
+    
+    if(!shell)
+    {
+        return -1;
+    }
+    
+    // prompt first: once it is up, everything the command printed is already queued
+    transfer_t result = IOUSBControlRequestTransfer(shell->client, 0xa1, PONGO_REQ_PROMPT, 0, 0, &prompt, sizeof(prompt));
+    if(result.ret != kIOReturnSuccess)
+    {
+        return -1;
+    }
+    
+    do
+    {
+        result = IOUSBControlRequestTransfer(shell->client, 0xa1, PONGO_REQ_STDOUT, 0, 0, (unsigned char *)shell->chunk, sizeof(shell->chunk));
+        if(result.ret != kIOReturnSuccess)
+        {
+            return -1;
+        }
+        if(result.wLenDone)
+        {
+            if(shell->output)
+            {
+                shell->output(shell->ctx, shell->chunk, result.wLenDone);
+            }
+            PongoRingWrite(shell, shell->chunk, result.wLenDone);
+        }
+    } while(result.wLenDone == sizeof(shell->chunk));
+    
+    if(prompt)
+    {
+        shell->running = false;
+    }
+    return shell->running ? 0 : 1;
+}
+
+RA1NPOC_API int IOUSBPongoWait(pongo_shell_t *shell, unsigned int timeout)
+{
+    uint64_t deadline = PongoNow() + timeout;
+    unsigned int interval = PONGO_POLL_MIN;
+    
+    for(;;)
+    {
+        uint64_t seen = shell ? shell->head : 0;
+        int ret = IOUSBPongoPoll(shell);
+        if(ret != 0)
+        {
+            return ret < 0 ? -1 : 0;
+        }
+        if(timeout && PongoNow() >= deadline)
+        {
+            return 1;
+        }
+        // back off while the command is quiet, stay close while it talks
+        interval = shell->head != seen ? PONGO_POLL_MIN : interval * 2;
+        if(interval > PONGO_POLL_MAX)
+        {
+            interval = PONGO_POLL_MAX;
+        }
+        usleep(interval);
+    }
+}
+
+RA1NPOC_API int IOUSBPongoCommand(pongo_shell_t *shell, const char *command, unsigned int timeout)
+{
+    if(IOUSBPongoSend(shell, command) != 0)
+    {
+        return -1;
+    }
+    return IOUSBPongoWait(shell, timeout);
+}
+
+RA1NPOC_API size_t IOUSBPongoRead(pongo_shell_t *shell, char *buf, size_t len)
+{
+    size_t pending = IOUSBPongoPending(shell);
+    if(len > pending)
+    {
+        len = pending;
+    }
+    if(!len)
+    {
+        return 0;
+    }
+    
+    size_t size = shell->mask + 1;
+    size_t off = shell->tail & shell->mask;
+    size_t first = size - off < len ? size - off : len;
+    memcpy(buf, shell->ring + off, first);
+    memcpy(buf + first, shell->ring, len - first);
+    shell->tail += len;
+    return len;
+}
+
+RA1NPOC_API size_t IOUSBPongoPending(pongo_shell_t *shell)
+{
+    return shell ? (size_t)(shell->head - shell->tail) : 0;
+}
+
+RA1NPOC_API uint64_t IOUSBPongoDropped(pongo_shell_t *shell)
+{
+    return shell ? shell->dropped : 0;
+}
+
+RA1NPOC_STATIC_API static IOReturn PongoAnnounce(pongo_shell_t *shell, uint32_t len)
+{
+    unsigned char size[4];
+    
+    size[0] = len & 0xff;
+    size[1] = (len >> 8) & 0xff;
+    size[2] = (len >> 16) & 0xff;
+    size[3] = (len >> 24) & 0xff;
+    transfer_t result = IOUSBControlRequestTransfer(shell->client, 0x21, PONGO_REQ_UPLOAD_SIZE, 0, 0, size, sizeof(size));
+    if(result.ret != kIOReturnSuccess)
+    {
+        ERR("Failed to announce a %u byte upload: 0x%x", len, result.ret);
+    }
+    return result.ret;
+}
+
+RA1NPOC_API transfer_t IOUSBPongoUpload(pongo_shell_t *shell, const void *data, uint32_t len, const upload_opts_t *opts)
+{
+    transfer_t result;
+    
+    memset(&result, '\0', sizeof(transfer_t));
+    if(!shell)
+    {
+        result.ret = kIOReturnBadArgument;
+        return result;
+    }
+    
+    result.ret = PongoAnnounce(shell, len);
+    if(result.ret != kIOReturnSuccess)
+    {
+        return result;
+    }
+    
+    return IOUSBBulkUploadStream(shell->client, data, len, opts);
+}
+
+RA1NPOC_API IOReturn IOUSBPongoUploadBegin(pongo_shell_t *shell, upload_stream_t *stream, const void *data, uint32_t len, const upload_opts_t *opts)
+{
+    if(!shell || !stream)
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    IOReturn ret = PongoAnnounce(shell, len);
+    if(ret != kIOReturnSuccess)
+    {
+        return ret;
+    }
+    
+    IOUSBBulkUploadBegin(stream, shell->client, data, len, opts);
+    return kIOReturnSuccess;
+}
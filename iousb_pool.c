@@ -0,0 +1,197 @@
+#include <stdatomic.h>
+
+#include <io/iousb.h>
+#include <io/iousb_pool.h>
+#include <common/log.h>
+#include <common/common.h>
+
+struct iousb_pool_p
+{
+    unsigned char *base;            // buffers, then the arena, then the blank
+    size_t length;
+    size_t page;
+    unsigned int buffers;
+    size_t buffer_size;
+    unsigned char *arena;
+    size_t arena_size;
+    unsigned char *blank;
+    _Atomic uint64_t free;          // one bit per buffer that can be borrowed
+    _Atomic size_t arena_used;
+    _Atomic uint64_t hits;
+    _Atomic uint64_t misses;
+};
+
+RA1NPOC_STATIC_API static size_t PoolRound(size_t size, size_t page)
+{
+    return (size + page - 1) & ~(page - 1);
+}
+
+RA1NPOC_API int IOUSBPoolCreate(client_t *client, unsigned int buffers, size_t buffer_size, size_t arena_size)
+{
+    if(!client)
+    {
+        return -1;
+    }
+    if(client->pool)
+    {
+        ERR("Client already has a buffer pool");
+        return -1;
+    }
+    
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    if(!buffers)
+    {
+        buffers = IOUSB_POOL_DEFAULT_BUFFERS;
+    }
+    if(buffers > IOUSB_POOL_MAX_BUFFERS)
+    {
+        buffers = IOUSB_POOL_MAX_BUFFERS;
+    }
+    buffer_size = PoolRound(buffer_size ? buffer_size : IOUSB_POOL_DEFAULT_BUFFER_SZ, page);
+    arena_size = PoolRound(arena_size ? arena_size : IOUSB_POOL_DEFAULT_ARENA_SZ, page);
+    
+    iousb_pool_t *pool = calloc(1, sizeof(iousb_pool_t));
+    if(!pool)
+    {
+        ERR("Out of memory");
+        return -1;
+    }
+    pool->page = page;
+    pool->buffers = buffers;
+    pool->buffer_size = buffer_size;
+    pool->arena_size = arena_size;
+    pool->length = buffers * buffer_size + arena_size + PoolRound(DFU_MAX_TRANSFER_SZ, page);
+    
+    void *base = NULL;
+    if(posix_memalign(&base, page, pool->length) != 0)
+    {
+        ERR("Failed to allocate a %zu byte buffer pool", pool->length);
+        free(pool);
+        return -1;
+    }
+    // fault everything in now rather than on the first transfer
+    memset(base, '\0', pool->length);
+    pool->base = base;
+    pool->arena = pool->base + buffers * buffer_size;
+    pool->blank = pool->arena + arena_size;
+    atomic_init(&pool->free, buffers == 64 ? ~0ULL : (1ULL << buffers) - 1);
+    
+    client->pool = pool;
+    return 0;
+}
+
+RA1NPOC_API void IOUSBPoolDestroy(client_t *client)
+{
+    if(client && client->pool)
+    {
+        free(client->pool->base);
+        free(client->pool);
+        client->pool = NULL;
+    }
+}
+
+RA1NPOC_API void *IOUSBBufferGet(client_t *client, size_t size)
+{
+    iousb_pool_t *pool = client ? client->pool : NULL;
+    void *buf = NULL;
+    
+    if(pool && size <= pool->buffer_size)
+    {
+        uint64_t mask = atomic_load_explicit(&pool->free, memory_order_acquire);
+        while(mask)
+        {
+            unsigned int idx = __builtin_ctzll(mask);
+            if(atomic_compare_exchange_weak_explicit(&pool->free, &mask, mask & ~(1ULL << idx),
+                                                     memory_order_acquire, memory_order_acquire))
+            {
+                atomic_fetch_add_explicit(&pool->hits, 1, memory_order_relaxed);
+                return pool->base + idx * pool->buffer_size;
+            }
+        }
+    }
+    if(pool)
+    {
+        atomic_fetch_add_explicit(&pool->misses, 1, memory_order_relaxed);
+    }
+    
+    size_t page = pool ? pool->page : (size_t)sysconf(_SC_PAGESIZE);
+    if(posix_memalign(&buf, page, size ? size : 1) != 0)
+    {
+        return NULL;
+    }
+    return buf;
+}
+
+RA1NPOC_API void IOUSBBufferPut(client_t *client, void *buf)
+{
+    iousb_pool_t *pool = client ? client->pool : NULL;
+    
+    if(pool && (unsigned char *)buf >= pool->base && (unsigned char *)buf < pool->arena)
+    {
+        size_t idx = ((unsigned char *)buf - pool->base) / pool->buffer_size;
+        atomic_fetch_or_explicit(&pool->free, 1ULL << idx, memory_order_release);
+        return;
+    }
+    free(buf);
+}
+
+RA1NPOC_API void *IOUSBArenaAlloc(client_t *client, size_t size)
+{
+    iousb_pool_t *pool = client ? client->pool : NULL;
+    if(!pool)
+    {
+        return NULL;
+    }
+    
+    size = PoolRound(size ? size : 1, pool->page);
+    size_t used = atomic_load_explicit(&pool->arena_used, memory_order_relaxed);
+    do
+    {
+        if(size > pool->arena_size - used)
+        {
+            return NULL;
+        }
+    } while(!atomic_compare_exchange_weak_explicit(&pool->arena_used, &used, used + size,
+                                                   memory_order_relaxed, memory_order_relaxed));
+    return pool->arena + used;
+}
+
+RA1NPOC_API void IOUSBArenaReset(client_t *client)
+{
+    if(client && client->pool)
+    {
+        atomic_store(&client->pool->arena_used, 0);
+    }
+}
+
+RA1NPOC_API unsigned char *IOUSBBlank(client_t *client)
+{
+    if(!client)
+    {
+        return NULL;
+    }
+    if(!client->pool && IOUSBPoolCreate(client, 0, 0, 0) != 0)
+    {
+        return NULL;
+    }
+    return client->pool->blank;
+}
+
+RA1NPOC_API int IOUSBPoolGetStats(const client_t *client, iousb_pool_stats_t *stats)
+{
+    iousb_pool_t *pool = client ? client->pool : NULL;
+    if(!pool || !stats)
+    {
+        return -1;
+    }
+    
+    memset(stats, '\0', sizeof(iousb_pool_stats_t));
+    stats->buffers = pool->buffers;
+    stats->buffer_size = pool->buffer_size;
+    stats->arena_size = pool->arena_size;
+    stats->hits = atomic_load_explicit(&pool->hits, memory_order_relaxed);
+    stats->misses = atomic_load_explicit(&pool->misses, memory_order_relaxed);
+    stats->in_use = pool->buffers - __builtin_popcountll(atomic_load_explicit(&pool->free, memory_order_relaxed));
+    stats->arena_used = atomic_load_explicit(&pool->arena_used, memory_order_relaxed);
+    return 0;
+}
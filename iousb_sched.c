@@ -0,0 +1,505 @@
+#include <pthread.h>
+
+#include <io/iousb.h>
+#include <io/iousb_sched.h>
+#include <io/iousb_trace.h>
+#include <common/log.h>
+#include <common/common.h>
+
+typedef struct
+{
+    bool used;
+    uint32_t link;
+    uint64_t budget;
+    int64_t tokens;                 // bytes, negative while a large chunk is paid off
+    uint64_t refill;                // nsec the tokens were last topped up
+    uint64_t bytes;
+    uint32_t inflight;
+    unsigned int critical;
+    uint64_t waits;
+} sched_link_t;
+
+struct iousb_sched_p
+{
+    sched_opts_t opts;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;            // a link got tokens back, drained or went non-critical
+    sched_link_t links[SCHED_MAX_LINKS];
+};
+
+RA1NPOC_STATIC_API static uint64_t SchedNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+RA1NPOC_STATIC_API static void SchedDeadline(struct timespec *ts, uint64_t nsec)
+{
+    // condition variables wait on CLOCK_REALTIME unless told otherwise
+    clock_gettime(CLOCK_REALTIME, ts);
+    nsec += ts->tv_nsec;
+    ts->tv_sec += nsec / 1000000000ULL;
+    ts->tv_nsec = nsec % 1000000000ULL;
+}
+
+RA1NPOC_STATIC_API static int64_t SchedBurst(const iousb_sched_t *sched, const sched_link_t *link)
+{
+    return (int64_t)(link->budget * sched->opts.burst / 1000);
+}
+
+RA1NPOC_STATIC_API static sched_link_t *SchedLink(iousb_sched_t *sched, uint32_t id)
+{
+    sched_link_t *free_link = NULL;
+    for(int i = 0; i < SCHED_MAX_LINKS; i++)
+    {
+        sched_link_t *link = &sched->links[i];
+        if(!link->used)
+        {
+            if(!free_link)
+            {
+                free_link = link;
+            }
+            continue;
+        }
+        if(link->link == id)
+        {
+            return link;
+        }
+    }
+    if(!free_link)
+    {
+        return NULL;
+    }
+    memset(free_link, '\0', sizeof(sched_link_t));
+    free_link->used = true;
+    free_link->link = id;
+    free_link->budget = sched->opts.budget;
+    free_link->tokens = SchedBurst(sched, free_link);
+    free_link->refill = SchedNow();
+    return free_link;
+}
+
+// the links of client, NULL where the table is full
+RA1NPOC_STATIC_API static int SchedPath(iousb_sched_t *sched, const client_t *client, sched_link_t **path)
+{
+    uint32_t ids[SCHED_MAX_DEPTH];
+    int count = IOUSBSchedLinks(client->location, ids, SCHED_MAX_DEPTH);
+    for(int i = 0; i < count; i++)
+    {
+        path[i] = SchedLink(sched, ids[i]);
+    }
+    return count;
+}
+
+RA1NPOC_STATIC_API static void SchedRefill(const iousb_sched_t *sched, sched_link_t *link, uint64_t now)
+{
+    uint64_t elapsed = now - link->refill;
+    int64_t burst = SchedBurst(sched, link);
+    link->tokens += (int64_t)(elapsed * link->budget / 1000000000ULL);
+    if(link->tokens > burst)
+    {
+        link->tokens = burst;
+    }
+    link->refill = now;
+}
+
+// 0 when every link has budget left and none is held by a critical transfer,
+// otherwise nsec until that might change; the lock is held
+RA1NPOC_STATIC_API static uint64_t SchedBlocked(iousb_sched_t *sched, sched_link_t **path, int count)
+{
+    uint64_t now = SchedNow();
+    uint64_t wait = 0;
+    for(int i = 0; i < count; i++)
+    {
+        sched_link_t *link = path[i];
+        if(!link)
+        {
+            continue;
+        }
+        if(link->critical)
+        {
+            // critical ends wake us up, the timeout only bounds a lost wakeup
+            wait = wait > sched->opts.drain * 1000000ULL ? wait : sched->opts.drain * 1000000ULL;
+            continue;
+        }
+        SchedRefill(sched, link, now);
+        if(link->tokens <= 0 && link->budget)
+        {
+            uint64_t need = (uint64_t)(-link->tokens + 1) * 1000000000ULL / link->budget + 1;
+            wait = wait > need ? wait : need;
+        }
+    }
+    return wait;
+}
+
+RA1NPOC_STATIC_API static void SchedAdmit(sched_link_t **path, int count, uint32_t len)
+{
+    for(int i = 0; i < count; i++)
+    {
+        if(path[i])
+        {
+            path[i]->tokens -= len;
+            path[i]->bytes += len;
+            path[i]->inflight += len;
+        }
+    }
+}
+
+RA1NPOC_API int IOUSBSchedLinks(uint32_t location, uint32_t *links, int max)
+{
+    int depth = 0;
+    int count = 0;
+    if(!location || max <= 0)
+    {
+        return 0;
+    }
+    
+    // one nibble per port below the bus, the first zero ends the path
+    while(depth < SCHED_MAX_DEPTH && ((location >> (20 - 4 * depth)) & 0xf))
+    {
+        depth++;
+    }
+    
+    // the bus, then every hub, the device's own port left out
+    uint32_t prefix = location & 0xff000000;
+    links[count++] = prefix;
+    for(int i = 0; i < depth - 1 && count < max; i++)
+    {
+        prefix |= location & (0xfU << (20 - 4 * i));
+        links[count++] = prefix;
+    }
+    return count;
+}
+
+RA1NPOC_API iousb_sched_t *IOUSBSchedCreate(const sched_opts_t *opts)
+{
+    iousb_sched_t *sched = calloc(1, sizeof(iousb_sched_t));
+    if(!sched)
+    {
+        ERR("Out of memory");
+        return NULL;
+    }
+    if(opts)
+    {
+        sched->opts = *opts;
+    }
+    sched->opts.budget = sched->opts.budget ? sched->opts.budget : SCHED_DEFAULT_BUDGET;
+    sched->opts.burst = sched->opts.burst ? sched->opts.burst : SCHED_DEFAULT_BURST;
+    sched->opts.drain = sched->opts.drain ? sched->opts.drain : SCHED_DEFAULT_DRAIN;
+    
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_cond_init(&sched->cond, NULL);
+    return sched;
+}
+
+RA1NPOC_API void IOUSBSchedDestroy(iousb_sched_t *sched)
+{
+    if(sched)
+    {
+        pthread_cond_destroy(&sched->cond);
+        pthread_mutex_destroy(&sched->lock);
+        free(sched);
+    }
+}
+
+RA1NPOC_API void IOUSBSchedAttach(client_t *client, iousb_sched_t *sched)
+{
+    if(client)
+    {
+        client->sched = sched;
+    }
+}
+
+RA1NPOC_API int IOUSBSchedSetBudget(iousb_sched_t *sched, uint32_t link, uint64_t budget)
+{
+    if(!sched || !budget)
+    {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&sched->lock);
+    sched_link_t *l = SchedLink(sched, link);
+    if(l)
+    {
+        l->budget = budget;
+        if(l->tokens > SchedBurst(sched, l))
+        {
+            l->tokens = SchedBurst(sched, l);
+        }
+    }
+    pthread_cond_broadcast(&sched->cond);
+    pthread_mutex_unlock(&sched->lock);
+    return l ? 0 : -1;
+}
+
+RA1NPOC_API int IOUSBSchedBulkTryAcquire(client_t *client, uint32_t len)
+{
+    iousb_sched_t *sched = client ? client->sched : NULL;
+    sched_link_t *path[SCHED_MAX_DEPTH];
+    
+    if(!sched)
+    {
+        return 0;
+    }
+    
+    pthread_mutex_lock(&sched->lock);
+    int count = SchedPath(sched, client, path);
+    if(SchedBlocked(sched, path, count))
+    {
+        pthread_mutex_unlock(&sched->lock);
+        return -1;
+    }
+    SchedAdmit(path, count, len);
+    pthread_mutex_unlock(&sched->lock);
+    return 0;
+}
+
+RA1NPOC_API uint64_t IOUSBSchedBulkDeadline(client_t *client)
+{
+    iousb_sched_t *sched = client ? client->sched : NULL;
+    sched_link_t *path[SCHED_MAX_DEPTH];
+    
+    if(!sched)
+    {
+        return 0;
+    }
+    
+    pthread_mutex_lock(&sched->lock);
+    int count = SchedPath(sched, client, path);
+    uint64_t wait = SchedBlocked(sched, path, count);
+    pthread_mutex_unlock(&sched->lock);
+    return wait;
+}
+
+// blocks until the links of path would admit bulk; the lock is held
+RA1NPOC_STATIC_API static bool SchedWait(iousb_sched_t *sched, sched_link_t **path, int count)
+{
+    struct timespec ts;
+    bool waited = false;
+    uint64_t wait;
+    
+    while((wait = SchedBlocked(sched, path, count)) != 0)
+    {
+        if(!waited)
+        {
+            for(int i = 0; i < count; i++)
+            {
+                if(path[i])
+                {
+                    path[i]->waits++;
+                }
+            }
+            waited = true;
+        }
+        SchedDeadline(&ts, wait);
+        pthread_cond_timedwait(&sched->cond, &sched->lock, &ts);
+    }
+    return waited;
+}
+
+RA1NPOC_API void IOUSBSchedBulkWait(client_t *client)
+{
+    iousb_sched_t *sched = client ? client->sched : NULL;
+    sched_link_t *path[SCHED_MAX_DEPTH];
+    
+    if(!sched)
+    {
+        return;
+    }
+    
+    uint64_t trace = IOUSBTraceBegin();
+    pthread_mutex_lock(&sched->lock);
+    int count = SchedPath(sched, client, path);
+    bool waited = SchedWait(sched, path, count);
+    pthread_mutex_unlock(&sched->lock);
+    if(waited)
+    {
+        IOUSBTraceEndUnit(client, "sched_wait", trace, 0, kTraceNone);
+    }
+}
+
+RA1NPOC_API void IOUSBSchedBulkAcquire(client_t *client, uint32_t len)
+{
+    iousb_sched_t *sched = client ? client->sched : NULL;
+    sched_link_t *path[SCHED_MAX_DEPTH];
+    
+    if(!sched)
+    {
+        return;
+    }
+    
+    uint64_t trace = IOUSBTraceBegin();
+    pthread_mutex_lock(&sched->lock);
+    int count = SchedPath(sched, client, path);
+    bool waited = SchedWait(sched, path, count);
+    SchedAdmit(path, count, len);
+    pthread_mutex_unlock(&sched->lock);
+    if(waited)
+    {
+        IOUSBTraceEndUnit(client, "sched_wait", trace, len, kTraceBytes);
+    }
+}
+
+RA1NPOC_API void IOUSBSchedBulkRelease(client_t *client, uint32_t len)
+{
+    iousb_sched_t *sched = client ? client->sched : NULL;
+    sched_link_t *path[SCHED_MAX_DEPTH];
+    
+    if(!sched)
+    {
+        return;
+    }
+    
+    pthread_mutex_lock(&sched->lock);
+    int count = SchedPath(sched, client, path);
+    for(int i = 0; i < count; i++)
+    {
+        if(path[i])
+        {
+            path[i]->inflight -= path[i]->inflight < len ? path[i]->inflight : len;
+        }
+    }
+    pthread_cond_broadcast(&sched->cond);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+// bulk still in flight on any link of path; the lock is held
+RA1NPOC_STATIC_API static bool SchedBusy(sched_link_t **path, int count)
+{
+    for(int i = 0; i < count; i++)
+    {
+        if(path[i] && path[i]->inflight)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// holds back new bulk on the links of client; the lock is held
+RA1NPOC_STATIC_API static int SchedHold(iousb_sched_t *sched, client_t *client, sched_link_t **path)
+{
+    int count = SchedPath(sched, client, path);
+    for(int i = 0; i < count; i++)
+    {
+        if(path[i])
+        {
+            path[i]->critical++;
+        }
+    }
+    return count;
+}
+
+RA1NPOC_API void IOUSBSchedCriticalBegin(client_t *client)
+{
+    iousb_sched_t *sched = client ? client->sched : NULL;
+    sched_link_t *path[SCHED_MAX_DEPTH];
+    struct timespec ts;
+    
+    if(!sched)
+    {
+        return;
+    }
+    
+    uint64_t trace = IOUSBTraceBegin();
+    pthread_mutex_lock(&sched->lock);
+    int count = SchedHold(sched, client, path);
+    
+    // new bulk is held back from here on, give what is queued a moment to finish
+    SchedDeadline(&ts, sched->opts.drain * 1000000ULL);
+    while(SchedBusy(path, count))
+    {
+        if(pthread_cond_timedwait(&sched->cond, &sched->lock, &ts) != 0)
+        {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sched->lock);
+    IOUSBTraceEndUnit(client, "sched_drain", trace, 0, kTraceNone);
+}
+
+RA1NPOC_API int IOUSBSchedCriticalTryBegin(client_t *client)
+{
+    iousb_sched_t *sched = client ? client->sched : NULL;
+    sched_link_t *path[SCHED_MAX_DEPTH];
+    
+    if(!sched)
+    {
+        return 0;
+    }
+    
+    pthread_mutex_lock(&sched->lock);
+    int count = SchedHold(sched, client, path);
+    bool busy = SchedBusy(path, count);
+    pthread_mutex_unlock(&sched->lock);
+    return busy ? 1 : 0;
+}
+
+RA1NPOC_API bool IOUSBSchedDrained(client_t *client)
+{
+    iousb_sched_t *sched = client ? client->sched : NULL;
+    sched_link_t *path[SCHED_MAX_DEPTH];
+    
+    if(!sched)
+    {
+        return true;
+    }
+    
+    pthread_mutex_lock(&sched->lock);
+    int count = SchedPath(sched, client, path);
+    bool busy = SchedBusy(path, count);
+    pthread_mutex_unlock(&sched->lock);
+    return !busy;
+}
+
+RA1NPOC_API void IOUSBSchedCriticalEnd(client_t *client)
+{
+    iousb_sched_t *sched = client ? client->sched : NULL;
+    sched_link_t *path[SCHED_MAX_DEPTH];
+    
+    if(!sched)
+    {
+        return;
+    }
+    
+    pthread_mutex_lock(&sched->lock);
+    int count = SchedPath(sched, client, path);
+    for(int i = 0; i < count; i++)
+    {
+        if(path[i] && path[i]->critical)
+        {
+            path[i]->critical--;
+        }
+    }
+    pthread_cond_broadcast(&sched->cond);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+RA1NPOC_API size_t IOUSBSchedGetStats(iousb_sched_t *sched, sched_link_stats_t *stats, size_t max)
+{
+    size_t count = 0;
+    if(!sched || !stats)
+    {
+        return 0;
+    }
+    
+    pthread_mutex_lock(&sched->lock);
+    for(int i = 0; i < SCHED_MAX_LINKS && count < max; i++)
+    {
+        sched_link_t *link = &sched->links[i];
+        if(!link->used)
+        {
+            continue;
+        }
+        stats[count].link = link->link;
+        stats[count].budget = link->budget;
+        stats[count].bytes = link->bytes;
+        stats[count].inflight = link->inflight;
+        stats[count].critical = link->critical;
+        stats[count].waits = link->waits;
+        count++;
+    }
+    pthread_mutex_unlock(&sched->lock);
+    return count;
+}
@@ -0,0 +1,275 @@
+#include <pthread.h>
+
+#include <io/iousb.h>
+#include <io/iousb_session.h>
+#include <common/log.h>
+#include <common/common.h>
+
+#define SESSION_MAX_WORKERS     (64)
+
+typedef struct
+{
+    session_manager_t *mgr;
+    unsigned int index;
+    pthread_t thread;
+} session_worker_t;
+
+struct session_manager_p
+{
+    pthread_mutex_t lock;
+    pthread_cond_t kick;
+    pthread_cond_t done;
+    session_t *sessions[SESSION_MAX_DEVICES];
+    size_t count;
+    session_worker_t workers[SESSION_MAX_WORKERS];
+    unsigned int nworkers;
+    uint64_t generation;
+    unsigned int busy;
+    session_job_t job;
+    void *ctx;
+    int failed;
+    bool stop;
+};
+
+RA1NPOC_STATIC_API static int SessionRunOne(session_t *session, session_job_t job, void *ctx)
+{
+    if(!session->opened)
+    {
+        if(IOUSBOpenDevice(&session->client, &session->device) != 0)
+        {
+            ERR("Failed to open device ECID:%016llx at 0x%08x",
+                (unsigned long long)session->device.ecid, session->device.location);
+            return -1;
+        }
+        session->opened = true;
+    }
+    return job(session, ctx);
+}
+
+RA1NPOC_STATIC_API static void *SessionWorker(void *arg)
+{
+    session_worker_t *worker = arg;
+    session_manager_t *mgr = worker->mgr;
+    uint64_t seen = 0;
+    
+    pthread_mutex_lock(&mgr->lock);
+    for(;;)
+    {
+        while(!mgr->stop && mgr->generation == seen)
+        {
+            pthread_cond_wait(&mgr->kick, &mgr->lock);
+        }
+        if(mgr->stop)
+        {
+            break;
+        }
+        seen = mgr->generation;
+        session_job_t job = mgr->job;
+        void *ctx = mgr->ctx;
+        size_t count = mgr->count;
+        pthread_mutex_unlock(&mgr->lock);
+        
+        int failed = 0;
+        for(size_t i = worker->index; i < count; i += mgr->nworkers)
+        {
+            session_t *session = mgr->sessions[i];
+            session->result = SessionRunOne(session, job, ctx);
+            if(session->result != 0)
+            {
+                failed++;
+            }
+        }
+        
+        pthread_mutex_lock(&mgr->lock);
+        mgr->failed += failed;
+        if(--mgr->busy == 0)
+        {
+            pthread_cond_signal(&mgr->done);
+        }
+    }
+    pthread_mutex_unlock(&mgr->lock);
+    
+    return NULL;
+}
+
+RA1NPOC_API session_manager_t *IOUSBSessionManagerCreate(unsigned int workers)
+{
+    session_manager_t *mgr = calloc(1, sizeof(session_manager_t));
+    if(!mgr)
+    {
+        return NULL;
+    }
+    
+    if(!workers)
+    {
+        workers = 1;
+    }
+    if(workers > SESSION_MAX_WORKERS)
+    {
+        workers = SESSION_MAX_WORKERS;
+    }
+    
+    pthread_mutex_init(&mgr->lock, NULL);
+    pthread_cond_init(&mgr->kick, NULL);
+    pthread_cond_init(&mgr->done, NULL);
+    
+    for(unsigned int i = 0; i < workers; i++)
+    {
+        session_worker_t *worker = &mgr->workers[i];
+        worker->mgr = mgr;
+        worker->index = i;
+        if(pthread_create(&worker->thread, NULL, SessionWorker, worker) != 0)
+        {
+            ERR("Failed to start session worker %u", i);
+            break;
+        }
+        mgr->nworkers++;
+    }
+    if(!mgr->nworkers)
+    {
+        IOUSBSessionManagerDestroy(mgr);
+        return NULL;
+    }
+    
+    return mgr;
+}
+
+RA1NPOC_API void IOUSBSessionManagerDestroy(session_manager_t *mgr)
+{
+    if(!mgr)
+    {
+        return;
+    }
+    
+    pthread_mutex_lock(&mgr->lock);
+    mgr->stop = true;
+    pthread_cond_broadcast(&mgr->kick);
+    pthread_mutex_unlock(&mgr->lock);
+    
+    for(unsigned int i = 0; i < mgr->nworkers; i++)
+    {
+        pthread_join(mgr->workers[i].thread, NULL);
+    }
+    
+    for(size_t i = 0; i < mgr->count; i++)
+    {
+        IOUSBClose(&mgr->sessions[i]->client);
+        free(mgr->sessions[i]);
+    }
+    
+    pthread_cond_destroy(&mgr->done);
+    pthread_cond_destroy(&mgr->kick);
+    pthread_mutex_destroy(&mgr->lock);
+    free(mgr);
+}
+
+// the lock is held
+RA1NPOC_STATIC_API static session_t *SessionFind(session_manager_t *mgr, uint64_t ecid, uint32_t location)
+{
+    for(size_t i = 0; i < mgr->count; i++)
+    {
+        session_t *session = mgr->sessions[i];
+        if(ecid && session->device.ecid == ecid)
+        {
+            return session;
+        }
+        if(!ecid && location && session->device.location == location)
+        {
+            return session;
+        }
+    }
+    return NULL;
+}
+
+RA1NPOC_API session_t *IOUSBSessionManagerFind(session_manager_t *mgr, uint64_t ecid, uint32_t location)
+{
+    pthread_mutex_lock(&mgr->lock);
+    session_t *session = SessionFind(mgr, ecid, location);
+    pthread_mutex_unlock(&mgr->lock);
+    return session;
+}
+
+RA1NPOC_API int IOUSBSessionManagerScan(session_manager_t *mgr, const client_t *tmpl, uint16_t pid)
+{
+    usb_device_t devices[SESSION_MAX_DEVICES];
+    client_t probe;
+    int added = 0;
+    
+    memset(&probe, '\0', sizeof(client_t));
+    if(tmpl)
+    {
+        probe.backend = tmpl->backend;
+        probe.backend_data = tmpl->backend_data;
+    }
+    
+    int found = IOUSBEnumerate(&probe, pid, devices, SESSION_MAX_DEVICES);
+    if(found < 0)
+    {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&mgr->lock);
+    for(int i = 0; i < found; i++)
+    {
+        if(SessionFind(mgr, devices[i].ecid, devices[i].location))
+        {
+            continue;
+        }
+        if(mgr->count >= SESSION_MAX_DEVICES)
+        {
+            ERR("Too many sessions");
+            break;
+        }
+        
+        session_t *session = calloc(1, sizeof(session_t));
+        if(!session)
+        {
+            break;
+        }
+        session->device = devices[i];
+        session->client.backend = probe.backend;
+        session->client.backend_data = probe.backend_data;
+        mgr->sessions[mgr->count++] = session;
+        added++;
+    }
+    pthread_mutex_unlock(&mgr->lock);
+    
+    return added;
+}
+
+RA1NPOC_API size_t IOUSBSessionManagerCount(session_manager_t *mgr)
+{
+    pthread_mutex_lock(&mgr->lock);
+    size_t count = mgr->count;
+    pthread_mutex_unlock(&mgr->lock);
+    return count;
+}
+
+RA1NPOC_API session_t *IOUSBSessionManagerGet(session_manager_t *mgr, size_t index)
+{
+    pthread_mutex_lock(&mgr->lock);
+    session_t *session = index < mgr->count ? mgr->sessions[index] : NULL;
+    pthread_mutex_unlock(&mgr->lock);
+    return session;
+}
+
+RA1NPOC_API int IOUSBSessionManagerRun(session_manager_t *mgr, session_job_t job, void *ctx)
+{
+    int failed;
+    
+    pthread_mutex_lock(&mgr->lock);
+    mgr->job = job;
+    mgr->ctx = ctx;
+    mgr->failed = 0;
+    mgr->busy = mgr->nworkers;
+    mgr->generation++;
+    pthread_cond_broadcast(&mgr->kick);
+    while(mgr->busy)
+    {
+        pthread_cond_wait(&mgr->done, &mgr->lock);
+    }
+    failed = mgr->failed;
+    pthread_mutex_unlock(&mgr->lock);
+    
+    return failed;
+}
@@ -0,0 +1,1020 @@
+#include <pthread.h>
+#include <stdarg.h>
+
+#include <io/iousb.h>
+#include <io/iousb_sim.h>
+#include <io/iousb_pongo.h>
+#include <common/log.h>
+#include <common/common.h>
+
+#define SIM_MAX_FAULTS      (8)
+#define SIM_MAX_PENDING     (64)
+#define SIM_MAX_EVENTS      (4)
+#define SIM_PONGO_STDOUT_SZ (0x4000)
+
+typedef struct
+{
+    uint8_t b_request;
+    IOReturn ret;
+    unsigned int count;
+} sim_fault_t;
+
+typedef struct
+{
+    async_transfer_t *transfer;
+    uint16_t w_length;
+    uint64_t submit;
+    uint64_t done;
+    bool bulk;
+    bool aborted;
+    transfer_t result;
+} sim_pending_t;
+
+struct iousb_sim_p
+{
+    pthread_mutex_t lock;
+    iousb_sim_config_t config;
+    uint16_t pid;
+    bool open;
+    uint32_t rng;
+    uint8_t dfu_state;
+    uint8_t dfu_status;
+    sim_fault_t faults[SIM_MAX_FAULTS];
+    sim_pending_t pending[SIM_MAX_PENDING];
+    unsigned int npending;
+    uint64_t bulk_free;
+    uint64_t ep0_free;              // async control requests go over EP0 one at a time
+    pthread_cond_t plug;
+    uint64_t plugs;                 // bumped on every bus (dis)appearance
+    uint64_t replug_at;             // when replug_pid comes back, 0 = nothing pending
+    uint16_t replug_pid;
+    bool pongo_running;
+    uint64_t pongo_done;            // when the running shell command finishes
+    char pongo_command[PONGO_MAX_COMMAND_SZ];
+    char pongo_stdout[SIM_PONGO_STDOUT_SZ];
+    size_t pongo_stdout_len;
+    iousb_sim_stats_t stats;
+};
+
+typedef struct
+{
+    uint64_t plugs;
+    usb_device_t device;            // what the monitor last saw on the bus
+    hotplug_event_t events[SIM_MAX_EVENTS];
+    unsigned int nevents;
+} sim_monitor_t;
+
+RA1NPOC_STATIC_API static uint64_t SimNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+RA1NPOC_STATIC_API static void SimSleepUntil(uint64_t deadline)
+{
+    uint64_t now;
+    while((now = SimNow()) < deadline)
+    {
+        struct timespec ts;
+        ts.tv_sec = (deadline - now) / 1000000000ULL;
+        ts.tv_nsec = (deadline - now) % 1000000000ULL;
+        nanosleep(&ts, NULL);
+    }
+}
+
+RA1NPOC_STATIC_API static void SimDelay(uint64_t nsec)
+{
+    if(nsec)
+    {
+        SimSleepUntil(SimNow() + nsec);
+    }
+}
+
+// xorshift32, enough to make stall_rate repeatable for a given seed
+RA1NPOC_STATIC_API static uint32_t SimRandom(iousb_sim_t *sim)
+{
+    uint32_t x = sim->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    sim->rng = x;
+    return x;
+}
+
+RA1NPOC_STATIC_API static bool SimIsDFU(uint16_t pid)
+{
+    return pid == kDeviceDFUModeID || pid == kDeviceStage2ModeID;
+}
+
+RA1NPOC_STATIC_API static void SimSerial(iousb_sim_t *sim, char *buf, size_t len)
+{
+    const iousb_sim_config_t *c = &sim->config;
+    int n = snprintf(buf, len, "CPID:%04X CPRV:%02X CPFM:03 SCEP:01 BDID:0C ECID:%016llX IBFL:3C",
+                     c->cpid, c->cprv, (unsigned long long)c->ecid);
+    
+    if(n < 0 || (size_t)n >= len)
+    {
+        return;
+    }
+    if(sim->pid == kDevicePongoModeID)
+    {
+        snprintf(buf + n, len - n, " SRTG:[PongoOS-iousb-sim]");
+    }
+    else if(SimIsDFU(sim->pid))
+    {
+        n += snprintf(buf + n, len - n, " SRTG:[iBoot-iousb-sim]");
+        if(sim->pid == kDeviceStage2ModeID && (size_t)n < len)
+        {
+            n += snprintf(buf + n, len - n, " YOLO:checkra1n");
+        }
+        if(c->pwned && (size_t)n < len)
+        {
+            snprintf(buf + n, len - n, " PWND:[checkm8]");
+        }
+    }
+    else
+    {
+        snprintf(buf + n, len - n, " SRNM:[IOUSBSIM0000]");
+    }
+}
+
+RA1NPOC_STATIC_API static uint64_t SimDeviceId(iousb_sim_t *sim)
+{
+    // a re-enumerated device is a new device, like a fresh devnum or registry entry
+    return (uintptr_t)sim + sim->plugs;
+}
+
+// must hold sim->lock, the device leaves the bus and comes back as pid (0 = stays gone)
+RA1NPOC_STATIC_API static void SimPlugLocked(iousb_sim_t *sim, uint16_t pid)
+{
+    sim->pid = pid;
+    sim->open = false;
+    sim->plugs++;
+    sim->dfu_state = DFU_STATE_IDLE;
+    sim->dfu_status = DFU_STATUS_OK;
+    sim->pongo_running = false;
+    sim->pongo_stdout_len = 0;
+    pthread_cond_broadcast(&sim->plug);
+}
+
+// must hold sim->lock, like SimPlugLocked but pid only shows up after replug_delay
+RA1NPOC_STATIC_API static void SimReplugLocked(iousb_sim_t *sim, uint16_t pid)
+{
+    if(!sim->config.replug_delay || !pid)
+    {
+        SimPlugLocked(sim, pid);
+        return;
+    }
+    SimPlugLocked(sim, 0);
+    sim->replug_pid = pid;
+    sim->replug_at = SimNow() + sim->config.replug_delay * 1000ULL;
+}
+
+// must hold sim->lock
+RA1NPOC_STATIC_API static void SimPollLocked(iousb_sim_t *sim)
+{
+    if(sim->replug_at && SimNow() >= sim->replug_at)
+    {
+        sim->replug_at = 0;
+        SimPlugLocked(sim, sim->replug_pid);
+    }
+}
+
+RA1NPOC_STATIC_API static IOReturn SimFault(iousb_sim_t *sim, uint8_t b_request)
+{
+    for(int i = 0; i < SIM_MAX_FAULTS; i++)
+    {
+        sim_fault_t *f = &sim->faults[i];
+        if(f->count && f->b_request == b_request)
+        {
+            f->count--;
+            return f->ret;
+        }
+    }
+    if(sim->config.stall_rate && (SimRandom(sim) % 1000) < sim->config.stall_rate)
+    {
+        return kUSBHostReturnPipeStalled;
+    }
+    return kIOReturnSuccess;
+}
+
+RA1NPOC_STATIC_API static transfer_t SimDFURequest(iousb_sim_t *sim, const control_request_t *req, unsigned char *data)
+{
+    transfer_t result;
+    memset(&result, '\0', sizeof(transfer_t));
+    
+    if(req->bm_request_type == 0x21 && req->b_request == DFU_DNLOAD)
+    {
+        if(sim->dfu_state != DFU_STATE_IDLE && sim->dfu_state != DFU_STATE_DNLOAD_IDLE)
+        {
+            sim->dfu_state = DFU_STATE_ERROR;
+            sim->dfu_status = DFU_STATUS_ERR_STALLEDPKT;
+            result.ret = kUSBHostReturnPipeStalled;
+            return result;
+        }
+        if(req->w_length)
+        {
+            sim->stats.dfu_bytes += req->w_length;
+            sim->dfu_state = DFU_STATE_DNLOAD_SYNC;
+        }
+        else
+        {
+            sim->dfu_state = DFU_STATE_MANIFEST_SYNC;
+        }
+        result.wLenDone = req->w_length;
+        return result;
+    }
+    if(req->bm_request_type == 0xa1 && req->b_request == DFU_GET_STATUS)
+    {
+        switch(sim->dfu_state)
+        {
+            case DFU_STATE_DNLOAD_SYNC:
+                sim->dfu_state = DFU_STATE_DNLOAD_IDLE;
+                break;
+            case DFU_STATE_MANIFEST_SYNC:
+                sim->dfu_state = DFU_STATE_MANIFEST;
+                break;
+            case DFU_STATE_MANIFEST:
+                sim->dfu_state = DFU_STATE_MANIFEST_WAIT_RESET;
+                sim->stats.dfu_image_size = sim->stats.dfu_bytes;
+                sim->stats.dfu_bytes = 0;
+                break;
+            default:
+                break;
+        }
+        unsigned char status[6] = { sim->dfu_status, 0, 0, 0, sim->dfu_state, 0 };
+        result.wLenDone = req->w_length < sizeof(status) ? req->w_length : sizeof(status);
+        if(data)
+        {
+            memcpy(data, status, result.wLenDone);
+        }
+        return result;
+    }
+    if(req->bm_request_type == 0x21 && (req->b_request == DFU_CLR_STATUS || req->b_request == DFU_ABORT))
+    {
+        sim->dfu_state = DFU_STATE_IDLE;
+        sim->dfu_status = DFU_STATUS_OK;
+        sim->stats.dfu_bytes = 0;
+        return result;
+    }
+    
+    // anything else on ep0 is accepted, IN requests return zeroes
+    if((req->bm_request_type & 0x80) && data)
+    {
+        memset(data, '\0', req->w_length);
+    }
+    result.wLenDone = req->w_length;
+    return result;
+}
+
+// must hold sim->lock, console output that does not fit is lost like on the device
+RA1NPOC_STATIC_API static void SimPongoPrint(iousb_sim_t *sim, const char *fmt, ...)
+{
+    size_t room = sizeof(sim->pongo_stdout) - sim->pongo_stdout_len;
+    va_list ap;
+    
+    va_start(ap, fmt);
+    int n = vsnprintf(sim->pongo_stdout + sim->pongo_stdout_len, room, fmt, ap);
+    va_end(ap);
+    if(n > 0)
+    {
+        // vsnprintf keeps a byte for the terminator we never hand out
+        sim->pongo_stdout_len += (size_t)n < room ? (size_t)n : room - 1;
+    }
+}
+
+// must hold sim->lock, finishes the running shell command once its time is up;
+// boot commands take the device off the bus
+RA1NPOC_STATIC_API static void SimPongoTickLocked(iousb_sim_t *sim)
+{
+    if(sim->pongo_running && SimNow() >= sim->pongo_done)
+    {
+        sim->pongo_running = false;
+        SimPongoPrint(sim, "%s: done\n", sim->pongo_command);
+        if(!strncmp(sim->pongo_command, "boot", 4))
+        {
+            SimPlugLocked(sim, 0);
+        }
+    }
+}
+
+RA1NPOC_STATIC_API static transfer_t SimPongoRequest(iousb_sim_t *sim, const control_request_t *req, unsigned char *data)
+{
+    transfer_t result;
+    memset(&result, '\0', sizeof(transfer_t));
+    
+    if(req->bm_request_type == 0x21 && req->b_request == PONGO_REQ_COMMAND && data)
+    {
+        if(sim->pongo_running)
+        {
+            sim->stats.stalled++;
+            result.ret = kUSBHostReturnPipeStalled;
+            return result;
+        }
+        size_t len = 0;
+        while(len < req->w_length && len < sizeof(sim->pongo_command) - 1 && data[len] != '\n')
+        {
+            len++;
+        }
+        memcpy(sim->pongo_command, data, len);
+        sim->pongo_command[len] = '\0';
+        SimPongoPrint(sim, "pongoOS> %s\n", sim->pongo_command);
+        sim->pongo_running = true;
+        sim->pongo_done = SimNow() + sim->config.pongo_latency * 1000ULL;
+        sim->stats.pongo_commands++;
+    }
+    else if(req->bm_request_type == 0x21 && req->b_request == PONGO_REQ_UPLOAD_SIZE && data && req->w_length == 4)
+    {
+        sim->stats.pongo_upload = data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+    }
+    else if(req->bm_request_type == 0xa1 && req->b_request == PONGO_REQ_PROMPT && data && req->w_length)
+    {
+        memset(data, '\0', req->w_length);
+        data[0] = !sim->pongo_running;
+        result.wLenDone = 1;
+        return result;
+    }
+    else if(req->bm_request_type == 0xa1 && req->b_request == PONGO_REQ_STDOUT && data)
+    {
+        size_t len = sim->pongo_stdout_len < req->w_length ? sim->pongo_stdout_len : req->w_length;
+        memcpy(data, sim->pongo_stdout, len);
+        memmove(sim->pongo_stdout, sim->pongo_stdout + len, sim->pongo_stdout_len - len);
+        sim->pongo_stdout_len -= len;
+        result.wLenDone = (UInt32)len;
+        return result;
+    }
+    else if((req->bm_request_type & 0x80) && data)
+    {
+        memset(data, '\0', req->w_length);
+    }
+    result.wLenDone = req->w_length;
+    return result;
+}
+
+RA1NPOC_STATIC_API static transfer_t SimRequest(iousb_sim_t *sim, const control_request_t *req, unsigned char *data)
+{
+    transfer_t result;
+    memset(&result, '\0', sizeof(transfer_t));
+    
+    SimPongoTickLocked(sim);
+    if(!sim->open || !sim->pid)
+    {
+        result.ret = kIOReturnNoDevice;
+        return result;
+    }
+    
+    result.ret = SimFault(sim, req->b_request);
+    if(result.ret != kIOReturnSuccess)
+    {
+        if(result.ret == kUSBHostReturnPipeStalled)
+        {
+            sim->stats.stalled++;
+        }
+        return result;
+    }
+    
+    if(SimIsDFU(sim->pid))
+    {
+        return SimDFURequest(sim, req, data);
+    }
+    if(sim->pid == kDevicePongoModeID)
+    {
+        return SimPongoRequest(sim, req, data);
+    }
+    
+    if(sim->pid != kDevicePongoModeID && req->bm_request_type == 0x40 && data &&
+       req->w_length >= 6 && !memcmp(data, "reboot", 6))
+    {
+        // recovery reboot, the device drops off the bus
+        SimPlugLocked(sim, 0);
+    }
+    if((req->bm_request_type & 0x80) && data)
+    {
+        memset(data, '\0', req->w_length);
+    }
+    result.wLenDone = req->w_length;
+    return result;
+}
+
+RA1NPOC_API iousb_sim_t *IOUSBSimCreate(const iousb_sim_config_t *config)
+{
+    iousb_sim_t *sim = calloc(1, sizeof(iousb_sim_t));
+    if(!sim)
+    {
+        return NULL;
+    }
+    pthread_mutex_init(&sim->lock, NULL);
+    pthread_cond_init(&sim->plug, NULL);
+    if(config)
+    {
+        sim->config = *config;
+    }
+    if(!sim->config.pid)
+    {
+        sim->config.pid = kDeviceDFUModeID;
+    }
+    if(!sim->config.cpid)
+    {
+        sim->config.cpid = 0x8010;
+        sim->config.cprv = 0x11;
+    }
+    sim->pid = sim->config.pid;
+    sim->rng = sim->config.seed ? sim->config.seed : 0x1227;
+    sim->dfu_state = DFU_STATE_IDLE;
+    sim->dfu_status = DFU_STATUS_OK;
+    return sim;
+}
+
+RA1NPOC_API void IOUSBSimDestroy(iousb_sim_t *sim)
+{
+    if(sim)
+    {
+        pthread_cond_destroy(&sim->plug);
+        pthread_mutex_destroy(&sim->lock);
+        free(sim);
+    }
+}
+
+RA1NPOC_API void IOUSBSimAttach(client_t *client, iousb_sim_t *sim)
+{
+    client->backend = &iousb_sim_backend;
+    client->backend_data = sim;
+}
+
+RA1NPOC_API void IOUSBSimSetPid(iousb_sim_t *sim, uint16_t pid)
+{
+    pthread_mutex_lock(&sim->lock);
+    sim->replug_at = 0;
+    if(sim->pid != pid)
+    {
+        SimPlugLocked(sim, pid);
+    }
+    sim->dfu_state = DFU_STATE_IDLE;
+    sim->dfu_status = DFU_STATUS_OK;
+    pthread_mutex_unlock(&sim->lock);
+}
+
+RA1NPOC_API void IOUSBSimInjectFault(iousb_sim_t *sim, uint8_t b_request, IOReturn ret, unsigned int count)
+{
+    pthread_mutex_lock(&sim->lock);
+    for(int i = 0; i < SIM_MAX_FAULTS; i++)
+    {
+        sim_fault_t *f = &sim->faults[i];
+        if(!f->count || f->b_request == b_request)
+        {
+            f->b_request = b_request;
+            f->ret = ret;
+            f->count = count;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sim->lock);
+}
+
+RA1NPOC_API void IOUSBSimGetStats(iousb_sim_t *sim, iousb_sim_stats_t *stats)
+{
+    pthread_mutex_lock(&sim->lock);
+    SimPollLocked(sim);
+    *stats = sim->stats;
+    stats->dfu_state = sim->dfu_state;
+    stats->pid = sim->pid;
+    pthread_mutex_unlock(&sim->lock);
+}
+
+RA1NPOC_STATIC_API static int SimOpenLayout(client_t *client, uint16_t pid, const usb_layout_t *layout)
+{
+    iousb_sim_t *sim = client->backend_data;
+    char serialstr[256];
+    int ret = -1;
+    
+    if(!sim)
+    {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&sim->lock);
+    SimPollLocked(sim);
+    if(sim->pid && sim->pid == pid && !sim->open)
+    {
+        sim->open = true;
+        sim->npending = 0;
+        sim->stats.opens++;
+        if(!layout)
+        {
+            sim->stats.discoveries++;
+        }
+        SimSerial(sim, serialstr, sizeof(serialstr));
+        client->id = SimDeviceId(sim);
+        client->location = sim->config.location;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&sim->lock);
+    
+    if(!ret)
+    {
+        IOUSBGetInfo(client, serialstr);
+        if(layout)
+        {
+            client->layout = *layout;
+        }
+        else
+        {
+            // config descriptor walk, SET_CONFIGURATION and the serial string
+            SimDelay((uint64_t)sim->config.discovery_latency * 1000ULL);
+            memset(&client->layout, '\0', sizeof(usb_layout_t));
+            client->layout.pid = pid;
+            client->layout.config = 1;
+            client->layout.if_class = 0xfe;
+            client->layout.if_subclass = 0x01;
+            client->layout.bulk_out = 0x02;
+            client->layout.bulk_in = 0x81;
+            IOUSBLayoutStore(client, &client->layout);
+        }
+    }
+    return ret;
+}
+
+RA1NPOC_STATIC_API static int SimOpen(client_t *client, uint16_t pid)
+{
+    return SimOpenLayout(client, pid, NULL);
+}
+
+RA1NPOC_STATIC_API static int SimEnumerate(client_t *client, uint16_t pid, usb_device_t *devices, int max)
+{
+    iousb_sim_t *sim = client->backend_data;
+    int count = 0;
+    
+    if(!sim)
+    {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&sim->lock);
+    SimPollLocked(sim);
+    if(max > 0 && sim->pid && sim->pid == pid)
+    {
+        memset(devices, '\0', sizeof(usb_device_t));
+        devices->id = SimDeviceId(sim);
+        devices->pid = pid;
+        devices->location = sim->config.location;
+        devices->ecid = sim->config.ecid;
+        SimSerial(sim, devices->serial, sizeof(devices->serial));
+        count = 1;
+    }
+    pthread_mutex_unlock(&sim->lock);
+    
+    return count;
+}
+
+RA1NPOC_STATIC_API static int SimOpenDevice(client_t *client, const usb_device_t *device)
+{
+    iousb_sim_t *sim = client->backend_data;
+    if(!sim)
+    {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&sim->lock);
+    SimPollLocked(sim);
+    uint64_t id = SimDeviceId(sim);
+    pthread_mutex_unlock(&sim->lock);
+    
+    if(device->id != id)
+    {
+        return -1;
+    }
+    return SimOpenLayout(client, device->pid, IOUSBLayoutLookup(client, device->pid));
+}
+
+RA1NPOC_STATIC_API static void SimClose(client_t *client)
+{
+    iousb_sim_t *sim = client->backend_data;
+    if(sim)
+    {
+        pthread_mutex_lock(&sim->lock);
+        sim->open = false;
+        sim->npending = 0;
+        pthread_mutex_unlock(&sim->lock);
+    }
+}
+
+RA1NPOC_STATIC_API static void SimReset(client_t *client, int reset)
+{
+    iousb_sim_t *sim = client->backend_data;
+    (void)reset;
+    
+    pthread_mutex_lock(&sim->lock);
+    if(sim->pid)
+    {
+        // a bus reset always re-enumerates, a manifested image comes back as manifest_pid
+        bool manifest = SimIsDFU(sim->pid) && sim->dfu_state == DFU_STATE_MANIFEST_WAIT_RESET;
+        SimReplugLocked(sim, manifest ? sim->config.manifest_pid : sim->pid);
+    }
+    pthread_mutex_unlock(&sim->lock);
+}
+
+RA1NPOC_STATIC_API static IOReturn SimAbortPipeZero(client_t *client)
+{
+    iousb_sim_t *sim = client->backend_data;
+    uint64_t now = SimNow();
+    
+    pthread_mutex_lock(&sim->lock);
+    if(!sim->open)
+    {
+        pthread_mutex_unlock(&sim->lock);
+        return kIOReturnError;
+    }
+    for(unsigned int i = 0; i < sim->npending; i++)
+    {
+        sim_pending_t *p = &sim->pending[i];
+        if(p->bulk || p->aborted || (!sim->config.async_hang && p->done <= now))
+        {
+            continue;
+        }
+        // report the ep0 packets that made it out before the abort
+        uint64_t len = 0;
+        if(p->done > p->submit && now > p->submit)
+        {
+            len = (uint64_t)p->w_length * (now - p->submit) / (p->done - p->submit);
+            if(len > p->w_length)
+            {
+                len = p->w_length;
+            }
+        }
+        p->aborted = true;
+        p->done = now;
+        p->result.ret = kIOReturnAborted;
+        p->result.wLenDone = (UInt32)(len - (len % EP0_MAX_PACKET_SZ));
+        sim->stats.aborted++;
+    }
+    sim->ep0_free = now;
+    pthread_mutex_unlock(&sim->lock);
+    return kIOReturnSuccess;
+}
+
+RA1NPOC_STATIC_API static transfer_t SimControlTransfer(client_t *client,
+                                                        const control_request_t *req,
+                                                        unsigned char *data,
+                                                        unsigned int timeout)
+{
+    iousb_sim_t *sim = client->backend_data;
+    transfer_t result;
+    (void)timeout;
+    
+    pthread_mutex_lock(&sim->lock);
+    sim->stats.control++;
+    result = SimRequest(sim, req, data);
+    pthread_mutex_unlock(&sim->lock);
+    
+    SimDelay((uint64_t)sim->config.control_latency * 1000);
+    
+    return result;
+}
+
+RA1NPOC_STATIC_API static transfer_t SimAsyncControlTransfer(client_t *client,
+                                                             const control_request_t *req,
+                                                             unsigned char *data,
+                                                             async_transfer_t *transfer,
+                                                             unsigned int timeout)
+{
+    iousb_sim_t *sim = client->backend_data;
+    transfer_t result;
+    (void)timeout;
+    
+    memset(&result, '\0', sizeof(transfer_t));
+    
+    pthread_mutex_lock(&sim->lock);
+    if(!sim->open)
+    {
+        result.ret = kIOReturnNoDevice;
+    }
+    else if(sim->npending >= SIM_MAX_PENDING)
+    {
+        result.ret = kIOReturnNoResources;
+    }
+    else
+    {
+        sim_pending_t *p = &sim->pending[sim->npending++];
+        memset(p, '\0', sizeof(sim_pending_t));
+        p->transfer = transfer;
+        p->w_length = req->w_length;
+        uint64_t now = SimNow();
+        p->submit = now > sim->ep0_free ? now : sim->ep0_free;
+        p->done = p->submit + (uint64_t)sim->config.control_latency * 1000;
+        sim->ep0_free = p->done;
+        p->result = SimRequest(sim, req, data);
+        sim->stats.async++;
+    }
+    pthread_mutex_unlock(&sim->lock);
+    
+    return result;
+}
+
+RA1NPOC_STATIC_API static int SimAsyncWait(client_t *client)
+{
+    iousb_sim_t *sim = client->backend_data;
+    sim_pending_t done;
+    int idx = -1;
+    
+    pthread_mutex_lock(&sim->lock);
+    for(unsigned int i = 0; i < sim->npending; i++)
+    {
+        sim_pending_t *p = &sim->pending[i];
+        if(sim->config.async_hang && !p->bulk && !p->aborted)
+        {
+            continue;
+        }
+        if(idx < 0 || p->done < sim->pending[idx].done)
+        {
+            idx = i;
+        }
+    }
+    if(idx >= 0)
+    {
+        done = sim->pending[idx];
+        sim->pending[idx] = sim->pending[--sim->npending];
+    }
+    pthread_mutex_unlock(&sim->lock);
+    
+    if(idx < 0)
+    {
+        return -1;
+    }
+    
+    SimSleepUntil(done.done);
+    if(done.transfer)
+    {
+        *done.transfer = done.result;
+    }
+    return 0;
+}
+
+RA1NPOC_STATIC_API static int SimAsyncPoll(client_t *client)
+{
+    iousb_sim_t *sim = client->backend_data;
+    sim_pending_t done[SIM_MAX_PENDING];
+    unsigned int count = 0;
+    uint64_t now = SimNow();
+    
+    pthread_mutex_lock(&sim->lock);
+    for(unsigned int i = 0; i < sim->npending;)
+    {
+        sim_pending_t *p = &sim->pending[i];
+        if((sim->config.async_hang && !p->bulk && !p->aborted) || p->done > now)
+        {
+            i++;
+            continue;
+        }
+        done[count++] = *p;
+        *p = sim->pending[--sim->npending];
+    }
+    pthread_mutex_unlock(&sim->lock);
+    
+    for(unsigned int i = 0; i < count; i++)
+    {
+        if(done[i].transfer)
+        {
+            *done[i].transfer = done[i].result;
+        }
+    }
+    return (int)count;
+}
+
+RA1NPOC_STATIC_API static uint64_t SimAsyncDeadline(client_t *client)
+{
+    iousb_sim_t *sim = client->backend_data;
+    uint64_t deadline = 0;
+    
+    pthread_mutex_lock(&sim->lock);
+    for(unsigned int i = 0; i < sim->npending; i++)
+    {
+        sim_pending_t *p = &sim->pending[i];
+        if(sim->config.async_hang && !p->bulk && !p->aborted)
+        {
+            continue;
+        }
+        if(!deadline || p->done < deadline)
+        {
+            deadline = p->done;
+        }
+    }
+    pthread_mutex_unlock(&sim->lock);
+    
+    return deadline;
+}
+
+RA1NPOC_STATIC_API static transfer_t SimInterfaceControlTransfer(client_t *client,
+                                                                 const control_request_t *req,
+                                                                 unsigned char *data)
+{
+    return SimControlTransfer(client, req, data, IOUSB_NO_TIMEOUT);
+}
+
+// the bulk pipe is a serial resource: the per-transfer latency overlaps with
+// whatever is still queued, the wire time does not
+RA1NPOC_STATIC_API static IOReturn SimBulkSchedule(iousb_sim_t *sim, uint32_t len, uint64_t *done)
+{
+    if(!sim->open || !sim->pid)
+    {
+        return kIOReturnNoDevice;
+    }
+    if(SimIsDFU(sim->pid))
+    {
+        // DFU has no bulk pipe
+        return kIOReturnNotFound;
+    }
+    
+    uint64_t now = SimNow();
+    uint64_t start = now + (uint64_t)sim->config.bulk_latency * 1000;
+    if(start < sim->bulk_free)
+    {
+        start = sim->bulk_free;
+    }
+    if(sim->config.bulk_bandwidth)
+    {
+        start += (uint64_t)len * 1000000000ULL / sim->config.bulk_bandwidth;
+    }
+    sim->bulk_free = start;
+    sim->stats.bulk++;
+    sim->stats.bulk_bytes += len;
+    *done = start;
+    return kIOReturnSuccess;
+}
+
+RA1NPOC_STATIC_API static transfer_t SimBulkUpload(client_t *client, void *data, uint32_t len)
+{
+    iousb_sim_t *sim = client->backend_data;
+    transfer_t result;
+    uint64_t done = 0;
+    (void)data;
+    
+    memset(&result, '\0', sizeof(transfer_t));
+    
+    pthread_mutex_lock(&sim->lock);
+    result.ret = SimBulkSchedule(sim, len, &done);
+    pthread_mutex_unlock(&sim->lock);
+    
+    if(result.ret == kIOReturnSuccess)
+    {
+        SimSleepUntil(done);
+        result.wLenDone = len;
+    }
+    
+    return result;
+}
+
+RA1NPOC_STATIC_API static transfer_t SimBulkUploadAsync(client_t *client, void *data, uint32_t len, async_transfer_t *transfer)
+{
+    iousb_sim_t *sim = client->backend_data;
+    transfer_t result;
+    uint64_t done = 0;
+    (void)data;
+    
+    memset(&result, '\0', sizeof(transfer_t));
+    
+    pthread_mutex_lock(&sim->lock);
+    if(sim->npending >= SIM_MAX_PENDING)
+    {
+        result.ret = kIOReturnNoResources;
+    }
+    else
+    {
+        result.ret = SimBulkSchedule(sim, len, &done);
+    }
+    if(result.ret == kIOReturnSuccess)
+    {
+        sim_pending_t *p = &sim->pending[sim->npending++];
+        memset(p, '\0', sizeof(sim_pending_t));
+        p->transfer = transfer;
+        p->bulk = true;
+        p->submit = SimNow();
+        p->done = done;
+        p->result.wLenDone = len;
+    }
+    pthread_mutex_unlock(&sim->lock);
+    
+    return result;
+}
+
+RA1NPOC_STATIC_API static void *SimMonitorOpen(client_t *client)
+{
+    iousb_sim_t *sim = client->backend_data;
+    if(!sim)
+    {
+        return NULL;
+    }
+    
+    sim_monitor_t *monitor = calloc(1, sizeof(sim_monitor_t));
+    if(!monitor)
+    {
+        return NULL;
+    }
+    
+    pthread_mutex_lock(&sim->lock);
+    SimPollLocked(sim);
+    monitor->plugs = sim->plugs;
+    monitor->device.id = SimDeviceId(sim);
+    monitor->device.pid = sim->pid;
+    pthread_mutex_unlock(&sim->lock);
+    
+    return monitor;
+}
+
+RA1NPOC_STATIC_API static int SimMonitorNext(client_t *client, void *handle, hotplug_event_t *event, unsigned int timeout)
+{
+    iousb_sim_t *sim = client->backend_data;
+    sim_monitor_t *monitor = handle;
+    uint64_t deadline = SimNow() + timeout * 1000000ULL;
+    int ret = 1;
+    
+    pthread_mutex_lock(&sim->lock);
+    for(;;)
+    {
+        SimPollLocked(sim);
+        // Only with the queue drained, so it never holds more than the two
+        // events below. Whatever happened meanwhile is collapsed on the next
+        // call instead.
+        if(!monitor->nevents && monitor->plugs != sim->plugs)
+        {
+            // collapse whatever happened since into remove + arrive
+            if(monitor->device.pid)
+            {
+                hotplug_event_t *ev = &monitor->events[monitor->nevents++];
+                ev->type = kUSBDeviceRemoved;
+                ev->device = monitor->device;
+            }
+            memset(&monitor->device, '\0', sizeof(usb_device_t));
+            monitor->device.id = SimDeviceId(sim);
+            monitor->device.pid = sim->pid;
+            monitor->device.location = sim->config.location;
+            monitor->device.ecid = sim->config.ecid;
+            if(sim->pid)
+            {
+                SimSerial(sim, monitor->device.serial, sizeof(monitor->device.serial));
+                hotplug_event_t *ev = &monitor->events[monitor->nevents++];
+                ev->type = kUSBDeviceArrived;
+                ev->device = monitor->device;
+            }
+            monitor->plugs = sim->plugs;
+        }
+        if(monitor->nevents)
+        {
+            *event = monitor->events[0];
+            memmove(&monitor->events[0], &monitor->events[1], --monitor->nevents * sizeof(hotplug_event_t));
+            ret = 0;
+            break;
+        }
+        
+        uint64_t now = SimNow();
+        if(now >= deadline)
+        {
+            break;
+        }
+        uint64_t wake = deadline;
+        if(sim->replug_at && sim->replug_at < wake)
+        {
+            wake = sim->replug_at;
+        }
+        
+        // sim time is CLOCK_MONOTONIC, the condvar waits on CLOCK_REALTIME
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        uint64_t abs = ts.tv_sec * 1000000000ULL + ts.tv_nsec + (wake - now);
+        ts.tv_sec = abs / 1000000000ULL;
+        ts.tv_nsec = abs % 1000000000ULL;
+        pthread_cond_timedwait(&sim->plug, &sim->lock, &ts);
+    }
+    pthread_mutex_unlock(&sim->lock);
+    
+    return ret;
+}
+
+RA1NPOC_STATIC_API static void SimMonitorClose(client_t *client, void *monitor)
+{
+    (void)client;
+    free(monitor);
+}
+
+const iousb_backend_t iousb_sim_backend =
+{
+    .name                       = "sim",
+    .open                       = SimOpen,
+    .enumerate                  = SimEnumerate,
+    .open_device                = SimOpenDevice,
+    .close                      = SimClose,
+    .reset                      = SimReset,
+    .reenumerate                = kDeviceUSBResetDevice | kDeviceUSBReEnumerate | kDeviceUSBPhysRePlug,
+    .abort_pipe_zero            = SimAbortPipeZero,
+    .control_transfer           = SimControlTransfer,
+    .async_control_transfer     = SimAsyncControlTransfer,
+    .async_wait                 = SimAsyncWait,
+    .interface_control_transfer = SimInterfaceControlTransfer,
+    .bulk_upload                = SimBulkUpload,
+    .bulk_upload_async          = SimBulkUploadAsync,
+    .monitor_open               = SimMonitorOpen,
+    .monitor_next               = SimMonitorNext,
+    .monitor_close              = SimMonitorClose,
+    .async_poll                 = SimAsyncPoll,
+    .async_deadline             = SimAsyncDeadline,
+};
@@ -0,0 +1,408 @@
+#include <stdarg.h>
+#include <stdatomic.h>
+
+#include <io/iousb.h>
+#include <io/iousb_telemetry.h>
+#include <io/iousb_autoboot.h>
+#include <io/iousb_trace.h>
+#include <io/iousb_policy.h>
+#include <common/log.h>
+#include <common/common.h>
+
+typedef struct
+{
+    _Atomic uint64_t count;
+    _Atomic uint64_t bytes;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t buckets[TELEMETRY_BUCKETS];
+    _Atomic uint64_t errors[TELEMETRY_MAX_ERRORS];
+} telemetry_counters_t;
+
+struct iousb_telemetry_p
+{
+    telemetry_counters_t ops[TELEMETRY_MAX_OPS];
+    _Atomic uint64_t stage_entries[TELEMETRY_MAX_STAGES];
+    _Atomic uint64_t stage_time[TELEMETRY_MAX_STAGES];
+    _Atomic int stage;
+    _Atomic uint64_t stage_start;
+};
+
+typedef struct
+{
+    char *buf;
+    size_t len;
+    size_t off;
+} telemetry_writer_t;
+
+static const char *op_names[TELEMETRY_MAX_OPS] =
+{
+    "control", "control_to", "async_control", "interface_control", "batch", "bulk", "bulk_async",
+};
+
+static const char *error_names[TELEMETRY_MAX_ERRORS] =
+{
+    "ok", "stalled", "timeout", "aborted", "no_device", "not_responding", "short", "other",
+};
+
+RA1NPOC_STATIC_API static uint64_t TelemetryNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+RA1NPOC_STATIC_API static int TelemetryBucket(uint64_t nsec)
+{
+    uint64_t n = nsec >> 10;
+    int idx = n ? 64 - __builtin_clzll(n) : 0;
+    return idx < TELEMETRY_BUCKETS ? idx : TELEMETRY_BUCKETS - 1;
+}
+
+RA1NPOC_STATIC_API static int TelemetryError(IOReturn ret)
+{
+    switch(ret)
+    {
+        case kIOReturnSuccess:
+            return kTelemetryOK;
+        case kUSBHostReturnPipeStalled:
+#if defined(__APPLE__)
+        case kIOUSBPipeStalled:
+#endif
+            return kTelemetryStalled;
+        case kIOReturnTimeout:
+#if defined(__APPLE__)
+        case kIOUSBTransactionTimeout:
+#endif
+            return kTelemetryTimeout;
+        case kIOReturnAborted:
+            return kTelemetryAborted;
+        case kIOReturnNoDevice:
+            return kTelemetryNoDevice;
+        case kIOReturnNotResponding:
+            return kTelemetryNotResponding;
+        case kIOReturnUnderrun:
+        case kIOReturnOverrun:
+            return kTelemetryShort;
+        default:
+            return kTelemetryOther;
+    }
+}
+
+RA1NPOC_API int IOUSBTelemetryEnable(client_t *client)
+{
+    if(!client)
+    {
+        return -1;
+    }
+    if(!client->telemetry)
+    {
+        iousb_telemetry_t *telemetry = calloc(1, sizeof(iousb_telemetry_t));
+        if(!telemetry)
+        {
+            ERR("Out of memory");
+            return -1;
+        }
+        atomic_store(&telemetry->stage_start, TelemetryNow());
+        client->telemetry = telemetry;
+    }
+    return 0;
+}
+
+RA1NPOC_API void IOUSBTelemetryDisable(client_t *client)
+{
+    if(client && client->telemetry)
+    {
+        free(client->telemetry);
+        client->telemetry = NULL;
+    }
+}
+
+RA1NPOC_API void IOUSBTelemetryReset(client_t *client)
+{
+    iousb_telemetry_t *telemetry = client ? client->telemetry : NULL;
+    if(!telemetry)
+    {
+        return;
+    }
+    for(int i = 0; i < TELEMETRY_MAX_OPS; i++)
+    {
+        telemetry_counters_t *c = &telemetry->ops[i];
+        atomic_store_explicit(&c->count, 0, memory_order_relaxed);
+        atomic_store_explicit(&c->bytes, 0, memory_order_relaxed);
+        atomic_store_explicit(&c->sum, 0, memory_order_relaxed);
+        for(int j = 0; j < TELEMETRY_BUCKETS; j++)
+        {
+            atomic_store_explicit(&c->buckets[j], 0, memory_order_relaxed);
+        }
+        for(int j = 0; j < TELEMETRY_MAX_ERRORS; j++)
+        {
+            atomic_store_explicit(&c->errors[j], 0, memory_order_relaxed);
+        }
+    }
+    for(int i = 0; i < TELEMETRY_MAX_STAGES; i++)
+    {
+        atomic_store_explicit(&telemetry->stage_entries[i], 0, memory_order_relaxed);
+        atomic_store_explicit(&telemetry->stage_time[i], 0, memory_order_relaxed);
+    }
+    atomic_store(&telemetry->stage_start, TelemetryNow());
+}
+
+RA1NPOC_API uint64_t IOUSBTelemetryStart(const client_t *client)
+{
+    return client && (client->telemetry || client->policy) ? TelemetryNow() : 0;
+}
+
+RA1NPOC_API void IOUSBTelemetryRecord(client_t *client, int op, uint64_t start, IOReturn ret, uint64_t bytes)
+{
+    if(!start)
+    {
+        return;
+    }
+    
+    uint64_t now = TelemetryNow();
+    uint64_t nsec = now > start ? now - start : 0;
+    if(client->policy)
+    {
+        IOUSBPolicyRecord(client, op, nsec, ret);
+    }
+    
+    iousb_telemetry_t *telemetry = client->telemetry;
+    if(!telemetry || op < 0 || op >= TELEMETRY_MAX_OPS)
+    {
+        return;
+    }
+    
+    telemetry_counters_t *c = &telemetry->ops[op];
+    atomic_fetch_add_explicit(&c->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&c->bytes, bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&c->sum, nsec, memory_order_relaxed);
+    atomic_fetch_add_explicit(&c->buckets[TelemetryBucket(nsec)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&c->errors[TelemetryError(ret)], 1, memory_order_relaxed);
+}
+
+RA1NPOC_API void IOUSBTelemetryStage(client_t *client, int stage)
+{
+    if(!client || stage < 0 || stage >= TELEMETRY_MAX_STAGES)
+    {
+        return;
+    }
+    client->stage = stage;
+    IOUSBTraceCounter(client, "stage", stage);
+    
+    iousb_telemetry_t *telemetry = client->telemetry;
+    if(!telemetry)
+    {
+        return;
+    }
+    
+    uint64_t now = TelemetryNow();
+    int prev = atomic_exchange(&telemetry->stage, stage);
+    uint64_t start = atomic_exchange(&telemetry->stage_start, now);
+    atomic_fetch_add_explicit(&telemetry->stage_time[prev], now - start, memory_order_relaxed);
+    atomic_fetch_add_explicit(&telemetry->stage_entries[stage], 1, memory_order_relaxed);
+}
+
+RA1NPOC_API int IOUSBTelemetrySnapshot(const client_t *client, telemetry_snapshot_t *snapshot)
+{
+    iousb_telemetry_t *telemetry = client ? client->telemetry : NULL;
+    if(!telemetry || !snapshot)
+    {
+        return -1;
+    }
+    
+    // counters are read one by one, a snapshot under load is close, not exact
+    memset(snapshot, '\0', sizeof(telemetry_snapshot_t));
+    snapshot->ecid = client->ecid;
+    snapshot->location = client->location;
+    snapshot->cpid = client->cpid;
+    for(int i = 0; i < TELEMETRY_MAX_OPS; i++)
+    {
+        telemetry_counters_t *c = &telemetry->ops[i];
+        telemetry_op_t *op = &snapshot->ops[i];
+        op->count = atomic_load_explicit(&c->count, memory_order_relaxed);
+        op->bytes = atomic_load_explicit(&c->bytes, memory_order_relaxed);
+        op->sum = atomic_load_explicit(&c->sum, memory_order_relaxed);
+        for(int j = 0; j < TELEMETRY_BUCKETS; j++)
+        {
+            op->buckets[j] = atomic_load_explicit(&c->buckets[j], memory_order_relaxed);
+        }
+        for(int j = 0; j < TELEMETRY_MAX_ERRORS; j++)
+        {
+            op->errors[j] = atomic_load_explicit(&c->errors[j], memory_order_relaxed);
+        }
+    }
+    for(int i = 0; i < TELEMETRY_MAX_STAGES; i++)
+    {
+        snapshot->stages[i].entries = atomic_load_explicit(&telemetry->stage_entries[i], memory_order_relaxed);
+        snapshot->stages[i].time = atomic_load_explicit(&telemetry->stage_time[i], memory_order_relaxed);
+    }
+    snapshot->stage = atomic_load(&telemetry->stage);
+    snapshot->stages[snapshot->stage].time += TelemetryNow() - atomic_load(&telemetry->stage_start);
+    return 0;
+}
+
+RA1NPOC_STATIC_API static void TelemetryPrintf(telemetry_writer_t *w, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    size_t room = w->off < w->len ? w->len - w->off : 0;
+    int n = vsnprintf(room ? w->buf + w->off : NULL, room, fmt, ap);
+    va_end(ap);
+    if(n > 0)
+    {
+        w->off += n;
+    }
+}
+
+RA1NPOC_STATIC_API static size_t TelemetryFinish(telemetry_writer_t *w)
+{
+    if(w->len)
+    {
+        w->buf[w->off < w->len ? w->off : w->len - 1] = '\0';
+    }
+    return w->off;
+}
+
+RA1NPOC_API size_t IOUSBTelemetryExportJSON(const telemetry_snapshot_t *snapshots, size_t count, char *buf, size_t len)
+{
+    telemetry_writer_t w = { buf, len, 0 };
+    
+    TelemetryPrintf(&w, "[");
+    for(size_t s = 0; s < count; s++)
+    {
+        const telemetry_snapshot_t *snap = &snapshots[s];
+        TelemetryPrintf(&w, "%s{\"ecid\":\"0x%016llx\",\"location\":\"0x%08x\",\"cpid\":\"0x%04x\",\"stage\":\"%s\",\"ops\":{",
+                        s ? "," : "", (unsigned long long)snap->ecid, snap->location, snap->cpid, IOUSBAutobootStageName(snap->stage));
+        for(int i = 0; i < TELEMETRY_MAX_OPS; i++)
+        {
+            const telemetry_op_t *op = &snap->ops[i];
+            TelemetryPrintf(&w, "%s\"%s\":{\"count\":%llu,\"bytes\":%llu,\"sum_ns\":%llu,\"errors\":{",
+                            i ? "," : "", op_names[i], (unsigned long long)op->count,
+                            (unsigned long long)op->bytes, (unsigned long long)op->sum);
+            for(int j = 0; j < TELEMETRY_MAX_ERRORS; j++)
+            {
+                TelemetryPrintf(&w, "%s\"%s\":%llu", j ? "," : "", error_names[j], (unsigned long long)op->errors[j]);
+            }
+            TelemetryPrintf(&w, "},\"buckets\":[");
+            for(int j = 0; j < TELEMETRY_BUCKETS; j++)
+            {
+                TelemetryPrintf(&w, "%s%llu", j ? "," : "", (unsigned long long)op->buckets[j]);
+            }
+            TelemetryPrintf(&w, "]}");
+        }
+        TelemetryPrintf(&w, "},\"stages\":{");
+        bool first = true;
+        for(int i = 0; i < TELEMETRY_MAX_STAGES; i++)
+        {
+            if(!snap->stages[i].entries && !snap->stages[i].time)
+            {
+                continue;
+            }
+            TelemetryPrintf(&w, "%s\"%s\":{\"entries\":%llu,\"time_ns\":%llu}", first ? "" : ",", IOUSBAutobootStageName(i),
+                            (unsigned long long)snap->stages[i].entries, (unsigned long long)snap->stages[i].time);
+            first = false;
+        }
+        TelemetryPrintf(&w, "}}");
+    }
+    TelemetryPrintf(&w, "]");
+    
+    return TelemetryFinish(&w);
+}
+
+RA1NPOC_API size_t IOUSBTelemetryExportPrometheus(const telemetry_snapshot_t *snapshots, size_t count, char *buf, size_t len)
+{
+    telemetry_writer_t w = { buf, len, 0 };
+    char labels[128];
+    
+    TelemetryPrintf(&w, "# HELP iousb_transfer_seconds Time spent in IOUSB transfer calls.\n");
+    TelemetryPrintf(&w, "# TYPE iousb_transfer_seconds histogram\n");
+    for(size_t s = 0; s < count; s++)
+    {
+        const telemetry_snapshot_t *snap = &snapshots[s];
+        for(int i = 0; i < TELEMETRY_MAX_OPS; i++)
+        {
+            const telemetry_op_t *op = &snap->ops[i];
+            uint64_t cumulative = 0;
+            if(!op->count)
+            {
+                continue;
+            }
+            snprintf(labels, sizeof(labels), "ecid=\"0x%016llx\",location=\"0x%08x\",op=\"%s\"",
+                     (unsigned long long)snap->ecid, snap->location, op_names[i]);
+            for(int j = 0; j < TELEMETRY_BUCKETS - 1; j++)
+            {
+                cumulative += op->buckets[j];
+                TelemetryPrintf(&w, "iousb_transfer_seconds_bucket{%s,le=\"%g\"} %llu\n",
+                                labels, (double)(1ULL << (j + 10)) / 1e9, (unsigned long long)cumulative);
+            }
+            TelemetryPrintf(&w, "iousb_transfer_seconds_bucket{%s,le=\"+Inf\"} %llu\n", labels, (unsigned long long)op->count);
+            TelemetryPrintf(&w, "iousb_transfer_seconds_sum{%s} %.9f\n", labels, op->sum / 1e9);
+            TelemetryPrintf(&w, "iousb_transfer_seconds_count{%s} %llu\n", labels, (unsigned long long)op->count);
+        }
+    }
+    
+    TelemetryPrintf(&w, "# HELP iousb_transfer_bytes_total Bytes reported done by IOUSB transfers.\n");
+    TelemetryPrintf(&w, "# TYPE iousb_transfer_bytes_total counter\n");
+    for(size_t s = 0; s < count; s++)
+    {
+        const telemetry_snapshot_t *snap = &snapshots[s];
+        for(int i = 0; i < TELEMETRY_MAX_OPS; i++)
+        {
+            if(snap->ops[i].count)
+            {
+                TelemetryPrintf(&w, "iousb_transfer_bytes_total{ecid=\"0x%016llx\",location=\"0x%08x\",op=\"%s\"} %llu\n",
+                                (unsigned long long)snap->ecid, snap->location, op_names[i],
+                                (unsigned long long)snap->ops[i].bytes);
+            }
+        }
+    }
+    
+    TelemetryPrintf(&w, "# HELP iousb_transfer_results_total IOUSB transfer outcomes by kind.\n");
+    TelemetryPrintf(&w, "# TYPE iousb_transfer_results_total counter\n");
+    for(size_t s = 0; s < count; s++)
+    {
+        const telemetry_snapshot_t *snap = &snapshots[s];
+        for(int i = 0; i < TELEMETRY_MAX_OPS; i++)
+        {
+            for(int j = 0; snap->ops[i].count && j < TELEMETRY_MAX_ERRORS; j++)
+            {
+                TelemetryPrintf(&w, "iousb_transfer_results_total{ecid=\"0x%016llx\",location=\"0x%08x\",op=\"%s\",result=\"%s\"} %llu\n",
+                                (unsigned long long)snap->ecid, snap->location, op_names[i], error_names[j],
+                                (unsigned long long)snap->ops[i].errors[j]);
+            }
+        }
+    }
+    
+    TelemetryPrintf(&w, "# HELP iousb_stage_seconds_total Time spent in each autoboot stage.\n");
+    TelemetryPrintf(&w, "# TYPE iousb_stage_seconds_total counter\n");
+    for(size_t s = 0; s < count; s++)
+    {
+        const telemetry_snapshot_t *snap = &snapshots[s];
+        for(int i = 0; i < TELEMETRY_MAX_STAGES; i++)
+        {
+            if(snap->stages[i].entries || snap->stages[i].time)
+            {
+                TelemetryPrintf(&w, "iousb_stage_seconds_total{ecid=\"0x%016llx\",location=\"0x%08x\",stage=\"%s\"} %.9f\n",
+                                (unsigned long long)snap->ecid, snap->location, IOUSBAutobootStageName(i), snap->stages[i].time / 1e9);
+            }
+        }
+    }
+    
+    TelemetryPrintf(&w, "# HELP iousb_stage_entries_total Times each autoboot stage was entered.\n");
+    TelemetryPrintf(&w, "# TYPE iousb_stage_entries_total counter\n");
+    for(size_t s = 0; s < count; s++)
+    {
+        const telemetry_snapshot_t *snap = &snapshots[s];
+        for(int i = 0; i < TELEMETRY_MAX_STAGES; i++)
+        {
+            if(snap->stages[i].entries)
+            {
+                TelemetryPrintf(&w, "iousb_stage_entries_total{ecid=\"0x%016llx\",location=\"0x%08x\",stage=\"%s\"} %llu\n",
+                                (unsigned long long)snap->ecid, snap->location, IOUSBAutobootStageName(i),
+                                (unsigned long long)snap->stages[i].entries);
+            }
+        }
+    }
+    
+    return TelemetryFinish(&w);
+}
@@ -0,0 +1,360 @@
+#if defined(__linux__)
+#define _GNU_SOURCE // pthread_{get,set}affinity_np
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+
+#if defined(__APPLE__)
+#include <mach/mach_time.h>
+#elif defined(__linux__)
+#include <sys/timerfd.h>
+#endif
+
+#include <io/iousb.h>
+#include <io/iousb_timer.h>
+#include <io/iousb_trace.h>
+#include <io/iousb_sched.h>
+#include <common/log.h>
+#include <common/common.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TIMER_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define TIMER_RELAX() __asm__ __volatile__("yield")
+#else
+#define TIMER_RELAX() do {} while(0)
+#endif
+
+#define TIMER_CALIBRATE_DELAY   (100000)
+#define TIMER_CLOCK_SAMPLES     (1000)
+
+typedef struct
+{
+    bool pinned;
+    bool realtime;
+#if defined(__linux__)
+    cpu_set_t cpus;
+#endif
+    int policy;
+    struct sched_param param;
+} timer_thread_t;
+
+#if defined(__APPLE__)
+static mach_timebase_info_data_t timebase;
+#endif
+
+RA1NPOC_API uint64_t IOUSBTimerNow(void)
+{
+#if defined(__APPLE__)
+    if(!timebase.denom)
+    {
+        mach_timebase_info(&timebase);
+    }
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+RA1NPOC_STATIC_API static void TimerSpinUntil(const abort_timer_t *timer, uint64_t deadline)
+{
+    while(IOUSBTimerNow() + timer->clock_cost < deadline)
+    {
+        TIMER_RELAX();
+    }
+}
+
+RA1NPOC_STATIC_API static void TimerSleepUntil(const abort_timer_t *timer, uint64_t deadline)
+{
+#if defined(__APPLE__)
+    (void)timer;
+    mach_wait_until(deadline * timebase.denom / timebase.numer);
+#elif defined(__linux__)
+    if(timer->fd >= 0)
+    {
+        struct itimerspec its;
+        uint64_t expirations;
+        memset(&its, '\0', sizeof(its));
+        its.it_value.tv_sec = deadline / 1000000000ULL;
+        its.it_value.tv_nsec = deadline % 1000000000ULL;
+        if(timerfd_settime(timer->fd, TFD_TIMER_ABSTIME, &its, NULL) == 0)
+        {
+            while(read(timer->fd, &expirations, sizeof(expirations)) < 0 && errno == EINTR);
+            return;
+        }
+    }
+    struct timespec ts =
+    {
+        .tv_sec  = deadline / 1000000000ULL,
+        .tv_nsec = deadline % 1000000000ULL,
+    };
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+#else
+    (void)timer;
+    uint64_t now = IOUSBTimerNow();
+    if(deadline > now)
+    {
+        usleep((deadline - now) / 1000);
+    }
+#endif
+}
+
+RA1NPOC_API void IOUSBTimerWaitUntil(const abort_timer_t *timer, uint64_t deadline)
+{
+    uint64_t now = IOUSBTimerNow();
+    if(deadline <= now)
+    {
+        return;
+    }
+    
+    switch(timer->mode)
+    {
+        case kAbortTimerSleep:
+        {
+            uint64_t delay = deadline - now;
+            struct timespec req =
+            {
+                .tv_sec  = delay / 1000000000ULL,
+                .tv_nsec = delay % 1000000000ULL,
+            };
+            nanosleep(&req, NULL);
+            break;
+        }
+        case kAbortTimerNative:
+            if(deadline - now > timer->slack)
+            {
+                TimerSleepUntil(timer, deadline - timer->slack);
+            }
+            TimerSpinUntil(timer, deadline);
+            break;
+        default:
+            TimerSpinUntil(timer, deadline);
+            break;
+    }
+}
+
+RA1NPOC_API int IOUSBTimerInit(abort_timer_t *timer, int mode)
+{
+    if(!timer)
+    {
+        return -1;
+    }
+    memset(timer, '\0', sizeof(abort_timer_t));
+    timer->mode = mode;
+    timer->cpu = -1;
+    timer->slack = ABORT_TIMER_DEFAULT_SLACK;
+    timer->fd = -1;
+    IOUSBTimerNow();
+    
+#if defined(__linux__)
+    if(mode == kAbortTimerNative)
+    {
+        timer->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if(timer->fd < 0)
+        {
+            // TimerSleepUntil falls back to clock_nanosleep, same clock
+            ERR("timerfd_create: %s", strerror(errno));
+        }
+    }
+#endif
+    return 0;
+}
+
+RA1NPOC_API void IOUSBTimerDestroy(abort_timer_t *timer)
+{
+    if(timer && timer->fd >= 0)
+    {
+        close(timer->fd);
+        timer->fd = -1;
+    }
+}
+
+RA1NPOC_STATIC_API static int TimerCompare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+RA1NPOC_API int IOUSBTimerCalibrate(abort_timer_t *timer)
+{
+    uint64_t late[ABORT_TIMER_CALIBRATE_ROUNDS];
+    
+    if(!timer)
+    {
+        return -1;
+    }
+    
+    uint64_t t0 = IOUSBTimerNow();
+    for(int i = 0; i < TIMER_CLOCK_SAMPLES; i++)
+    {
+        IOUSBTimerNow();
+    }
+    timer->clock_cost = (IOUSBTimerNow() - t0) / TIMER_CLOCK_SAMPLES;
+    
+    for(int i = 0; i < ABORT_TIMER_CALIBRATE_ROUNDS; i++)
+    {
+        uint64_t deadline = IOUSBTimerNow() + TIMER_CALIBRATE_DELAY;
+        TimerSleepUntil(timer, deadline);
+        uint64_t now = IOUSBTimerNow();
+        late[i] = now > deadline ? now - deadline : 0;
+    }
+    qsort(late, ABORT_TIMER_CALIBRATE_ROUNDS, sizeof(uint64_t), TimerCompare);
+    
+    // wake early by the worst wakeup we are willing to plan for, spin the rest
+    uint64_t p98 = late[ABORT_TIMER_CALIBRATE_ROUNDS * 98 / 100];
+    timer->slack = p98 + p98 / 4 + timer->clock_cost;
+    return 0;
+}
+
+#if defined(RA1NPOC_MODE)
+RA1NPOC_STATIC_API static void TimerEnter(const abort_timer_t *timer, timer_thread_t *saved)
+{
+    pthread_t self = pthread_self();
+    
+    memset(saved, '\0', sizeof(timer_thread_t));
+#if defined(__linux__)
+    if(timer->cpu >= 0 && pthread_getaffinity_np(self, sizeof(cpu_set_t), &saved->cpus) == 0)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(timer->cpu, &cpus);
+        saved->pinned = pthread_setaffinity_np(self, sizeof(cpu_set_t), &cpus) == 0;
+        if(!saved->pinned)
+        {
+            ERR("Failed to pin to cpu %d", timer->cpu);
+        }
+    }
+#endif
+    if(timer->priority > 0 && pthread_getschedparam(self, &saved->policy, &saved->param) == 0)
+    {
+        struct sched_param param;
+        memset(&param, '\0', sizeof(param));
+        param.sched_priority = timer->priority;
+        int err = pthread_setschedparam(self, SCHED_FIFO, &param);
+        saved->realtime = err == 0;
+        if(!saved->realtime)
+        {
+            ERR("SCHED_FIFO: %s", strerror(err));
+        }
+    }
+}
+
+RA1NPOC_STATIC_API static void TimerLeave(const timer_thread_t *saved)
+{
+    pthread_t self = pthread_self();
+    
+    if(saved->realtime)
+    {
+        pthread_setschedparam(self, saved->policy, &saved->param);
+    }
+#if defined(__linux__)
+    if(saved->pinned)
+    {
+        pthread_setaffinity_np(self, sizeof(cpu_set_t), &saved->cpus);
+    }
+#endif
+}
+
+RA1NPOC_STATIC_API static bool TimerPending(void *ctx)
+{
+    const async_transfer_t *transfer = ctx;
+    return transfer->wLenDone == IOUSB_TRANSFER_PENDING;
+}
+
+RA1NPOC_API IOReturn IOUSBAsyncControlTransferTimedAbort(client_t *client,
+                                                         uint8_t bm_request_type,
+                                                         uint8_t b_request,
+                                                         uint16_t w_value,
+                                                         uint16_t w_index,
+                                                         unsigned char *data,
+                                                         uint16_t w_length,
+                                                         unsigned int timeout,
+                                                         unsigned int ns_time,
+                                                         const abort_timer_t *timer,
+                                                         timed_abort_t *result)
+{
+    const iousb_backend_t *backend = IOUSBGetBackend(client);
+    control_request_t req = { bm_request_type, b_request, w_value, w_index, w_length };
+    async_transfer_t transfer;
+    timer_thread_t saved;
+    transfer_t submit;
+    IOReturn error;
+    
+    memset(result, '\0', sizeof(timed_abort_t));
+    memset(&transfer, '\0', sizeof(async_transfer_t));
+    transfer.wLenDone = IOUSB_TRANSFER_PENDING;
+    result->target = ns_time;
+    
+    // neighbours' bulk is held back before the timing starts, not during it
+    IOUSBSchedCriticalBegin(client);
+    TimerEnter(timer, &saved);
+    result->pinned = saved.pinned;
+    result->realtime = saved.realtime;
+    
+    // nothing but the backend calls and the clock between submit and abort,
+    // the trace spans are written once the window is over
+    uint64_t t0 = IOUSBTimerNow();
+    submit = backend->async_control_transfer(client, &req, data, &transfer, timeout);
+    uint64_t t1 = IOUSBTimerNow();
+    if(submit.ret != kIOReturnSuccess)
+    {
+        TimerLeave(&saved);
+        IOUSBSchedCriticalEnd(client);
+        result->ret = submit.ret;
+        return submit.ret;
+    }
+    IOUSBTimerWaitUntil(timer, t1 + ns_time);
+    uint64_t t2 = IOUSBTimerNow();
+    error = backend->abort_pipe_zero(client);
+    uint64_t t3 = IOUSBTimerNow();
+    TimerLeave(&saved);
+    
+    result->submitted = true;
+    result->submit = t1 - t0;
+    result->delta = t2 - t1;
+    
+    uint64_t trace = IOUSBTraceBegin();
+    if(trace)
+    {
+        // the timer clock is not the trace clock on every host
+        uint64_t skew = trace - IOUSBTimerNow();
+        IOUSBTraceSpan(client, "IOUSBAsyncControlTransfer", t0 + skew, t1 + skew, submit.ret, kTraceReturn);
+        IOUSBTraceSpan(client, "sleep", t1 + skew, t2 + skew, (int64_t)result->delta, kTraceNsec);
+        IOUSBTraceSpan(client, "IOUSBAbortPipeZero", t2 + skew, t3 + skew, error, kTraceReturn);
+    }
+    
+    if(error != kIOReturnSuccess)
+    {
+        // nothing was aborted, the transfer completes on its own or not at all
+        IOUSBAsyncDiscard(client, TimerPending, &transfer);
+        IOUSBSchedCriticalEnd(client);
+        result->ret = error;
+        return error;
+    }
+    
+    while(transfer.wLenDone == IOUSB_TRANSFER_PENDING)
+    {
+        if(IOUSBAsyncWait(client) != 0)
+        {
+            // the transfer is on our stack, it may not land after we return
+            IOUSBAsyncDiscard(client, TimerPending, &transfer);
+            break;
+        }
+    }
+    IOUSBSchedCriticalEnd(client);
+    
+    if(transfer.wLenDone == IOUSB_TRANSFER_PENDING)
+    {
+        result->ret = kIOReturnNotResponding;
+        return kIOReturnNotResponding;
+    }
+    result->ret = transfer.ret;
+    result->wLenDone = transfer.wLenDone;
+    return kIOReturnSuccess;
+}
+#endif
@@ -0,0 +1,341 @@
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include <io/iousb.h>
+#include <io/iousb_trace.h>
+#include <io/iousb_autoboot.h>
+#include <common/log.h>
+#include <common/common.h>
+
+#define TRACE_MAX_DEVICES       (256)
+#define TRACE_MAX_PIDS          (TRACE_MAX_DEVICES + 2)
+
+typedef struct
+{
+    uint64_t start;                 // nsec, the begin of a span
+    uint64_t end;
+    const char *name;
+    uint64_t ecid;
+    uint32_t location;
+    int16_t stage;
+    uint8_t type;
+    uint8_t unit;                   // of value for spans
+    int64_t value;
+} trace_event_t;
+
+typedef struct trace_ring_p trace_ring_t;
+
+struct trace_ring_p
+{
+    trace_ring_t *next;
+    long tid;
+    bool exited;                    // kept until what it holds was written out
+    size_t capacity;
+    size_t mask;                    // of the current trace, never above capacity - 1
+    _Atomic uint64_t head;          // events ever written since the trace started
+    uint64_t written;               // head when IOUSBTraceWriteJSON last saw it
+    trace_event_t events[];
+};
+
+typedef struct
+{
+    uint64_t ecid;
+    uint32_t location;
+} trace_device_t;
+
+atomic_bool iousb_trace_enabled;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t *trace_rings;   // freed once their thread exited and nothing in them is unwritten
+static size_t trace_ring_size = TRACE_DEFAULT_RING_SZ;
+static uint64_t trace_origin;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;     // runs TraceThreadExit for threads that own a ring
+static __thread trace_ring_t *trace_local;
+
+RA1NPOC_API uint64_t IOUSBTraceClock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+RA1NPOC_STATIC_API static long TraceThreadId(void)
+{
+#if defined(__APPLE__)
+    uint64_t tid = 0;
+    pthread_threadid_np(NULL, &tid);
+    return (long)tid;
+#else
+    return (long)syscall(SYS_gettid);
+#endif
+}
+
+// must hold trace_lock, frees the rings of exited threads that hold nothing unwritten
+RA1NPOC_STATIC_API static void TraceReapLocked(void)
+{
+    trace_ring_t **link = &trace_rings;
+    while(*link)
+    {
+        trace_ring_t *ring = *link;
+        if(ring->exited && atomic_load_explicit(&ring->head, memory_order_relaxed) == ring->written)
+        {
+            *link = ring->next;
+            free(ring);
+        }
+        else
+        {
+            link = &ring->next;
+        }
+    }
+}
+
+RA1NPOC_STATIC_API static void TraceThreadExit(void *arg)
+{
+    trace_ring_t *ring = (trace_ring_t *)arg;
+    
+    // anything traced from here on, e.g. by another key's destructor, takes a new ring
+    trace_local = NULL;
+    pthread_mutex_lock(&trace_lock);
+    ring->exited = true;
+    TraceReapLocked();
+    pthread_mutex_unlock(&trace_lock);
+}
+
+RA1NPOC_STATIC_API static void TraceKeyCreate(void)
+{
+    pthread_key_create(&trace_key, TraceThreadExit);
+}
+
+RA1NPOC_STATIC_API static trace_ring_t *TraceRegister(void)
+{
+    pthread_once(&trace_once, TraceKeyCreate);
+    pthread_mutex_lock(&trace_lock);
+    size_t size = trace_ring_size;
+    trace_ring_t *ring = calloc(1, sizeof(trace_ring_t) + size * sizeof(trace_event_t));
+    if(ring)
+    {
+        ring->tid = TraceThreadId();
+        ring->capacity = size;
+        ring->mask = size - 1;
+        ring->next = trace_rings;
+        trace_rings = ring;
+    }
+    pthread_mutex_unlock(&trace_lock);
+    if(ring)
+    {
+        pthread_setspecific(trace_key, ring);
+    }
+    trace_local = ring;
+    return ring;
+}
+
+RA1NPOC_API int IOUSBTraceStart(size_t ring_events)
+{
+    size_t size = 1;
+    
+    if(!ring_events)
+    {
+        ring_events = TRACE_DEFAULT_RING_SZ;
+    }
+    while(size < ring_events)
+    {
+        size <<= 1;
+    }
+    
+    pthread_mutex_lock(&trace_lock);
+    trace_ring_size = size;
+    for(trace_ring_t *ring = trace_rings; ring; ring = ring->next)
+    {
+        ring->mask = (size < ring->capacity ? size : ring->capacity) - 1;
+        ring->written = 0;
+        atomic_store(&ring->head, 0);
+    }
+    // what exited threads left is dropped along with the rest
+    TraceReapLocked();
+    trace_origin = IOUSBTraceClock();
+    pthread_mutex_unlock(&trace_lock);
+    
+    atomic_store(&iousb_trace_enabled, true);
+    return 0;
+}
+
+RA1NPOC_API void IOUSBTraceStop(void)
+{
+    atomic_store(&iousb_trace_enabled, false);
+}
+
+RA1NPOC_STATIC_API static void TraceRecord(client_t *client, int type, const char *name, uint64_t start, uint64_t end, int64_t value, int unit)
+{
+    trace_ring_t *ring = trace_local;
+    if(!ring && !(ring = TraceRegister()))
+    {
+        return;
+    }
+    
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    trace_event_t *event = &ring->events[head & ring->mask];
+    event->start = start;
+    event->end = end;
+    event->name = name;
+    event->ecid = client ? client->ecid : 0;
+    event->location = client ? client->location : 0;
+    event->stage = client ? (int16_t)client->stage : NONE;
+    event->type = (uint8_t)type;
+    event->unit = (uint8_t)unit;
+    event->value = value;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+RA1NPOC_API void IOUSBTraceEvent(client_t *client, int type, const char *name, uint64_t start, int64_t value)
+{
+    uint64_t now = IOUSBTraceClock();
+    TraceRecord(client, type, name, type == kTraceSpan ? start : now, now, value, kTraceReturn);
+}
+
+RA1NPOC_API void IOUSBTraceSpan(client_t *client, const char *name, uint64_t start, uint64_t end, int64_t value, int unit)
+{
+    if(atomic_load_explicit(&iousb_trace_enabled, memory_order_relaxed))
+    {
+        TraceRecord(client, kTraceSpan, name, start, end, value, unit);
+    }
+}
+
+RA1NPOC_API uint64_t IOUSBTraceDropped(void)
+{
+    uint64_t dropped = 0;
+    
+    pthread_mutex_lock(&trace_lock);
+    for(trace_ring_t *ring = trace_rings; ring; ring = ring->next)
+    {
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if(head > ring->mask + 1)
+        {
+            dropped += head - (ring->mask + 1);
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return dropped;
+}
+
+// process id of the device an event belongs to, 1 is the host
+RA1NPOC_STATIC_API static int TraceDevice(trace_device_t *devices, int *count, const trace_event_t *event)
+{
+    if(!event->ecid && !event->location)
+    {
+        return 1;
+    }
+    for(int i = 0; i < *count; i++)
+    {
+        if(devices[i].ecid == event->ecid && devices[i].location == event->location)
+        {
+            return i + 2;
+        }
+    }
+    if(*count == TRACE_MAX_DEVICES)
+    {
+        return 1;
+    }
+    devices[*count].ecid = event->ecid;
+    devices[*count].location = event->location;
+    return ++*count + 1;
+}
+
+RA1NPOC_STATIC_API static double TraceMicros(uint64_t nsec)
+{
+    return nsec > trace_origin ? (nsec - trace_origin) / 1e3 : 0.0;
+}
+
+RA1NPOC_STATIC_API static void TraceWriteValue(FILE *fp, const trace_event_t *event)
+{
+    switch(event->unit)
+    {
+        case kTraceBytes:
+            fprintf(fp, ",\"bytes\":%lld", (long long)event->value);
+            break;
+        case kTraceNsec:
+            fprintf(fp, ",\"nsec\":%lld", (long long)event->value);
+            break;
+        case kTraceCount:
+            fprintf(fp, ",\"count\":%lld", (long long)event->value);
+            break;
+        case kTraceNone:
+            break;
+        default:
+            fprintf(fp, ",\"ret\":\"0x%x\"", (uint32_t)event->value);
+            break;
+    }
+}
+
+RA1NPOC_API int IOUSBTraceWriteJSON(FILE *fp)
+{
+    trace_device_t *devices = calloc(TRACE_MAX_DEVICES, sizeof(trace_device_t));
+    int ndevices = 0;
+    bool first = true;
+    
+    if(!fp || !devices)
+    {
+        free(devices);
+        return -1;
+    }
+    
+    pthread_mutex_lock(&trace_lock);
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for(trace_ring_t *ring = trace_rings; ring; ring = ring->next)
+    {
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t tail = head > ring->mask + 1 ? head - (ring->mask + 1) : 0;
+        uint64_t named[(TRACE_MAX_PIDS + 63) / 64] = { 0 };    // pids this thread is named in
+        
+        for(uint64_t i = tail; i < head; i++)
+        {
+            const trace_event_t *event = &ring->events[i & ring->mask];
+            int pid = TraceDevice(devices, &ndevices, event);
+            
+            if(!(named[pid / 64] & (1ULL << (pid % 64))))
+            {
+                named[pid / 64] |= 1ULL << (pid % 64);
+                fprintf(fp, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%ld,\"args\":{\"name\":\"thread %ld\"}}",
+                        first ? "" : ",\n", pid, ring->tid, ring->tid);
+                first = false;
+            }
+            
+            // the thread is named in pid by now, so this is never the first entry
+            switch(event->type)
+            {
+                case kTraceSpan:
+                    fprintf(fp, ",\n{\"ph\":\"X\",\"name\":\"%s\",\"pid\":%d,\"tid\":%ld,\"ts\":%.3f,\"dur\":%.3f,"
+                            "\"args\":{\"stage\":\"%s\"",
+                            event->name, pid, ring->tid, TraceMicros(event->start), (event->end - event->start) / 1e3,
+                            IOUSBAutobootStageName(event->stage));
+                    TraceWriteValue(fp, event);
+                    fprintf(fp, "}}");
+                    break;
+                case kTraceCounter:
+                    fprintf(fp, ",\n{\"ph\":\"C\",\"name\":\"%s\",\"pid\":%d,\"ts\":%.3f,\"args\":{\"value\":%lld}}",
+                            event->name, pid, TraceMicros(event->end), (long long)event->value);
+                    break;
+                default:
+                    fprintf(fp, ",\n{\"ph\":\"i\",\"s\":\"t\",\"name\":\"%s\",\"pid\":%d,\"tid\":%ld,\"ts\":%.3f,"
+                            "\"args\":{\"stage\":\"%s\",\"value\":%lld}}",
+                            event->name, pid, ring->tid, TraceMicros(event->end),
+                            IOUSBAutobootStageName(event->stage), (long long)event->value);
+                    break;
+            }
+        }
+        ring->written = head;
+    }
+    // exited threads have nothing left to give
+    TraceReapLocked();
+    pthread_mutex_unlock(&trace_lock);
+    
+    fprintf(fp, "%s{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":1,\"args\":{\"name\":\"host\"}}", first ? "" : ",\n");
+    for(int i = 0; i < ndevices; i++)
+    {
+        fprintf(fp, ",\n{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"args\":{\"name\":\"ECID 0x%016llx @ 0x%08x\"}}",
+                i + 2, (unsigned long long)devices[i].ecid, devices[i].location);
+    }
+    fprintf(fp, "\n]}\n");
+    free(devices);
+    return ferror(fp) ? -1 : 0;
+}
@@ -0,0 +1,296 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <io/iousb.h>
+#include <io/iousb_upload.h>
+#include <io/iousb_trace.h>
+#include <io/iousb_sched.h>
+#include <common/log.h>
+#include <common/common.h>
+
+RA1NPOC_API void IOUSBBulkUploadBegin(upload_stream_t *stream, client_t *client, const void *data, uint32_t len, const upload_opts_t *opts)
+{
+    memset(stream, '\0', sizeof(upload_stream_t));
+    stream->client = client;
+    stream->data = data;
+    stream->len = len;
+    stream->chunk = BULK_DEFAULT_CHUNK_SZ;
+    stream->depth = BULK_DEFAULT_DEPTH;
+    
+    if(!client)
+    {
+        stream->result.ret = kIOReturnBadArgument;
+        stream->failed = true;
+        return;
+    }
+    
+    if(opts)
+    {
+        stream->opts = *opts;
+    }
+    if(opts && opts->chunk_size)
+    {
+        stream->chunk = opts->chunk_size;
+    }
+    // keep every chunk but the last free of short packets
+    if(stream->chunk < BULK_MAX_PACKET_SZ)
+    {
+        stream->chunk = BULK_MAX_PACKET_SZ;
+    }
+    stream->chunk -= stream->chunk % BULK_MAX_PACKET_SZ;
+    if(opts && opts->depth)
+    {
+        stream->depth = opts->depth < BULK_MAX_DEPTH ? opts->depth : BULK_MAX_DEPTH;
+    }
+}
+
+RA1NPOC_API int IOUSBBulkUploadPump(upload_stream_t *stream)
+{
+    for(;;)
+    {
+        while(!stream->failed && stream->offset < stream->len && stream->inflight < stream->depth)
+        {
+            upload_slot_t *slot = &stream->slots[(stream->head + stream->inflight) % BULK_MAX_DEPTH];
+            slot->offset = stream->offset;
+            slot->len = (stream->len - stream->offset) < stream->chunk ? (stream->len - stream->offset) : stream->chunk;
+            slot->transfer.ret = kIOReturnSuccess;
+            slot->transfer.wLenDone = IOUSB_TRANSFER_PENDING;
+            
+            if(stream->client->sched && IOUSBSchedBulkTryAcquire(stream->client, slot->len) != 0)
+            {
+                // the link is busy, retried on the next pump; with nothing in
+                // flight that is the caller's to time, see IOUSBSchedBulkDeadline
+                break;
+            }
+            
+            unsigned char *chunk = (unsigned char *)stream->data + stream->offset;
+            transfer_t submit = stream->opts.submit ?
+                                stream->opts.submit(stream->opts.ctx, stream->client, chunk, slot->len, &slot->transfer) :
+                                IOUSBBulkUploadAsync(stream->client, chunk, slot->len, &slot->transfer);
+            if(submit.ret != kIOReturnSuccess)
+            {
+                if(stream->client->sched)
+                {
+                    IOUSBSchedBulkRelease(stream->client, slot->len);
+                }
+                stream->result.ret = submit.ret;
+                stream->failed = true;
+                break;
+            }
+            stream->offset += slot->len;
+            stream->inflight++;
+        }
+        
+        if(!stream->inflight)
+        {
+            return stream->failed || stream->offset >= stream->len;
+        }
+        
+        // bulk transfers on one pipe complete in order, retire from the head
+        upload_slot_t *slot = &stream->slots[stream->head];
+        if(slot->transfer.wLenDone == IOUSB_TRANSFER_PENDING)
+        {
+            return 0;
+        }
+        if(stream->client->sched)
+        {
+            IOUSBSchedBulkRelease(stream->client, slot->len);
+        }
+        
+        if(!stream->failed)
+        {
+            stream->result.wLenDone += slot->transfer.wLenDone;
+            IOUSBTraceCounter(stream->client, "bulk_bytes", stream->result.wLenDone);
+            if(slot->transfer.ret != kIOReturnSuccess)
+            {
+                stream->result.ret = slot->transfer.ret;
+                stream->failed = true;
+            }
+            else if(slot->transfer.wLenDone != slot->len)
+            {
+                ERR("Short bulk write at 0x%x: %u of %u bytes", slot->offset, slot->transfer.wLenDone, slot->len);
+                stream->result.ret = kIOReturnUnderrun;
+                stream->failed = true;
+            }
+            else if(stream->opts.progress)
+            {
+                stream->opts.progress(stream->opts.ctx, stream->result.wLenDone, stream->len);
+            }
+        }
+        
+        stream->head = (stream->head + 1) % BULK_MAX_DEPTH;
+        stream->inflight--;
+    }
+}
+
+RA1NPOC_STATIC_API static bool IOUSBBulkUploadPending(void *ctx)
+{
+    upload_stream_t *stream = ctx;
+    for(unsigned int i = 0; i < stream->inflight; i++)
+    {
+        if(stream->slots[(stream->head + i) % BULK_MAX_DEPTH].transfer.wLenDone == IOUSB_TRANSFER_PENDING)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+RA1NPOC_API transfer_t IOUSBBulkUploadStream(client_t *client, const void *data, uint32_t len, const upload_opts_t *opts)
+{
+    upload_stream_t stream;
+    
+    uint64_t trace = IOUSBTraceBegin();
+    IOUSBBulkUploadBegin(&stream, client, data, len, opts);
+    // completions come in through IOUSBAsyncWait here, not someone else's queue
+    stream.opts.submit = NULL;
+    while(!IOUSBBulkUploadPump(&stream))
+    {
+        if(!stream.inflight)
+        {
+            // held back by the scheduler, no completion is coming to wake us
+            IOUSBSchedBulkWait(client);
+            continue;
+        }
+        if(IOUSBAsyncWait(client) != 0)
+        {
+            // the slots are on our stack, nothing may land in them once we return
+            ERR("Bulk upload failed with %u transfers in flight", stream.inflight);
+            IOUSBAsyncDiscard(client, IOUSBBulkUploadPending, &stream);
+            for(unsigned int i = 0; i < stream.inflight; i++)
+            {
+                upload_slot_t *slot = &stream.slots[(stream.head + i) % BULK_MAX_DEPTH];
+                if(client->sched)
+                {
+                    IOUSBSchedBulkRelease(client, slot->len);
+                }
+            }
+            if(!stream.failed)
+            {
+                stream.result.ret = kIOReturnError;
+            }
+            break;
+        }
+    }
+    
+    IOUSBTraceEnd(client, "IOUSBBulkUploadStream", trace, stream.result.ret);
+    return stream.result;
+}
+
+RA1NPOC_API int IOUSBMapPayloadFd(int fd, payload_map_t *map)
+{
+    struct stat st;
+    
+    memset(map, '\0', sizeof(payload_map_t));
+    
+    if(fstat(fd, &st) != 0)
+    {
+        ERR("fstat: %s", strerror(errno));
+        return -1;
+    }
+    if(!S_ISREG(st.st_mode))
+    {
+        ERR("Payload is not a regular file");
+        return -1;
+    }
+    if(!st.st_size)
+    {
+        return 0;
+    }
+    
+    void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(addr == MAP_FAILED)
+    {
+        ERR("mmap: %s", strerror(errno));
+        return -1;
+    }
+    // the upload walks the image front to back exactly once
+    madvise(addr, st.st_size, MADV_SEQUENTIAL);
+    
+    map->data = addr;
+    map->len = st.st_size;
+    return 0;
+}
+
+RA1NPOC_API int IOUSBMapPayload(const char *path, payload_map_t *map)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+    {
+        memset(map, '\0', sizeof(payload_map_t));
+        ERR("open(%s): %s", path, strerror(errno));
+        return -1;
+    }
+    // the mapping keeps its own reference to the file
+    int ret = IOUSBMapPayloadFd(fd, map);
+    close(fd);
+    return ret;
+}
+
+RA1NPOC_API void IOUSBUnmapPayload(payload_map_t *map)
+{
+    if(map && map->data)
+    {
+        munmap(map->data, map->len);
+        map->data = NULL;
+        map->len = 0;
+    }
+}
+
+RA1NPOC_API transfer_t IOUSBBulkUploadFd(client_t *client, int fd, const upload_opts_t *opts)
+{
+    transfer_t result;
+    payload_map_t map;
+    struct stat st;
+    
+    memset(&result, '\0', sizeof(transfer_t));
+    
+    // a backend that can take the file itself saves mapping it here, unless progress is wanted
+    const iousb_backend_t *backend = IOUSBGetBackend(client);
+    if(backend->bulk_upload_fd && !(opts && opts->progress) &&
+       fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (uint64_t)st.st_size <= UINT32_MAX)
+    {
+        uint64_t trace = IOUSBTraceBegin();
+        result = backend->bulk_upload_fd(client, fd, (uint32_t)st.st_size);
+        IOUSBTraceEnd(client, "IOUSBBulkUploadFd", trace, result.ret);
+        return result;
+    }
+    
+    if(IOUSBMapPayloadFd(fd, &map) != 0)
+    {
+        result.ret = kIOReturnBadArgument;
+        return result;
+    }
+    if(map.len > UINT32_MAX)
+    {
+        ERR("Payload too large: %zu bytes", map.len);
+        IOUSBUnmapPayload(&map);
+        result.ret = kIOReturnBadArgument;
+        return result;
+    }
+    
+    result = IOUSBBulkUploadStream(client, map.data, (uint32_t)map.len, opts);
+    IOUSBUnmapPayload(&map);
+    
+    return result;
+}
+
+RA1NPOC_API transfer_t IOUSBBulkUploadFile(client_t *client, const char *path, const upload_opts_t *opts)
+{
+    transfer_t result;
+    
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+    {
+        memset(&result, '\0', sizeof(transfer_t));
+        ERR("open(%s): %s", path, strerror(errno));
+        result.ret = kIOReturnNotFound;
+        return result;
+    }
+    result = IOUSBBulkUploadFd(client, fd, opts);
+    close(fd);
+    
+    return result;
+}